@@ -0,0 +1,511 @@
+#include "aot.h"
+#include "natives.h"
+#include "verify.h"
+
+typedef struct {
+  const san_program_t *program;
+  const char *file;
+  FILE *out;
+
+  /* The function being emitted, its stack depths and branch targets */
+  int function;
+  const san_function_t *fn;
+  const san_bytecode_t *code;
+  int *depths;
+  char *targets;
+  int usesArena;
+} aot_state_t;
+
+/*
+ * Builtins with a version in integer.h: a function returning the result, one
+ * that can fail, or a comparison operator for sani_compare.
+ */
+#define AOT_TOTAL    0
+#define AOT_PARTIAL  1
+#define AOT_COMPARE  2
+
+typedef struct {
+  const char *native, *integer;
+  int kind;
+} aot_integer_t;
+
+static const aot_integer_t INTEGER_NATIVES[] = {
+  { "abs", "sani_abs", AOT_TOTAL },
+  { "square", "sani_square", AOT_TOTAL },
+  { "sqrt", "sani_sqrt", AOT_PARTIAL },
+  { "factorial", "sani_factorial", AOT_PARTIAL },
+  { "sub", "sani_sub", AOT_TOTAL },
+  { "mod", "sani_mod", AOT_PARTIAL },
+  { "eq", "==", AOT_COMPARE },
+  { "lt", "<", AOT_COMPARE },
+  { NULL, NULL, 0 }
+};
+
+/*
+ * Helpers shared by every compiled program. A function that fails returns
+ * an object of type SAN_AOT_FAILED after printing why, and each caller adds
+ * where it made the call, like the VM's backtrace. Natives run in
+ * san_runtime, whose heap holds bignums until the program exits as nothing
+ * collects it.
+ */
+static const char *PRELUDE =
+  "#include \"errors.h\"\n"
+  "#include \"integer.h\"\n"
+  "#include \"natives.h\"\n"
+  "\n"
+  "#define SAN_AOT_FAILED 0xFFFF\n"
+  "\n"
+  "static const vm_object san_nil = SAN_VM_NIL_OBJECT;\n"
+  "static const vm_object san_failed = (vm_object)SAN_AOT_FAILED << SAN_VM_TYPE_SHIFT;\n"
+  "static san_vector_t san_heap, san_arena;\n"
+  "static san_runtime_t san_runtime;\n"
+  "\n"
+  "static inline vm_object san_int(int64_t n) {\n"
+  "  return vm_from_int(n);\n"
+  "}\n"
+  "\n"
+  "static inline vm_object san_string(const char *s) {\n"
+  "  return vm_from_string(SAN_VM_STRING, s);\n"
+  "}\n"
+  "\n"
+  "static inline int san_truthy(vm_object obj) {\n"
+  "  return obj != san_nil && obj != vm_from_int(0);\n"
+  "}\n"
+  "\n"
+  "static const char *san_type_name(int type) {\n"
+  "  switch (type) {\n"
+  "    case SAN_VM_INT:\n"
+  "    case SAN_VM_BIGNUM: return \"an integer\";\n"
+  "    case SAN_VM_STRING: return \"a string\";\n"
+  "    case SAN_VM_SYMBOL: return \"a symbol\";\n"
+  "    case SAN_VM_LIST: return \"a list\";\n"
+  "  }\n"
+  "  return \"nil\";\n"
+  "}\n"
+  "\n"
+  "static vm_object san_error(int code, const char *msg, const char *where) {\n"
+  "  fprintf(stderr, \"[%s] ERROR S%d: %s\\n\", where, code, msg);\n"
+  "  return san_failed;\n"
+  "}\n"
+  "\n"
+  "static vm_object san_type_error(const char *expected, int type, const char *where) {\n"
+  "  char msg[200];\n"
+  "  sprintf(msg, SAN_ERROR_TYPE_MISMATCH_MSG, expected, san_type_name(type));\n"
+  "  return san_error(SAN_ERROR_TYPE_MISMATCH, msg, where);\n"
+  "}\n"
+  "\n"
+  "static vm_object san_native_error(const char *name, const char *where) {\n"
+  "  char msg[200];\n"
+  "  sprintf(msg, SAN_ERROR_NATIVE_FAILED_MSG, name);\n"
+  "  return san_error(SAN_ERROR_NATIVE_FAILED, msg, where);\n"
+  "}\n"
+  "\n"
+  "static vm_object san_called_from(const char *name, const char *where) {\n"
+  "  char msg[200];\n"
+  "  sprintf(msg, SAN_ERROR_CALLED_FROM_MSG, name);\n"
+  "  return san_error(SAN_ERROR_CALLED_FROM, msg, where);\n"
+  "}\n"
+  "\n"
+  "static const san_native_t *san_native(const char *name) {\n"
+  "  int index = sann_lookup(name);\n"
+  "  if (index < 0) fprintf(stderr, \"ERROR S%d: \" SAN_ERROR_UNKNOWN_FUNCTION_MSG \"\\n\",\n"
+  "    SAN_ERROR_UNKNOWN_FUNCTION, name);\n"
+  "  return sann_nth(index);\n"
+  "}\n"
+  "\n"
+  "static vm_object san_new_list(san_vector_t *owner) {\n"
+  "  vm_list *list = calloc(1, sizeof(vm_list));\n"
+  "  sanv_create(&list->items, sizeof(vm_object));\n"
+  "  sanv_push(owner, &list);\n"
+  "  return vm_from_list(list);\n"
+  "}\n"
+  "\n"
+  "static inline void san_append(vm_object list, vm_object item) {\n"
+  "  sanv_push(&vm_to_list(list)->items, &item);\n"
+  "}\n"
+  "\n"
+  "static int san_destroy_list(void *ptr) {\n"
+  "  vm_list *list = *(vm_list**)ptr;\n"
+  "  sanv_destroy(&list->items, sanv_nodestructor);\n"
+  "  free(list);\n"
+  "  return SAN_OK;\n"
+  "}\n"
+  "\n"
+  "static void san_release(int mark) {\n"
+  "  for (int i = mark; i < san_arena.size; ++i) san_destroy_list(sanv_nth(&san_arena, i));\n"
+  "  san_arena.size = mark;\n"
+  "}\n";
+
+static void emit_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s != '\0'; ++s) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(out, "\\%c", *s);
+    } else if (*s == '\n') {
+      fputs("\\n", out);
+    } else if ((unsigned char)*s < ' ') {
+      fprintf(out, "\\%03o", (unsigned char)*s);
+    } else {
+      fputc(*s, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/* The source position of an instruction, as a string literal */
+static void emit_where(aot_state_t *state, int pc) {
+  char *where = SAN_MALLOC(strlen(state->file) + 32);
+  int line = 0, column = 0;
+
+  sanb_position(state->program, state->fn->entry + pc, &line, &column);
+  sprintf(where, "%s:%d:%d", state->file, line, column);
+  emit_string(state->out, where);
+  SAN_FREE(where);
+}
+
+static void emit_signature(aot_state_t *state, int function) {
+  const san_function_t *fn = sanv_nth(&state->program->functions, function);
+
+  fprintf(state->out, "static vm_object san_f%d(", function);
+  for (int i = 0; i < fn->arity; ++i) {
+    fprintf(state->out, "%svm_object l%d", i > 0 ? ", " : "", i);
+  }
+  fprintf(state->out, fn->arity == 0 ? "void)" : ")");
+}
+
+static void emit_check_int(aot_state_t *state, int pc, int s) {
+  fprintf(state->out, "  if (!vm_is_integer(s%d)) return san_type_error(\"an integer\", vm_type(s%d), ", s, s);
+  emit_where(state, pc);
+  fprintf(state->out, ");\n");
+}
+
+static const aot_integer_t *integer_native(const san_native_t *native) {
+  for (int i = 0; INTEGER_NATIVES[i].native != NULL; ++i) {
+    if (strcmp(INTEGER_NATIVES[i].native, native->name) == 0) return &INTEGER_NATIVES[i];
+  }
+  return NULL;
+}
+
+/*
+ * A native call leaves its result where its first argument was. Calls
+ * specialised to integers go straight to integer.h where there is a
+ * version there.
+ */
+static void emit_native_call(aot_state_t *state, int pc, int d) {
+  const san_bytecode_t *code = &state->code[pc];
+  const san_native_t *native = sann_nth(code->arg1.ref);
+  const aot_integer_t *integer = integer_native(native);
+  int argc = code->arg2.ref, first = d - argc;
+  FILE *out = state->out;
+
+  if (code->opcode == SAN_BYTECODE_CALL_NATIVE && (native->flags & SAN_NATIVE_INT)) {
+    for (int i = d - 1; i >= first; --i) emit_check_int(state, pc, i);
+  }
+
+  if ((native->flags & SAN_NATIVE_INT) && integer != NULL) {
+    if (integer->kind == AOT_COMPARE) {
+      fprintf(out, "  s%d = san_int(sani_compare(s%d, s%d) %s 0);\n", first, first, first + 1, integer->integer);
+      return;
+    }
+    if (integer->kind == AOT_TOTAL) {
+      fprintf(out, "  s%d = %s(&san_runtime.gc", first, integer->integer);
+      for (int i = first; i < d; ++i) fprintf(out, ", s%d", i);
+      fprintf(out, ");\n");
+      return;
+    }
+    fprintf(out, "  if (%s(&san_runtime.gc", integer->integer);
+    for (int i = first; i < d; ++i) fprintf(out, ", s%d", i);
+    fprintf(out, ", &s%d) != SAN_OK) return san_native_error(", first);
+    emit_string(out, native->name);
+    fprintf(out, ", ");
+    emit_where(state, pc);
+    fprintf(out, ");\n");
+    return;
+  }
+
+  fprintf(out, "  {\n    vm_object args[%d] = { ", argc > 0 ? argc : 1);
+  for (int i = first; i < d; ++i) fprintf(out, "%ss%d", i > first ? ", " : "", i);
+  if (argc == 0) fprintf(out, "san_nil");
+  fprintf(out, " };\n    s%d = san_nil;\n", first);
+  fprintf(out, "    if (san_native%d->fn(&san_runtime, args, %d, &s%d) != SAN_OK) return san_native_error(",
+    code->arg1.ref, argc, first);
+  emit_string(out, native->name);
+  fprintf(out, ", ");
+  emit_where(state, pc);
+  fprintf(out, ");\n  }\n");
+}
+
+static void emit_call(aot_state_t *state, int pc, int d) {
+  const san_bytecode_t *code = &state->code[pc];
+  const san_function_t *callee = sanv_nth(&state->program->functions, code->arg1.ref);
+  int argc = code->arg2.ref, first = d - argc;
+  FILE *out = state->out;
+
+  fprintf(out, "  s%d = san_f%d(", first, code->arg1.ref);
+  for (int i = first; i < d; ++i) fprintf(out, "%ss%d", i > first ? ", " : "", i);
+  fprintf(out, ");\n  if (vm_type(s%d) == SAN_AOT_FAILED) return san_called_from(", first);
+  emit_string(out, callee->name);
+  fprintf(out, ", ");
+  emit_where(state, pc);
+  fprintf(out, ");\n");
+}
+
+/*
+ * A tail call to the same function reassigns the parameters and jumps back
+ * to its start. Other tail calls are left to the C compiler.
+ */
+static void emit_tailcall(aot_state_t *state, int pc, int d) {
+  const san_bytecode_t *code = &state->code[pc];
+  int argc = code->arg2.ref, first = d - argc;
+  FILE *out = state->out;
+
+  if (code->arg1.ref != state->function) {
+    fprintf(out, "  t = san_f%d(", code->arg1.ref);
+    for (int i = first; i < d; ++i) fprintf(out, "%ss%d", i > first ? ", " : "", i);
+    fprintf(out, ");\n");
+    if (state->usesArena) fprintf(out, "  san_release(mark);\n");
+    fprintf(out, "  return t;\n");
+    return;
+  }
+
+  for (int i = 0; i < argc; ++i) fprintf(out, "  l%d = s%d;\n", i, first + i);
+  for (int i = argc; i < state->fn->nslots; ++i) fprintf(out, "  l%d = san_nil;\n", i);
+  if (state->usesArena) fprintf(out, "  san_release(mark);\n");
+  fprintf(out, "  goto entry;\n");
+}
+
+static void emit_instruction(aot_state_t *state, int pc) {
+  const san_bytecode_t *code = &state->code[pc];
+  const san_arg_t *arg1 = &code->arg1;
+  int d = state->depths[pc];
+  int target = arg1->ref - state->fn->entry;
+  FILE *out = state->out;
+
+  switch (code->opcode) {
+    case SAN_BYTECODE_PUSH:
+      if (arg1->type == SAN_BYTECODE_TYPE_NUMBER_LITERAL) {
+        fprintf(out, "  s%d = san_int(%lldLL);\n", d, (long long)*(int64_t*)sanv_nth(&state->program->numbers, arg1->ref));
+      } else if (arg1->type == SAN_BYTECODE_TYPE_BIGNUM_LITERAL) {
+        fprintf(out, "  s%d = sani_parse(&san_runtime.gc, \"%s\");\n", d,
+          *(const char**)sanv_nth(&state->program->bignums, arg1->ref));
+      } else if (arg1->type == SAN_BYTECODE_TYPE_STRING_LITERAL) {
+        fprintf(out, "  s%d = san_string(", d);
+        emit_string(out, *(const char**)sanv_nth(&state->program->strings, arg1->ref));
+        fprintf(out, ");\n");
+      } else {
+        fprintf(out, "  s%d = san_nil;\n", d);
+      }
+      break;
+    case SAN_BYTECODE_POP:
+      break;
+    case SAN_BYTECODE_DUP:
+      fprintf(out, "  s%d = s%d;\n", d, d - 1);
+      break;
+    case SAN_BYTECODE_PICK:
+      fprintf(out, "  s%d = s%d;\n", d, d - 1 - arg1->ref);
+      break;
+    case SAN_BYTECODE_ROLL:
+      fprintf(out, "  t = s%d;\n", d - 1 - arg1->ref);
+      for (int i = d - 1 - arg1->ref; i < d - 1; ++i) fprintf(out, "  s%d = s%d;\n", i, i + 1);
+      fprintf(out, "  s%d = t;\n", d - 1);
+      break;
+    case SAN_BYTECODE_JUMP:
+      fprintf(out, "  goto L%d;\n", target);
+      break;
+    case SAN_BYTECODE_JUMP_IF_FALSE:
+    case SAN_BYTECODE_JUMP_IF_TRUE:
+      fprintf(out, "  if (%ssan_truthy(s%d)) goto L%d;\n",
+        code->opcode == SAN_BYTECODE_JUMP_IF_FALSE ? "!" : "", d - 1, target);
+      break;
+    case SAN_BYTECODE_LOAD_SLOT:
+      if (arg1->type == SAN_BYTECODE_TYPE_GLOBAL) {
+        fprintf(out, "  s%d = san_globals[%d];\n", d, arg1->ref);
+      } else {
+        fprintf(out, "  s%d = l%d;\n", d, arg1->ref);
+      }
+      break;
+    case SAN_BYTECODE_STORE_SLOT:
+      if (arg1->type == SAN_BYTECODE_TYPE_GLOBAL) {
+        fprintf(out, "  san_globals[%d] = s%d;\n", arg1->ref, d - 1);
+      } else {
+        fprintf(out, "  l%d = s%d;\n", arg1->ref, d - 1);
+      }
+      break;
+    case SAN_BYTECODE_ADD:
+    case SAN_BYTECODE_MUL:
+      emit_check_int(state, pc, d - 1);
+      emit_check_int(state, pc, d - 2);
+      /* Fall through */
+    case SAN_BYTECODE_ADD_II:
+    case SAN_BYTECODE_MUL_II: {
+      int isAdd = code->opcode == SAN_BYTECODE_ADD || code->opcode == SAN_BYTECODE_ADD_II;
+      fprintf(out, "  s%d = sani_%s(&san_runtime.gc, s%d, s%d);\n", d - 2, isAdd ? "add" : "mul", d - 2, d - 1);
+      break;
+    }
+    case SAN_BYTECODE_CALL_NATIVE:
+    case SAN_BYTECODE_CALL_NATIVE_I:
+      emit_native_call(state, pc, d);
+      break;
+    case SAN_BYTECODE_CALL:
+      emit_call(state, pc, d);
+      break;
+    case SAN_BYTECODE_TAILCALL:
+      emit_tailcall(state, pc, d);
+      break;
+    case SAN_BYTECODE_RET:
+      if (state->usesArena) fprintf(out, "  san_release(mark);\n");
+      fprintf(out, "  return s%d;\n", d - 1);
+      break;
+    case SAN_BYTECODE_MAKE_LIST:
+    case SAN_BYTECODE_MAKE_LOCAL_LIST: {
+      int first = d - arg1->ref;
+      fprintf(out, "  t = san_new_list(&%s);\n", code->opcode == SAN_BYTECODE_MAKE_LIST ? "san_heap" : "san_arena");
+      for (int i = first; i < d; ++i) fprintf(out, "  san_append(t, s%d);\n", i);
+      fprintf(out, "  s%d = t;\n", first);
+      break;
+    }
+    case SAN_BYTECODE_LIST_APPEND:
+      fprintf(out, "  san_append(s%d, s%d);\n", d - 2, d - 1);
+      break;
+    case SAN_BYTECODE_ITER:
+      fprintf(out, "  if (vm_type(s%d) != SAN_VM_LIST) return san_type_error(\"a list\", vm_type(s%d), ", d - 1, d - 1);
+      emit_where(state, pc);
+      fprintf(out, ");\n  s%d = san_int(0);\n", d);
+      break;
+    case SAN_BYTECODE_ITER_NEXT:
+      /* [list index acc] -> [list index+1 acc item], or [acc] and exit */
+      fprintf(out, "  if (vm_to_int(s%d) < vm_to_list(s%d)->items.size) {\n", d - 2, d - 3);
+      fprintf(out, "    s%d = *(vm_object*)sanv_nth(&vm_to_list(s%d)->items, vm_to_int(s%d));\n",
+        d, d - 3, d - 2);
+      fprintf(out, "    s%d = san_int(vm_to_int(s%d) + 1);\n", d - 2, d - 2);
+      fprintf(out, "  } else {\n    s%d = s%d;\n    goto L%d;\n  }\n", d - 3, d - 1, target);
+      break;
+  }
+}
+
+static int emit_function(aot_state_t *state, int function) {
+  const san_function_t *fn = sanv_nth(&state->program->functions, function);
+  int maxDepth = fn->maxStack - fn->nslots;
+  int selfTail = 0, usesTemp = 0;
+  const char *separator = "  vm_object ";
+  FILE *out = state->out;
+
+  state->function = function;
+  state->fn = fn;
+  state->code = sanv_nth(&state->program->bytecode, fn->entry);
+  state->depths = SAN_MALLOC(fn->length * sizeof(int));
+  state->targets = SAN_CALLOC(fn->length, 1);
+  state->usesArena = 0;
+
+  if (sanc_depths(state->program, function, state->depths) != SAN_OK) {
+    SAN_FREE(state->depths);
+    SAN_FREE(state->targets);
+    return SAN_FAIL;
+  }
+
+  for (int pc = 0; pc < fn->length; ++pc) {
+    const san_bytecode_t *code = &state->code[pc];
+    if (code->opcode == SAN_BYTECODE_JUMP || code->opcode == SAN_BYTECODE_JUMP_IF_FALSE ||
+        code->opcode == SAN_BYTECODE_JUMP_IF_TRUE || code->opcode == SAN_BYTECODE_ITER_NEXT) {
+      state->targets[code->arg1.ref - fn->entry] = 1;
+    }
+    if (code->opcode == SAN_BYTECODE_MAKE_LOCAL_LIST) state->usesArena = 1;
+    if (code->opcode == SAN_BYTECODE_TAILCALL && code->arg1.ref == function) selfTail = 1;
+
+    /* t holds a result for a moment, which these are the only ones to need */
+    if ((code->opcode == SAN_BYTECODE_TAILCALL && code->arg1.ref != function) ||
+        code->opcode == SAN_BYTECODE_ROLL || code->opcode == SAN_BYTECODE_MAKE_LIST ||
+        code->opcode == SAN_BYTECODE_MAKE_LOCAL_LIST) {
+      usesTemp = 1;
+    }
+  }
+
+  fprintf(out, "\n/* %s/%d */\n", fn->name, fn->arity);
+  emit_signature(state, function);
+  fprintf(out, " {\n");
+  if (usesTemp) {
+    fprintf(out, "%st", separator);
+    separator = ", ";
+  }
+  for (int i = fn->arity; i < fn->nslots; ++i, separator = ", ") fprintf(out, "%sl%d = san_nil", separator, i);
+  for (int i = 0; i < maxDepth; ++i, separator = ", ") fprintf(out, "%ss%d", separator, i);
+  if (separator[0] == ',') fprintf(out, ";\n");
+  if (state->usesArena) fprintf(out, "  int mark = san_arena.size;\n");
+  if (selfTail) fprintf(out, "entry:\n");
+
+  for (int pc = 0; pc < fn->length; ++pc) {
+    if (state->depths[pc] < 0) continue;
+    if (state->targets[pc]) fprintf(out, "L%d:;\n", pc);
+    emit_instruction(state, pc);
+  }
+  fprintf(out, "}\n");
+
+  SAN_FREE(state->depths);
+  SAN_FREE(state->targets);
+  return SAN_OK;
+}
+
+int sana_emit_c(const san_program_t *program, const char *file, FILE *out) {
+  aot_state_t state;
+  char *natives;
+  int result = SAN_OK;
+
+  memset(&state, 0, sizeof state);
+  state.program = program;
+  state.file = file;
+  state.out = out;
+  if (!program->verified) return SAN_FAIL;
+
+  /* Natives called through the registry */
+  natives = SAN_CALLOC(sann_count() + 1, 1);
+  SAN_VECTOR_FOR_EACH(program->bytecode, i, san_bytecode_t, code)
+    if (code->opcode == SAN_BYTECODE_CALL_NATIVE || code->opcode == SAN_BYTECODE_CALL_NATIVE_I) {
+      const san_native_t *native = sann_nth(code->arg1.ref);
+      if (!(native->flags & SAN_NATIVE_INT) || integer_native(native) == NULL) natives[code->arg1.ref] = 1;
+    }
+  SAN_VECTOR_END_FOR_EACH
+
+  fprintf(out, "/* Compiled by san %d.%d.%d from ", SAN_VERSION_MAJOR, SAN_VERSION_MINOR, SAN_VERSION_PATCH);
+  emit_string(out, file);
+  fprintf(out, " */\n%s\n", PRELUDE);
+  fprintf(out, "static vm_object san_globals[%d];\n", program->nglobals + 1);
+  for (int i = 0; i < sann_count(); ++i) {
+    if (natives[i]) fprintf(out, "static const san_native_t *san_native%d;\n", i);
+  }
+  fprintf(out, "\n");
+  for (int i = 0; i < program->functions.size; ++i) {
+    emit_signature(&state, i);
+    fprintf(out, ";\n");
+  }
+
+  for (int i = 0; i < program->functions.size && result == SAN_OK; ++i) {
+    result = emit_function(&state, i);
+  }
+
+  fprintf(out, "\nint san_main(void) {\n  san_gc_limits_t limits = SAN_GC_DEFAULT_LIMITS;\n  vm_object ret;\n");
+  for (int i = 0; i < sann_count(); ++i) {
+    if (!natives[i]) continue;
+    fprintf(out, "  if ((san_native%d = san_native(", i);
+    emit_string(out, sann_nth(i)->name);
+    fprintf(out, ")) == NULL) return SAN_FAIL;\n");
+  }
+  fprintf(out,
+    "  sanv_create(&san_heap, sizeof(vm_list*));\n"
+    "  sanv_create(&san_arena, sizeof(vm_list*));\n"
+    "  sanm_create(&san_runtime, &limits, stdout);\n"
+    "  ret = san_f0();\n"
+    "  sanv_destroy(&san_heap, san_destroy_list);\n"
+    "  sanv_destroy(&san_arena, san_destroy_list);\n"
+    "  sanm_destroy(&san_runtime);\n"
+    "  return vm_type(ret) == SAN_AOT_FAILED ? SAN_FAIL : SAN_OK;\n"
+    "}\n"
+    "\n"
+    "#ifndef SAN_AOT_LIBRARY\n"
+    "int main(void) {\n"
+    "  return san_main() == SAN_OK ? 0 : 1;\n"
+    "}\n"
+    "#endif\n");
+
+  SAN_FREE(natives);
+  return result;
+}
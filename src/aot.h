@@ -0,0 +1,27 @@
+#ifndef __SAN_AOT_H
+#define __SAN_AOT_H
+
+#include "bytecode.h"
+
+/*
+ * Ahead-of-time compiler
+ *
+ * Translates a verified program into a standalone C file. Each function
+ * becomes a C function whose stack entries and slots are local variables,
+ * which the verifier's fixed stack depths make possible, and branches
+ * become gotos. Natives are called through the registry in natives.h, or
+ * straight into the sani_* functions of integer.h once type inference has
+ * proved their arguments to be integers.
+ *
+ * The output includes headers from src and links against the objects of
+ * the runtime, without cli.o:
+ *
+ *   cc -O2 -Isrc prog.c build/libsan.a -lm -lpthread -o prog
+ *
+ * Defining SAN_AOT_LIBRARY leaves out main, so that the file can be built
+ * into a shared object and run with san_main. Runtime errors are printed to
+ * stderr with the position in file they were compiled from.
+ */
+int sana_emit_c(const san_program_t *program, const char *file, FILE *out);
+
+#endif
@@ -1,37 +1,220 @@
+#include <errno.h>
+#include <limits.h>
 #include "bytecode.h"
+#include "natives.h"
+#include "scope.h"
+#include "types.h"
+#include "escape.h"
+#include "object.h"
+#include "super.h"
+
+/*
+ * Pure values are hash-consed: a value is keyed by its operation, an operand
+ * such as a slot or literal, and the ids of its arguments, so structurally
+ * equal expressions get the same id.
+ */
+#define SAN_CSE_MAX_ARGS 4
+
+typedef struct {
+  int kind, value, nargs;
+  int args[SAN_CSE_MAX_ARGS];
+
+  /* Where the value was last computed, valid while epoch is current */
+  int epoch, start, end;
+  int temp, stored;
+} bc_value_t;
+
+typedef struct {
+  const void *key;
+  int id, next;
+} bc_memo_t;
+
+typedef struct {
+  san_vector_t values;
+  int *buckets;
+  int capacity;
+
+  /* Value ids of nodes and call terms, by node */
+  bc_memo_t *memo;
+  int memoCapacity, memoSize;
+
+  int epoch;
+} bc_cse_t;
+
+typedef struct {
+  int line, column;
+} bc_position_t;
+
+/*
+ * Bytecode of a function until it is linked into program->bytecode, with
+ * the source position of each instruction. A body is complete once its
+ * return has been emitted.
+ */
+typedef struct {
+  san_vector_t code;
+  san_vector_t positions;
+  int complete;
+} bc_body_t;
 
 typedef struct {
   const san_node_t *node;
   san_program_t *program;
   san_vector_t *errors;
+
+  /* Bodies of every function, by index */
+  san_vector_t *bodies;
+  int function;
+  int isTail;
+
+  /* Set on definitions whose nil would only be popped */
+  int isDropped;
+
+  /* Values computed so far in the current function */
+  bc_cse_t *cse;
 } bcgen_state_t;
 
 static const san_arg_t NO_ARG = { -1, -1 };
 
+static san_error_t _compileError(const san_node_t *node, int code) {
+  san_error_t err;
+  memset(&err, 0, sizeof err);
+  err.code = code;
+  if (node->token != NULL) {
+    err.line = node->token->line;
+    err.column = node->token->column;
+  }
+  return err;
+}
+
+#define compileError(__state, __node, __code, ...) do { \
+  san_error_t err = _compileError((__node), __code); \
+  sprintf(err.msg, __code##_MSG, __VA_ARGS__); \
+  sanv_push((__state)->errors, &err); \
+} while (0)
+
 static int generate(bcgen_state_t *state);
+
+static bcgen_state_t child_state(const bcgen_state_t *state, const san_node_t *node, int isTail) {
+  bcgen_state_t child = *state;
+  child.node = node;
+  child.isTail = isTail;
+  child.isDropped = 0;
+  return child;
+}
+
+static inline bc_body_t *nth_body(const bcgen_state_t *state, int function) {
+  return (bc_body_t*)sanv_nth(state->bodies, function);
+}
+
+static void create_body(bc_body_t *body) {
+  sanv_create(&body->code, sizeof(san_bytecode_t));
+  sanv_create(&body->positions, sizeof(bc_position_t));
+  body->complete = 0;
+}
+
+static int destroy_body(void *ptr) {
+  bc_body_t *body = ptr;
+  sanv_destroy(&body->positions, sanv_nodestructor);
+  return sanv_destroy(&body->code, sanv_nodestructor);
+}
+
+static inline san_vector_t *current_code(bcgen_state_t *state) {
+  return &nth_body(state, state->function)->code;
+}
+
 /*
-static bcgen_state_t clone_state(const bcgen_state_t *state) {
-  bcgen_state_t clone = { state->node, state->bytecode, state->errors };
-  return clone;
+ * Appends an instruction at the given position or, without one, at that of
+ * the node being generated. Nodes without a token inherit the position of
+ * the previous instruction.
+ */
+static void emit_at(bcgen_state_t *state, const san_bytecode_t *code, const bc_position_t *at) {
+  bc_body_t *body = nth_body(state, state->function);
+  const san_token_t *token = state->node != NULL ? state->node->token : NULL;
+  bc_position_t position = { 0, 0 };
+
+  if (at != NULL) {
+    position = *at;
+  } else if (token != NULL) {
+    position.line = token->line;
+    position.column = token->column;
+  } else if (body->positions.size > 0) {
+    position = *(bc_position_t*)sanv_back(&body->positions);
+  }
+  sanv_push(&body->code, code);
+  sanv_push(&body->positions, &position);
 }
-*/
 
 static void emit0(bcgen_state_t *state, int opcode) {
   san_bytecode_t code = { opcode, NO_ARG, NO_ARG };
-  sanv_push(&state->program->bytecode, &code);
+  emit_at(state, &code, NULL);
 }
 
 static void emit1(bcgen_state_t *state, int opcode, san_arg_t *arg1) {
   san_bytecode_t code = { opcode, *arg1, NO_ARG };
-  sanv_push(&state->program->bytecode, &code);
+  emit_at(state, &code, NULL);
+}
+
+static void emit2(bcgen_state_t *state, int opcode, san_arg_t *arg1, san_arg_t *arg2) {
+  san_bytecode_t code = { opcode, *arg1, *arg2 };
+  emit_at(state, &code, NULL);
+}
+
+static void emit_nil(bcgen_state_t *state) {
+  san_arg_t nil = { SAN_BYTECODE_TYPE_NIL, 0 };
+  emit1(state, SAN_BYTECODE_PUSH, &nil);
+}
+
+static void emit_count(bcgen_state_t *state, int opcode, int count) {
+  san_arg_t arg = { SAN_BYTECODE_TYPE_COUNT, count };
+  emit1(state, opcode, &arg);
+}
+
+/*
+ * Jump targets are offsets into the current function until link_program
+ * relocates them.
+ */
+static inline int here(bcgen_state_t *state) {
+  return current_code(state)->size;
 }
+
 /*
-static void emit2(bcgen_state_t *state, int opcode, void *arg1, void *arg2) {
-  san_bytecode_t code = { opcode, arg1, arg2 };
-  sanv_push(&state->program->bytecode, &code);
+ * Values are only reused within a basic block, so every jump and every jump
+ * target forgets them. This also keeps the positions of jumps and labels
+ * stable, since reusing a value may insert code after its first use.
+ */
+static inline void cse_barrier(bcgen_state_t *state) {
+  state->cse->epoch++;
+}
+
+static inline int label(bcgen_state_t *state) {
+  cse_barrier(state);
+  return here(state);
+}
+
+static int emit_jump(bcgen_state_t *state, int opcode, int target) {
+  san_arg_t arg = { SAN_BYTECODE_TYPE_TARGET, target };
+  cse_barrier(state);
+  emit1(state, opcode, &arg);
+  return here(state) - 1;
+}
+
+static void patch_jump(bcgen_state_t *state, int at, int target) {
+  san_bytecode_t *code = sanv_nth(current_code(state), at);
+  cse_barrier(state);
+  code->arg1.ref = target;
 }
-*/
-static int store_number_literal(bcgen_state_t *state, int number, int *ref) {
+
+/*
+ * Whether a number literal fits an integer's payload. Larger ones are kept
+ * as their digits, and made into a bignum at every use.
+ */
+static int parse_number_literal(const char *raw, int64_t *number) {
+  errno = 0;
+  *number = strtoll(raw, NULL, 10);
+  return errno == 0 && *number <= SAN_VM_INT_MAX ? SAN_OK : SAN_FAIL;
+}
+
+static int store_number_literal(bcgen_state_t *state, int64_t number, int *ref) {
   if (sanv_push(&state->program->numbers, &number) != SAN_OK) {
     return SAN_FAIL;
   }
@@ -40,6 +223,15 @@ static int store_number_literal(bcgen_state_t *state, int number, int *ref) {
   return SAN_OK;
 }
 
+static int store_bignum_literal(bcgen_state_t *state, const char *digits, int *ref) {
+  if (sanv_push(&state->program->bignums, &digits) != SAN_OK) {
+    return SAN_FAIL;
+  }
+
+  *ref = state->program->bignums.size - 1;
+  return SAN_OK;
+}
+
 static int store_string_literal(bcgen_state_t *state, const char *string, int *ref) {
   if (sanv_push(&state->program->strings, &string) != SAN_OK) {
     return SAN_FAIL;
@@ -49,53 +241,1009 @@ static int store_string_literal(bcgen_state_t *state, const char *string, int *r
   return SAN_OK;
 }
 
-static int store_symbol(bcgen_state_t *state, const char *symbol, int *ref) {
-  if (sanv_push(&state->program->symbols, &symbol) != SAN_OK) {
+/*
+ * Common subexpressions
+ */
+static void cse_create(bc_cse_t *cse) {
+  memset(cse, 0, sizeof *cse);
+  sanv_create(&cse->values, sizeof(bc_value_t));
+
+  /* New values have epoch 0 and are never available */
+  cse->epoch = 1;
+}
+
+static void cse_destroy(bc_cse_t *cse) {
+  sanv_destroy(&cse->values, sanv_nodestructor);
+  SAN_FREE(cse->buckets);
+  SAN_FREE(cse->memo);
+}
+
+static inline bc_value_t *nth_value(const bc_cse_t *cse, int id) {
+  return (bc_value_t*)sanv_nth(&cse->values, id);
+}
+
+static unsigned int hash_value(const bc_value_t *key) {
+  unsigned int hash = 2166136261u;
+  hash = (hash ^ key->kind) * 16777619u;
+  hash = (hash ^ key->value) * 16777619u;
+  for (int i = 0; i < key->nargs; ++i) hash = (hash ^ key->args[i]) * 16777619u;
+  return hash;
+}
+
+static inline int same_value(const bc_value_t *a, const bc_value_t *b) {
+  return a->kind == b->kind && a->value == b->value && a->nargs == b->nargs &&
+    memcmp(a->args, b->args, a->nargs * sizeof(int)) == 0;
+}
+
+static void cse_rehash(bc_cse_t *cse) {
+  SAN_FREE(cse->buckets);
+  cse->capacity = cse->capacity == 0 ? 64 : cse->capacity * 2;
+  cse->buckets = SAN_MALLOC(cse->capacity * sizeof(int));
+  memset(cse->buckets, -1, cse->capacity * sizeof(int));
+
+  SAN_VECTOR_FOR_EACH(cse->values, id, bc_value_t, value)
+    unsigned int i = hash_value(value) & (cse->capacity - 1);
+    while (cse->buckets[i] >= 0) i = (i + 1) & (cse->capacity - 1);
+    cse->buckets[i] = id;
+  SAN_VECTOR_END_FOR_EACH
+}
+
+/*
+ * Returns the id of the value, adding it if it is new.
+ */
+static int intern_value(bc_cse_t *cse, int kind, int value, int nargs, const int *args) {
+  bc_value_t key;
+  unsigned int i;
+
+  memset(&key, 0, sizeof key);
+  key.kind = kind;
+  key.value = value;
+  key.nargs = nargs;
+  memcpy(key.args, args, nargs * sizeof(int));
+  key.temp = -1;
+
+  if (2 * (cse->values.size + 1) > cse->capacity) cse_rehash(cse);
+  for (i = hash_value(&key) & (cse->capacity - 1); cse->buckets[i] >= 0;
+       i = (i + 1) & (cse->capacity - 1)) {
+    if (same_value(nth_value(cse, cse->buckets[i]), &key)) return cse->buckets[i];
+  }
+
+  cse->buckets[i] = cse->values.size;
+  sanv_push(&cse->values, &key);
+  return cse->values.size - 1;
+}
+
+static bc_memo_t *memo_slot(bc_cse_t *cse, const void *key) {
+  unsigned int i = (unsigned int)(((size_t)key >> 4) * 2654435761u);
+  for (i &= cse->memoCapacity - 1; cse->memo[i].key != NULL && cse->memo[i].key != key;
+       i = (i + 1) & (cse->memoCapacity - 1));
+  return &cse->memo[i];
+}
+
+static bc_memo_t *memo_lookup(bc_cse_t *cse, const void *key) {
+  bc_memo_t *slot;
+
+  if (2 * (cse->memoSize + 1) > cse->memoCapacity) {
+    bc_memo_t *old = cse->memo;
+    int oldCapacity = cse->memoCapacity;
+    cse->memoCapacity = oldCapacity == 0 ? 64 : oldCapacity * 2;
+    cse->memo = SAN_CALLOC(cse->memoCapacity, sizeof(bc_memo_t));
+    for (int i = 0; i < oldCapacity; ++i) {
+      if (old[i].key != NULL) *memo_slot(cse, old[i].key) = old[i];
+    }
+    SAN_FREE(old);
+  }
+
+  slot = memo_slot(cse, key);
+  if (slot->key == NULL) {
+    slot->key = key;
+    slot->id = -2;
+    cse->memoSize++;
+  }
+  return slot;
+}
+
+static void flatten_call(const san_node_t *node, san_vector_t *terms);
+static inline const san_node_t *nth_term(const san_vector_t *terms, int n);
+static inline int is_callable(const san_node_t *node);
+static int term_value(bcgen_state_t *state, const san_vector_t *terms, int pos, int *next);
+
+/*
+ * Returns the value id of a node, or -1 if it is not pure or not worth
+ * keying, like a list. Ids are memoised per node so generating an expression
+ * stays linear in its size.
+ */
+static int node_value(bcgen_state_t *state, const san_node_t *node) {
+  const san_vector_t *children = &node->children;
+  bc_memo_t *memo;
+  int id = -1;
+
+  /* The memo entry of a callee is that of the call */
+  if (is_callable(node)) return -1;
+
+  memo = memo_lookup(state->cse, node);
+  if (memo->id != -2) return memo->id;
+
+  switch (node->type) {
+    case SAN_PARSER_NUMBER_LITERAL: {
+      /* Values are keyed by an int, so wider literals are not shared */
+      int64_t number;
+      if (parse_number_literal(node->token->raw, &number) == SAN_OK && number <= INT_MAX) {
+        id = intern_value(state->cse, SAN_BYTECODE_PUSH, (int)number, 0, NULL);
+      }
+      break;
+    }
+    case SAN_PARSER_PRIMARY_EXPRESSION:
+    case SAN_PARSER_VARIABLE_LVALUE:
+      if (children->size == 0) {
+        if (node->binding == SAN_BINDING_LOCAL || node->binding == SAN_BINDING_GLOBAL) {
+          int slot = 2 * node->slot + (node->binding == SAN_BINDING_GLOBAL);
+          id = intern_value(state->cse, SAN_BYTECODE_LOAD_SLOT, slot, 0, NULL);
+        }
+        break;
+      }
+      /* Fall through */
+    case SAN_PARSER_EXPRESSION:
+      if (children->size == 1) id = node_value(state, sanv_nth(children, 0));
+      break;
+    case SAN_PARSER_LIST:
+      if (children->size == 1 && ((san_node_t*)sanv_nth(children, 0))->type == SAN_PARSER_EXPRESSION) {
+        id = node_value(state, sanv_nth(children, 0));
+      }
+      break;
+    case SAN_PARSER_ADDITIVE_EXPRESSION:
+    case SAN_PARSER_MULTIPLICATIVE_EXPRESSION: {
+      /* a + b + c is evaluated as a + (b + c) */
+      int kind = node->type == SAN_PARSER_ADDITIVE_EXPRESSION ? SAN_BYTECODE_ADD : SAN_BYTECODE_MUL;
+      id = node_value(state, sanv_nth(children, children->size - 1));
+      for (int i = children->size - 2; i >= 0 && id >= 0; --i) {
+        int args[2] = { node_value(state, sanv_nth(children, i)), id };
+        id = args[0] >= 0 ? intern_value(state->cse, kind, 0, 2, args) : -1;
+      }
+      break;
+    }
+    case SAN_PARSER_FN_EXPRESSION: {
+      san_vector_t terms;
+      int next;
+      sanv_create(&terms, sizeof(san_node_t*));
+      flatten_call(node, &terms);
+      id = term_value(state, &terms, 0, &next);
+      if (next != terms.size) id = -1;
+      sanv_destroy(&terms, sanv_nodestructor);
+      break;
+    }
+  }
+
+  /* The memo table may have grown */
+  memo_lookup(state->cse, node)->id = id;
+  return id;
+}
+
+/*
+ * Returns the value id of the term group starting at terms[pos], and the
+ * position after it. Calls are only keyed if the native is pure.
+ */
+static int term_value(bcgen_state_t *state, const san_vector_t *terms, int pos, int *next) {
+  const san_node_t *term = nth_term(terms, pos);
+  bc_memo_t *memo;
+  int args[SAN_CSE_MAX_ARGS];
+  int arity, id, pure = 1;
+
+  if (!is_callable(term)) {
+    *next = pos + 1;
+    return node_value(state, term);
+  }
+
+  memo = memo_lookup(state->cse, term);
+  if (memo->id != -2) {
+    *next = memo->next;
+    return memo->id;
+  }
+
+  if (term->binding == SAN_BINDING_FUNCTION) {
+    arity = ((const san_function_t*)sanv_nth(&state->program->functions, term->slot))->arity;
+    pure = 0;
+  } else {
+    arity = sann_nth(term->slot)->arity;
+    pure = (sann_nth(term->slot)->flags & SAN_NATIVE_PURE) != 0;
+  }
+  if (arity == SAN_NATIVE_VARIADIC) {
+    arity = terms->size - pos - 1;
+    pure = 0;
+  }
+  if (arity > SAN_CSE_MAX_ARGS) pure = 0;
+
+  *next = pos + 1;
+  for (int i = 0; i < arity && *next < terms->size; ++i) {
+    int arg = term_value(state, terms, *next, next);
+    if (arg < 0) pure = 0;
+    if (pure) args[i] = arg;
+  }
+
+  id = pure ? intern_value(state->cse, SAN_BYTECODE_CALL_NATIVE, term->slot, arity, args) : -1;
+  memo = memo_lookup(state->cse, term);
+  memo->id = id;
+  memo->next = *next;
+  return id;
+}
+
+/*
+ * Inserts code at the given position of the current function. Only values
+ * are moved: there are no jumps or labels after a value that is still
+ * available.
+ */
+static void insert_code(bcgen_state_t *state, int at, const san_bytecode_t *code, int count) {
+  bc_body_t *body = nth_body(state, state->function);
+  bc_position_t position = *(bc_position_t*)sanv_nth(&body->positions, at > 0 ? at - 1 : 0);
+
+  for (int i = 0; i < count; ++i) emit_at(state, code, &position);
+  memmove(sanv_nth(&body->code, at + count), sanv_nth(&body->code, at),
+    (body->code.size - count - at) * sizeof(san_bytecode_t));
+  memcpy(sanv_nth(&body->code, at), code, count * sizeof(san_bytecode_t));
+  memmove(sanv_nth(&body->positions, at + count), sanv_nth(&body->positions, at),
+    (body->positions.size - count - at) * sizeof(bc_position_t));
+  for (int i = 0; i < count; ++i) *(bc_position_t*)sanv_nth(&body->positions, at + i) = position;
+
+  SAN_VECTOR_FOR_EACH(state->cse->values, i, bc_value_t, value)
+    if (value->epoch != state->cse->epoch) continue;
+    if (value->start >= at) value->start += count;
+    if (value->end >= at) value->end += count;
+  SAN_VECTOR_END_FOR_EACH
+}
+
+/*
+ * Emits a value computed earlier in the block instead of computing it
+ * again: a dup if it is still on top of the stack, otherwise a load from a
+ * temporary slot that is stored the first time it is needed. Returns 1 if
+ * the value was reused.
+ */
+static int cse_reuse(bcgen_state_t *state, int id) {
+  bc_value_t *value;
+
+  if (id < 0) return 0;
+  value = nth_value(state->cse, id);
+  if (value->nargs == 0 || value->epoch != state->cse->epoch) return 0;
+
+  if (value->end == here(state)) {
+    emit0(state, SAN_BYTECODE_DUP);
+    value->end = here(state);
+    return 1;
+  }
+
+  if (!value->stored) {
+    san_function_t *fn = sanv_nth(&state->program->functions, state->function);
+    san_bytecode_t save[2] = {
+      { SAN_BYTECODE_DUP, NO_ARG, NO_ARG },
+      { SAN_BYTECODE_STORE_SLOT, NO_ARG, NO_ARG }
+    };
+
+    if (value->temp < 0) value->temp = fn->nslots++;
+    save[1].arg1.type = SAN_BYTECODE_TYPE_LOCAL;
+    save[1].arg1.ref = value->temp;
+    insert_code(state, value->end, save, 2);
+    value->stored = 1;
+  }
+
+  san_arg_t slot = { SAN_BYTECODE_TYPE_LOCAL, value->temp };
+  emit1(state, SAN_BYTECODE_LOAD_SLOT, &slot);
+  return 1;
+}
+
+static void cse_record(bcgen_state_t *state, int id, int start) {
+  bc_value_t *value;
+
+  if (id < 0) return;
+  value = nth_value(state->cse, id);
+  if (value->epoch == state->cse->epoch) return;
+  value->epoch = state->cse->epoch;
+  value->start = start;
+  value->end = here(state);
+  value->stored = 0;
+}
+
+/*
+ * A node is in tail position only if it is the sole child of a node in tail
+ * position; operands of arithmetic and call arguments never are.
+ */
+static int gen_children(bcgen_state_t *state) {
+  const san_vector_t *children = &state->node->children;
+  int isTail = state->isTail && children->size == 1;
+  int result = SAN_OK;
+
+  SAN_VECTOR_FOR_EACH(*children, i, san_node_t, child)
+    bcgen_state_t childState = child_state(state, child, isTail);
+    if (generate(&childState) != SAN_OK) result = SAN_FAIL;
+  SAN_VECTOR_END_FOR_EACH
+
+  return result;
+}
+
+/*
+ * Blocks evaluate to their last expression; the values of the ones before it
+ * are popped. Definitions before it push nothing in the first place.
+ */
+static int gen_sequence(bcgen_state_t *state) {
+  const san_vector_t *children = &state->node->children;
+  int result = SAN_OK;
+
+  if (children->size == 0) {
+    emit_nil(state);
+    return SAN_OK;
+  }
+
+  SAN_VECTOR_FOR_EACH(*children, i, san_node_t, child)
+    int isLast = i == children->size - 1;
+    const san_node_t *statement = child;
+    bcgen_state_t childState;
+
+    while (statement->type == SAN_PARSER_EXPRESSION && statement->children.size == 1) {
+      statement = sanv_nth(&statement->children, 0);
+    }
+    if (!isLast && statement->type == SAN_PARSER_VARIABLE_EXPRESSION) {
+      childState = child_state(state, statement, 0);
+      childState.isDropped = 1;
+    } else {
+      childState = child_state(state, child, state->isTail && isLast);
+    }
+
+    if (generate(&childState) != SAN_OK) result = SAN_FAIL;
+    if (!isLast && !childState.isDropped) emit0(state, SAN_BYTECODE_POP);
+  SAN_VECTOR_END_FOR_EACH
+
+  return result;
+}
+
+static inline int is_callable(const san_node_t *node) {
+  return node->binding == SAN_BINDING_FUNCTION || node->binding == SAN_BINDING_NATIVE;
+}
+
+/*
+ * Names were resolved to slots by the scope pass, so loading one is a
+ * single indexed read in the VM.
+ */
+static int gen_identifier(bcgen_state_t *state) {
+  const san_node_t *node = state->node;
+  san_arg_t slot = { SAN_BYTECODE_TYPE_LOCAL, node->slot };
+
+  switch (node->binding) {
+    case SAN_BINDING_GLOBAL:
+      slot.type = SAN_BYTECODE_TYPE_GLOBAL;
+      /* Fall through */
+    case SAN_BINDING_LOCAL:
+      emit1(state, SAN_BYTECODE_LOAD_SLOT, &slot);
+      return SAN_OK;
+    case SAN_BINDING_NONE:
+      compileError(state, node, SAN_ERROR_UNBOUND_NAME, node->token->raw);
+      return SAN_FAIL;
+    default:
+      /* Functions are not values yet */
+      compileError(state, node, SAN_ERROR_UNSUPPORTED_EXPRESSION, node->token->raw);
+      return SAN_FAIL;
+  }
+}
+
+/*
+ * The parser nests calls to the right, so "f a g b c" arrives as
+ * f(a, g(b(c))). Since every callee is known at compile time the chain is
+ * flattened back into a sequence of terms and regrouped by arity, the way
+ * Logo does it: f takes two terms, a and the call g b c.
+ */
+static void flatten_call(const san_node_t *node, san_vector_t *terms) {
+  SAN_VECTOR_FOR_EACH(node->children, i, san_node_t, child)
+    if (child->type == SAN_PARSER_FN_EXPRESSION) {
+      flatten_call(child, terms);
+    } else {
+      const san_node_t *name = sanp_bare_name(child);
+      if (name != NULL) child = (san_node_t*)name;
+      sanv_push(terms, &child);
+    }
+  SAN_VECTOR_END_FOR_EACH
+}
+
+static inline const san_node_t *nth_term(const san_vector_t *terms, int n) {
+  return *(const san_node_t**)sanv_nth(terms, n);
+}
+
+static int gen_term(bcgen_state_t *state, const san_vector_t *terms, int *pos);
+
+static int call_target(bcgen_state_t *state, const san_node_t *callee,
+  int *arity, int *opcode, san_arg_t *target) {
+  target->ref = callee->slot;
+
+  if (callee->binding == SAN_BINDING_FUNCTION) {
+    *arity = ((const san_function_t*)sanv_nth(&state->program->functions, callee->slot))->arity;
+    *opcode = state->isTail ? SAN_BYTECODE_TAILCALL : SAN_BYTECODE_CALL;
+    target->type = SAN_BYTECODE_TYPE_FUNCTION;
+  } else if (callee->binding == SAN_BINDING_NATIVE) {
+    *arity = sann_nth(callee->slot)->arity;
+    *opcode = SAN_BYTECODE_CALL_NATIVE;
+    target->type = SAN_BYTECODE_TYPE_NATIVE;
+  } else {
+    compileError(state, callee, SAN_ERROR_UNKNOWN_FUNCTION, callee->token->raw);
+    return SAN_FAIL;
+  }
+
+  return SAN_OK;
+}
+
+/*
+ * Inlining
+ *
+ * A call to a small function without branches is replaced by a copy of its
+ * compiled body. The arguments are already on the stack: if the body starts
+ * by loading its parameters in order and never touches them again, those
+ * loads are dropped and the arguments are used in place. Otherwise they are
+ * stored into fresh slots of the caller, where the callee's locals also go.
+ */
+#define SAN_INLINE_MAX_SIZE 12
+
+static const char *inline_refusal(bcgen_state_t *state, int callee) {
+  const bc_body_t *body;
+
+  if (callee == state->function || !nth_body(state, callee)->complete) return "recursive";
+  body = nth_body(state, callee);
+  if (body->code.size - 1 > SAN_INLINE_MAX_SIZE) return "too large";
+
+  SAN_VECTOR_FOR_EACH(body->code, i, san_bytecode_t, code)
+    if (code->arg1.type == SAN_BYTECODE_TYPE_TARGET) return "has branches";
+    if ((code->opcode == SAN_BYTECODE_CALL || code->opcode == SAN_BYTECODE_TAILCALL) &&
+        code->arg1.ref == callee) {
+      return "recursive";
+    }
+  SAN_VECTOR_END_FOR_EACH
+  return NULL;
+}
+
+static inline int is_local_access(const san_bytecode_t *code) {
+  return (code->opcode == SAN_BYTECODE_LOAD_SLOT || code->opcode == SAN_BYTECODE_STORE_SLOT) &&
+    code->arg1.type == SAN_BYTECODE_TYPE_LOCAL;
+}
+
+static int loads_params_in_place(const san_vector_t *code, int arity) {
+  for (int i = 0; i < code->size - 1; ++i) {
+    const san_bytecode_t *instr = sanv_nth(code, i);
+    if (!is_local_access(instr)) continue;
+    if (i < arity && instr->opcode == SAN_BYTECODE_LOAD_SLOT && instr->arg1.ref == i) continue;
+    if (instr->arg1.ref < arity) return 0;
+  }
+  return code->size - 1 >= arity;
+}
+
+static void gen_inline(bcgen_state_t *state, int callee) {
+  const san_function_t *fn = sanv_nth(&state->program->functions, callee);
+  const san_vector_t *code = &nth_body(state, callee)->code;
+  san_function_t *caller = sanv_nth(&state->program->functions, state->function);
+  int base = caller->nslots, first = 0;
+
+  if (loads_params_in_place(code, fn->arity)) {
+    first = fn->arity;
+  } else {
+    for (int i = fn->arity - 1; i >= 0; --i) {
+      san_arg_t slot = { SAN_BYTECODE_TYPE_LOCAL, base + i };
+      emit1(state, SAN_BYTECODE_STORE_SLOT, &slot);
+    }
+  }
+  if (fn->nslots > first) caller->nslots += fn->nslots;
+
+  /* Everything but the return, keeping the callee's source positions */
+  for (int i = first; i < code->size - 1; ++i) {
+    san_bytecode_t instr = *(san_bytecode_t*)sanv_nth(code, i);
+    if (is_local_access(&instr)) instr.arg1.ref += base;
+    if (instr.opcode == SAN_BYTECODE_TAILCALL && !state->isTail) instr.opcode = SAN_BYTECODE_CALL;
+    emit_at(state, &instr, sanv_nth(&nth_body(state, callee)->positions, i));
+  }
+}
+
+static const char *function_name(bcgen_state_t *state, int function) {
+  return ((const san_function_t*)sanv_nth(&state->program->functions, function))->name;
+}
+
+/*
+ * Emits a call whose arguments are on the stack, inlining user functions
+ * where possible. Every call site to a user function is recorded in
+ * program->calls.
+ */
+static void emit_call(bcgen_state_t *state, const san_node_t *callee,
+  int opcode, san_arg_t *target, san_arg_t *argc) {
+  /* Calls are placed at their callee, so traces point at the name called */
+  bcgen_state_t calleeState = child_state(state, callee, state->isTail);
+  san_call_site_t site;
+
+  if (target->type != SAN_BYTECODE_TYPE_FUNCTION) {
+    emit2(&calleeState, opcode, target, argc);
+    return;
+  }
+
+  site.caller = function_name(state, state->function);
+  site.callee = function_name(state, target->ref);
+  site.line = callee->token != NULL ? callee->token->line : 0;
+  site.column = callee->token != NULL ? callee->token->column : 0;
+  site.reason = inline_refusal(state, target->ref);
+  sanv_push(&state->program->calls, &site);
+
+  if (site.reason == NULL) {
+    gen_inline(state, target->ref);
+  } else {
+    emit2(&calleeState, opcode, target, argc);
+  }
+}
+
+/*
+ * Callees were resolved by the scope pass, so the VM only sees a function
+ * or registry index and arity mismatches are compile errors. Calls to user
+ * functions in tail position reuse the caller's frame.
+ *
+ * The last piped arguments are already on the stack; the arguments taken
+ * from the terms are rolled beneath them.
+ */
+static int gen_call(bcgen_state_t *state, const san_vector_t *terms, int *pos, int piped) {
+  const san_node_t *callee = nth_term(terms, (*pos)++);
+  int available = terms->size - *pos;
+  int arity, opcode, nargs = 0, result = SAN_OK;
+  san_arg_t target;
+
+  if (call_target(state, callee, &arity, &opcode, &target) != SAN_OK) {
+    return SAN_FAIL;
+  }
+
+  if (arity != SAN_NATIVE_VARIADIC && (arity < piped || arity - piped > available)) {
+    compileError(state, callee, SAN_ERROR_ARITY_MISMATCH, callee->token->raw,
+      arity, available + piped);
+    return SAN_FAIL;
+  }
+
+  /* Variadic natives take every remaining term */
+  bcgen_state_t argState = child_state(state, state->node, 0);
+  while (arity == SAN_NATIVE_VARIADIC ? *pos < terms->size : nargs < arity - piped) {
+    if (gen_term(&argState, terms, pos) != SAN_OK) result = SAN_FAIL;
+    nargs++;
+  }
+
+  for (int i = 0; i < piped && nargs > 0; ++i) {
+    emit_count(state, SAN_BYTECODE_ROLL, nargs + piped - 1);
+  }
+
+  san_arg_t argc = { SAN_BYTECODE_TYPE_COUNT, nargs + piped };
+  emit_call(state, callee, opcode, &target, &argc);
+  return result;
+}
+
+static int gen_term(bcgen_state_t *state, const san_vector_t *terms, int *pos) {
+  const san_node_t *term = nth_term(terms, *pos);
+
+  if (is_callable(term)) {
+    int next, start = here(state), result;
+    int id = term_value(state, terms, *pos, &next);
+    if (cse_reuse(state, id)) {
+      *pos = next;
+      return SAN_OK;
+    }
+    result = gen_call(state, terms, pos, 0);
+    cse_record(state, id, start);
+    return result;
+  }
+
+  (*pos)++;
+  bcgen_state_t termState = child_state(state, term, state->isTail);
+  if (term->type == SAN_PARSER_VARIABLE_LVALUE) {
+    return gen_identifier(&termState);
+  }
+  return generate(&termState);
+}
+
+/*
+ * Generates the call starting at terms[first], which must use up every
+ * remaining term.
+ */
+static int gen_call_terms(bcgen_state_t *state, const san_vector_t *terms, int first, int piped) {
+  const san_node_t *callee = nth_term(terms, first);
+  int pos = first;
+  int result = gen_call(state, terms, &pos, piped);
+
+  if (result == SAN_OK && pos < terms->size) {
+    compileError(state, callee, SAN_ERROR_ARITY_MISMATCH, callee->token->raw,
+      pos - first - 1 + piped, terms->size - first - 1 + piped);
+    result = SAN_FAIL;
+  }
+  return result;
+}
+
+static int gen_application(bcgen_state_t *state) {
+  san_vector_t terms;
+  int result;
+
+  sanv_create(&terms, sizeof(san_node_t*));
+  flatten_call(state->node, &terms);
+  result = gen_call_terms(state, &terms, 0, 0);
+  sanv_destroy(&terms, sanv_nodestructor);
+  return result;
+}
+
+/*
+ * A pipe stage that is not fused is a call with the piped value as its last
+ * argument: "xs | f a" is f a xs.
+ */
+static int gen_stage_call(bcgen_state_t *state, const san_node_t *stage) {
+  const san_node_t *name = sanp_bare_name(stage);
+  san_vector_t terms;
+  int result;
+
+  if (stage->type != SAN_PARSER_FN_EXPRESSION && (name == NULL || !is_callable(name))) {
+    compileError(state, stage, SAN_ERROR_UNSUPPORTED_EXPRESSION, stage->token->raw);
+    return SAN_FAIL;
+  }
+
+  sanv_create(&terms, sizeof(san_node_t*));
+  if (stage->type == SAN_PARSER_FN_EXPRESSION) {
+    flatten_call(stage, &terms);
+  } else {
+    sanv_push(&terms, &name);
+  }
+  result = gen_call_terms(state, &terms, 0, 1);
+  sanv_destroy(&terms, sanv_nodestructor);
+  return result;
+}
+
+static inline int is_terminal_stage(int stage) {
+  return stage == SAN_STAGE_REDUCE || stage == SAN_STAGE_SUM ||
+    stage == SAN_STAGE_COUNT || stage == SAN_STAGE_LIST;
+}
+
+/*
+ * reduce f init: f is called with the accumulator and the element.
+ */
+static int gen_reduce_step(bcgen_state_t *state, const san_vector_t *terms) {
+  const san_node_t *callee = nth_term(terms, 1);
+  int arity, opcode;
+  san_arg_t target;
+
+  if (call_target(state, callee, &arity, &opcode, &target) != SAN_OK) {
+    return SAN_FAIL;
+  }
+  if (arity != 2 && arity != SAN_NATIVE_VARIADIC) {
+    compileError(state, callee, SAN_ERROR_ARITY_MISMATCH, callee->token->raw, arity, 2);
     return SAN_FAIL;
   }
 
-  *ref = state->program->symbols.size - 1;
+  san_arg_t argc = { SAN_BYTECODE_TYPE_COUNT, 2 };
+  emit_call(state, callee, opcode, &target, &argc);
   return SAN_OK;
 }
 
-static void gen_children(bcgen_state_t *state) {
+/*
+ * Fuses the stages [first, last) of a pipe into one loop over the list on
+ * top of the stack, so no intermediate list is built between stages. The
+ * loop keeps [list index accumulator] on the stack, and each element runs
+ * through every stage before the next one is fetched:
+ *
+ *         iter
+ *         <initial accumulator>
+ *   loop: iter_next exit         ; [list index acc x]
+ *         <map and filter stages>
+ *         <fold x into acc>
+ *         jump loop
+ *   skip: pop                    ; x was filtered out
+ *         jump loop
+ *   exit:                        ; [acc]
+ *
+ * Unless the last stage is a fold, the accumulator is the output list.
+ * ITER is marked SAN_BYTECODE_ITER_LIST then, and SAN_BYTECODE_ITER_SUM
+ * for sum and count, so the VM may run the loop in chunks.
+ */
+static int gen_fused(bcgen_state_t *state, int first, int last) {
+  const san_vector_t *stages = &state->node->children;
+  const san_node_t *terminal = sanv_nth(stages, last - 1);
+  bcgen_state_t stageState = child_state(state, state->node, 0);
+  san_vector_t terms, skips;
+  int loop, next, result = SAN_OK;
+
+  sanv_create(&terms, sizeof(san_node_t*));
+  sanv_create(&skips, sizeof(int));
+
+  switch (terminal->slot) {
+    case SAN_STAGE_SUM:
+    case SAN_STAGE_COUNT: {
+      san_arg_t zero = { SAN_BYTECODE_TYPE_NUMBER_LITERAL, 0 };
+      store_number_literal(state, 0, &zero.ref);
+      emit_count(state, SAN_BYTECODE_ITER, SAN_BYTECODE_ITER_SUM);
+      emit1(state, SAN_BYTECODE_PUSH, &zero);
+      break;
+    }
+    case SAN_STAGE_REDUCE: {
+      int pos = 2;
+      emit0(state, SAN_BYTECODE_ITER);
+      flatten_call(terminal, &terms);
+      if (terms.size != 3) {
+        compileError(state, terminal, SAN_ERROR_ARITY_MISMATCH, "reduce", 2, terms.size - 1);
+        result = SAN_FAIL;
+        break;
+      }
+      result = gen_term(&stageState, &terms, &pos);
+      break;
+    }
+    default:
+      emit_count(state, SAN_BYTECODE_ITER, SAN_BYTECODE_ITER_LIST);
+      emit_count(state, SAN_BYTECODE_MAKE_LIST, 0);
+      break;
+  }
+
+  loop = label(state);
+  next = emit_jump(state, SAN_BYTECODE_ITER_NEXT, 0);
+
+  for (int i = first; i < last && result == SAN_OK; ++i) {
+    const san_node_t *stage = sanv_nth(stages, i);
+
+    terms.size = 0;
+    flatten_call(stage, &terms);
+    stageState.node = stage;
+
+    switch (stage->slot) {
+      case SAN_STAGE_MAP:
+        result = gen_call_terms(&stageState, &terms, 1, 1);
+        break;
+      case SAN_STAGE_FILTER: {
+        int skip;
+        emit0(state, SAN_BYTECODE_DUP);
+        result = gen_call_terms(&stageState, &terms, 1, 1);
+        skip = emit_jump(state, SAN_BYTECODE_JUMP_IF_FALSE, 0);
+        sanv_push(&skips, &skip);
+        break;
+      }
+      case SAN_STAGE_REDUCE:
+        result = gen_reduce_step(&stageState, &terms);
+        break;
+      case SAN_STAGE_SUM:
+        emit0(state, SAN_BYTECODE_ADD);
+        break;
+      case SAN_STAGE_COUNT: {
+        san_arg_t one = { SAN_BYTECODE_TYPE_NUMBER_LITERAL, 0 };
+        store_number_literal(state, 1, &one.ref);
+        emit0(state, SAN_BYTECODE_POP);
+        emit1(state, SAN_BYTECODE_PUSH, &one);
+        emit0(state, SAN_BYTECODE_ADD);
+        break;
+      }
+    }
+  }
+
+  if (!is_terminal_stage(terminal->slot) || terminal->slot == SAN_STAGE_LIST) {
+    emit0(state, SAN_BYTECODE_LIST_APPEND);
+  }
+  emit_jump(state, SAN_BYTECODE_JUMP, loop);
+
+  if (skips.size > 0) {
+    int skip = label(state);
+    emit0(state, SAN_BYTECODE_POP);
+    emit_jump(state, SAN_BYTECODE_JUMP, loop);
+    SAN_VECTOR_FOR_EACH(skips, i, int, at)
+      patch_jump(state, *at, skip);
+    SAN_VECTOR_END_FOR_EACH
+  }
+  patch_jump(state, next, label(state));
+
+  sanv_destroy(&terms, sanv_nodestructor);
+  sanv_destroy(&skips, sanv_nodestructor);
+  return result;
+}
+
+/*
+ * source | stage | stage ...
+ *
+ * Runs of map and filter stages, up to and including a fold or list stage,
+ * are fused into a single loop. Any other stage gets the whole value.
+ */
+/* Runs the value on top of the stack through the stages of the pipe from the second on */
+static int gen_stages(bcgen_state_t *state, int isTail) {
+  const san_vector_t *stages = &state->node->children;
+  int result = SAN_OK;
+  int i = 1;
+
+  while (i < stages->size) {
+    const san_node_t *stage = sanv_nth(stages, i);
+
+    if (stage->binding == SAN_BINDING_STAGE) {
+      int last = i + 1;
+      while (last < stages->size && !is_terminal_stage(((san_node_t*)sanv_nth(stages, last - 1))->slot) &&
+             ((san_node_t*)sanv_nth(stages, last))->binding == SAN_BINDING_STAGE) {
+        last++;
+      }
+      if (gen_fused(state, i, last) != SAN_OK) result = SAN_FAIL;
+      i = last;
+    } else {
+      bcgen_state_t stageState = child_state(state, stage, isTail && i == stages->size - 1);
+      if (gen_stage_call(&stageState, stage) != SAN_OK) result = SAN_FAIL;
+      i++;
+    }
+  }
+
+  return result;
+}
+
+/*
+ * A variadic call takes every term up to the pipe, so "print l | map f" is
+ * print (l | map f). The terms after the callee are the pipe's source, a
+ * list if they make several values, and the call takes what comes out.
+ */
+static int gen_variadic_pipe(bcgen_state_t *state, const san_vector_t *terms) {
+  const san_node_t *callee = nth_term(terms, 0);
+  bcgen_state_t sourceState = child_state(state, sanv_nth(&state->node->children, 0), 0);
+  int pos = 1, count = 0, result = SAN_OK, arity, opcode;
+  san_arg_t target, argc = { SAN_BYTECODE_TYPE_COUNT, 1 };
+
+  while (pos < terms->size) {
+    if (gen_term(&sourceState, terms, &pos) != SAN_OK) result = SAN_FAIL;
+    count++;
+  }
+  if (count > 1) emit_count(state, SAN_BYTECODE_MAKE_LIST, count);
+
+  if (gen_stages(state, 0) != SAN_OK) result = SAN_FAIL;
+  if (call_target(state, callee, &arity, &opcode, &target) != SAN_OK) return SAN_FAIL;
+  emit_call(state, callee, opcode, &target, &argc);
+  return result;
+}
+
+static int gen_pipe(bcgen_state_t *state) {
+  const san_node_t *source = sanv_nth(&state->node->children, 0);
+  bcgen_state_t sourceState = child_state(state, source, 0);
+  int result;
+
+  if (source->type == SAN_PARSER_FN_EXPRESSION) {
+    san_vector_t terms;
+    const san_node_t *callee;
+
+    sanv_create(&terms, sizeof(san_node_t*));
+    flatten_call(source, &terms);
+    callee = nth_term(&terms, 0);
+    if (terms.size > 1 && callee->binding == SAN_BINDING_NATIVE &&
+        sann_nth(callee->slot)->arity == SAN_NATIVE_VARIADIC) {
+      result = gen_variadic_pipe(state, &terms);
+      sanv_destroy(&terms, sanv_nodestructor);
+      return result;
+    }
+    sanv_destroy(&terms, sanv_nodestructor);
+  }
+
+  result = generate(&sourceState);
+  if (gen_stages(state, state->isTail) != SAN_OK) result = SAN_FAIL;
+  return result;
+}
+
+/*
+ * if cond then a else b
+ *
+ * Both branches are in tail position if the if is. A missing else branch
+ * evaluates to nil.
+ */
+static int gen_if(bcgen_state_t *state) {
   const san_vector_t *children = &state->node->children;
+  bcgen_state_t condState = child_state(state, sanv_nth(children, 0), 0);
+  bcgen_state_t thenState = child_state(state, sanv_nth(children, 1), state->isTail);
+  int result = generate(&condState);
+  int toElse, toEnd;
+
+  toElse = emit_jump(state, SAN_BYTECODE_JUMP_IF_FALSE, 0);
+  if (generate(&thenState) != SAN_OK) result = SAN_FAIL;
+  toEnd = emit_jump(state, SAN_BYTECODE_JUMP, 0);
 
+  patch_jump(state, toElse, label(state));
+  if (children->size > 2) {
+    bcgen_state_t elseState = child_state(state, sanv_nth(children, 2), state->isTail);
+    if (generate(&elseState) != SAN_OK) result = SAN_FAIL;
+  } else {
+    emit_nil(state);
+  }
+  patch_jump(state, toEnd, label(state));
+
+  return result;
+}
+
+/*
+ * Bare lists build a list; a parenthesised expression only groups.
+ */
+static int gen_list(bcgen_state_t *state) {
+  const san_vector_t *children = &state->node->children;
+  const san_node_t *first = sanv_nth(children, 0);
+
+  if (children->size == 1 && first->type == SAN_PARSER_EXPRESSION) {
+    bcgen_state_t groupState = child_state(state, first, state->isTail);
+    return generate(&groupState);
+  }
+
+  int result = SAN_OK;
   SAN_VECTOR_FOR_EACH(*children, i, san_node_t, child)
-    bcgen_state_t childState = { child, state->program, state->errors };
-    generate(&childState);
+    bcgen_state_t childState = child_state(state, child, 0);
+    if (generate(&childState) != SAN_OK) result = SAN_FAIL;
   SAN_VECTOR_END_FOR_EACH
+
+  emit_count(state, SAN_BYTECODE_MAKE_LIST, children->size);
+  return result;
 }
 
-static int generate(bcgen_state_t *state) {
+/*
+ * let name params = body
+ *
+ * The body is compiled into its own bytecode buffer. Functions are numbered
+ * in definition order by the scope pass, which is the order they are pushed
+ * here.
+ */
+static int gen_function(bcgen_state_t *state) {
+  const san_node_t *lvalue = sanv_nth(&state->node->children, 0);
+  const san_node_t *params = sanv_nth(&lvalue->children, 0);
+  const san_node_t *body = sanv_nth(&state->node->children, 1);
+  san_function_t fn = { lvalue->token->raw, params->children.size, state->node->nslots, 0, 0 };
+  bc_body_t code;
+  bc_cse_t cse;
+  int result;
+
+  create_body(&code);
+  sanv_push(&state->program->functions, &fn);
+  sanv_push(state->bodies, &code);
+  cse_create(&cse);
+
+  bcgen_state_t bodyState = child_state(state, body, 1);
+  bodyState.function = state->program->functions.size - 1;
+  bodyState.cse = &cse;
+  result = generate(&bodyState);
+  emit0(&bodyState, SAN_BYTECODE_RET);
+  nth_body(state, bodyState.function)->complete = 1;
+  cse_destroy(&cse);
+
+  /* The definition itself evaluates to nil */
+  if (!state->isDropped) emit_nil(state);
+  return result;
+}
+
+/*
+ * let name = value
+ */
+static int gen_variable(bcgen_state_t *state) {
+  const san_node_t *node = state->node;
+  bcgen_state_t valueState = child_state(state, sanv_nth(&node->children, 1), 0);
+  san_arg_t slot = { SAN_BYTECODE_TYPE_LOCAL, node->slot };
+  int result = generate(&valueState);
+
+  if (node->binding == SAN_BINDING_GLOBAL) slot.type = SAN_BYTECODE_TYPE_GLOBAL;
+  emit1(state, SAN_BYTECODE_STORE_SLOT, &slot);
+  if (!state->isDropped) emit_nil(state);
+  return result;
+}
+
+static int gen_node(bcgen_state_t *state) {
   switch (state->node->type) {
-    case SAN_PARSER_ROOT: gen_children(state); break;
+    case SAN_PARSER_ROOT:
+    case SAN_PARSER_BLOCK:
+      return gen_sequence(state);
     case SAN_PARSER_EXPRESSION:
-      gen_children(state);
-      break;
-    case SAN_PARSER_ADDITIVE_EXPRESSION:
-      gen_children(state);
-      if (state->node->children.size == 1) {
-        /* Pass through */
-      } else if (state->node->children.size == 2) {
+      return gen_children(state);
+    case SAN_PARSER_ADDITIVE_EXPRESSION: {
+      int result = gen_children(state);
+      /* a + b + c has three operands and needs two adds */
+      for (int i = 1; i < state->node->children.size; ++i) {
         emit0(state, SAN_BYTECODE_ADD);
       }
-      break;
-    case SAN_PARSER_MULTIPLICATIVE_EXPRESSION:
-      gen_children(state);
-      if (state->node->children.size == 1) {
-        /* Pass through */
-      } else if (state->node->children.size == 2) {
+      return result;
+    }
+    case SAN_PARSER_MULTIPLICATIVE_EXPRESSION: {
+      int result = gen_children(state);
+      for (int i = 1; i < state->node->children.size; ++i) {
         emit0(state, SAN_BYTECODE_MUL);
       }
-      break;
+      return result;
+    }
     case SAN_PARSER_PRIMARY_EXPRESSION:
-      gen_children(state);
-      break;
+      if (state->node->children.size == 0) {
+        return gen_identifier(state);
+      }
+      return gen_children(state);
     case SAN_PARSER_NUMBER_LITERAL: {
-      int number = strtol(state->node->token->raw, NULL, 10);
       san_arg_t arg = { SAN_BYTECODE_TYPE_NUMBER_LITERAL, 0 };
-      store_number_literal(state, number, &arg.ref);
+      int64_t number;
+      if (parse_number_literal(state->node->token->raw, &number) == SAN_OK) {
+        store_number_literal(state, number, &arg.ref);
+      } else {
+        arg.type = SAN_BYTECODE_TYPE_BIGNUM_LITERAL;
+        store_bignum_literal(state, state->node->token->raw, &arg.ref);
+      }
       emit1(state, SAN_BYTECODE_PUSH, &arg);
       break;
     }
@@ -106,40 +1254,113 @@ static int generate(bcgen_state_t *state) {
       emit1(state, SAN_BYTECODE_PUSH, &arg);
       break;
     }
-    case SAN_PARSER_FN_EXPRESSION: {
-      gen_children(state);
-      emit0(state, SAN_BYTECODE_CALL);
-      break;
-    }
-    case SAN_PARSER_VARIABLE_LVALUE: {
-      const char *fname = state->node->token->raw;
-      san_arg_t arg = { SAN_BYTECODE_TYPE_IDENTIFIER, 0 };
-      store_symbol(state, fname, &arg.ref);
-      emit1(state, SAN_BYTECODE_PUSH, &arg);
-      break;
+    case SAN_PARSER_FN_EXPRESSION:
+      return gen_application(state);
+    case SAN_PARSER_PIPE_EXPRESSION:
+      return gen_pipe(state);
+    case SAN_PARSER_LIST:
+      return gen_list(state);
+    case SAN_PARSER_IF_EXPRESSION:
+      return gen_if(state);
+    case SAN_PARSER_VARIABLE_EXPRESSION: {
+      const san_node_t *lvalue = sanv_nth(&state->node->children, 0);
+      if (lvalue->type == SAN_PARSER_FUNCTION_LVALUE) {
+        return gen_function(state);
+      }
+      return gen_variable(state);
     }
     default:
+      compileError(state, state->node, SAN_ERROR_UNSUPPORTED_EXPRESSION,
+        state->node->token != NULL ? state->node->token->raw : "");
       return SAN_FAIL;
   }
 
   return SAN_OK;
 }
 
-const char *fmt_opcode(int opcode) {
+/*
+ * A pure value already computed in the current block is reused rather than
+ * generated again.
+ */
+static int generate(bcgen_state_t *state) {
+  int id = node_value(state, state->node);
+  int start = here(state), result;
+
+  if (cse_reuse(state, id)) return SAN_OK;
+  result = gen_node(state);
+  cse_record(state, id, start);
+  return result;
+}
+
+const char *sanb_opcode_name(int opcode) {
   switch (opcode) {
   case SAN_BYTECODE_PUSH: return "push";
   case SAN_BYTECODE_POP: return "pop";
   case SAN_BYTECODE_MUL: return "mul";
   case SAN_BYTECODE_ADD: return "add";
+  case SAN_BYTECODE_CALL_NATIVE: return "call_native";
   case SAN_BYTECODE_CALL: return "call";
+  case SAN_BYTECODE_TAILCALL: return "tailcall";
+  case SAN_BYTECODE_RET: return "ret";
+  case SAN_BYTECODE_LOAD_SLOT: return "load_slot";
+  case SAN_BYTECODE_STORE_SLOT: return "store_slot";
+  case SAN_BYTECODE_JUMP: return "jump";
+  case SAN_BYTECODE_JUMP_IF_FALSE: return "jump_if_false";
+  case SAN_BYTECODE_PICK: return "pick";
+  case SAN_BYTECODE_ROLL: return "roll";
+  case SAN_BYTECODE_MAKE_LIST: return "make_list";
+  case SAN_BYTECODE_MAKE_LOCAL_LIST: return "make_local_list";
+  case SAN_BYTECODE_LIST_APPEND: return "list_append";
+  case SAN_BYTECODE_ITER: return "iter";
+  case SAN_BYTECODE_ITER_NEXT: return "iter_next";
+  case SAN_BYTECODE_JUMP_IF_TRUE: return "jump_if_true";
+  case SAN_BYTECODE_DUP: return "dup";
+  case SAN_BYTECODE_ADD_II: return "add_ii";
+  case SAN_BYTECODE_MUL_II: return "mul_ii";
+  case SAN_BYTECODE_CALL_NATIVE_I: return "call_native_i";
   }
   return "ERROR";
 }
 
+#define BC_SUPER2(a, b) { 2, { SAN_BYTECODE_##a, SAN_BYTECODE_##b } },
+#define BC_SUPER3(a, b, c) { 3, { SAN_BYTECODE_##a, SAN_BYTECODE_##b, SAN_BYTECODE_##c } },
+
+static const san_super_t supers[] = {
+  { 0, { 0 } },
+  SAN_SUPERINSTRUCTIONS(BC_SUPER2, BC_SUPER3)
+};
+
+const san_super_t *sanb_super(int id) {
+  return id > 0 && id < (int)(sizeof supers / sizeof supers[0]) ? &supers[id] : NULL;
+}
+
+static void mark_supers(san_program_t *program) {
+  int nsupers = sizeof supers / sizeof supers[0];
+
+  SAN_VECTOR_FOR_EACH(program->functions, i, san_function_t, fn)
+    for (int pc = fn->entry; pc < fn->entry + fn->length; ++pc) {
+      const san_bytecode_t *code = sanv_nth(&program->bytecode, pc);
+      int best = 0;
+      for (int id = 1; id < nsupers; ++id) {
+        int n = 0;
+        if (supers[id].length <= supers[best].length || pc + supers[id].length > fn->entry + fn->length) continue;
+        while (n < supers[id].length && code[n].opcode == supers[id].opcodes[n]) n++;
+        if (n == supers[id].length) best = id;
+      }
+      sanv_push_int(&program->supers, best);
+    }
+  SAN_VECTOR_END_FOR_EACH
+}
+
 void dump_program(san_program_t *program) {
   san_dbg("Number literals:\n");
-  SAN_VECTOR_FOR_EACH(program->numbers, i, int, number)
-    san_dbg("%d:%d\n", i, *number);
+  SAN_VECTOR_FOR_EACH(program->numbers, i, int64_t, number)
+    san_dbg("%d:%lld\n", i, (long long)*number);
+  SAN_VECTOR_END_FOR_EACH
+
+  san_dbg("\nBignum literals:\n");
+  SAN_VECTOR_FOR_EACH(program->bignums, i, const char*, digits)
+    san_dbg("%d:%s\n", i, *digits);
   SAN_VECTOR_END_FOR_EACH
 
   san_dbg("\nString literals:\n");
@@ -147,33 +1368,387 @@ void dump_program(san_program_t *program) {
     san_dbg("%d:%s\n", i, *string);
   SAN_VECTOR_END_FOR_EACH
 
-  san_dbg("\nSymbols:\n");
-  SAN_VECTOR_FOR_EACH(program->symbols, i, const char*, symbol)
-    san_dbg("%d:%s\n", i, *symbol);
+  san_dbg("\nGlobals: %d\n", program->nglobals);
+
+  san_dbg("\nFunctions:\n");
+  SAN_VECTOR_FOR_EACH(program->functions, i, san_function_t, fn)
+    san_dbg("%d:%s/%d (entry %d, length %d, slots %d)\n",
+      i, fn->name, fn->arity, fn->entry, fn->length, fn->nslots);
+  SAN_VECTOR_END_FOR_EACH
+
+  san_dbg("\nCalls:\n");
+  SAN_VECTOR_FOR_EACH(program->calls, i, san_call_site_t, call)
+    if (call->reason == NULL) {
+      san_dbg("%d:%d: %s -> %s inlined\n", call->line, call->column, call->caller, call->callee);
+    } else {
+      san_dbg("%d:%d: %s -> %s not inlined (%s)\n",
+        call->line, call->column, call->caller, call->callee, call->reason);
+    }
   SAN_VECTOR_END_FOR_EACH
 
   san_dbg("\nOpcodes:\n");
   SAN_VECTOR_FOR_EACH(program->bytecode, i, san_bytecode_t, code)
-    san_dbg("%s (%d, %d)\n", fmt_opcode(code->opcode), code->arg1.ref, code->arg2.ref);
+    san_dbg("%d: %s (%d, %d)\n", i, sanb_opcode_name(code->opcode), code->arg1.ref, code->arg2.ref);
+  SAN_VECTOR_END_FOR_EACH
+
+  san_dbg("\nLine table: %d bytes\n", program->lines.size);
+}
+
+/*
+ * Code layout
+ *
+ * Each function body is split into basic blocks and laid out again before
+ * linking. Jumps to unconditional jumps are threaded to their final target,
+ * blocks that cannot be reached are dropped, and blocks are chained so the
+ * likely successor of each block falls through. Conditional jumps are
+ * inverted where that saves a jump.
+ */
+typedef struct {
+  int start, end;
+
+  /* Successor blocks, or -1 */
+  int target, next, likely;
+  int reachable, placed, address;
+} bc_block_t;
+
+static inline int is_jump(int opcode) {
+  return opcode == SAN_BYTECODE_JUMP || opcode == SAN_BYTECODE_JUMP_IF_FALSE ||
+    opcode == SAN_BYTECODE_JUMP_IF_TRUE || opcode == SAN_BYTECODE_ITER_NEXT;
+}
+
+static inline int is_conditional(int opcode) {
+  return is_jump(opcode) && opcode != SAN_BYTECODE_JUMP;
+}
+
+static inline int ends_flow(int opcode) {
+  return opcode == SAN_BYTECODE_JUMP || opcode == SAN_BYTECODE_RET ||
+    opcode == SAN_BYTECODE_TAILCALL;
+}
+
+static inline san_bytecode_t *block_end(const san_vector_t *code, const bc_block_t *block) {
+  return (san_bytecode_t*)sanv_nth(code, block->end - 1);
+}
+
+static inline bc_block_t *nth_block(const san_vector_t *blocks, int n) {
+  return (bc_block_t*)sanv_nth(blocks, n);
+}
+
+/*
+ * Follows blocks that are nothing but an unconditional jump.
+ */
+static int thread_jump(const san_vector_t *code, const san_vector_t *blocks, int block) {
+  for (int hops = 0; block >= 0 && hops < blocks->size; ++hops) {
+    const bc_block_t *b = nth_block(blocks, block);
+    const san_bytecode_t *last = block_end(code, b);
+    if (b->end - b->start != 1 || last->opcode != SAN_BYTECODE_JUMP) break;
+    block = b->target;
+  }
+  return block;
+}
+
+/*
+ * A path that returns without calling a function is taken to be the rarer
+ * side of a branch, like the base case of a recursion.
+ */
+static int is_exit_path(const san_vector_t *code, const san_vector_t *blocks, int block) {
+  for (int hops = 0; block >= 0 && hops < blocks->size; ++hops) {
+    const bc_block_t *b = nth_block(blocks, block);
+    for (int pc = b->start; pc < b->end; ++pc) {
+      int opcode = ((san_bytecode_t*)sanv_nth(code, pc))->opcode;
+      if (opcode == SAN_BYTECODE_CALL || opcode == SAN_BYTECODE_TAILCALL) return 0;
+      if (opcode == SAN_BYTECODE_RET) return 1;
+    }
+    if (is_conditional(block_end(code, b)->opcode)) return 0;
+    if (b->target >= 0 && b->target <= block) return 0;
+    block = b->target >= 0 ? b->target : b->next;
+  }
+  return 0;
+}
+
+static void build_blocks(const san_vector_t *code, san_vector_t *blocks, int *blockOf) {
+  int *isLeader = SAN_CALLOC(code->size + 1, sizeof(int));
+
+  isLeader[0] = 1;
+  SAN_VECTOR_FOR_EACH(*code, pc, san_bytecode_t, instr)
+    if (is_jump(instr->opcode)) isLeader[instr->arg1.ref] = 1;
+    if (is_jump(instr->opcode) || ends_flow(instr->opcode)) isLeader[pc + 1] = 1;
+  SAN_VECTOR_END_FOR_EACH
+
+  for (int pc = 0; pc < code->size; ++pc) {
+    if (isLeader[pc]) {
+      bc_block_t block = { pc, pc, -1, -1, -1, 0, 0, 0 };
+      sanv_push(blocks, &block);
+    }
+    nth_block(blocks, blocks->size - 1)->end = pc + 1;
+    blockOf[pc] = blocks->size - 1;
+  }
+  SAN_FREE(isLeader);
+
+  SAN_VECTOR_FOR_EACH(*blocks, i, bc_block_t, block)
+    const san_bytecode_t *last = block_end(code, block);
+    if (is_jump(last->opcode)) block->target = blockOf[last->arg1.ref];
+    if (!ends_flow(last->opcode) && block->end < code->size) block->next = i + 1;
+  SAN_VECTOR_END_FOR_EACH
+}
+
+static void mark_reachable(san_vector_t *blocks, int block) {
+  bc_block_t *b;
+  while (block >= 0 && !(b = nth_block(blocks, block))->reachable) {
+    b->reachable = 1;
+    mark_reachable(blocks, b->target);
+    block = b->next;
+  }
+}
+
+static void emit_layout(bc_body_t *out, const san_bytecode_t *code, const void *position) {
+  sanv_push(&out->code, code);
+  sanv_push(&out->positions, position);
+}
+
+static void emit_layout_jump(bc_body_t *out, int opcode, int block, const void *position) {
+  san_bytecode_t jump = { opcode, { SAN_BYTECODE_TYPE_TARGET, block }, NO_ARG };
+  emit_layout(out, &jump, position);
+}
+
+/*
+ * A jump to a lone return is replaced by the return itself.
+ */
+static void emit_layout_goto(bc_body_t *out, const bc_body_t *body,
+  const san_vector_t *blocks, int block, const void *position) {
+  const bc_block_t *b = nth_block(blocks, block);
+  if (b->end - b->start == 1 && block_end(&body->code, b)->opcode == SAN_BYTECODE_RET) {
+    emit_layout(out, block_end(&body->code, b), sanv_nth(&body->positions, b->start));
+  } else {
+    emit_layout_jump(out, SAN_BYTECODE_JUMP, block, position);
+  }
+}
+
+static void layout_code(bc_body_t *body) {
+  const san_vector_t *code = &body->code;
+  san_vector_t blocks, order;
+  bc_body_t out;
+  int *blockOf;
+
+  if (code->size == 0) return;
+
+  blockOf = SAN_CALLOC(code->size, sizeof(int));
+  sanv_create(&blocks, sizeof(bc_block_t));
+  sanv_create(&order, sizeof(int));
+  create_body(&out);
+  build_blocks(code, &blocks, blockOf);
+
+  SAN_VECTOR_FOR_EACH(blocks, i, bc_block_t, block)
+    block->target = thread_jump(code, &blocks, block->target);
+    block->next = thread_jump(code, &blocks, block->next);
+  SAN_VECTOR_END_FOR_EACH
+  mark_reachable(&blocks, 0);
+
+  SAN_VECTOR_FOR_EACH(blocks, i, bc_block_t, block)
+    int opcode = block_end(code, block)->opcode;
+    block->likely = block->target >= 0 && block->next < 0 ? block->target : block->next;
+    if ((opcode == SAN_BYTECODE_JUMP_IF_FALSE || opcode == SAN_BYTECODE_JUMP_IF_TRUE) &&
+        is_exit_path(code, &blocks, block->next) && !is_exit_path(code, &blocks, block->target)) {
+      block->likely = block->target;
+    }
+  SAN_VECTOR_END_FOR_EACH
+
+  /* Chain blocks along their likely successors, otherwise in source order */
+  for (int first = 0; first < blocks.size; ++first) {
+    int block = first;
+    while (block >= 0) {
+      bc_block_t *b = nth_block(&blocks, block);
+      if (!b->reachable || b->placed) break;
+      b->placed = 1;
+      sanv_push(&order, &block);
+      block = b->likely;
+    }
+  }
+
+  SAN_VECTOR_FOR_EACH(order, i, int, index)
+    bc_block_t *b = nth_block(&blocks, *index);
+    const san_bytecode_t *last = block_end(code, b);
+    int following = i + 1 < order.size ? *(int*)sanv_nth(&order, i + 1) : -1;
+    const void *position = sanv_nth(&body->positions, b->end - 1);
+    int end = is_jump(last->opcode) ? b->end - 1 : b->end;
+
+    b->address = out.code.size;
+    for (int pc = b->start; pc < end; ++pc) {
+      emit_layout(&out, sanv_nth(code, pc), sanv_nth(&body->positions, pc));
+    }
+
+    if (is_conditional(last->opcode)) {
+      if (following == b->target && last->opcode != SAN_BYTECODE_ITER_NEXT) {
+        int inverted = last->opcode == SAN_BYTECODE_JUMP_IF_FALSE
+          ? SAN_BYTECODE_JUMP_IF_TRUE : SAN_BYTECODE_JUMP_IF_FALSE;
+        emit_layout_jump(&out, inverted, b->next, position);
+      } else {
+        emit_layout_jump(&out, last->opcode, b->target, position);
+        if (following != b->next) emit_layout_goto(&out, body, &blocks, b->next, position);
+      }
+    } else if (last->opcode == SAN_BYTECODE_JUMP) {
+      if (following != b->target) emit_layout_goto(&out, body, &blocks, b->target, position);
+    } else if (b->next >= 0 && following != b->next) {
+      emit_layout_goto(&out, body, &blocks, b->next, position);
+    }
+  SAN_VECTOR_END_FOR_EACH
+
+  SAN_VECTOR_FOR_EACH(out.code, pc, san_bytecode_t, instr)
+    if (is_jump(instr->opcode)) instr->arg1.ref = nth_block(&blocks, instr->arg1.ref)->address;
+  SAN_VECTOR_END_FOR_EACH
+
+  destroy_body(body);
+  body->code = out.code;
+  body->positions = out.positions;
+  sanv_destroy(&blocks, sanv_nodestructor);
+  sanv_destroy(&order, sanv_nodestructor);
+  SAN_FREE(blockOf);
+}
+
+/*
+ * Line table
+ *
+ * Source positions live beside the bytecode as a line program, like DWARF's:
+ * a row is only written where the position changes, as the deltas of the
+ * pc, line and column from the previous row in LEB128.
+ */
+typedef struct {
+  int pc, line, column;
+} bc_row_t;
+
+static void encode_uleb(san_vector_t *out, unsigned int value) {
+  do {
+    unsigned char byte = value & 0x7f;
+    value >>= 7;
+    if (value != 0) byte |= 0x80;
+    sanv_push(out, &byte);
+  } while (value != 0);
+}
+
+static void encode_sleb(san_vector_t *out, int value) {
+  /* Zigzag, so that small negative deltas stay small */
+  encode_uleb(out, ((unsigned int)value << 1) ^ (unsigned int)(value >> 31));
+}
+
+static unsigned int decode_uleb(const san_vector_t *in, int *at) {
+  unsigned int value = 0;
+  int shift = 0;
+  unsigned char byte;
+  do {
+    byte = *(unsigned char*)sanv_nth(in, (*at)++);
+    value |= (unsigned int)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return value;
+}
+
+static int decode_sleb(const san_vector_t *in, int *at) {
+  unsigned int value = decode_uleb(in, at);
+  return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+static void encode_positions(san_program_t *program, const bc_body_t *body, int entry, bc_row_t *last) {
+  SAN_VECTOR_FOR_EACH(body->positions, pc, bc_position_t, position)
+    if (position->line == last->line && position->column == last->column) continue;
+    encode_uleb(&program->lines, entry + pc - last->pc);
+    encode_sleb(&program->lines, position->line - last->line);
+    encode_sleb(&program->lines, position->column - last->column);
+    last->pc = entry + pc;
+    last->line = position->line;
+    last->column = position->column;
+  SAN_VECTOR_END_FOR_EACH
+}
+
+int sanb_position(const san_program_t *program, int pc, int *line, int *column) {
+  bc_row_t row = { 0, 0, 0 };
+  int at = 0;
+
+  while (at < program->lines.size) {
+    int next = at;
+    int rowPc = row.pc + decode_uleb(&program->lines, &next);
+    if (rowPc > pc) break;
+    row.pc = rowPc;
+    row.line += decode_sleb(&program->lines, &next);
+    row.column += decode_sleb(&program->lines, &next);
+    at = next;
+  }
+
+  *line = row.line;
+  *column = row.column;
+  return row.line > 0 ? SAN_OK : SAN_FAIL;
+}
+
+/*
+ * Lays the function bodies out one after the other in program->bytecode,
+ * relocates jump targets and records where each instruction came from.
+ */
+static void link_program(san_program_t *program, san_vector_t *bodies) {
+  bc_row_t last = { 0, 0, 0 };
+
+  SAN_VECTOR_FOR_EACH(*bodies, i, bc_body_t, body)
+    san_function_t *fn = sanv_nth(&program->functions, i);
+    san_vector_t *code = &body->code;
+    layout_code(body);
+    fn->entry = program->bytecode.size;
+    fn->length = code->size;
+    SAN_VECTOR_FOR_EACH2((*code), j, san_bytecode_t, instr)
+      if (instr->arg1.type == SAN_BYTECODE_TYPE_TARGET) instr->arg1.ref += fn->entry;
+      sanv_push(&program->bytecode, instr);
+    SAN_VECTOR_END_FOR_EACH
+    encode_positions(program, body, fn->entry, &last);
   SAN_VECTOR_END_FOR_EACH
 }
 
 int sanb_generate(const san_node_t *ast, san_program_t *program, san_vector_t *errors) {
-  bcgen_state_t state = { ast, program, errors };
+  san_function_t main = { "<main>", 0, 0, 0, 0 };
+  san_vector_t bodies;
+  bc_body_t mainCode;
+  bc_cse_t cse;
+  bcgen_state_t state = { ast, program, errors, &bodies, 0, 0, 0, &cse };
+  int numErrors = errors->size;
+  int result;
 
   sanv_create(&program->bytecode, sizeof(san_bytecode_t));
-  sanv_create(&program->numbers, sizeof(int));
+  sanv_create(&program->numbers, sizeof(int64_t));
+  sanv_create(&program->bignums, sizeof(char*));
   sanv_create(&program->strings, sizeof(char*));
-  sanv_create(&program->symbols, sizeof(char*));
-  generate(&state);
-  //sanv_destroy(program->bytecode);
+  sanv_create(&program->functions, sizeof(san_function_t));
+  sanv_create(&program->calls, sizeof(san_call_site_t));
+  sanv_create(&program->lines, sizeof(unsigned char));
+  sanv_create(&program->supers, sizeof(int));
+  sanv_create(&bodies, sizeof(bc_body_t));
+  create_body(&mainCode);
+  sanv_push(&program->functions, &main);
+  sanv_push(&bodies, &mainCode);
+  program->nglobals = ast->nslots;
+  program->verified = 0;
+  cse_create(&cse);
+
+  result = generate(&state);
+  emit0(&state, SAN_BYTECODE_RET);
+  cse_destroy(&cse);
+  link_program(program, &bodies);
+  sanv_destroy(&bodies, destroy_body);
+  if (result == SAN_OK && errors->size == numErrors) {
+    sany_infer(program);
+    sanx_analyse(program);
+    mark_supers(program);
+  } else {
+    result = SAN_FAIL;
+  }
 
   dump_program(program);
 
-  return SAN_OK;
+  return result;
 }
 
 int sanb_destroy(san_program_t *program) {
   sanv_destroy(&program->bytecode, sanv_nodestructor);
+  sanv_destroy(&program->numbers, sanv_nodestructor);
+  sanv_destroy(&program->bignums, sanv_nodestructor);
+  sanv_destroy(&program->strings, sanv_nodestructor);
+  sanv_destroy(&program->functions, sanv_nodestructor);
+  sanv_destroy(&program->calls, sanv_nodestructor);
+  sanv_destroy(&program->lines, sanv_nodestructor);
+  sanv_destroy(&program->supers, sanv_nodestructor);
   return SAN_OK;
 }
@@ -7,11 +7,49 @@
 #define SAN_BYTECODE_POP  2
 #define SAN_BYTECODE_MUL  3
 #define SAN_BYTECODE_ADD  4
-#define SAN_BYTECODE_CALL 5
+#define SAN_BYTECODE_CALL_NATIVE 5
+#define SAN_BYTECODE_CALL 6
+#define SAN_BYTECODE_TAILCALL 7
+#define SAN_BYTECODE_RET 8
+#define SAN_BYTECODE_LOAD_SLOT 9
+#define SAN_BYTECODE_STORE_SLOT 10
+#define SAN_BYTECODE_JUMP 11
+#define SAN_BYTECODE_JUMP_IF_FALSE 12
+#define SAN_BYTECODE_PICK 13
+#define SAN_BYTECODE_ROLL 14
+#define SAN_BYTECODE_MAKE_LIST 15
+#define SAN_BYTECODE_LIST_APPEND 16
+#define SAN_BYTECODE_ITER 17
+#define SAN_BYTECODE_ITER_NEXT 18
+#define SAN_BYTECODE_JUMP_IF_TRUE 19
+#define SAN_BYTECODE_DUP 20
+
+/* Specialised by type inference: the operands are known to be integers */
+#define SAN_BYTECODE_ADD_II 21
+#define SAN_BYTECODE_MUL_II 22
+#define SAN_BYTECODE_CALL_NATIVE_I 23
+
+/* Made by escape analysis: the list never outlives the frame that made it */
+#define SAN_BYTECODE_MAKE_LOCAL_LIST 24
+
+/*
+ * The count ITER may carry says the loop it starts folds elements into its
+ * accumulator in a way that could as well be done in chunks and combined:
+ * appending to a list, or adding up.
+ */
+#define SAN_BYTECODE_ITER_LIST 1
+#define SAN_BYTECODE_ITER_SUM 2
 
 #define SAN_BYTECODE_TYPE_NUMBER_LITERAL                      1
-#define SAN_BYTECODE_TYPE_IDENTIFIER                          2
+#define SAN_BYTECODE_TYPE_BIGNUM_LITERAL                      2
 #define SAN_BYTECODE_TYPE_STRING_LITERAL                      3
+#define SAN_BYTECODE_TYPE_NATIVE                              4
+#define SAN_BYTECODE_TYPE_COUNT                               5
+#define SAN_BYTECODE_TYPE_FUNCTION                            6
+#define SAN_BYTECODE_TYPE_LOCAL                               7
+#define SAN_BYTECODE_TYPE_NIL                                 8
+#define SAN_BYTECODE_TYPE_GLOBAL                              9
+#define SAN_BYTECODE_TYPE_TARGET                              10
 
 typedef struct {
   int type;
@@ -23,14 +61,71 @@ typedef struct {
   san_arg_t arg1, arg2;
 } san_bytecode_t;
 
+/*
+ * A compiled function owns the bytecode range [entry, entry + length). Its
+ * frame has nslots fixed slots, the first arity of which hold the arguments.
+ * Function 0 is the top-level program.
+ */
+typedef struct {
+  const char *name;
+  int arity, nslots;
+  int entry, length;
+  int maxStack;
+} san_function_t;
+
+/*
+ * A call to a user function and whether it was inlined. reason is NULL if it
+ * was, and says why not otherwise.
+ */
+typedef struct {
+  const char *caller, *callee;
+  int line, column;
+  const char *reason;
+} san_call_site_t;
+
 typedef struct {
-  san_vector_t numbers;
+  san_vector_t numbers;   /* int64_t */
+  san_vector_t bignums;   /* const char*: the digits of literals too large for an integer */
   san_vector_t strings;
-  san_vector_t symbols;
+  san_vector_t functions;
   san_vector_t bytecode;
+  san_vector_t calls;
+
+  /* Source positions of the bytecode, looked up with sanb_position */
+  san_vector_t lines;
+
+  /* int: the superinstruction starting at each pc, or 0 if none does */
+  san_vector_t supers;
+  int nglobals;
+  int verified;
 } san_program_t;
 
 int sanb_generate(const san_node_t *ast, san_program_t *program, san_vector_t *errors);
 int sanb_destroy(san_program_t *program);
 
+/*
+ * Finds the source position the instruction at pc was compiled from. This
+ * decodes the line table from the start, so it is meant for errors and
+ * profiling rather than for every instruction.
+ */
+int sanb_position(const san_program_t *program, int pc, int *line, int *column);
+
+/* The opcode's name as listings and profiles show it */
+const char *sanb_opcode_name(int opcode);
+
+/*
+ * Superinstructions are the runs of instructions listed in super.h, which
+ * the VM dispatches once. Every pc the generator finds one starting at
+ * within a function is marked with its id, from 1, to the longest there.
+ */
+#define SAN_BYTECODE_SUPER_LENGTH 3
+
+typedef struct {
+  int length;
+  int opcodes[SAN_BYTECODE_SUPER_LENGTH];
+} san_super_t;
+
+/* The superinstruction with id, or NULL if there is none */
+const san_super_t *sanb_super(int id);
+
 #endif
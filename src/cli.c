@@ -1,9 +1,14 @@
+#include <ctype.h>
 #include "san.h"
 #include "vector.h"
 #include "errors.h"
 #include "tokenizer.h"
 #include "parser.h"
+#include "scope.h"
+#include "liveness.h"
 #include "bytecode.h"
+#include "verify.h"
+#include "aot.h"
 #include "vm.h"
 
 void print_help() {
@@ -11,7 +16,11 @@ void print_help() {
     SAN_VERSION_MAJOR,
     SAN_VERSION_MINOR,
     SAN_VERSION_PATCH);
-  printf("Usage: san [ --repl | source.san ]\n");
+  printf("Usage: san [ --repl | source.san | --emit-c source.san output.c |\n"
+         "            --removed source.san | --time source.san |\n"
+         "            --profile source.san [ stacks.folded ] |\n"
+         "            --record ngrams.txt source.san... |\n"
+         "            --super ngrams.txt super.h ]\n");
 }
 
 void print_error(const char *file, const char *source, san_error_t const *error) {
@@ -44,7 +53,7 @@ void print_error(const char *file, const char *source, san_error_t const *error)
         SAN_FREE(sourceLine);
       }
       if (lineNo == error->line) {
-        char *caretLine = (char*)SAN_MALLOC(sizeof(char) * len*2 + 12);
+        char *caretLine = (char*)SAN_MALLOC(sizeof(char) * len*2 + 13);
         memset(caretLine, '~', len*2 + 12);
         caretLine[len*2+12] = 0;
         strncpy(&caretLine[error->column], "\x1B[1;37m^\x1B[0m", 12);
@@ -107,18 +116,24 @@ void start_repl() {
     san_error_t *last = sanv_back(&errList);
     if (errList.size == 1 && last->code == SAN_ERROR_EXPECTED_BLOCK && !isReadingMultiline) {
       isReadingMultiline = 1;
-    } else if (errList.size != 0) {
+    }
+
+    san_program_t program;
+    memset(&program, 0, sizeof program);
+    if (sans_resolve(&root, &errList) == SAN_OK &&
+        sanl_eliminate(&root, NULL) == SAN_OK &&
+        sanb_generate(&root, &program, &errList) == SAN_OK &&
+        sanc_verify(&program, &errList) == SAN_OK && errList.size == 0) {
+      sanm_run(&program, &errList);
+    }
+
+    if (!isReadingMultiline && errList.size != 0) {
       SAN_VECTOR_FOR_EACH(errList, i, san_error_t, error)
         print_error("CLI", inputString, error);
       SAN_VECTOR_END_FOR_EACH
       printf("ERRORS: %d\n", errList.size);
     }
 
-    san_program_t program;
-    sanb_generate(&root, &program, &errList);
-
-    sanm_run(&program);
-
     sanb_destroy(&program);
     sanv_destroy(&tokens, &sant_destructor);
     sanv_destroy(&errList, &sane_destructor);
@@ -129,12 +144,10 @@ void start_repl() {
   sanv_destroy(&input, sanv_nodestructor);
 }
 
-void run_file(const char *file) {
+char *read_file(const char *file) {
   FILE *fp;
   long fsize;
   char *input;
-  san_vector_t tokens, errList;
-  san_node_t root;
 
   fp = fopen(file, "r");
   if (fp == NULL) {
@@ -151,15 +164,88 @@ void run_file(const char *file) {
   fclose(fp);
 
   input[fsize] = 0;
+  return input;
+}
+
+#define CLI_RUN     0
+#define CLI_EMIT_C  1
+#define CLI_PROFILE 2
+#define CLI_RECORD  3
+#define CLI_REMOVED 4
+#define CLI_TIME    5
+
+static FILE *open_output(const char *output) {
+  FILE *out = fopen(output, "w");
+  if (out == NULL) {
+    printf("Unable to write file %s.\n", output);
+    exit(1);
+  }
+  return out;
+}
+
+/*
+ * Runs the program in file, or as mode says: compiles it to C in output,
+ * runs it profiled, reporting to stderr and writing the sampled stacks
+ * folded to output if set, runs it adding to what profile has counted, runs
+ * it reporting how long it took to stderr, or only lists the code dead
+ * binding elimination removed from it.
+ */
+void run_file(const char *file, int mode, const char *output, san_profile_t *profile) {
+  char *input = read_file(file);
+  san_vector_t tokens, errList, removed;
+  san_node_t root;
 
   sanv_create(&tokens, sizeof(san_token_t));
   sanv_create(&errList, sizeof(san_error_t));
+  sanv_create(&removed, sizeof(san_removal_t));
 
   if (sant_tokenize(input, &tokens, &errList) == SAN_OK) {
   }
 
   sanp_parse(&tokens, &root, &errList);
 
+  san_program_t program;
+  memset(&program, 0, sizeof program);
+  if (sans_resolve(&root, &errList) == SAN_OK &&
+      sanl_eliminate(&root, mode == CLI_REMOVED ? &removed : NULL) == SAN_OK &&
+      sanb_generate(&root, &program, &errList) == SAN_OK &&
+      sanc_verify(&program, &errList) == SAN_OK && errList.size == 0) {
+    FILE *out;
+    double start;
+    switch (mode) {
+      case CLI_RUN:
+        sanm_run(&program, &errList);
+        break;
+      case CLI_EMIT_C:
+        out = open_output(output);
+        sana_emit_c(&program, file, out);
+        fclose(out);
+        break;
+      case CLI_PROFILE:
+        sanm_profile(&program, profile, &errList);
+        sanr_report(profile, &program, stderr);
+        if (output != NULL) {
+          out = open_output(output);
+          sanr_fold(profile, &program, out);
+          fclose(out);
+        }
+        break;
+      case CLI_RECORD:
+        sanm_profile(&program, profile, &errList);
+        break;
+      case CLI_TIME:
+        start = sanm_time();
+        sanm_run(&program, &errList);
+        fprintf(stderr, "%-16s %14.3f s\n", "Elapsed", sanm_time() - start);
+        break;
+      case CLI_REMOVED:
+        SAN_VECTOR_FOR_EACH(removed, i, san_removal_t, removal)
+          printf("%d:%d %s %s\n", removal->line, removal->column, removal->what, removal->name);
+        SAN_VECTOR_END_FOR_EACH
+        break;
+    }
+  }
+
   if (errList.size != 0) {
     SAN_VECTOR_FOR_EACH(errList, i, san_error_t, error)
       print_error(file, input, error);
@@ -167,18 +253,77 @@ void run_file(const char *file) {
     printf("ERRORS: %d\n", errList.size);
   }
 
-  san_program_t program;
-  sanb_generate(&root, &program, &errList);
-
-  sanm_run(&program);
-
   sanb_destroy(&program);
   sanv_destroy(&tokens, sant_destructor);
   sanv_destroy(&errList, sane_destructor);
+  sanv_destroy(&removed, sanv_nodestructor);
   sanp_destroy(&root);
   SAN_FREE(input);
 }
 
+/*
+ * Runs each file, adding the opcode sequences they run to those counted in
+ * ngrams, if it exists, and writing them all there.
+ */
+void record(const char *ngrams, const char **files, int nfiles) {
+  san_profile_t profile;
+  FILE *fp;
+
+  sanr_create(&profile);
+  if ((fp = fopen(ngrams, "r")) != NULL) {
+    if (sanr_read_ngrams(&profile, fp) != SAN_OK) {
+      printf("Unable to read counts from %s.\n", ngrams);
+      exit(1);
+    }
+    fclose(fp);
+  }
+  for (int i = 0; i < nfiles; ++i) run_file(files[i], CLI_RECORD, NULL, &profile);
+
+  fp = open_output(ngrams);
+  sanr_write_ngrams(&profile, fp);
+  fclose(fp);
+  sanr_destroy(&profile);
+}
+
+/* The most superinstructions --super picks */
+#define CLI_SUPERS 16
+
+static void write_opcode(FILE *out, int opcode, const char *separator) {
+  for (const char *c = sanb_opcode_name(opcode); *c; ++c) fputc(toupper(*c), out);
+  fputs(separator, out);
+}
+
+/* Writes the superinstructions picked from the n-grams counted in ngrams to header, for the VM to be built with */
+void write_supers(const char *ngrams, const char *header) {
+  san_profile_t profile;
+  int picked[CLI_SUPERS], count;
+  FILE *fp;
+
+  sanr_create(&profile);
+  if ((fp = fopen(ngrams, "r")) == NULL || sanr_read_ngrams(&profile, fp) != SAN_OK) {
+    printf("Unable to read counts from %s.\n", ngrams);
+    exit(1);
+  }
+  fclose(fp);
+  count = sanr_pick_supers(&profile, CLI_SUPERS, picked);
+
+  fp = open_output(header);
+  fprintf(fp, "/* Generated by san --super from %s: do not edit */\n", ngrams);
+  fprintf(fp, "#ifndef __SAN_SUPER_H\n#define __SAN_SUPER_H\n\n");
+  fprintf(fp, "/* The superinstructions, as X2 of a pair of opcodes or X3 of a triple */\n");
+  fprintf(fp, "#define SAN_SUPERINSTRUCTIONS(X2, X3)");
+  for (int n = 0; n < count; ++n) {
+    int a = picked[n] / (SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES);
+    fprintf(fp, " \\\n  X%d(", a == 0 ? 2 : 3);
+    if (a != 0) write_opcode(fp, a, ", ");
+    write_opcode(fp, picked[n] / SAN_PROFILE_OPCODES % SAN_PROFILE_OPCODES, ", ");
+    write_opcode(fp, picked[n] % SAN_PROFILE_OPCODES, ")");
+  }
+  fprintf(fp, "\n\n#endif\n");
+  fclose(fp);
+  sanr_destroy(&profile);
+}
+
 int main(int argc, const char **argv) {
   if (argc == 1) {
     print_help();
@@ -186,8 +331,23 @@ int main(int argc, const char **argv) {
     if (strcmp(argv[1], "--repl") == 0) {
       start_repl();
     } else {
-      run_file(argv[1]);
+      run_file(argv[1], CLI_RUN, NULL, NULL);
     }
+  } else if (argc == 3 && strcmp(argv[1], "--removed") == 0) {
+    run_file(argv[2], CLI_REMOVED, NULL, NULL);
+  } else if (argc == 3 && strcmp(argv[1], "--time") == 0) {
+    run_file(argv[2], CLI_TIME, NULL, NULL);
+  } else if (argc == 4 && strcmp(argv[1], "--emit-c") == 0) {
+    run_file(argv[2], CLI_EMIT_C, argv[3], NULL);
+  } else if ((argc == 3 || argc == 4) && strcmp(argv[1], "--profile") == 0) {
+    san_profile_t profile;
+    sanr_create(&profile);
+    run_file(argv[2], CLI_PROFILE, argc == 4 ? argv[3] : NULL, &profile);
+    sanr_destroy(&profile);
+  } else if (argc >= 4 && strcmp(argv[1], "--record") == 0) {
+    record(argv[2], argv + 3, argc - 3);
+  } else if (argc == 4 && strcmp(argv[1], "--super") == 0) {
+    write_supers(argv[2], argv[3]);
   }
 
   return 0;
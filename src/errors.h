@@ -55,6 +55,50 @@ typedef struct {
 #define SAN_ERROR_EXPECTED_FACTOR_MSG \
   "Expected a factor in multiplicative expression after '%s'"
 
+#define SAN_ERROR_UNKNOWN_FUNCTION             1011
+#define SAN_ERROR_UNKNOWN_FUNCTION_MSG \
+  "Call to unknown function '%s'"
+
+#define SAN_ERROR_ARITY_MISMATCH               1012
+#define SAN_ERROR_ARITY_MISMATCH_MSG \
+  "Function '%s' expects %d argument(s) but was given %d"
+
+#define SAN_ERROR_UNSUPPORTED_EXPRESSION       1013
+#define SAN_ERROR_UNSUPPORTED_EXPRESSION_MSG \
+  "Expression starting at '%s' cannot be compiled yet"
+
+#define SAN_ERROR_NATIVE_FAILED                1014
+#define SAN_ERROR_NATIVE_FAILED_MSG \
+  "Call to native function '%s' failed"
+
+#define SAN_ERROR_UNBOUND_NAME                 1015
+#define SAN_ERROR_UNBOUND_NAME_MSG \
+  "Unbound name '%s'"
+
+#define SAN_ERROR_CAPTURED_LOCAL               1016
+#define SAN_ERROR_CAPTURED_LOCAL_MSG \
+  "'%s' is local to an enclosing function and cannot be captured"
+
+#define SAN_ERROR_TYPE_MISMATCH                1017
+#define SAN_ERROR_TYPE_MISMATCH_MSG \
+  "Expected %s but got %s"
+
+#define SAN_ERROR_INVALID_BYTECODE             1018
+#define SAN_ERROR_INVALID_BYTECODE_MSG \
+  "Invalid bytecode at %d in '%s': %s"
+
+#define SAN_ERROR_CALLED_FROM                  1019
+#define SAN_ERROR_CALLED_FROM_MSG \
+  "In the call to '%s' made here"
+
+#define SAN_ERROR_STACK_OVERFLOW               1020
+#define SAN_ERROR_STACK_OVERFLOW_MSG \
+  "Stack overflow in the call to '%s'"
+
+#define SAN_ERROR_OUT_OF_MEMORY                1021
+#define SAN_ERROR_OUT_OF_MEMORY_MSG \
+  "More than %d lists are still reachable"
+
 
 int sane_create(san_error_t **error);
 int sane_destructor(void *ptr);
@@ -0,0 +1,250 @@
+#include "escape.h"
+
+/*
+ * Each slot and stack entry holds either the offset of the MAKE_LIST that
+ * made its list, or one of these
+ */
+#define ES_UNSEEN   -2
+#define ES_HEAP     -1
+
+typedef struct {
+  int size;
+  int *sites;
+} es_state_t;
+
+typedef struct {
+  const san_function_t *fn;
+  san_bytecode_t *code;
+
+  /* In-states of the basic blocks, and per MAKE_LIST whether it escapes */
+  es_state_t *blocks;
+  int *isLeader, *isQueued, *worklist, *escapes;
+  int pending;
+  int consistent;
+} es_function_t;
+
+static inline int is_branch(int opcode) {
+  return opcode == SAN_BYTECODE_JUMP || opcode == SAN_BYTECODE_JUMP_IF_FALSE ||
+    opcode == SAN_BYTECODE_JUMP_IF_TRUE || opcode == SAN_BYTECODE_ITER_NEXT;
+}
+
+static inline int ends_block(int opcode) {
+  return opcode == SAN_BYTECODE_JUMP || opcode == SAN_BYTECODE_RET ||
+    opcode == SAN_BYTECODE_TAILCALL;
+}
+
+static inline void escape(es_function_t *fun, int site) {
+  if (site >= 0) fun->escapes[site] = 1;
+}
+
+/*
+ * Two different lists meeting in one place can't be told apart afterwards,
+ * so both escape.
+ */
+static int join(es_function_t *fun, int a, int b) {
+  if (a == b || b == ES_UNSEEN) return a;
+  if (a == ES_UNSEEN) return b;
+  escape(fun, a);
+  escape(fun, b);
+  return ES_HEAP;
+}
+
+static void merge(es_function_t *fun, int offset, const es_state_t *state) {
+  es_state_t *block = &fun->blocks[offset];
+  int changed = 0;
+
+  if (block->sites == NULL) {
+    block->size = state->size;
+    block->sites = SAN_MALLOC((state->size + 1) * sizeof(int));
+    memcpy(block->sites, state->sites, state->size * sizeof(int));
+    changed = 1;
+  } else if (block->size != state->size) {
+    fun->consistent = 0;
+    return;
+  } else {
+    for (int i = 0; i < state->size; ++i) {
+      int joined = join(fun, block->sites[i], state->sites[i]);
+      if (joined != block->sites[i]) {
+        block->sites[i] = joined;
+        changed = 1;
+      }
+    }
+  }
+
+  if (changed && !fun->isQueued[offset]) {
+    fun->isQueued[offset] = 1;
+    fun->worklist[fun->pending++] = offset;
+  }
+}
+
+static inline int top(const es_state_t *state, int depth) {
+  return state->sites[state->size - 1 - depth];
+}
+
+static inline void push(es_state_t *state, int site) {
+  state->sites[state->size++] = site;
+}
+
+static void escape_top(es_function_t *fun, es_state_t *state, int count) {
+  for (int i = 0; i < count; ++i) escape(fun, top(state, i));
+  state->size -= count;
+}
+
+static void transfer(es_function_t *fun, int pc, es_state_t *state) {
+  san_bytecode_t *code = &fun->code[pc];
+
+  switch (code->opcode) {
+    case SAN_BYTECODE_PUSH:
+    case SAN_BYTECODE_ITER:
+      push(state, ES_HEAP);
+      break;
+    case SAN_BYTECODE_POP:
+    case SAN_BYTECODE_JUMP_IF_FALSE:
+    case SAN_BYTECODE_JUMP_IF_TRUE:
+      state->size--;
+      break;
+    case SAN_BYTECODE_DUP:
+      push(state, top(state, 0));
+      break;
+    case SAN_BYTECODE_PICK:
+      push(state, top(state, code->arg1.ref));
+      break;
+    case SAN_BYTECODE_ROLL: {
+      int depth = code->arg1.ref, site = top(state, depth);
+      int *at = &state->sites[state->size - 1 - depth];
+      memmove(at, at + 1, depth * sizeof(int));
+      state->sites[state->size - 1] = site;
+      break;
+    }
+    case SAN_BYTECODE_ADD:
+    case SAN_BYTECODE_MUL:
+    case SAN_BYTECODE_ADD_II:
+    case SAN_BYTECODE_MUL_II:
+      state->size -= 2;
+      push(state, ES_HEAP);
+      break;
+    case SAN_BYTECODE_CALL_NATIVE:
+    case SAN_BYTECODE_CALL_NATIVE_I:
+      state->size -= code->arg2.ref;
+      push(state, ES_HEAP);
+      break;
+    case SAN_BYTECODE_CALL:
+      escape_top(fun, state, code->arg2.ref);
+      push(state, ES_HEAP);
+      break;
+    case SAN_BYTECODE_TAILCALL:
+      escape_top(fun, state, code->arg2.ref);
+      break;
+    case SAN_BYTECODE_RET:
+      escape_top(fun, state, 1);
+      break;
+    case SAN_BYTECODE_LOAD_SLOT:
+      push(state, code->arg1.type == SAN_BYTECODE_TYPE_GLOBAL
+        ? ES_HEAP : state->sites[code->arg1.ref]);
+      break;
+    case SAN_BYTECODE_STORE_SLOT:
+      if (code->arg1.type == SAN_BYTECODE_TYPE_GLOBAL) {
+        escape_top(fun, state, 1);
+      } else {
+        state->sites[code->arg1.ref] = top(state, 0);
+        state->size--;
+      }
+      break;
+    case SAN_BYTECODE_MAKE_LIST:
+    case SAN_BYTECODE_MAKE_LOCAL_LIST:
+      escape_top(fun, state, code->arg1.ref);
+      push(state, pc);
+      break;
+    case SAN_BYTECODE_LIST_APPEND:
+      escape_top(fun, state, 1);
+      break;
+    case SAN_BYTECODE_ITER_NEXT: {
+      /* [list index acc] becomes [acc] at the exit; items are never local */
+      int list = top(state, 2), acc = top(state, 0);
+      state->size -= 2;
+      state->sites[state->size - 1] = acc;
+      merge(fun, code->arg1.ref - fun->fn->entry, state);
+      state->sites[state->size - 1] = list;
+      state->size += 2;
+      push(state, ES_HEAP);
+      return;
+    }
+  }
+
+  if (is_branch(code->opcode)) merge(fun, code->arg1.ref - fun->fn->entry, state);
+}
+
+static void run_block(es_function_t *fun, int offset, es_state_t *scratch) {
+  const es_state_t *in = &fun->blocks[offset];
+
+  scratch->size = in->size;
+  memcpy(scratch->sites, in->sites, in->size * sizeof(int));
+
+  for (int pc = offset; pc < fun->fn->length; ++pc) {
+    transfer(fun, pc, scratch);
+    if (ends_block(fun->code[pc].opcode)) break;
+    if (pc + 1 < fun->fn->length && fun->isLeader[pc + 1]) {
+      merge(fun, pc + 1, scratch);
+      break;
+    }
+  }
+}
+
+static void analyse_function(san_program_t *program, const san_function_t *fn) {
+  es_function_t fun = { fn, sanv_nth(&program->bytecode, fn->entry), NULL, NULL, NULL, NULL, NULL, 0, 1 };
+  es_state_t entry, scratch;
+
+  if (fn->length == 0) return;
+
+  fun.blocks = SAN_CALLOC(fn->length, sizeof(es_state_t));
+  fun.isLeader = SAN_CALLOC(fn->length + 1, sizeof(int));
+  fun.isQueued = SAN_CALLOC(fn->length, sizeof(int));
+  fun.escapes = SAN_CALLOC(fn->length, sizeof(int));
+  fun.worklist = SAN_MALLOC(fn->length * sizeof(int));
+
+  fun.isLeader[0] = 1;
+  for (int pc = 0; pc < fn->length; ++pc) {
+    int opcode = fun.code[pc].opcode;
+    if (is_branch(opcode)) fun.isLeader[fun.code[pc].arg1.ref - fn->entry] = 1;
+    if (is_branch(opcode) || ends_block(opcode)) fun.isLeader[pc + 1] = 1;
+  }
+
+  /* Arguments come from the caller, so they are never local to this frame */
+  entry.size = fn->nslots;
+  entry.sites = SAN_MALLOC((fn->nslots + 1) * sizeof(int));
+  for (int i = 0; i < fn->nslots; ++i) entry.sites[i] = ES_HEAP;
+  scratch.sites = SAN_MALLOC((fn->nslots + fn->length + 1) * sizeof(int));
+
+  merge(&fun, 0, &entry);
+  while (fun.pending > 0 && fun.consistent) {
+    int offset = fun.worklist[--fun.pending];
+    fun.isQueued[offset] = 0;
+    run_block(&fun, offset, &scratch);
+  }
+
+  for (int pc = 0; pc < fn->length; ++pc) {
+    san_bytecode_t *code = &fun.code[pc];
+    if (code->opcode == SAN_BYTECODE_MAKE_LIST || code->opcode == SAN_BYTECODE_MAKE_LOCAL_LIST) {
+      code->opcode = fun.consistent && !fun.escapes[pc]
+        ? SAN_BYTECODE_MAKE_LOCAL_LIST : SAN_BYTECODE_MAKE_LIST;
+    }
+    if (fun.blocks[pc].sites != NULL) {
+      SAN_FREE(fun.blocks[pc].sites);
+    }
+  }
+
+  SAN_FREE(fun.blocks);
+  SAN_FREE(fun.isLeader);
+  SAN_FREE(fun.isQueued);
+  SAN_FREE(fun.escapes);
+  SAN_FREE(fun.worklist);
+  SAN_FREE(entry.sites);
+  SAN_FREE(scratch.sites);
+}
+
+int sanx_analyse(san_program_t *program) {
+  SAN_VECTOR_FOR_EACH(program->functions, i, san_function_t, fn)
+    analyse_function(program, fn);
+  SAN_VECTOR_END_FOR_EACH
+  return SAN_OK;
+}
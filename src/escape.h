@@ -0,0 +1,18 @@
+#ifndef __SAN_ESCAPE_H
+#define __SAN_ESCAPE_H
+
+#include "bytecode.h"
+
+/*
+ * Escape analysis
+ *
+ * Follows every list made by MAKE_LIST through its function's stack and
+ * slots. A list escapes if it may be stored into a global or another list,
+ * returned, or passed to a user function. Natives never keep their
+ * arguments, so passing a list to one does not count. Lists that cannot
+ * escape are made with MAKE_LOCAL_LIST instead, and the VM frees them in
+ * bulk when their frame returns.
+ */
+int sanx_analyse(san_program_t *program);
+
+#endif
@@ -0,0 +1,161 @@
+#define _DEFAULT_SOURCE
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include "fiber.h"
+
+/* Keeps sleeping ordered by wakeAt, latest first */
+static void add_sleeping(san_scheduler_t *sched, san_fiber_t *fiber) {
+  int i;
+  sanv_push(&sched->sleeping, &fiber);
+  for (i = sched->sleeping.size - 1; i > 0; --i) {
+    san_fiber_t **before = sanv_nth(&sched->sleeping, i - 1);
+    if ((*before)->runtime.wakeAt >= fiber->runtime.wakeAt) break;
+    *(san_fiber_t**)sanv_nth(&sched->sleeping, i) = *before;
+  }
+  *(san_fiber_t**)sanv_nth(&sched->sleeping, i) = fiber;
+}
+
+static void add_ready(san_scheduler_t *sched, san_fiber_t *fiber) {
+  sanv_push(&sched->ready, &fiber);
+  pthread_cond_signal(&sched->wake);
+}
+
+static void finish(san_scheduler_t *sched, san_fiber_t *fiber, int result) {
+  fiber->result = result;
+  fiber->finished = 1;
+  if (--sched->live == 0) pthread_cond_broadcast(&sched->done);
+}
+
+/* With the lock held: the next fiber to run, waiting for one, or NULL once stopping */
+static san_fiber_t *next_fiber(san_scheduler_t *sched) {
+  san_fiber_t *fiber;
+
+  while (!sched->stopping) {
+    double now = sanm_time();
+    while (sched->sleeping.size > 0) {
+      fiber = *(san_fiber_t**)sanv_back(&sched->sleeping);
+      if (fiber->runtime.wakeAt > now) break;
+      sched->sleeping.size--;
+      sanv_push(&sched->ready, &fiber);
+    }
+
+    if ((int)sched->ready.size > sched->head) {
+      fiber = *(san_fiber_t**)sanv_nth(&sched->ready, sched->head++);
+      if ((int)sched->ready.size == sched->head) {
+        sched->ready.size = sched->head = 0;
+      } else {
+        /* The queue may never drain while fibers take turns, so drop what was taken */
+        if (sched->head * 2 >= (int)sched->ready.size) {
+          sched->ready.size -= sched->head;
+          memmove(sched->ready.elems, sanv_nth(&sched->ready, sched->head), sched->ready.size * sizeof(san_fiber_t*));
+          sched->head = 0;
+        }
+        pthread_cond_signal(&sched->wake);
+      }
+      return fiber;
+    }
+
+    if (sched->sleeping.size > 0) {
+      double wakeAt = (*(san_fiber_t**)sanv_back(&sched->sleeping))->runtime.wakeAt;
+      struct timespec until = { (time_t)wakeAt, (long)((wakeAt - floor(wakeAt)) * 1e9) };
+      pthread_cond_timedwait(&sched->wake, &sched->lock, &until);
+    } else {
+      pthread_cond_wait(&sched->wake, &sched->lock);
+    }
+  }
+  return NULL;
+}
+
+static void *run(void *ptr) {
+  san_scheduler_t *sched = ptr;
+  san_fiber_t *fiber;
+
+  pthread_mutex_lock(&sched->lock);
+  while ((fiber = next_fiber(sched)) != NULL) {
+    pthread_mutex_unlock(&sched->lock);
+    int result = sanm_resume(&fiber->runtime, &fiber->errors);
+    pthread_mutex_lock(&sched->lock);
+
+    if (result == SAN_VM_PREEMPTED) {
+      add_ready(sched, fiber);
+    } else if (result != SAN_VM_SUSPENDED) {
+      finish(sched, fiber, result);
+    } else if (fiber->runtime.wakeAt <= sanm_time()) {
+      add_ready(sched, fiber);
+    } else {
+      /* Another thread may be waiting for a later fiber */
+      add_sleeping(sched, fiber);
+      pthread_cond_signal(&sched->wake);
+    }
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return NULL;
+}
+
+int sanf_create(san_scheduler_t *sched, int nthreads) {
+  memset(sched, 0, sizeof *sched);
+  if (nthreads <= 0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0) nthreads = 1;
+
+  sched->threads = SAN_CALLOC(nthreads, sizeof(pthread_t));
+  sched->budget.seconds = SAN_FIBER_TIME_SLICE;
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->wake, NULL);
+  pthread_cond_init(&sched->done, NULL);
+  sanv_create(&sched->ready, sizeof(san_fiber_t*));
+  sanv_create(&sched->sleeping, sizeof(san_fiber_t*));
+
+  for (; sched->nthreads < nthreads; ++sched->nthreads) {
+    if (pthread_create(&sched->threads[sched->nthreads], NULL, run, sched) != 0) break;
+  }
+  return sched->nthreads > 0 ? SAN_OK : SAN_FAIL;
+}
+
+void sanf_destroy(san_scheduler_t *sched) {
+  pthread_mutex_lock(&sched->lock);
+  sched->stopping = 1;
+  pthread_cond_broadcast(&sched->wake);
+  pthread_mutex_unlock(&sched->lock);
+  for (int i = 0; i < sched->nthreads; ++i) pthread_join(sched->threads[i], NULL);
+
+  sanv_destroy(&sched->ready, sanv_nodestructor);
+  sanv_destroy(&sched->sleeping, sanv_nodestructor);
+  SAN_FREE(sched->threads);
+  pthread_mutex_destroy(&sched->lock);
+  pthread_cond_destroy(&sched->wake);
+  pthread_cond_destroy(&sched->done);
+}
+
+int sanf_spawn(san_scheduler_t *sched, san_fiber_t *fiber, const san_program_t *program,
+  const san_gc_limits_t *limits, FILE *out) {
+  sanv_create(&fiber->errors, sizeof(san_error_t));
+  sanm_create(&fiber->runtime, limits, out);
+  fiber->runtime.stackSize = SAN_FIBER_STACK_SIZE;
+  fiber->runtime.budget = sched->budget;
+  fiber->result = SAN_OK;
+  fiber->finished = 0;
+
+  if (sanm_start(&fiber->runtime, program, &fiber->errors) != SAN_OK) {
+    fiber->result = SAN_FAIL;
+    fiber->finished = 1;
+    return SAN_FAIL;
+  }
+
+  pthread_mutex_lock(&sched->lock);
+  sched->live++;
+  add_ready(sched, fiber);
+  pthread_mutex_unlock(&sched->lock);
+  return SAN_OK;
+}
+
+void sanf_wait(san_scheduler_t *sched) {
+  pthread_mutex_lock(&sched->lock);
+  while (sched->live > 0) pthread_cond_wait(&sched->done, &sched->lock);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void sanf_release(san_fiber_t *fiber) {
+  sanm_destroy(&fiber->runtime);
+  sanv_destroy(&fiber->errors, &sane_destructor);
+}
@@ -0,0 +1,65 @@
+#ifndef __SAN_FIBER_H
+#define __SAN_FIBER_H
+
+#include <pthread.h>
+#include "vm.h"
+
+/* Operand stack and heap of a fiber, which mostly run small scripts */
+#define SAN_FIBER_STACK_SIZE (1 << 14)
+#define SAN_FIBER_DEFAULT_LIMITS { 256, 4096, 0 }
+
+/* Seconds a fiber runs for at a time by default before others get a turn */
+#define SAN_FIBER_TIME_SLICE 0.01
+
+/*
+ * Fibers: many programs run on a few threads
+ *
+ * Each fiber is a program running in a runtime of its own. A scheduler's
+ * threads take ready fibers in turn and run each until it ends or a
+ * blocking native suspends it or it has spent its budget; a suspended
+ * fiber sleeps without a thread until it is due, then is resumed by
+ * whichever thread is free. A preempted fiber goes to the back of the
+ * ready fibers, so one that computes for long takes turns with the rest.
+ */
+
+typedef struct {
+  san_runtime_t runtime;
+  san_vector_t errors;
+  int result;           /* SAN_OK or SAN_FAIL once finished */
+  int finished;
+} san_fiber_t;
+
+typedef struct {
+  int nthreads;
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;  /* for threads, when a fiber is ready or due sooner */
+  pthread_cond_t done;  /* for sanf_wait, when no fiber is left */
+  san_vector_t ready;   /* san_fiber_t*, the first to run from head */
+  int head;
+  san_vector_t sleeping; /* san_fiber_t*, the first due last */
+  int live;             /* fibers spawned and not finished */
+  int stopping;
+  san_budget_t budget;  /* for each turn of the fibers spawned from now on */
+} san_scheduler_t;
+
+/* Starts nthreads threads, or one per online processor if it is 0 */
+int sanf_create(san_scheduler_t *sched, int nthreads);
+
+/* Stops and joins the threads; fibers still live are left as they stand */
+void sanf_destroy(san_scheduler_t *sched);
+
+/*
+ * Starts program in fiber, printing to out, and makes it ready. The fiber
+ * belongs to the scheduler until it has finished, and to the caller after.
+ */
+int sanf_spawn(san_scheduler_t *sched, san_fiber_t *fiber, const san_program_t *program,
+  const san_gc_limits_t *limits, FILE *out);
+
+/* Waits until every fiber spawned has finished */
+void sanf_wait(san_scheduler_t *sched);
+
+/* Frees a finished fiber, or one that failed to spawn */
+void sanf_release(san_fiber_t *fiber);
+
+#endif
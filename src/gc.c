@@ -0,0 +1,228 @@
+#include <time.h>
+#include "gc.h"
+
+static inline int in_nursery(const san_gc_t *gc, const vm_list *list) {
+  return list >= gc->nursery && list < gc->nursery + gc->limits.nurserySize;
+}
+
+static int destroy_bignum(void *ptr) {
+  SAN_FREE(*(vm_bignum**)ptr);
+  return SAN_OK;
+}
+
+static int destroy_old(void *ptr) {
+  vm_list *list = *(vm_list**)ptr;
+  sanv_destroy(&list->items, sanv_nodestructor);
+  SAN_FREE(list);
+  return SAN_OK;
+}
+
+void sang_create(san_gc_t *gc, const san_gc_limits_t *limits) {
+  memset(gc, 0, sizeof *gc);
+  gc->limits = *limits;
+  gc->nursery = SAN_CALLOC(limits->nurserySize, sizeof(vm_list));
+  gc->nextMajor = limits->majorSize;
+  gc->nextBignums = limits->majorSize;
+  sanv_create(&gc->old, sizeof(vm_list*));
+  sanv_create(&gc->remembered, sizeof(vm_list*));
+  sanv_create(&gc->bignums, sizeof(vm_bignum*));
+}
+
+void sang_destroy(san_gc_t *gc) {
+  for (int i = 0; i < gc->nurseryUsed; ++i) sanv_destroy(&gc->nursery[i].items, sanv_nodestructor);
+  SAN_FREE(gc->nursery);
+  sanv_destroy(&gc->old, destroy_old);
+  sanv_destroy(&gc->remembered, sanv_nodestructor);
+  sanv_destroy(&gc->bignums, destroy_bignum);
+}
+
+/*
+ * Minor collection
+ */
+
+/* Moves the list in slot to the old space if it is in the nursery */
+static void promote(san_gc_t *gc, vm_object *slot) {
+  vm_list *list;
+
+  if (vm_type(*slot) != SAN_VM_LIST) return;
+  list = vm_to_list(*slot);
+  if (!in_nursery(gc, list)) return;
+
+  if (list->forward == NULL) {
+    vm_list *copy = SAN_MALLOC(sizeof(vm_list));
+    *copy = *list;
+    copy->flags = SAN_VM_LIST_OLD;
+    list->forward = copy;
+    sanv_push(&gc->old, &copy);
+    gc->stats.promoted++;
+  }
+  *slot = vm_from_list(list->forward);
+}
+
+static void promote_items(san_gc_t *gc, vm_list *list) {
+  for (int i = 0; i < list->items.size; ++i) promote(gc, (vm_object*)sanv_nth(&list->items, i));
+}
+
+static void promote_roots(san_gc_t *gc, const san_gc_roots_t *roots) {
+  for (int i = 0; i < roots->stackSize; ++i) promote(gc, &roots->stack[i]);
+  for (int i = 0; i < roots->nglobals; ++i) promote(gc, &roots->globals[i]);
+  SAN_VECTOR_FOR_EACH(*roots->locals, i, vm_list*, list)
+    promote_items(gc, *list);
+  SAN_VECTOR_END_FOR_EACH
+}
+
+static void collect_minor(san_gc_t *gc, const san_gc_roots_t *roots) {
+  int scanned = gc->old.size;
+
+  promote_roots(gc, roots);
+  SAN_VECTOR_FOR_EACH(gc->remembered, i, vm_list*, list)
+    (*list)->flags &= ~SAN_VM_LIST_REMEMBERED;
+    promote_items(gc, *list);
+  SAN_VECTOR_END_FOR_EACH
+  sanv_pop_all(&gc->remembered);
+
+  /* Lists promoted since may point into the nursery in turn */
+  for (; scanned < gc->old.size; ++scanned) promote_items(gc, *(vm_list**)sanv_nth(&gc->old, scanned));
+
+  for (int i = 0; i < gc->nurseryUsed; ++i) {
+    vm_list *list = &gc->nursery[i];
+    if (list->forward == NULL) {
+      sanv_destroy(&list->items, sanv_nodestructor);
+      gc->stats.freed++;
+    }
+  }
+  memset(gc->nursery, 0, gc->nurseryUsed * sizeof(vm_list));
+  gc->nurseryUsed = 0;
+  gc->stats.minor++;
+}
+
+/*
+ * Major collection, once the nursery is empty
+ */
+
+static void mark(san_vector_t *worklist, vm_object obj) {
+  vm_list *list;
+
+  if (vm_type(obj) == SAN_VM_BIGNUM) vm_to_bignum(obj)->flags |= SAN_VM_BIGNUM_MARKED;
+  if (vm_type(obj) != SAN_VM_LIST) return;
+  list = vm_to_list(obj);
+  if ((list->flags & SAN_VM_LIST_OLD) && !(list->flags & SAN_VM_LIST_MARKED)) {
+    list->flags |= SAN_VM_LIST_MARKED;
+    sanv_push(worklist, &list);
+  }
+}
+
+static void mark_items(san_vector_t *worklist, const vm_list *list) {
+  for (int i = 0; i < list->items.size; ++i) mark(worklist, *(vm_object*)sanv_nth(&list->items, i));
+}
+
+static void collect_major(san_gc_t *gc, const san_gc_roots_t *roots) {
+  san_vector_t worklist;
+  vm_list *list;
+  int live = 0;
+
+  sanv_create(&worklist, sizeof(vm_list*));
+  for (int i = 0; i < roots->stackSize; ++i) mark(&worklist, roots->stack[i]);
+  for (int i = 0; i < roots->nglobals; ++i) mark(&worklist, roots->globals[i]);
+  SAN_VECTOR_FOR_EACH(*roots->locals, i, vm_list*, local)
+    mark_items(&worklist, *local);
+  SAN_VECTOR_END_FOR_EACH
+  while (sanv_pop(&worklist, &list) == SAN_OK) mark_items(&worklist, list);
+  sanv_destroy(&worklist, sanv_nodestructor);
+
+  SAN_VECTOR_FOR_EACH(gc->old, i, vm_list*, old)
+    if ((*old)->flags & SAN_VM_LIST_MARKED) {
+      (*old)->flags &= ~SAN_VM_LIST_MARKED;
+      *(vm_list**)sanv_nth(&gc->old, live++) = *old;
+    } else {
+      destroy_old(old);
+      gc->stats.freed++;
+    }
+  SAN_VECTOR_END_FOR_EACH
+  gc->old.size = live;
+  gc->nextMajor = live * 2 > gc->limits.majorSize ? live * 2 : gc->limits.majorSize;
+
+  live = 0;
+  SAN_VECTOR_FOR_EACH(gc->bignums, i, vm_bignum*, bignum)
+    if ((*bignum)->flags & SAN_VM_BIGNUM_MARKED) {
+      (*bignum)->flags &= ~SAN_VM_BIGNUM_MARKED;
+      *(vm_bignum**)sanv_nth(&gc->bignums, live++) = *bignum;
+    } else {
+      destroy_bignum(bignum);
+      gc->stats.freed++;
+    }
+  SAN_VECTOR_END_FOR_EACH
+  gc->bignums.size = live;
+  gc->nextBignums = live * 2 > gc->limits.majorSize ? live * 2 : gc->limits.majorSize;
+  gc->stats.major++;
+}
+
+static int collect(san_gc_t *gc, const san_gc_roots_t *roots, int forceMajor) {
+  clock_t start = clock();
+  int isMajor = 0;
+  double pause;
+
+  collect_minor(gc, roots);
+  if (forceMajor || gc->old.size >= gc->nextMajor ||
+      (gc->limits.heapLimit > 0 && gc->old.size > gc->limits.heapLimit)) {
+    collect_major(gc, roots);
+    isMajor = 1;
+  }
+
+  pause = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+  gc->stats.totalPause += pause;
+  if (pause > gc->stats.maxPause) gc->stats.maxPause = pause;
+  san_dbg("GC %s: %d old lists, %d bignums, %.3f ms\n", isMajor ? "major" : "minor",
+    gc->old.size, gc->bignums.size, pause);
+
+  if (gc->limits.heapLimit > 0 && gc->old.size > gc->limits.heapLimit) return SAN_FAIL;
+  return SAN_OK;
+}
+
+vm_list *sang_alloc(san_gc_t *gc, const san_gc_roots_t *roots) {
+  vm_list *list;
+
+  if (gc->nurseryUsed == gc->limits.nurserySize && collect(gc, roots, 0) != SAN_OK) return NULL;
+
+  list = &gc->nursery[gc->nurseryUsed++];
+  sanv_create(&list->items, sizeof(vm_object));
+  return list;
+}
+
+void sang_barrier(san_gc_t *gc, vm_list *list, vm_object item) {
+  if ((list->flags & (SAN_VM_LIST_OLD | SAN_VM_LIST_REMEMBERED)) == SAN_VM_LIST_OLD &&
+      vm_type(item) == SAN_VM_LIST && in_nursery(gc, vm_to_list(item))) {
+    list->flags |= SAN_VM_LIST_REMEMBERED;
+    sanv_push(&gc->remembered, &list);
+  }
+}
+
+vm_bignum *sang_alloc_bignum(san_gc_t *gc, int size) {
+  vm_bignum *bignum = SAN_MALLOC(sizeof(vm_bignum) + size * sizeof(uint32_t));
+  bignum->size = size;
+  bignum->flags = 0;
+  sanv_push(&gc->bignums, &bignum);
+  return bignum;
+}
+
+int sang_due(const san_gc_t *gc) {
+  return gc->bignums.size >= gc->nextBignums;
+}
+
+int sang_collect(san_gc_t *gc, const san_gc_roots_t *roots) {
+  return collect(gc, roots, 1);
+}
+
+void sang_adopt(san_gc_t *gc, san_gc_t *from, const san_gc_roots_t *roots) {
+  collect_minor(from, roots);
+  SAN_VECTOR_FOR_EACH(from->old, i, vm_list*, list)
+    (*list)->flags |= SAN_VM_LIST_REMEMBERED;
+    sanv_push(&gc->old, list);
+    sanv_push(&gc->remembered, list);
+  SAN_VECTOR_END_FOR_EACH
+  SAN_VECTOR_FOR_EACH(from->bignums, i, vm_bignum*, bignum)
+    sanv_push(&gc->bignums, bignum);
+  SAN_VECTOR_END_FOR_EACH
+  sanv_pop_all(&from->old);
+  sanv_pop_all(&from->bignums);
+}
@@ -0,0 +1,89 @@
+#ifndef __SAN_GC_H
+#define __SAN_GC_H
+
+#include "object.h"
+
+/*
+ * Garbage collector
+ *
+ * Manages the lists the VM makes with MAKE_LIST. New lists are bumped out
+ * of a fixed nursery. When it fills up, a minor collection moves the
+ * nursery lists still reachable into the old space and frees the rest, so
+ * the nursery is empty again. Once the old space has grown past a
+ * threshold, a major collection marks it from the roots and sweeps what
+ * is unreachable, then sets the threshold to twice what survived.
+ *
+ * The roots are the operand stack, the globals and the items of the
+ * frame-local lists, which escape analysis keeps out of the collector.
+ * Old lists that are appended a nursery list are remembered, and scanned
+ * as roots by the next minor collection too.
+ *
+ * Bignums are allocated straight into the old space, without collecting,
+ * since their callers hold intermediate results the roots don't see. The
+ * VM checks sang_due where it is safe to collect instead, and the next
+ * major collection sweeps them with the lists.
+ */
+
+typedef struct {
+  int nurserySize;    /* lists made between minor collections */
+  int majorSize;      /* old lists before the first major collection */
+  int heapLimit;      /* old lists still reachable after a major collection, 0 for no limit */
+} san_gc_limits_t;
+
+#define SAN_GC_DEFAULT_LIMITS { 4096, 65536, 0 }
+
+typedef struct {
+  int minor, major;
+  int promoted, freed;
+  double totalPause, maxPause;    /* milliseconds of processor time */
+} san_gc_stats_t;
+
+typedef struct {
+  san_gc_limits_t limits;
+  san_gc_stats_t stats;
+  vm_list *nursery;
+  int nurseryUsed;
+  san_vector_t old;         /* vm_list* */
+  san_vector_t remembered;  /* vm_list* in old pointing into the nursery */
+  san_vector_t bignums;     /* vm_bignum* */
+  int nextMajor;
+  int nextBignums;
+} san_gc_t;
+
+typedef struct {
+  vm_object *stack;
+  int stackSize;
+  vm_object *globals;
+  int nglobals;
+  const san_vector_t *locals;   /* vm_list* */
+} san_gc_roots_t;
+
+void sang_create(san_gc_t *gc, const san_gc_limits_t *limits);
+void sang_destroy(san_gc_t *gc);
+
+/*
+ * Returns a new empty list, collecting first if the nursery is full. The
+ * roots may be moved. Returns NULL if the heap limit has been exceeded.
+ */
+vm_list *sang_alloc(san_gc_t *gc, const san_gc_roots_t *roots);
+
+/* Must be called when item is appended to list */
+void sang_barrier(san_gc_t *gc, vm_list *list, vm_object item);
+
+/* Returns a bignum of size limbs, its sign and limbs left for the caller */
+vm_bignum *sang_alloc_bignum(san_gc_t *gc, int size);
+
+/* Whether enough bignums have been allocated since the last collection */
+int sang_due(const san_gc_t *gc);
+
+/* Collects both generations. Returns SAN_FAIL if the heap limit has been exceeded */
+int sang_collect(san_gc_t *gc, const san_gc_roots_t *roots);
+
+/*
+ * Moves what from holds into gc, after a minor collection of from with
+ * roots, leaving from empty. The lists moved are remembered, since they
+ * may point into gc's nursery.
+ */
+void sang_adopt(san_gc_t *gc, san_gc_t *from, const san_gc_roots_t *roots);
+
+#endif
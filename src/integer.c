@@ -0,0 +1,447 @@
+#include <inttypes.h>
+#include "integer.h"
+
+/* The sign and magnitude of an integer, small or not, without copying it */
+typedef struct {
+  int sign;
+  int size;
+  const uint32_t *limbs;
+} int_view_t;
+
+static void view(vm_object a, int_view_t *v, uint32_t small[2]) {
+  if (vm_type(a) == SAN_VM_BIGNUM) {
+    v->sign = vm_to_bignum(a)->sign;
+    v->size = vm_to_bignum(a)->size;
+    v->limbs = vm_to_bignum(a)->limbs;
+  } else {
+    int64_t n = vm_to_int(a);
+    uint64_t magnitude = n < 0 ? -(uint64_t)n : (uint64_t)n;
+    small[0] = (uint32_t)magnitude;
+    small[1] = (uint32_t)(magnitude >> 32);
+    v->sign = n < 0 ? -1 : 1;
+    v->size = small[1] != 0 ? 2 : small[0] != 0 ? 1 : 0;
+    v->limbs = small;
+  }
+}
+
+static int trim(const uint32_t *a, int n) {
+  while (n > 0 && a[n - 1] == 0) --n;
+  return n;
+}
+
+/* The integer sign * limbs, small if it fits */
+static vm_object make(san_gc_t *gc, int sign, const uint32_t *limbs, int size) {
+  vm_bignum *bignum;
+
+  size = trim(limbs, size);
+  if (size <= 2) {
+    uint64_t magnitude = size == 0 ? 0 : size == 1 ? limbs[0] : ((uint64_t)limbs[1] << 32 | limbs[0]);
+    if (magnitude <= (uint64_t)SAN_VM_INT_MAX) return vm_from_int(sign < 0 ? -(int64_t)magnitude : (int64_t)magnitude);
+    if (sign < 0 && magnitude == (uint64_t)SAN_VM_INT_MAX + 1) return vm_from_int(SAN_VM_INT_MIN);
+  }
+
+  bignum = sang_alloc_bignum(gc, size);
+  bignum->sign = sign;
+  memcpy(bignum->limbs, limbs, size * sizeof(uint32_t));
+  return vm_from_bignum(bignum);
+}
+
+vm_object sani_from_int64(san_gc_t *gc, int64_t n) {
+  uint64_t magnitude = n < 0 ? -(uint64_t)n : (uint64_t)n;
+  uint32_t limbs[2] = { (uint32_t)magnitude, (uint32_t)(magnitude >> 32) };
+  return make(gc, n < 0 ? -1 : 1, limbs, 2);
+}
+
+vm_object sani_parse(san_gc_t *gc, const char *digits) {
+  int length = strlen(digits), size = 0;
+  uint32_t *limbs = SAN_MALLOC((length / 9 + 1) * sizeof(uint32_t));
+  vm_object result;
+
+  /* Nine digits at a time, each adding at most 30 bits */
+  for (int i = 0; i < length; i += 9) {
+    uint32_t chunk = 0, scale = 1;
+    uint64_t carry;
+    for (int j = i; j < i + 9 && j < length; ++j) {
+      chunk = chunk * 10 + (digits[j] - '0');
+      scale *= 10;
+    }
+    carry = chunk;
+    for (int k = 0; k < size; ++k) {
+      carry += (uint64_t)limbs[k] * scale;
+      limbs[k] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    if (carry != 0) limbs[size++] = (uint32_t)carry;
+  }
+
+  result = make(gc, 1, limbs, size);
+  SAN_FREE(limbs);
+  return result;
+}
+
+/*
+ * Magnitudes
+ */
+
+static int mag_cmp(const uint32_t *a, int an, const uint32_t *b, int bn) {
+  an = trim(a, an);
+  bn = trim(b, bn);
+  if (an != bn) return an < bn ? -1 : 1;
+  for (int i = an - 1; i >= 0; --i) {
+    if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+/* r = a + b, r having room for max(an, bn) + 1 limbs. Returns that size */
+static int mag_add(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn) {
+  uint64_t carry = 0;
+
+  if (an < bn) {
+    const uint32_t *t = a; int tn = an;
+    a = b; an = bn;
+    b = t; bn = tn;
+  }
+  for (int i = 0; i < an; ++i) {
+    carry += (uint64_t)a[i] + (i < bn ? b[i] : 0);
+    r[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  r[an] = (uint32_t)carry;
+  return an + 1;
+}
+
+/* r = a - b for a >= b, r having room for an limbs and possibly being a */
+static void mag_sub(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn) {
+  int64_t borrow = 0;
+
+  for (int i = 0; i < an; ++i) {
+    int64_t d = (int64_t)a[i] - (i < bn ? b[i] : 0) - borrow;
+    borrow = d < 0;
+    r[i] = (uint32_t)(d + (borrow ? (INT64_C(1) << 32) : 0));
+  }
+}
+
+/* r += x << (32 * offset), the sum fitting in rn limbs */
+static void mag_add_at(uint32_t *r, int rn, int offset, const uint32_t *x, int xn) {
+  uint64_t carry = 0;
+
+  for (int i = 0; offset + i < rn && (i < xn || carry != 0); ++i) {
+    carry += (uint64_t)r[offset + i] + (i < xn ? x[i] : 0);
+    r[offset + i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+}
+
+static void mul_schoolbook(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn) {
+  memset(r, 0, (an + bn) * sizeof(uint32_t));
+  for (int i = 0; i < an; ++i) {
+    uint64_t carry = 0;
+    for (int j = 0; j < bn; ++j) {
+      carry += (uint64_t)a[i] * b[j] + r[i + j];
+      r[i + j] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    r[i + bn] = (uint32_t)carry;
+  }
+}
+
+/*
+ * r = a * b, r having room for an + bn limbs. Splitting both at m limbs,
+ * a * b = z2 B^2m + z1 B^m + z0 where z1 = (a0 + a1)(b0 + b1) - z0 - z2,
+ * three products of half the size instead of four.
+ */
+static void mag_mul(uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn) {
+  int m = ((an > bn ? an : bn) + 1) / 2;
+  int a1n = an - m, b1n = bn - m, z1n = 2 * m + 2;
+  uint32_t *z0, *z1, *z2, *sa, *sb;
+
+  if (an < SAN_INTEGER_KARATSUBA || bn < SAN_INTEGER_KARATSUBA || a1n <= 0 || b1n <= 0) {
+    mul_schoolbook(r, a, an, b, bn);
+    return;
+  }
+
+  z0 = SAN_MALLOC(2 * m * sizeof(uint32_t));
+  z2 = SAN_MALLOC((a1n + b1n) * sizeof(uint32_t));
+  z1 = SAN_MALLOC(z1n * sizeof(uint32_t));
+  sa = SAN_MALLOC((m + 1) * sizeof(uint32_t));
+  sb = SAN_MALLOC((m + 1) * sizeof(uint32_t));
+
+  mag_mul(z0, a, m, b, m);
+  mag_mul(z2, a + m, a1n, b + m, b1n);
+  mag_add(sa, a, m, a + m, a1n);
+  mag_add(sb, b, m, b + m, b1n);
+  mag_mul(z1, sa, m + 1, sb, m + 1);
+  mag_sub(z1, z1, z1n, z0, 2 * m);
+  mag_sub(z1, z1, z1n, z2, a1n + b1n);
+
+  memset(r, 0, (an + bn) * sizeof(uint32_t));
+  mag_add_at(r, an + bn, 0, z0, 2 * m);
+  mag_add_at(r, an + bn, m, z1, trim(z1, z1n));
+  mag_add_at(r, an + bn, 2 * m, z2, a1n + b1n);
+
+  SAN_FREE(z0);
+  SAN_FREE(z1);
+  SAN_FREE(z2);
+  SAN_FREE(sa);
+  SAN_FREE(sb);
+}
+
+/* q = a / d, q possibly being a. Returns the remainder */
+static uint32_t mag_div_small(uint32_t *q, const uint32_t *a, int an, uint32_t d) {
+  uint64_t rem = 0;
+
+  for (int i = an - 1; i >= 0; --i) {
+    rem = rem << 32 | a[i];
+    q[i] = (uint32_t)(rem / d);
+    rem %= d;
+  }
+  return (uint32_t)rem;
+}
+
+/* q = a / b and r = a % b, q having room for an limbs and r for bn + 1 */
+static void mag_divmod(uint32_t *q, uint32_t *r, const uint32_t *a, int an, const uint32_t *b, int bn) {
+  memset(q, 0, an * sizeof(uint32_t));
+  memset(r, 0, (bn + 1) * sizeof(uint32_t));
+  if (bn == 1) {
+    r[0] = mag_div_small(q, a, an, b[0]);
+    return;
+  }
+
+  for (int bit = an * 32 - 1; bit >= 0; --bit) {
+    for (int i = bn; i > 0; --i) r[i] = r[i] << 1 | r[i - 1] >> 31;
+    r[0] = r[0] << 1 | ((a[bit / 32] >> (bit % 32)) & 1);
+    if (mag_cmp(r, bn + 1, b, bn) >= 0) {
+      mag_sub(r, r, bn + 1, b, bn);
+      q[bit / 32] |= UINT32_C(1) << (bit % 32);
+    }
+  }
+}
+
+/*
+ * Signed operations
+ */
+
+static vm_object add_views(san_gc_t *gc, const int_view_t *a, const int_view_t *b) {
+  int size = (a->size > b->size ? a->size : b->size) + 1;
+  uint32_t *r = SAN_MALLOC(size * sizeof(uint32_t));
+  vm_object result;
+
+  if (a->sign == b->sign) {
+    mag_add(r, a->limbs, a->size, b->limbs, b->size);
+    result = make(gc, a->sign, r, size);
+  } else if (mag_cmp(a->limbs, a->size, b->limbs, b->size) >= 0) {
+    mag_sub(r, a->limbs, a->size, b->limbs, b->size);
+    result = make(gc, a->sign, r, a->size);
+  } else {
+    mag_sub(r, b->limbs, b->size, a->limbs, a->size);
+    result = make(gc, b->sign, r, b->size);
+  }
+
+  SAN_FREE(r);
+  return result;
+}
+
+vm_object sani_add_slow(san_gc_t *gc, vm_object a, vm_object b) {
+  uint32_t sa[2], sb[2];
+  int_view_t va, vb;
+
+  view(a, &va, sa);
+  view(b, &vb, sb);
+  return add_views(gc, &va, &vb);
+}
+
+vm_object sani_sub_slow(san_gc_t *gc, vm_object a, vm_object b) {
+  uint32_t sa[2], sb[2];
+  int_view_t va, vb;
+
+  view(a, &va, sa);
+  view(b, &vb, sb);
+  vb.sign = -vb.sign;
+  return add_views(gc, &va, &vb);
+}
+
+vm_object sani_mul_slow(san_gc_t *gc, vm_object a, vm_object b) {
+  uint32_t sa[2], sb[2], *r;
+  int_view_t va, vb;
+  vm_object result;
+
+  view(a, &va, sa);
+  view(b, &vb, sb);
+  if (va.size == 0 || vb.size == 0) return vm_from_int(0);
+
+  r = SAN_MALLOC((va.size + vb.size) * sizeof(uint32_t));
+  mag_mul(r, va.limbs, va.size, vb.limbs, vb.size);
+  result = make(gc, va.sign * vb.sign, r, va.size + vb.size);
+  SAN_FREE(r);
+  return result;
+}
+
+int sani_compare(vm_object a, vm_object b) {
+  uint32_t sa[2], sb[2];
+  int_view_t va, vb;
+  int signA, signB;
+
+  if (vm_type(a) == SAN_VM_INT && vm_type(b) == SAN_VM_INT) {
+    return (vm_to_int(a) > vm_to_int(b)) - (vm_to_int(a) < vm_to_int(b));
+  }
+
+  view(a, &va, sa);
+  view(b, &vb, sb);
+  signA = va.size == 0 ? 0 : va.sign;
+  signB = vb.size == 0 ? 0 : vb.sign;
+  if (signA != signB) return (signA > signB) - (signA < signB);
+  return signA * mag_cmp(va.limbs, va.size, vb.limbs, vb.size);
+}
+
+vm_object sani_abs(san_gc_t *gc, vm_object a) {
+  int64_t result;
+
+  if (vm_type(a) == SAN_VM_INT) {
+    /* Only SAN_VM_INT_MIN becomes a bignum */
+    sanstd_absi(vm_to_int(a), &result);
+    return sani_from_int64(gc, result);
+  }
+  if (vm_to_bignum(a)->sign > 0) return a;
+  return make(gc, 1, vm_to_bignum(a)->limbs, vm_to_bignum(a)->size);
+}
+
+vm_object sani_square(san_gc_t *gc, vm_object a) {
+  int64_t result;
+
+  if (vm_type(a) == SAN_VM_INT && sanstd_squarei(vm_to_int(a), &result) && vm_fits_int(result)) {
+    return vm_from_int(result);
+  }
+  return sani_mul_slow(gc, a, a);
+}
+
+/* lo * (lo + 1) * ... * hi, split in halves so the products stay balanced */
+static vm_object range_product(san_gc_t *gc, int64_t lo, int64_t hi) {
+  vm_object result;
+  int64_t mid;
+
+  if (hi - lo < 8) {
+    result = vm_from_int(lo);
+    for (int64_t n = lo + 1; n <= hi; ++n) result = sani_mul(gc, result, vm_from_int(n));
+    return result;
+  }
+  mid = lo + (hi - lo) / 2;
+  return sani_mul(gc, range_product(gc, lo, mid), range_product(gc, mid + 1, hi));
+}
+
+int sani_factorial(san_gc_t *gc, vm_object a, vm_object *result) {
+  int64_t n;
+
+  if (vm_type(a) != SAN_VM_INT) return SAN_FAIL;
+  if (sanstd_factoriali(vm_to_int(a), &n)) {
+    *result = sani_from_int64(gc, n);
+  } else {
+    *result = range_product(gc, 2, vm_to_int(a));
+  }
+  return SAN_OK;
+}
+
+/* Truncated like C's %, the result taking the sign of a */
+int sani_mod(san_gc_t *gc, vm_object a, vm_object b, vm_object *result) {
+  uint32_t sa[2], sb[2], *q, *r;
+  int_view_t va, vb;
+
+  view(a, &va, sa);
+  view(b, &vb, sb);
+  if (vb.size == 0) return SAN_FAIL;
+  if (vm_type(a) == SAN_VM_INT && vm_type(b) == SAN_VM_INT) {
+    *result = vm_from_int(sanstd_modi(vm_to_int(a), vm_to_int(b)));
+    return SAN_OK;
+  }
+  if (mag_cmp(va.limbs, va.size, vb.limbs, vb.size) < 0) {
+    *result = a;
+    return SAN_OK;
+  }
+
+  q = SAN_MALLOC(va.size * sizeof(uint32_t));
+  r = SAN_MALLOC((vb.size + 1) * sizeof(uint32_t));
+  mag_divmod(q, r, va.limbs, va.size, vb.limbs, vb.size);
+  *result = make(gc, va.sign, r, vb.size + 1);
+  SAN_FREE(q);
+  SAN_FREE(r);
+  return SAN_OK;
+}
+
+static vm_object divide(san_gc_t *gc, vm_object a, vm_object b) {
+  uint32_t sa[2], sb[2], *q, *r;
+  int_view_t va, vb;
+  vm_object result;
+
+  view(a, &va, sa);
+  view(b, &vb, sb);
+  if (va.size < vb.size) return vm_from_int(0);
+
+  q = SAN_MALLOC(va.size * sizeof(uint32_t));
+  r = SAN_MALLOC((vb.size + 1) * sizeof(uint32_t));
+  mag_divmod(q, r, va.limbs, va.size, vb.limbs, vb.size);
+  result = make(gc, va.sign * vb.sign, q, va.size);
+  SAN_FREE(q);
+  SAN_FREE(r);
+  return result;
+}
+
+/*
+ * Rounds to the nearest integer like sanstd_sqrti. Newton's iteration from
+ * above finds x = floor(sqrt(a)), and the root is nearer x + 1 when
+ * a - x^2 > x.
+ */
+int sani_sqrt(san_gc_t *gc, vm_object a, vm_object *result) {
+  vm_bignum *bignum;
+  vm_object x, y;
+
+  if (sani_compare(a, vm_from_int(0)) < 0) return SAN_FAIL;
+  if (vm_type(a) == SAN_VM_INT) {
+    *result = vm_from_int(sanstd_sqrti(vm_to_int(a)));
+    return SAN_OK;
+  }
+
+  bignum = sang_alloc_bignum(gc, (vm_to_bignum(a)->size + 1) / 2 + 1);
+  bignum->sign = 1;
+  memset(bignum->limbs, 0, bignum->size * sizeof(uint32_t));
+  bignum->limbs[bignum->size - 1] = 1;
+  x = vm_from_bignum(bignum);
+  for (;;) {
+    y = divide(gc, sani_add(gc, x, divide(gc, a, x)), vm_from_int(2));
+    if (sani_compare(y, x) >= 0) break;
+    x = y;
+  }
+
+  if (sani_compare(sani_sub(gc, a, sani_mul(gc, x, x)), x) > 0) x = sani_add(gc, x, vm_from_int(1));
+  *result = x;
+  return SAN_OK;
+}
+
+void sani_print(FILE *out, vm_object a) {
+  const vm_bignum *bignum = vm_to_bignum(a);
+  uint32_t *q, *chunks;
+  int size, count = 0;
+
+  if (vm_type(a) == SAN_VM_INT) {
+    fprintf(out, "%" PRId64, vm_to_int(a));
+    return;
+  }
+
+  /* Base 10^9 digits, least significant first */
+  size = bignum->size;
+  if (size <= 0) {
+    fputc('0', out);
+    return;
+  }
+  q = SAN_MALLOC(size * sizeof(uint32_t));
+  chunks = SAN_MALLOC((size * 10 / 9 + 2) * sizeof(uint32_t));
+  memcpy(q, bignum->limbs, size * sizeof(uint32_t));
+  while (size > 0) {
+    chunks[count++] = mag_div_small(q, q, size, 1000000000);
+    size = trim(q, size);
+  }
+
+  fprintf(out, "%s%" PRIu32, bignum->sign < 0 ? "-" : "", chunks[count - 1]);
+  for (int i = count - 2; i >= 0; --i) fprintf(out, "%09" PRIu32, chunks[i]);
+  SAN_FREE(q);
+  SAN_FREE(chunks);
+}
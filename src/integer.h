@@ -0,0 +1,73 @@
+#ifndef __SAN_INTEGER_H
+#define __SAN_INTEGER_H
+
+#include "gc.h"
+#include "std.h"
+
+/*
+ * Integer arithmetic
+ *
+ * Integers are small, in the payload of a value, until an operation
+ * overflows SAN_VM_INT_MIN..SAN_VM_INT_MAX. The result is then promoted to
+ * a bignum allocated from gc, and demoted back as soon as it fits again, so
+ * a value is a bignum exactly when it is too large to be small.
+ *
+ * The operations below take small integers or bignums. The fast path of
+ * each is inline: a 64-bit operation on two small integers checked with
+ * __builtin_*_overflow. Bignum products switch from schoolbook to Karatsuba
+ * multiplication from SAN_INTEGER_KARATSUBA limbs.
+ */
+
+#define SAN_INTEGER_KARATSUBA 32
+
+vm_object sani_from_int64(san_gc_t *gc, int64_t n);
+
+/* The integer written in decimal as digits, which has no sign */
+vm_object sani_parse(san_gc_t *gc, const char *digits);
+
+vm_object sani_add_slow(san_gc_t *gc, vm_object a, vm_object b);
+vm_object sani_sub_slow(san_gc_t *gc, vm_object a, vm_object b);
+vm_object sani_mul_slow(san_gc_t *gc, vm_object a, vm_object b);
+
+static inline vm_object sani_add(san_gc_t *gc, vm_object a, vm_object b) {
+  int64_t result;
+  if (vm_type(a) == SAN_VM_INT && vm_type(b) == SAN_VM_INT &&
+      !__builtin_add_overflow(vm_to_int(a), vm_to_int(b), &result) && vm_fits_int(result)) {
+    return vm_from_int(result);
+  }
+  return sani_add_slow(gc, a, b);
+}
+
+static inline vm_object sani_sub(san_gc_t *gc, vm_object a, vm_object b) {
+  int64_t result;
+  if (vm_type(a) == SAN_VM_INT && vm_type(b) == SAN_VM_INT &&
+      sanstd_subi(vm_to_int(a), vm_to_int(b), &result) && vm_fits_int(result)) {
+    return vm_from_int(result);
+  }
+  return sani_sub_slow(gc, a, b);
+}
+
+static inline vm_object sani_mul(san_gc_t *gc, vm_object a, vm_object b) {
+  int64_t result;
+  if (vm_type(a) == SAN_VM_INT && vm_type(b) == SAN_VM_INT &&
+      !__builtin_mul_overflow(vm_to_int(a), vm_to_int(b), &result) && vm_fits_int(result)) {
+    return vm_from_int(result);
+  }
+  return sani_mul_slow(gc, a, b);
+}
+
+/* Negative, zero or positive as a is less than, equal to or greater than b */
+int sani_compare(vm_object a, vm_object b);
+
+vm_object sani_abs(san_gc_t *gc, vm_object a);
+vm_object sani_square(san_gc_t *gc, vm_object a);
+
+/* These fail on a zero divisor, a negative radicand or a bignum factorial */
+int sani_factorial(san_gc_t *gc, vm_object a, vm_object *result);
+int sani_mod(san_gc_t *gc, vm_object a, vm_object b, vm_object *result);
+int sani_sqrt(san_gc_t *gc, vm_object a, vm_object *result);
+
+/* Writes a in decimal */
+void sani_print(FILE *out, vm_object a);
+
+#endif
@@ -0,0 +1,417 @@
+#define _DEFAULT_SOURCE
+#include <limits.h>
+#include "jit.h"
+#include "natives.h"
+#include "verify.h"
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * Registers holding values, by position: a function's slots first, then
+ * its stack. rdi points to the arguments until the last is loaded, so it
+ * comes last. r11 is kept as scratch. rsi, the result pointer, is pushed
+ * on entry as its register holds a value.
+ */
+static const int JIT_REGS[SAN_JIT_REGISTERS] = { 0, 1, 2, 6, 8, 9, 10, 7 };
+
+#define RAX     0
+#define RDI     7
+#define R11     11
+
+/* Condition codes for jcc and setcc */
+#define CC_O    0x0
+#define CC_E    0x4
+#define CC_NE   0x5
+#define CC_L    0xC
+
+#define JIT_ABS     1
+#define JIT_SQUARE  2
+#define JIT_SUB     3
+#define JIT_EQ      4
+#define JIT_LT      5
+
+typedef struct {
+  int offset, target;
+} jit_patch_t;
+
+typedef struct {
+  const san_program_t *program;
+  const san_function_t *fn;
+  const san_bytecode_t *code;
+  int *depths;
+
+  san_vector_t out;
+  san_vector_t patches;
+  int *offsets;
+  int loop;
+  int overflow;
+} jit_state_t;
+
+static int native_template(const san_bytecode_t *code) {
+  const char *name;
+
+  if (code->opcode != SAN_BYTECODE_CALL_NATIVE && code->opcode != SAN_BYTECODE_CALL_NATIVE_I) return 0;
+  name = sann_nth(code->arg1.ref)->name;
+  if (strcmp(name, "abs") == 0) return JIT_ABS;
+  if (strcmp(name, "square") == 0) return JIT_SQUARE;
+  if (strcmp(name, "sub") == 0) return JIT_SUB;
+  if (strcmp(name, "eq") == 0) return JIT_EQ;
+  if (strcmp(name, "lt") == 0) return JIT_LT;
+  return 0;
+}
+
+static int is_supported(const jit_state_t *state, const san_bytecode_t *code) {
+  switch (code->opcode) {
+    case SAN_BYTECODE_PUSH:
+      /* Bignum literals are made on the heap, so they stay in the VM */
+      return code->arg1.type == SAN_BYTECODE_TYPE_NUMBER_LITERAL &&
+        *(int64_t*)sanv_nth(&state->program->numbers, code->arg1.ref) <= INT_MAX;
+    case SAN_BYTECODE_LOAD_SLOT:
+    case SAN_BYTECODE_STORE_SLOT:
+      return code->arg1.type == SAN_BYTECODE_TYPE_LOCAL;
+    case SAN_BYTECODE_TAILCALL:
+      return code->arg1.ref == state->fn - (const san_function_t*)state->program->functions.elems;
+    case SAN_BYTECODE_CALL_NATIVE:
+    case SAN_BYTECODE_CALL_NATIVE_I:
+      return native_template(code) != 0;
+    case SAN_BYTECODE_POP:
+    case SAN_BYTECODE_DUP:
+    case SAN_BYTECODE_PICK:
+    case SAN_BYTECODE_ROLL:
+    case SAN_BYTECODE_JUMP:
+    case SAN_BYTECODE_JUMP_IF_FALSE:
+    case SAN_BYTECODE_JUMP_IF_TRUE:
+    case SAN_BYTECODE_ADD:
+    case SAN_BYTECODE_MUL:
+    case SAN_BYTECODE_ADD_II:
+    case SAN_BYTECODE_MUL_II:
+    case SAN_BYTECODE_RET:
+      return 1;
+  }
+  return 0;
+}
+
+static void flow_to(unsigned int *assigned, int *worklist, int *pending, int pc, unsigned int mask) {
+  if ((assigned[pc] & mask) != assigned[pc]) {
+    int queued = 0;
+    assigned[pc] &= mask;
+    for (int i = 0; i < *pending; ++i) queued |= worklist[i] == pc;
+    if (!queued) worklist[(*pending)++] = pc;
+  }
+}
+
+/*
+ * Every value is an integer as long as no slot is loaded before it is
+ * stored on some path: parameters are stored on entry, the other slots
+ * start out nil. Finds the slots certainly stored at each instruction.
+ */
+static int check_slots(const jit_state_t *state) {
+  int length = state->fn->length, entry = state->fn->entry;
+  unsigned int *assigned;
+  int *worklist, pending = 0, result = SAN_OK;
+
+  if (length <= 0) return SAN_FAIL;
+  assigned = SAN_MALLOC(length * sizeof(unsigned int));
+  worklist = SAN_MALLOC(length * sizeof(int));
+  for (int pc = 0; pc < length; ++pc) assigned[pc] = ~0u;
+  flow_to(assigned, worklist, &pending, 0, (1u << state->fn->arity) - 1);
+
+  while (pending > 0) {
+    int pc = worklist[--pending];
+    const san_bytecode_t *code = &state->code[pc];
+    unsigned int mask = assigned[pc];
+
+    if (code->opcode == SAN_BYTECODE_STORE_SLOT) mask |= 1u << code->arg1.ref;
+    if (code->opcode == SAN_BYTECODE_JUMP || code->opcode == SAN_BYTECODE_JUMP_IF_FALSE ||
+        code->opcode == SAN_BYTECODE_JUMP_IF_TRUE) {
+      flow_to(assigned, worklist, &pending, code->arg1.ref - entry, mask);
+    }
+    if (code->opcode != SAN_BYTECODE_JUMP && code->opcode != SAN_BYTECODE_RET &&
+        code->opcode != SAN_BYTECODE_TAILCALL) {
+      flow_to(assigned, worklist, &pending, pc + 1, mask);
+    }
+  }
+
+  for (int pc = 0; pc < length; ++pc) {
+    const san_bytecode_t *code = &state->code[pc];
+    if (state->depths[pc] >= 0 && code->opcode == SAN_BYTECODE_LOAD_SLOT &&
+        !(assigned[pc] & (1u << code->arg1.ref))) {
+      result = SAN_FAIL;
+    }
+  }
+
+  SAN_FREE(assigned);
+  SAN_FREE(worklist);
+  return result;
+}
+
+/*
+ * x86-64 encoding. Values are C ints, so all arithmetic is on the 32-bit
+ * registers.
+ */
+static void emit_byte(jit_state_t *state, int byte) {
+  unsigned char b = byte;
+  sanv_push(&state->out, &b);
+}
+
+static void emit_int(jit_state_t *state, int n) {
+  for (int i = 0; i < 4; ++i) emit_byte(state, (unsigned int)n >> (8 * i));
+}
+
+static void emit_rex(jit_state_t *state, int reg, int rm) {
+  if (reg >= 8 || rm >= 8) emit_byte(state, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+/* An instruction with a register-direct ModRM, opcode being one or two bytes */
+static void emit_rr(jit_state_t *state, int opcode, int reg, int rm) {
+  emit_rex(state, reg, rm);
+  if (opcode > 0xFF) emit_byte(state, opcode >> 8);
+  emit_byte(state, opcode & 0xFF);
+  emit_byte(state, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emit_mov(jit_state_t *state, int dst, int src) {
+  if (dst != src) emit_rr(state, 0x89, src, dst);
+}
+
+static void emit_jump(jit_state_t *state, int cc, int target) {
+  jit_patch_t patch;
+
+  if (cc < 0) {
+    emit_byte(state, 0xE9);
+  } else {
+    emit_byte(state, 0x0F);
+    emit_byte(state, 0x80 | cc);
+  }
+  patch.offset = state->out.size;
+  patch.target = target;
+  sanv_push(&state->patches, &patch);
+  emit_int(state, 0);
+}
+
+/* Jumps to the overflow exit if the last operation overflowed */
+static void emit_overflow_check(jit_state_t *state) {
+  emit_jump(state, CC_O, -2);
+}
+
+/* dst = (dst cc src) */
+static void emit_compare(jit_state_t *state, int cc, int dst, int src) {
+  emit_rr(state, 0x39, src, dst);
+  emit_byte(state, 0x41);
+  emit_byte(state, 0x0F);
+  emit_byte(state, 0x90 | cc);
+  emit_byte(state, 0xC0 | (R11 & 7));
+  emit_rr(state, 0x0FB6, dst, R11);
+}
+
+static inline int reg_of(const jit_state_t *state, int position) {
+  return JIT_REGS[position];
+}
+
+static void emit_instruction(jit_state_t *state, int pc) {
+  const san_bytecode_t *code = &state->code[pc];
+  int nslots = state->fn->nslots;
+  int d = state->depths[pc];
+  int top = nslots + d - 1;
+  int target = code->arg1.ref - state->fn->entry;
+
+  switch (code->opcode) {
+    case SAN_BYTECODE_PUSH:
+      emit_rex(state, 0, reg_of(state, top + 1));
+      emit_byte(state, 0xB8 + (reg_of(state, top + 1) & 7));
+      emit_int(state, (int)*(int64_t*)sanv_nth(&state->program->numbers, code->arg1.ref));
+      break;
+    case SAN_BYTECODE_LOAD_SLOT:
+      emit_mov(state, reg_of(state, top + 1), reg_of(state, code->arg1.ref));
+      break;
+    case SAN_BYTECODE_STORE_SLOT:
+      emit_mov(state, reg_of(state, code->arg1.ref), reg_of(state, top));
+      break;
+    case SAN_BYTECODE_POP:
+      break;
+    case SAN_BYTECODE_DUP:
+      emit_mov(state, reg_of(state, top + 1), reg_of(state, top));
+      break;
+    case SAN_BYTECODE_PICK:
+      emit_mov(state, reg_of(state, top + 1), reg_of(state, top - code->arg1.ref));
+      break;
+    case SAN_BYTECODE_ROLL:
+      emit_mov(state, R11, reg_of(state, top - code->arg1.ref));
+      for (int p = top - code->arg1.ref; p < top; ++p) emit_mov(state, reg_of(state, p), reg_of(state, p + 1));
+      emit_mov(state, reg_of(state, top), R11);
+      break;
+    case SAN_BYTECODE_ADD:
+    case SAN_BYTECODE_ADD_II:
+      emit_rr(state, 0x01, reg_of(state, top), reg_of(state, top - 1));
+      emit_overflow_check(state);
+      break;
+    case SAN_BYTECODE_MUL:
+    case SAN_BYTECODE_MUL_II:
+      emit_rr(state, 0x0FAF, reg_of(state, top - 1), reg_of(state, top));
+      emit_overflow_check(state);
+      break;
+    case SAN_BYTECODE_CALL_NATIVE:
+    case SAN_BYTECODE_CALL_NATIVE_I:
+      switch (native_template(code)) {
+        case JIT_ABS:
+          /* r11 = -x; x = r11 if r11 >= 0 */
+          emit_mov(state, R11, reg_of(state, top));
+          emit_rr(state, 0xF7, 3, R11);
+          emit_overflow_check(state);
+          emit_rr(state, 0x0F49, reg_of(state, top), R11);
+          break;
+        case JIT_SQUARE:
+          emit_rr(state, 0x0FAF, reg_of(state, top), reg_of(state, top));
+          emit_overflow_check(state);
+          break;
+        case JIT_SUB:
+          emit_rr(state, 0x29, reg_of(state, top), reg_of(state, top - 1));
+          emit_overflow_check(state);
+          break;
+        case JIT_EQ:
+          emit_compare(state, CC_E, reg_of(state, top - 1), reg_of(state, top));
+          break;
+        case JIT_LT:
+          emit_compare(state, CC_L, reg_of(state, top - 1), reg_of(state, top));
+          break;
+      }
+      break;
+    case SAN_BYTECODE_JUMP:
+      emit_jump(state, -1, target);
+      break;
+    case SAN_BYTECODE_JUMP_IF_FALSE:
+    case SAN_BYTECODE_JUMP_IF_TRUE:
+      emit_rr(state, 0x85, reg_of(state, top), reg_of(state, top));
+      emit_jump(state, code->opcode == SAN_BYTECODE_JUMP_IF_FALSE ? CC_E : CC_NE, target);
+      break;
+    case SAN_BYTECODE_RET: {
+      /* pop r11; mov [r11], top; mov eax, 1; ret */
+      int reg = reg_of(state, top);
+      emit_byte(state, 0x41);
+      emit_byte(state, 0x58 | (R11 & 7));
+      emit_rex(state, reg, R11);
+      emit_byte(state, 0x89);
+      emit_byte(state, ((reg & 7) << 3) | (R11 & 7));
+      emit_byte(state, 0xB8 | RAX);
+      emit_int(state, 1);
+      emit_byte(state, 0xC3);
+      break;
+    }
+    case SAN_BYTECODE_TAILCALL: {
+      /* The arguments are above the slots, so moving them down in order is safe */
+      int first = top - code->arg2.ref + 1;
+      for (int i = 0; i < code->arg2.ref; ++i) emit_mov(state, reg_of(state, i), reg_of(state, first + i));
+      emit_jump(state, -1, -1);
+      break;
+    }
+  }
+}
+
+/* Saves rsi, then loads the arguments into the registers of their slots */
+static void emit_prologue(jit_state_t *state) {
+  emit_byte(state, 0x56);
+  for (int i = 0; i < state->fn->arity; ++i) {
+    int reg = reg_of(state, i);
+    emit_rex(state, reg, RDI);
+    emit_byte(state, 0x8B);
+    emit_byte(state, 0x40 | ((reg & 7) << 3) | RDI);
+    emit_byte(state, 4 * i);
+  }
+}
+
+static int install(jit_state_t *state, san_jit_code_t *code) {
+  long page = sysconf(_SC_PAGESIZE);
+  size_t size = (state->out.size + page - 1) / page * page;
+  void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (memory == MAP_FAILED) return SAN_FAIL;
+  memcpy(memory, state->out.elems, state->out.size);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return SAN_FAIL;
+  }
+
+  code->memory = memory;
+  code->size = size;
+  code->entry = (san_jit_fn)(size_t)memory;
+  return SAN_OK;
+}
+
+int sanj_compile(const san_program_t *program, int function, san_jit_code_t *code) {
+  jit_state_t state;
+  int result = SAN_OK;
+
+  memset(code, 0, sizeof *code);
+  memset(&state, 0, sizeof state);
+  state.program = program;
+  state.fn = sanv_nth(&program->functions, function);
+  state.code = sanv_nth(&program->bytecode, state.fn->entry);
+  if (!program->verified || state.fn->maxStack > SAN_JIT_REGISTERS) return SAN_FAIL;
+
+  for (int pc = 0; pc < state.fn->length; ++pc) {
+    if (!is_supported(&state, &state.code[pc])) return SAN_FAIL;
+  }
+
+  state.depths = SAN_MALLOC(state.fn->length * sizeof(int));
+  state.offsets = SAN_MALLOC(state.fn->length * sizeof(int));
+  if (sanc_depths(program, function, state.depths) != SAN_OK || check_slots(&state) != SAN_OK) {
+    SAN_FREE(state.depths);
+    SAN_FREE(state.offsets);
+    return SAN_FAIL;
+  }
+
+  sanv_create(&state.out, sizeof(unsigned char));
+  sanv_create(&state.patches, sizeof(jit_patch_t));
+  emit_prologue(&state);
+  state.loop = state.out.size;
+  for (int pc = 0; pc < state.fn->length; ++pc) {
+    state.offsets[pc] = state.out.size;
+    if (state.depths[pc] >= 0) emit_instruction(&state, pc);
+  }
+
+  /* pop r11; xor eax, eax; ret */
+  state.overflow = state.out.size;
+  emit_byte(&state, 0x41);
+  emit_byte(&state, 0x58 | (R11 & 7));
+  emit_rr(&state, 0x31, RAX, RAX);
+  emit_byte(&state, 0xC3);
+
+  /* Jumps are relative to the end of their displacement; -1 is the top, -2 the overflow exit */
+  SAN_VECTOR_FOR_EACH(state.patches, i, jit_patch_t, patch)
+    int to = patch->target == -1 ? state.loop : patch->target == -2 ? state.overflow : state.offsets[patch->target];
+    int rel = to - (patch->offset + 4);
+    memcpy((unsigned char*)state.out.elems + patch->offset, &rel, sizeof rel);
+  SAN_VECTOR_END_FOR_EACH
+
+  result = install(&state, code);
+  san_dbg("JIT %s: %d bytes\n", state.fn->name, state.out.size);
+
+  sanv_destroy(&state.out, sanv_nodestructor);
+  sanv_destroy(&state.patches, sanv_nodestructor);
+  SAN_FREE(state.depths);
+  SAN_FREE(state.offsets);
+  return result;
+}
+
+void sanj_free(san_jit_code_t *code) {
+  if (code->memory != NULL) munmap(code->memory, code->size);
+  memset(code, 0, sizeof *code);
+}
+
+#else
+
+int sanj_compile(const san_program_t *program, int function, san_jit_code_t *code) {
+  memset(code, 0, sizeof *code);
+  return SAN_FAIL;
+}
+
+void sanj_free(san_jit_code_t *code) {
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __SAN_JIT_H
+#define __SAN_JIT_H
+
+#include "bytecode.h"
+
+/*
+ * Baseline JIT
+ *
+ * Translates a whole function into x86-64 machine code, one template per
+ * instruction. The verifier fixes the stack depth at every instruction, so
+ * each slot and stack entry lives in its own machine register and values
+ * never touch memory. A self tail call becomes a jump back to the top.
+ *
+ * Only functions that work on integers alone are compiled: every value
+ * must come from a number literal, an integer operation or a parameter,
+ * slots must be stored before they are loaded, and natives must be ones
+ * with a template. Globals, lists and calls are left to the interpreter,
+ * as are functions needing more registers than there are. The VM checks
+ * that the arguments are integers that fit in a C int before entering
+ * compiled code. Arithmetic is on 32-bit registers; if any operation
+ * overflows, the compiled code returns 0 without a result, and since it
+ * has no side effects the VM interprets the call from the start instead.
+ *
+ * Code is written into mmap'ed pages that are made executable once
+ * written. On other architectures nothing is compiled.
+ */
+
+/* Calls or tail calls of a function before the VM compiles it */
+#define SAN_JIT_THRESHOLD 100
+
+/* Registers for a compiled function's slots and stack entries together */
+#define SAN_JIT_REGISTERS 8
+
+/* Returns 1 and sets result, or 0 if an operation overflowed */
+typedef int (*san_jit_fn)(const int *args, int *result);
+
+typedef struct {
+  san_jit_fn entry;
+  void *memory;
+  size_t size;
+} san_jit_code_t;
+
+int sanj_compile(const san_program_t *program, int function, san_jit_code_t *code);
+void sanj_free(san_jit_code_t *code);
+
+#endif
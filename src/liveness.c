@@ -0,0 +1,254 @@
+#include "liveness.h"
+#include "natives.h"
+#include "scope.h"
+
+typedef struct {
+  san_vector_t *removed;
+  int numRemoved;
+
+  /* Function definitions by number, and whether calling them is pure */
+  san_node_t **definitions;
+  int *pure;
+  int numFunctions;
+
+  /* References to each global and function, not counting recursion */
+  int *globals, *functions;
+  int numGlobals;
+} lv_state_t;
+
+static inline san_node_t *nth_child(const san_node_t *node, int n) {
+  return sanv_nth(&node->children, n);
+}
+
+static inline int is_definition(const san_node_t *node) {
+  return node->type == SAN_PARSER_VARIABLE_EXPRESSION;
+}
+
+static inline int is_function(const san_node_t *node) {
+  return is_definition(node) && nth_child(node, 0)->type == SAN_PARSER_FUNCTION_LVALUE;
+}
+
+/* Statements are wrapped in expression nodes */
+static san_node_t *statement_of(san_node_t *node) {
+  while (node->type == SAN_PARSER_EXPRESSION && node->children.size == 1) {
+    node = nth_child(node, 0);
+  }
+  return node;
+}
+
+static int max_function(const san_node_t *node) {
+  int max = is_function(node) ? node->slot : 0;
+  SAN_VECTOR_FOR_EACH(node->children, i, san_node_t, child)
+    int n = max_function(child);
+    if (n > max) max = n;
+  SAN_VECTOR_END_FOR_EACH
+  return max;
+}
+
+/*
+ * Counts references to globals and functions. The left-hand side of a
+ * definition is not a reference, and neither is a call a function makes to
+ * itself.
+ */
+static void count_uses(lv_state_t *state, san_node_t *node, int function) {
+  if (is_function(node)) {
+    state->definitions[node->slot] = node;
+    function = node->slot;
+  }
+  if (node->binding == SAN_BINDING_GLOBAL && !is_definition(node)) {
+    state->globals[node->slot]++;
+  } else if (node->binding == SAN_BINDING_FUNCTION && !is_definition(node) && node->slot != function) {
+    state->functions[node->slot]++;
+  }
+
+  for (int i = is_definition(node) ? 1 : 0; i < node->children.size; ++i) {
+    count_uses(state, nth_child(node, i), function);
+  }
+}
+
+/* Locals of nested functions are counted with their own function */
+static void count_locals(const san_node_t *node, int *uses) {
+  if (is_function(node)) return;
+  if (node->binding == SAN_BINDING_LOCAL && !is_definition(node)) uses[node->slot]++;
+
+  for (int i = is_definition(node) ? 1 : 0; i < node->children.size; ++i) {
+    count_locals(nth_child(node, i), uses);
+  }
+}
+
+/*
+ * Arithmetic counts as pure, as it does for common subexpressions, even
+ * though it fails at runtime on anything but integers.
+ */
+static int is_pure(const lv_state_t *state, const san_node_t *node) {
+  if (is_function(node)) return 1;
+  if (node->binding == SAN_BINDING_NATIVE && !(sann_nth(node->slot)->flags & SAN_NATIVE_PURE)) return 0;
+  if (node->binding == SAN_BINDING_FUNCTION && !is_definition(node) && !state->pure[node->slot]) return 0;
+
+  for (int i = is_definition(node) ? 1 : 0; i < node->children.size; ++i) {
+    if (!is_pure(state, nth_child(node, i))) return 0;
+  }
+  return 1;
+}
+
+/* Functions are pure until their body is shown to call something impure */
+static void find_pure(lv_state_t *state) {
+  int changed = 1;
+
+  for (int i = 0; i <= state->numFunctions; ++i) state->pure[i] = 1;
+  while (changed) {
+    changed = 0;
+    for (int i = 1; i <= state->numFunctions; ++i) {
+      const san_node_t *definition = state->definitions[i];
+      if (definition == NULL || !state->pure[i]) continue;
+      if (!is_pure(state, nth_child(definition, 1))) {
+        state->pure[i] = 0;
+        changed = 1;
+      }
+    }
+  }
+}
+
+static void report(lv_state_t *state, const char *what, const san_token_t *token) {
+  san_removal_t removal = { what, token->raw, token->line, token->column };
+
+  san_dbg("%d:%d: removed unused %s %s\n", token->line, token->column, what, token->raw);
+  if (state->removed != NULL) sanv_push(state->removed, &removal);
+  state->numRemoved++;
+}
+
+static void remove_child(san_node_t *node, int n) {
+  san_node_t *child = nth_child(node, n);
+  sanp_destroy(child);
+  memmove(child, child + 1, (node->children.size - n - 1) * sizeof(san_node_t));
+  node->children.size--;
+}
+
+/* let name = value becomes value */
+static void keep_value(san_node_t *definition) {
+  san_node_t value = *nth_child(definition, 1);
+  definition->children.size = 1;
+  sanp_destroy(definition);
+  *definition = value;
+}
+
+/*
+ * Returns 1 if a statement whose value is dropped can be removed. Outside
+ * functions every let is global, so locals may be NULL there.
+ */
+static int is_dead(lv_state_t *state, san_node_t *statement, const int *locals) {
+  const san_node_t *lvalue;
+  int uses;
+
+  if (!is_definition(statement)) {
+    if (!is_pure(state, statement)) return 0;
+    report(state, "expression", statement->token);
+    return 1;
+  }
+
+  lvalue = nth_child(statement, 0);
+  if (is_function(statement)) {
+    uses = state->functions[statement->slot];
+  } else if (statement->binding == SAN_BINDING_GLOBAL) {
+    uses = state->globals[statement->slot];
+  } else {
+    uses = locals[statement->slot];
+  }
+  if (uses > 0) return 0;
+
+  report(state, is_function(statement) ? "function" : "binding", lvalue->token);
+  if (is_function(statement) || is_pure(state, nth_child(statement, 1))) return 1;
+  keep_value(statement);
+  return 0;
+}
+
+static void sweep(lv_state_t *state, san_node_t *node, const int *locals);
+
+/*
+ * The values of all statements of the root are dropped, and of all but the
+ * last statement of a block.
+ */
+static void sweep_sequence(lv_state_t *state, san_node_t *node, const int *locals) {
+  int i = 0;
+
+  while (i < node->children.size) {
+    int isDropped = node->type == SAN_PARSER_ROOT || i < node->children.size - 1;
+    if (isDropped && is_dead(state, statement_of(nth_child(node, i)), locals)) {
+      remove_child(node, i);
+      continue;
+    }
+    sweep(state, nth_child(node, i), locals);
+    ++i;
+  }
+}
+
+static void sweep(lv_state_t *state, san_node_t *node, const int *locals) {
+  if (is_function(node)) {
+    san_node_t *body = nth_child(node, 1);
+    int *uses = SAN_CALLOC(node->nslots + 1, sizeof(int));
+    count_locals(body, uses);
+    sweep(state, body, uses);
+    SAN_FREE(uses);
+    return;
+  }
+
+  if (node->type == SAN_PARSER_ROOT || node->type == SAN_PARSER_BLOCK) {
+    sweep_sequence(state, node, locals);
+    return;
+  }
+
+  SAN_VECTOR_FOR_EACH(node->children, i, san_node_t, child)
+    sweep(state, child, locals);
+  SAN_VECTOR_END_FOR_EACH
+}
+
+/* Numbers the remaining functions in definition order again */
+static void number_functions(const san_node_t *node, int *numbers, int *next) {
+  if (is_function(node)) numbers[node->slot] = ++*next;
+  SAN_VECTOR_FOR_EACH(node->children, i, san_node_t, child)
+    number_functions(child, numbers, next);
+  SAN_VECTOR_END_FOR_EACH
+}
+
+static void renumber_functions(san_node_t *node, const int *numbers) {
+  if (node->binding == SAN_BINDING_FUNCTION) node->slot = numbers[node->slot];
+  SAN_VECTOR_FOR_EACH(node->children, i, san_node_t, child)
+    renumber_functions(child, numbers);
+  SAN_VECTOR_END_FOR_EACH
+}
+
+int sanl_eliminate(san_node_t *ast, san_vector_t *removed) {
+  lv_state_t state;
+  int numRemoved;
+
+  memset(&state, 0, sizeof state);
+  state.removed = removed;
+  state.numFunctions = max_function(ast);
+  state.numGlobals = ast->nslots;
+  state.definitions = SAN_MALLOC((state.numFunctions + 1) * sizeof(san_node_t*));
+  state.pure = SAN_MALLOC((state.numFunctions + 1) * sizeof(int));
+  state.functions = SAN_MALLOC((state.numFunctions + 1) * sizeof(int));
+  state.globals = SAN_MALLOC((state.numGlobals + 1) * sizeof(int));
+
+  do {
+    numRemoved = state.numRemoved;
+    memset(state.definitions, 0, (state.numFunctions + 1) * sizeof(san_node_t*));
+    memset(state.functions, 0, (state.numFunctions + 1) * sizeof(int));
+    memset(state.globals, 0, (state.numGlobals + 1) * sizeof(int));
+    count_uses(&state, ast, 0);
+    find_pure(&state);
+    sweep(&state, ast, NULL);
+  } while (state.numRemoved > numRemoved);
+
+  if (state.numRemoved > 0) {
+    int next = 0;
+    number_functions(ast, state.functions, &next);
+    renumber_functions(ast, state.functions);
+  }
+
+  SAN_FREE(state.definitions);
+  SAN_FREE(state.pure);
+  SAN_FREE(state.functions);
+  SAN_FREE(state.globals);
+  return SAN_OK;
+}
@@ -0,0 +1,33 @@
+#ifndef __SAN_LIVENESS_H
+#define __SAN_LIVENESS_H
+
+#include "parser.h"
+
+/*
+ * Dead binding elimination
+ *
+ * Runs between sans_resolve and sanb_generate and removes code whose value
+ * is never used and that has no effect: lets and function definitions that
+ * are never referenced, and statements whose value is dropped. An
+ * expression is pure unless it may call a native without SAN_NATIVE_PURE,
+ * like print, directly or through a user function. An unused let of an
+ * impure value keeps the value as a statement.
+ *
+ * Removing one binding can leave others unused, so the pass repeats until
+ * nothing changes. Functions are renumbered afterwards so that they stay in
+ * definition order.
+ */
+typedef struct {
+  /* "binding", "function" or "expression" */
+  const char *what;
+  const char *name;
+  int line, column;
+} san_removal_t;
+
+/*
+ * Appends what was removed to removed, which may be NULL. Removals are also
+ * printed with san_dbg.
+ */
+int sanl_eliminate(san_node_t *ast, san_vector_t *removed);
+
+#endif
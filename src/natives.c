@@ -0,0 +1,136 @@
+#include "natives.h"
+#include "vector.h"
+#include "integer.h"
+
+static san_vector_t registry;
+static int isInitialized = 0;
+
+/*
+ * Builtins
+ */
+static void print_object(FILE *out, vm_object const *obj) {
+  switch (vm_type(*obj)) {
+    case SAN_VM_INT:
+    case SAN_VM_BIGNUM: sani_print(out, *obj); break;
+    case SAN_VM_STRING:
+    case SAN_VM_SYMBOL: fprintf(out, "%s", vm_to_string(*obj)); break;
+    case SAN_VM_LIST:
+      fprintf(out, "(");
+      SAN_VECTOR_FOR_EACH(vm_to_list(*obj)->items, i, vm_object, item)
+        if (i > 0) fprintf(out, " ");
+        print_object(out, item);
+      SAN_VECTOR_END_FOR_EACH
+      fprintf(out, ")");
+      break;
+    default: fprintf(out, "nil"); break;
+  }
+}
+
+static int native_print(san_runtime_t *runtime, vm_object const *args, int nargs, vm_object *result) {
+  for (int i = 0; i < nargs; ++i) {
+    print_object(runtime->out, &args[i]);
+    fprintf(runtime->out, i + 1 < nargs ? " " : "\n");
+  }
+  *result = SAN_VM_NIL_OBJECT;
+  return SAN_OK;
+}
+
+#define INT_NATIVE(__name, __intfn) \
+  static int __name(san_runtime_t *runtime, vm_object const *args, int nargs, vm_object *result) { \
+    *result = __intfn(&runtime->gc, args[0]); \
+    return SAN_OK; \
+  }
+
+#define INT_PARTIAL_NATIVE(__name, __intfn) \
+  static int __name(san_runtime_t *runtime, vm_object const *args, int nargs, vm_object *result) { \
+    return __intfn(&runtime->gc, args[0], result); \
+  }
+
+INT_NATIVE(native_abs, sani_abs)
+INT_NATIVE(native_square, sani_square)
+INT_PARTIAL_NATIVE(native_sqrt, sani_sqrt)
+INT_PARTIAL_NATIVE(native_factorial, sani_factorial)
+
+static int native_sub(san_runtime_t *runtime, vm_object const *args, int nargs, vm_object *result) {
+  *result = sani_sub(&runtime->gc, args[0], args[1]);
+  return SAN_OK;
+}
+
+static int native_mod(san_runtime_t *runtime, vm_object const *args, int nargs, vm_object *result) {
+  return sani_mod(&runtime->gc, args[0], args[1], result);
+}
+
+static int native_eq(san_runtime_t *runtime, vm_object const *args, int nargs, vm_object *result) {
+  *result = vm_from_int(sani_compare(args[0], args[1]) == 0);
+  return SAN_OK;
+}
+
+static int native_lt(san_runtime_t *runtime, vm_object const *args, int nargs, vm_object *result) {
+  *result = vm_from_int(sani_compare(args[0], args[1]) < 0);
+  return SAN_OK;
+}
+
+/* Blocks for a number of milliseconds, which suspends a fiber rather than its thread */
+static int native_sleep(san_runtime_t *runtime, vm_object const *args, int nargs, vm_object *result) {
+  if (vm_type(args[0]) != SAN_VM_INT || vm_to_int(args[0]) < 0) return SAN_FAIL;
+  sanm_sleep(runtime, vm_to_int(args[0]) / 1000.0);
+  *result = SAN_VM_NIL_OBJECT;
+  return SAN_OK;
+}
+
+static void ensure_registry(void) {
+  if (isInitialized) return;
+  isInitialized = 1;
+  sanv_create(&registry, sizeof(san_native_t));
+
+  sann_register("print", SAN_NATIVE_VARIADIC, 0, native_print);
+  sann_register("abs", 1, SAN_NATIVE_PURE | SAN_NATIVE_INT, native_abs);
+  sann_register("square", 1, SAN_NATIVE_PURE | SAN_NATIVE_INT, native_square);
+  sann_register("sqrt", 1, SAN_NATIVE_PURE | SAN_NATIVE_INT, native_sqrt);
+  sann_register("factorial", 1, SAN_NATIVE_PURE | SAN_NATIVE_INT, native_factorial);
+  sann_register("sub", 2, SAN_NATIVE_PURE | SAN_NATIVE_INT, native_sub);
+  sann_register("mod", 2, SAN_NATIVE_PURE | SAN_NATIVE_INT, native_mod);
+  sann_register("eq", 2, SAN_NATIVE_PURE | SAN_NATIVE_INT, native_eq);
+  sann_register("lt", 2, SAN_NATIVE_PURE | SAN_NATIVE_INT, native_lt);
+  sann_register("sleep", 1, 0, native_sleep);
+}
+
+/*
+ * Registers a native function and returns its index. Registering a name that
+ * already exists replaces the previous definition in place, so programs
+ * compiled before the replacement call the new function.
+ */
+int sann_register(const char *name, int arity, int flags, san_native_fn fn) {
+  san_native_t native = { name, arity, flags, fn };
+  int index;
+
+  ensure_registry();
+
+  index = sann_lookup(name);
+  if (index >= 0) {
+    *(san_native_t*)sanv_nth(&registry, index) = native;
+    return index;
+  }
+
+  if (sanv_push(&registry, &native) != SAN_OK) return SAN_FAIL;
+  return registry.size - 1;
+}
+
+int sann_lookup(const char *name) {
+  ensure_registry();
+  SAN_VECTOR_FOR_EACH(registry, i, san_native_t, native)
+    if (strcmp(native->name, name) == 0) return i;
+  SAN_VECTOR_END_FOR_EACH
+  return -1;
+}
+
+san_native_t const *sann_nth(int index) {
+  ensure_registry();
+  if (index < 0 || index >= registry.size) return NULL;
+  return (san_native_t const*)sanv_nth(&registry, index);
+}
+
+int sann_count(void) {
+  ensure_registry();
+  return registry.size;
+}
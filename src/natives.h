@@ -0,0 +1,40 @@
+#ifndef __SAN_NATIVES_H
+#define __SAN_NATIVES_H
+
+#include "san.h"
+#include "vm.h"
+
+/*
+ * Native function registry
+ *
+ * Call targets are resolved against this table by the bytecode generator, so
+ * at runtime a call is a single indirect jump through san_native_t.fn.
+ * Embedders may add their own functions with sann_register before compiling.
+ */
+#define SAN_NATIVE_PURE       1
+
+/*
+ * Takes integers and returns an integer. The VM checks the arguments before
+ * the call unless type inference proved them to be integers, so the function
+ * itself need not.
+ */
+#define SAN_NATIVE_INT        2
+
+#define SAN_NATIVE_VARIADIC  -1
+
+/* Natives allocate any bignum they return from the runtime's heap */
+typedef int (*san_native_fn)(san_runtime_t *runtime, vm_object const *args, int nargs, vm_object *result);
+
+typedef struct {
+  const char *name;
+  int arity;
+  int flags;
+  san_native_fn fn;
+} san_native_t;
+
+int sann_register(const char *name, int arity, int flags, san_native_fn fn);
+int sann_lookup(const char *name);
+san_native_t const *sann_nth(int index);
+int sann_count(void);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef __SAN_OBJECT_H
+#define __SAN_OBJECT_H
+
+#include <stdint.h>
+#include "vector.h"
+
+/*
+ * Runtime values shared by the VM and native functions
+ */
+#define SAN_VM_NIL         0
+#define SAN_VM_INT         1
+#define SAN_VM_STRING      2
+#define SAN_VM_SYMBOL      3
+#define SAN_VM_LIST        4
+#define SAN_VM_BIGNUM      5
+
+typedef struct vm_list vm_list;
+typedef struct vm_bignum vm_bignum;
+
+/*
+ * A value is a single 64-bit word: its type in the top 16 bits and its
+ * payload, an integer or a pointer, in the 48 below. User-space pointers
+ * fit there on the platforms we run on. nil is the word 0, so checking a
+ * type or for nil is a shift and a compare.
+ */
+typedef uint64_t vm_object;
+
+#define SAN_VM_TYPE_SHIFT  48
+#define SAN_VM_PAYLOAD     ((UINT64_C(1) << SAN_VM_TYPE_SHIFT) - 1)
+#define SAN_VM_NIL_OBJECT  ((vm_object)0)
+
+static inline int vm_type(vm_object obj) {
+  return (int)(obj >> SAN_VM_TYPE_SHIFT);
+}
+
+static inline vm_object vm_tagged(int type, uint64_t payload) {
+  return ((uint64_t)type << SAN_VM_TYPE_SHIFT) | payload;
+}
+
+/*
+ * Integers in [SAN_VM_INT_MIN, SAN_VM_INT_MAX] are stored in the payload,
+ * sign-extended from 48 bits. Larger ones are bignums, see integer.h.
+ */
+#define SAN_VM_INT_MAX     ((INT64_C(1) << (SAN_VM_TYPE_SHIFT - 1)) - 1)
+#define SAN_VM_INT_MIN     (-SAN_VM_INT_MAX - 1)
+
+static inline int vm_fits_int(int64_t n) {
+  return n >= SAN_VM_INT_MIN && n <= SAN_VM_INT_MAX;
+}
+
+static inline vm_object vm_from_int(int64_t n) {
+  return vm_tagged(SAN_VM_INT, (uint64_t)n & SAN_VM_PAYLOAD);
+}
+
+static inline int64_t vm_to_int(vm_object obj) {
+  return (int64_t)(obj << (64 - SAN_VM_TYPE_SHIFT)) >> (64 - SAN_VM_TYPE_SHIFT);
+}
+
+static inline int vm_is_integer(vm_object obj) {
+  return vm_type(obj) == SAN_VM_INT || vm_type(obj) == SAN_VM_BIGNUM;
+}
+
+static inline vm_object vm_from_string(int type, const char *s) {
+  return vm_tagged(type, (uintptr_t)s);
+}
+
+static inline const char *vm_to_string(vm_object obj) {
+  return (const char*)(uintptr_t)(obj & SAN_VM_PAYLOAD);
+}
+
+static inline vm_object vm_from_list(vm_list *list) {
+  return vm_tagged(SAN_VM_LIST, (uintptr_t)list);
+}
+
+static inline vm_list *vm_to_list(vm_object obj) {
+  return (vm_list*)(uintptr_t)(obj & SAN_VM_PAYLOAD);
+}
+
+static inline vm_object vm_from_bignum(vm_bignum *bignum) {
+  return vm_tagged(SAN_VM_BIGNUM, (uintptr_t)bignum);
+}
+
+static inline vm_bignum *vm_to_bignum(vm_object obj) {
+  return (vm_bignum*)(uintptr_t)(obj & SAN_VM_PAYLOAD);
+}
+
+/*
+ * Lists are owned by the VM's garbage collector, or by their frame until it
+ * returns if escape analysis proved they can't outlive it. forward and
+ * flags belong to the collector.
+ */
+#define SAN_VM_LIST_OLD         1
+#define SAN_VM_LIST_REMEMBERED  2
+#define SAN_VM_LIST_MARKED      4
+
+struct vm_list {
+  san_vector_t items;
+  vm_list *forward;
+  int flags;
+};
+
+/*
+ * The magnitude of a bignum is size 32-bit limbs, least significant first,
+ * with the last one non-zero; sign is 1 or -1. Bignums never fit in a small
+ * integer, are immutable and are owned by the garbage collector.
+ */
+#define SAN_VM_BIGNUM_MARKED    1
+
+struct vm_bignum {
+  int sign;
+  int size;
+  int flags;
+  uint32_t limbs[];
+};
+
+#endif
@@ -60,14 +60,32 @@ static inline int head_len(parser_state_t const *state) {
   return strlen(state->tokenPtr->raw);
 }
 
+static inline int indent_depth(parser_state_t const *state) {
+  return state->indentStack.size > 0 ? sanv_back_int(&state->indentStack) : 0;
+}
+
+/*
+ * Indentation is only skipped as white space when it is deeper than the
+ * enclosing block, so a line at block depth always ends the expression before
+ * it. Lines starting at column one carry an empty indentation token, which
+ * makes them end top-level expressions the same way.
+ */
 static inline parser_state_t eat_wspace(parser_state_t const *state) {
   parser_state_t newState = *state;
   while (head_is(&newState, SAN_TOKEN_WHITE_SPACE) ||
-    (!state->indentSensitive && head_is(&newState, SAN_TOKEN_INDENTATION)))
+    (!state->indentSensitive && head_is(&newState, SAN_TOKEN_INDENTATION) &&
+     head_len(&newState) > indent_depth(state)))
     newState.tokenPtr += 1;
   return newState;
 }
 
+static inline int is_keyword(const char *raw) {
+  return strcmp(raw, SAN_KEYWORD_LET) == 0 ||
+    strcmp(raw, SAN_KEYWORD_IF) == 0 ||
+    strcmp(raw, SAN_KEYWORD_THEN) == 0 ||
+    strcmp(raw, SAN_KEYWORD_ELSE) == 0;
+}
+
 static inline parser_state_t create_state() {
   parser_state_t state;
   sanv_create(&state.nodeStack, sizeof(san_node_t));
@@ -96,13 +114,19 @@ void rawTokens(parser_state_t const *s1, parser_state_t const *s2, char *out, si
   san_token_t const *curTok = s1->tokenPtr;
   int tokenIndex = 0, i;
   for (i = 0; i < max-1; ++i) {
+    /* Skip empty tokens, such as the indentation of a line at column one */
+    while (curTok->raw[0] == '\0' && curTok->type != SAN_TOKEN_END) ++curTok;
+    if (curTok->type == SAN_TOKEN_END) {
+      out[i] = '\0';
+      return;
+    }
     if (curTok == s2->tokenPtr) {
       if (tokenIndex == s2->tokenPtr->rawSize) {
         break;
       }
     }
     out[i] = curTok->raw[tokenIndex++];
-    if (tokenIndex > strlen(curTok->raw)-1) {
+    if (tokenIndex >= strlen(curTok->raw)) {
       tokenIndex = 0;
       ++curTok;
       if (curTok->type == SAN_TOKEN_END) break;
@@ -119,6 +143,7 @@ static inline parser_state_t advance_state(parser_state_t *state) {
 
 static int push_node(parser_state_t *state, int type) {
   san_node_t node;
+  memset(&node, 0, sizeof(san_node_t));
   node.type = type;
 
   parser_state_t noWhitespace = eat_wspace(state);
@@ -170,9 +195,7 @@ void add_child(parser_state_t *state, int nodeIndex) {
 }
 
 san_node_t clone_node(const san_node_t *node) {
-  san_node_t newNode;
-  newNode.type = node->type;
-  newNode.token = node->token;
+  san_node_t newNode = *node;
   sanv_create(&newNode.children, sizeof(san_node_t));
   SAN_VECTOR_FOR_EACH(node->children, i, san_node_t, child)
     san_node_t newChild = clone_node(child);
@@ -205,10 +228,6 @@ static inline parser_state_t clone_state(parser_state_t const *state) {
 /*
  * Indentation
  */
-static inline int indent_depth(parser_state_t *state) {
-  return state->indentStack.size > 0 ? sanv_back_int(&state->indentStack) : 0;
-}
-
 static int push_indent(parser_state_t *state) {
   int depth = 0;
   parser_state_t s1 = eat_wspace(state);
@@ -247,10 +266,17 @@ match:
   return SAN_MATCH;
 
 nomatch:
-  destroy_state(newState);
   return SAN_NO_MATCH;
 }
 
+static int parse_identifier(parser_state_t const *state, parser_state_t *newState) {
+  parser_state_t s1 = eat_wspace(state);
+  if (head_is(&s1, SAN_TOKEN_IDENTIFIER_OR_KEYWORD) && is_keyword(s1.tokenPtr->raw)) {
+    return SAN_NO_MATCH;
+  }
+  return parse_terminal(state, newState, SAN_TOKEN_IDENTIFIER_OR_KEYWORD);
+}
+
 static inline int parse_keyword(
   parser_state_t const *state,
   parser_state_t *newState,
@@ -269,7 +295,6 @@ match:
   return SAN_MATCH;
 
 nomatch:
-  destroy_state(newState);
   return SAN_NO_MATCH;
 }
 
@@ -313,6 +338,11 @@ nomatch:
   return SAN_NO_MATCH;
 }
 
+int parse_paren_list(parser_state_t *state, parser_state_t *newState);
+
+/*
+ * primary = number | string | identifier | '(' exp ')' ;
+ */
 int parse_primary_exp(parser_state_t const *state, parser_state_t *newState) {
   san_dbg("Parsing primary expression\n");
   *newState = clone_state(state);
@@ -320,11 +350,12 @@ int parse_primary_exp(parser_state_t const *state, parser_state_t *newState) {
   parser_state_t s1;
 
   if (parse_number_literal(newState, &s1) != SAN_NO_MATCH ||
-      parse_string_literal(newState, &s1) != SAN_NO_MATCH) {
+      parse_string_literal(newState, &s1) != SAN_NO_MATCH ||
+      parse_paren_list(newState, &s1) != SAN_NO_MATCH) {
     add_child(&s1, nodeIndex);
     *newState = s1;
     goto match;
-  } else if (parse_terminal(newState, &s1, SAN_TOKEN_IDENTIFIER_OR_KEYWORD) != SAN_NO_MATCH) {
+  } else if (parse_identifier(newState, &s1) != SAN_NO_MATCH) {
     *newState = s1;
     goto match;
   }
@@ -411,7 +442,7 @@ int parse_func_param(parser_state_t *state, parser_state_t *newState) {
   *newState = clone_state(state);
   push_node(newState, SAN_PARSER_FUNCTION_PARAMETER);
 
-  if (parse_terminal(newState, newState, SAN_TOKEN_IDENTIFIER_OR_KEYWORD) != SAN_NO_MATCH) {
+  if (parse_identifier(newState, newState) != SAN_NO_MATCH) {
     goto match;
   }
 
@@ -458,7 +489,7 @@ int parse_var_lvalue(parser_state_t *state, parser_state_t *newState) {
   push_node(newState, SAN_PARSER_VARIABLE_LVALUE);
   int result = SAN_NO_MATCH;
 
-  if (parse_terminal(newState, newState, SAN_TOKEN_IDENTIFIER_OR_KEYWORD) != SAN_NO_MATCH) {
+  if (parse_identifier(newState, newState) != SAN_NO_MATCH) {
     result = SAN_MATCH;
   }
 
@@ -486,7 +517,7 @@ static int parse_func_lvalue(parser_state_t *state, parser_state_t *newState) {
 
   newState->indentSensitive = 0;
 
-  if (parse_terminal(newState, newState, SAN_TOKEN_IDENTIFIER_OR_KEYWORD) != SAN_NO_MATCH) {
+  if (parse_identifier(newState, newState) != SAN_NO_MATCH) {
     if (parse_func_param_list(newState, &s1) != SAN_NO_MATCH) {
       add_child(&s1, nodeIndex);
       *newState = s1;
@@ -617,9 +648,34 @@ nomatch:
 }
 
 /*
- * if_exp = 'if' exp 'then' exp
- *        | 'if' exp block
+ * An else may start a line of its own at the depth of its if.
+ */
+static int parse_else(parser_state_t *state, parser_state_t *newState, int nodeIndex) {
+  parser_state_t s1 = eat_wspace(state), s2;
+
+  if (head_is(&s1, SAN_TOKEN_INDENTATION) && head_len(&s1) == indent_depth(state)) {
+    s1 = advance_state(&s1);
+  }
+  if (parse_keyword(&s1, &s2, SAN_KEYWORD_ELSE) == SAN_NO_MATCH) {
+    return SAN_NO_MATCH;
+  }
+
+  if (parse_exp(&s2, newState) != SAN_NO_MATCH ||
+      parse_block(&s2, newState) != SAN_NO_MATCH) {
+    add_child(newState, nodeIndex);
+    return SAN_MATCH;
+  }
+
+  parseError0(state, &s2, SAN_ERROR_EXPECTED_EXPRESSION);
+  *newState = s2;
+  return SAN_MATCH;
+}
+
+/*
+ * if_exp = 'if' exp 'then' exp [ else ]
+ *        | 'if' exp block [ else ]
  *        ;
+ * else   = 'else' ( exp | block ) ;
  */
 int parse_if_exp(parser_state_t *state, parser_state_t *newState) {
   san_dbg("Parsing if expression\n");
@@ -633,12 +689,12 @@ int parse_if_exp(parser_state_t *state, parser_state_t *newState) {
         if (parse_exp(&s3, &s4) != SAN_NO_MATCH) {
           add_child(&s4, nodeIndex);
           *newState = s4;
-          goto match;
+          goto branches;
         }
       } else if(parse_block(&s2, &s3) != SAN_NO_MATCH) {
         add_child(&s3, nodeIndex);
         *newState = s3;
-        goto match;
+        goto branches;
       } else {
         parseError0(state, &s2, SAN_ERROR_EXPECTED_BLOCK);
         goto errmatch;
@@ -650,8 +706,12 @@ int parse_if_exp(parser_state_t *state, parser_state_t *newState) {
   }
   goto nomatch;
 
+branches:
+  if (parse_else(newState, &s1, nodeIndex) != SAN_NO_MATCH) {
+    *newState = s1;
+  }
+
 errmatch:
-match:
   return SAN_MATCH;
 
 nomatch:
@@ -690,29 +750,19 @@ int parse_list(parser_state_t *state, parser_state_t *newState) {
   *newState = clone_state(state);
   int nodeIndex = push_node(newState, SAN_PARSER_LIST);
   int result = SAN_NO_MATCH;
-  parser_state_t s1, s2, s3;
+  parser_state_t s1, s2;
 
-  if (parse_terminal(newState, &s1, SAN_TOKEN_LPAREN) != SAN_NO_MATCH) {
-    if (parse_exp(&s1, &s2) != SAN_NO_MATCH) {
-      add_child(&s2, nodeIndex);
-      if (parse_terminal(&s2, &s3, SAN_TOKEN_RPAREN) != SAN_NO_MATCH) {
-        *newState = s3;
-        return SAN_MATCH;
-      }
-    }
-  } else {
-    int nChildren = 0; // Unparenthesised lists must have > 1 child
-    s1 = *newState;
-    while ((parse_additive_exp(&s1, &s2) != SAN_NO_MATCH) ||
-           (parse_paren_list(&s1, &s2) != SAN_NO_MATCH)) {
-      s1 = s2;
-      add_child(&s1, nodeIndex);
-      ++nChildren;
+  /* A parenthesised list is a primary expression */
+  int nChildren = 0; // Unparenthesised lists must have > 1 child
+  s1 = *newState;
+  while (parse_additive_exp(&s1, &s2) != SAN_NO_MATCH) {
+    s1 = s2;
+    add_child(&s1, nodeIndex);
+    ++nChildren;
 
-      if (nChildren > 1) {
-        *newState = s1;
-        result = SAN_MATCH;
-      }
+    if (nChildren > 1) {
+      *newState = s1;
+      result = SAN_MATCH;
     }
   }
 
@@ -739,13 +789,18 @@ int parse_fn_exp(parser_state_t *state, parser_state_t *newState) {
 
   if (parse_var_lvalue(newState, &s1) != SAN_NO_MATCH) {
     add_child(&s1, nodeIndex);
-    result = SAN_MATCH;
 
+    /*
+     * A name without arguments is a primary expression, not a call. An if
+     * takes the rest of the line, so it can only be the last argument.
+     */
     while (parse_fn_exp(&s1, &s2) != SAN_NO_MATCH ||
-           parse_additive_exp(&s1, &s2) != SAN_NO_MATCH) {
+           parse_additive_exp(&s1, &s2) != SAN_NO_MATCH ||
+           parse_if_exp(&s1, &s2) != SAN_NO_MATCH) {
         add_child(&s2, nodeIndex);
         s1 = s2;
         *newState = s2;
+        result = SAN_MATCH;
     }
   }
 
@@ -772,8 +827,7 @@ int parse_pipe_exp(parser_state_t *state, parser_state_t *newState) {
 
   if ((parse_fn_exp(newState, &s1) != SAN_NO_MATCH) ||
       (parse_list(newState, &s1) != SAN_NO_MATCH) ||
-      (parse_additive_exp(newState, &s1) != SAN_NO_MATCH) ||
-      (parse_exp(newState, &s1) != SAN_NO_MATCH)) {
+      (parse_additive_exp(newState, &s1) != SAN_NO_MATCH)) {
     add_child(&s1, nodeIndex);
 
     while (parse_terminal(&s1, &s2, SAN_TOKEN_PIPE) != SAN_NO_MATCH) {
@@ -861,12 +915,19 @@ int sanp_parse(san_vector_t const *tokens, san_node_t *ast, san_vector_t *errors
   state.indentSensitive = 1;
 
   int firstIndex = push_node(&state, SAN_PARSER_ROOT);
-  parser_state_t s1;
-  if (parse_exp(&state, &s1) != SAN_NO_MATCH) {
+  parser_state_t s1 = eat_wspace(&state);
+  if (head_is(&s1, SAN_TOKEN_INDENTATION) && head_len(&s1) == 0) {
+    state = advance_state(&s1);
+  }
+
+  /* Top-level expressions are separated by lines starting at column one */
+  while (parse_exp(&state, &s1) != SAN_NO_MATCH) {
     add_child(&s1, firstIndex);
-    state = s1;
-  } else {}
-  *ast = *(san_node_t*)sanv_nth(&state.nodeStack, firstIndex);
+    state = eat_wspace(&s1);
+    if (!head_is(&state, SAN_TOKEN_INDENTATION) || head_len(&state) != 0) break;
+    state = advance_state(&state);
+  }
+  sanv_pop(&state.nodeStack, ast);
 
   dump_ast(ast, 0);
   destroy_state(&state);
@@ -874,6 +935,23 @@ int sanp_parse(san_vector_t const *tokens, san_node_t *ast, san_vector_t *errors
   return SAN_OK;
 }
 
+/*
+ * Returns the identifier if the node is nothing but a name, looking through
+ * the single-child expressions that wrap it, and NULL otherwise.
+ */
+san_node_t *sanp_bare_name(san_node_t const *node) {
+  while (node->children.size == 1 &&
+    (node->type == SAN_PARSER_EXPRESSION ||
+     node->type == SAN_PARSER_ADDITIVE_EXPRESSION ||
+     node->type == SAN_PARSER_MULTIPLICATIVE_EXPRESSION)) {
+    node = sanv_nth(&node->children, 0);
+  }
+  if (node->type == SAN_PARSER_PRIMARY_EXPRESSION && node->children.size == 0) {
+    return (san_node_t*)node;
+  }
+  return NULL;
+}
+
 int sanp_destroy(san_node_t *ptr) {
   sanv_destroy(&ptr->children, sanp_destructor);
   return SAN_OK;
@@ -30,14 +30,19 @@
 #define SAN_KEYWORD_LET                       "let"
 #define SAN_KEYWORD_IF                        "if"
 #define SAN_KEYWORD_THEN                      "then"
+#define SAN_KEYWORD_ELSE                      "else"
 
 typedef struct {
   int type;
   san_token_t const *token;
   san_vector_t children;
+
+  /* Filled in by the scope pass, see scope.h */
+  int binding, slot, nslots;
 } san_node_t;
 
 int sanp_parse(san_vector_t const* tokens, san_node_t *ast, san_vector_t *errors);
 int sanp_destroy(san_node_t *ptr);
+san_node_t *sanp_bare_name(san_node_t const *node);
 
 #endif
@@ -0,0 +1,181 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+#include "pool.h"
+
+typedef struct {
+  san_task_fn fn;
+  void *arg;
+  san_batch_t *batch;
+} san_task_t;
+
+typedef struct {
+  san_pool_t *pool;
+  int index;
+} san_worker_t;
+
+/* The newest task of the worker's own deque */
+static int take_own(san_deque_t *deque, san_task_t *task) {
+  int taken = 0;
+  pthread_mutex_lock(&deque->lock);
+  if ((int)deque->tasks.size > deque->head) {
+    sanv_pop(&deque->tasks, task);
+    taken = 1;
+  }
+  if ((int)deque->tasks.size == deque->head) deque->tasks.size = deque->head = 0;
+  pthread_mutex_unlock(&deque->lock);
+  return taken;
+}
+
+/* The oldest task of another deque */
+static int steal(san_deque_t *deque, san_task_t *task) {
+  int taken = 0;
+  pthread_mutex_lock(&deque->lock);
+  if ((int)deque->tasks.size > deque->head) {
+    *task = *(san_task_t*)sanv_nth(&deque->tasks, deque->head++);
+    taken = 1;
+  }
+  if ((int)deque->tasks.size == deque->head) deque->tasks.size = deque->head = 0;
+  pthread_mutex_unlock(&deque->lock);
+  return taken;
+}
+
+/* Finds a task for worker self, or for a thread outside the pool if self is -1 */
+static int take(san_pool_t *pool, int self, san_task_t *task) {
+  if (self >= 0 && take_own(&pool->deques[self], task)) goto taken;
+  for (int i = 1; i <= pool->nworkers; ++i) {
+    int victim = (self + i) % pool->nworkers;
+    if (victim != self && steal(&pool->deques[victim], task)) goto taken;
+  }
+  return 0;
+
+taken:
+  __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  return 1;
+}
+
+static void run(san_pool_t *pool, san_task_t *task) {
+  task->fn(task->arg);
+  if (__atomic_sub_fetch(&task->batch->remaining, 1, __ATOMIC_SEQ_CST) == 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void *work(void *ptr) {
+  san_worker_t *worker = ptr;
+  san_pool_t *pool = worker->pool;
+  san_task_t task;
+
+  for (;;) {
+    if (take(pool, worker->index, &task)) {
+      run(pool, &task);
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 && !pool->stopping) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->stopping && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  SAN_FREE(worker);
+  return NULL;
+}
+
+int sanw_create(san_pool_t *pool, int nworkers) {
+  memset(pool, 0, sizeof *pool);
+  if (nworkers <= 0) nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nworkers <= 0) nworkers = 1;
+
+  pool->threads = SAN_CALLOC(nworkers, sizeof(pthread_t));
+  pool->deques = SAN_CALLOC(nworkers, sizeof(san_deque_t));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  for (int i = 0; i < nworkers; ++i) {
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+    sanv_create(&pool->deques[i].tasks, sizeof(san_task_t));
+  }
+  pool->nworkers = nworkers;
+  return SAN_OK;
+}
+
+/*
+ * With the lock held. Workers steal from every deque, and waiting threads
+ * run tasks too, so the pool works if fewer start, or none.
+ */
+static void start_workers(san_pool_t *pool) {
+  for (; pool->nthreads < pool->nworkers; ++pool->nthreads) {
+    san_worker_t *worker = SAN_MALLOC(sizeof(san_worker_t));
+    worker->pool = pool;
+    worker->index = pool->nthreads;
+    if (pthread_create(&pool->threads[pool->nthreads], NULL, work, worker) != 0) {
+      SAN_FREE(worker);
+      break;
+    }
+  }
+}
+
+void sanw_destroy(san_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->nthreads; ++i) pthread_join(pool->threads[i], NULL);
+
+  for (int i = 0; i < pool->nworkers; ++i) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    sanv_destroy(&pool->deques[i].tasks, sanv_nodestructor);
+  }
+  SAN_FREE(pool->deques);
+  SAN_FREE(pool->threads);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->finished);
+}
+
+void sanw_submit(san_pool_t *pool, san_batch_t *batch, san_task_fn fn, void *arg) {
+  san_task_t task = { fn, arg, batch };
+  san_deque_t *deque;
+
+  __atomic_add_fetch(&batch->remaining, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&pool->lock);
+  if (!pool->started) {
+    pool->started = 1;
+    start_workers(pool);
+  }
+  deque = &pool->deques[pool->next];
+  pool->next = (pool->next + 1) % pool->nworkers;
+  pthread_mutex_unlock(&pool->lock);
+
+  pthread_mutex_lock(&deque->lock);
+  sanv_push(&deque->tasks, &task);
+  pthread_mutex_unlock(&deque->lock);
+
+  pthread_mutex_lock(&pool->lock);
+  __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void sanw_wait(san_pool_t *pool, san_batch_t *batch) {
+  san_task_t task;
+
+  while (__atomic_load_n(&batch->remaining, __ATOMIC_SEQ_CST) > 0) {
+    if (take(pool, -1, &task)) {
+      run(pool, &task);
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&batch->remaining, __ATOMIC_SEQ_CST) > 0 &&
+           __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0) {
+      pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
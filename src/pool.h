@@ -0,0 +1,57 @@
+#ifndef __SAN_POOL_H
+#define __SAN_POOL_H
+
+#include <pthread.h>
+#include "vector.h"
+
+/*
+ * Work-stealing thread pool
+ *
+ * Each worker has a deque of tasks. Submitted tasks are dealt out to the
+ * deques in turn; a worker takes the newest task from its own deque and,
+ * once that is empty, steals the oldest from another's. Idle workers sleep
+ * until something is submitted. The workers only start with the first
+ * task, so a pool that is never given one costs no threads.
+ *
+ * A batch counts the tasks submitted with it that have not finished yet.
+ * Waiting for a batch runs queued tasks on the waiting thread too, so it
+ * never just blocks while there is work, and then sleeps until the last
+ * of them finishes elsewhere.
+ */
+
+typedef void (*san_task_fn)(void *arg);
+
+typedef struct {
+  int remaining;
+} san_batch_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  san_vector_t tasks;   /* san_task_t, the oldest from head */
+  int head;
+} san_deque_t;
+
+typedef struct {
+  int nworkers;
+  int nthreads;         /* workers started, which may be fewer */
+  int started;          /* whether they have been, with the first task */
+  pthread_t *threads;
+  san_deque_t *deques;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t finished; /* signalled as a batch's last task finishes */
+  int queued;           /* tasks in the deques */
+  int next;             /* deque the next task is dealt to */
+  int stopping;
+} san_pool_t;
+
+/* Readies nworkers threads, or one per online processor if it is 0 */
+int sanw_create(san_pool_t *pool, int nworkers);
+
+/* Stops and joins the workers once the deques are empty */
+void sanw_destroy(san_pool_t *pool);
+
+void sanw_submit(san_pool_t *pool, san_batch_t *batch, san_task_fn fn, void *arg);
+void sanw_wait(san_pool_t *pool, san_batch_t *batch);
+
+#endif
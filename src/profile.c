@@ -0,0 +1,303 @@
+#define _DEFAULT_SOURCE
+#include <sys/time.h>
+#include "profile.h"
+#include "vm.h"
+
+static san_profile_t *volatile sampling;
+static struct sigaction previous;
+
+static void on_sigprof(int sig) {
+  san_profile_t *profile = sampling;
+  if (profile != NULL) profile->due = 1;
+}
+
+void sanr_create(san_profile_t *profile) {
+  memset(profile, 0, sizeof *profile);
+  sanv_create(&profile->samples, sizeof(int));
+  profile->ngrams = SAN_CALLOC(SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES, sizeof(int64_t));
+  profile->last = sanr_cycles();
+  profile->pc = -2;
+}
+
+void sanr_destroy(san_profile_t *profile) {
+  sanv_destroy(&profile->samples, sanv_nodestructor);
+  SAN_FREE(profile->ngrams);
+}
+
+int sanr_start(san_profile_t *profile, int hz) {
+  struct sigaction action;
+  struct itimerval timer;
+
+  if (sampling != NULL || hz <= 0) return SAN_FAIL;
+  memset(&action, 0, sizeof action);
+  action.sa_handler = on_sigprof;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &previous) != 0) return SAN_FAIL;
+
+  sampling = profile;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = hz > 1000000 ? 1 : 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+    sampling = NULL;
+    sigaction(SIGPROF, &previous, NULL);
+    return SAN_FAIL;
+  }
+  return SAN_OK;
+}
+
+void sanr_stop(san_profile_t *profile) {
+  struct itimerval off;
+
+  if (sampling != profile) return;
+  memset(&off, 0, sizeof off);
+  setitimer(ITIMER_PROF, &off, NULL);
+  sigaction(SIGPROF, &previous, NULL);
+  sampling = NULL;
+}
+
+void sanr_sample(san_profile_t *profile, const int *pcs, int depth) {
+  sanv_push_int(&profile->samples, depth);
+  for (int i = 0; i < depth; ++i) sanv_push_int(&profile->samples, pcs[i]);
+  profile->nsamples++;
+}
+
+/*
+ * The samples taken on a line of a function: self counts those taken
+ * there, total those with the line anywhere on their stack.
+ */
+typedef struct {
+  int function, line;
+  int self, total;
+  int lastSample;       /* the sample total was last counted for */
+} profile_line_t;
+
+static void locate(const san_program_t *program, int pc, int *function, int *line) {
+  int column;
+
+  *function = 0;
+  SAN_VECTOR_FOR_EACH(program->functions, i, san_function_t, fn)
+    if (pc >= fn->entry && pc < fn->entry + fn->length) *function = i;
+  SAN_VECTOR_END_FOR_EACH
+  sanb_position(program, pc, line, &column);
+}
+
+static const char *function_name(const san_program_t *program, int function) {
+  return ((const san_function_t*)sanv_nth(&program->functions, function))->name;
+}
+
+/* The profile whose opcodes are being sorted, by cycles */
+static const san_profile_t *sorting;
+
+static int compare_opcodes(const void *a, const void *b) {
+  uint64_t x = sorting->cycles[*(const int*)a], y = sorting->cycles[*(const int*)b];
+  return x < y ? 1 : x > y ? -1 : *(const int*)a - *(const int*)b;
+}
+
+static int compare_lines(const void *a, const void *b) {
+  const profile_line_t *x = a, *y = b;
+  if (x->self != y->self) return y->self - x->self;
+  if (x->total != y->total) return y->total - x->total;
+  return x->function != y->function ? x->function - y->function : x->line - y->line;
+}
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void report_opcodes(const san_profile_t *profile, FILE *out) {
+  int opcodes[SAN_PROFILE_OPCODES], n = 0;
+  int64_t count = 0;
+  uint64_t cycles = 0;
+
+  for (int op = 1; op < SAN_PROFILE_OPCODES; ++op) {
+    if (profile->counts[op] == 0) continue;
+    opcodes[n++] = op;
+    count += profile->counts[op];
+    cycles += profile->cycles[op];
+  }
+  sorting = profile;
+  qsort(opcodes, n, sizeof(int), compare_opcodes);
+
+  fprintf(out, "%-16s %14s %16s %10s %7s\n", "Opcode", "Count", "Cycles", "Cycles/op", "%");
+  for (int i = 0; i < n; ++i) {
+    int op = opcodes[i];
+    fprintf(out, "%-16s %14lld %16llu %10.1f %6.2f%%\n",
+      sanb_opcode_name(op),
+      (long long)profile->counts[op], (unsigned long long)profile->cycles[op],
+      (double)profile->cycles[op] / profile->counts[op],
+      cycles > 0 ? 100.0 * profile->cycles[op] / cycles : 0.0);
+  }
+  fprintf(out, "%-16s %14lld %16llu %10.1f\n", "Total", (long long)count, (unsigned long long)cycles,
+    count > 0 ? (double)cycles / count : 0.0);
+  fprintf(out, "%-16s %14lld\n", "Dispatches", (long long)profile->dispatches);
+}
+
+static void report_lines(const san_profile_t *profile, const san_program_t *program, FILE *out) {
+  san_vector_t lines;
+  int at = 0;
+
+  sanv_create(&lines, sizeof(profile_line_t));
+  for (int sample = 0; sample < profile->nsamples; ++sample) {
+    int depth = *(int*)sanv_nth(&profile->samples, at++);
+    for (int i = 0; i < depth; ++i) {
+      profile_line_t *found = NULL;
+      int function, line;
+      locate(program, *(int*)sanv_nth(&profile->samples, at++), &function, &line);
+
+      SAN_VECTOR_FOR_EACH(lines, j, profile_line_t, entry)
+        if (entry->function == function && entry->line == line) found = entry;
+      SAN_VECTOR_END_FOR_EACH
+      if (found == NULL) {
+        profile_line_t entry = { function, line, 0, 0, -1 };
+        sanv_push(&lines, &entry);
+        found = sanv_back(&lines);
+      }
+      if (i == 0) found->self++;
+      if (found->lastSample != sample) {
+        found->total++;
+        found->lastSample = sample;
+      }
+    }
+  }
+  qsort(lines.elems, lines.size, sizeof(profile_line_t), compare_lines);
+
+  fprintf(out, "\nSamples: %d\n", profile->nsamples);
+  fprintf(out, "%-24s %8s %7s %8s %7s\n", "Line", "Self", "%", "Total", "%");
+  SAN_VECTOR_FOR_EACH(lines, i, profile_line_t, entry)
+    char where[64];
+    snprintf(where, sizeof where, "%.40s:%d", function_name(program, entry->function), entry->line);
+    fprintf(out, "%-24s %8d %6.2f%% %8d %6.2f%%\n", where,
+      entry->self, 100.0 * entry->self / profile->nsamples,
+      entry->total, 100.0 * entry->total / profile->nsamples);
+  SAN_VECTOR_END_FOR_EACH
+  sanv_destroy(&lines, sanv_nodestructor);
+}
+
+void sanr_report(const san_profile_t *profile, const san_program_t *program, FILE *out) {
+  report_opcodes(profile, out);
+  if (profile->nsamples > 0) report_lines(profile, program, out);
+}
+
+void sanr_fold(const san_profile_t *profile, const san_program_t *program, FILE *out) {
+  char **stacks = SAN_CALLOC(profile->nsamples + 1, sizeof(char*));
+  int at = 0;
+
+  /* Each stack outermost first, as name:line frames joined by ';' */
+  for (int sample = 0; sample < profile->nsamples; ++sample) {
+    int depth = *(int*)sanv_nth(&profile->samples, at);
+    int length = 0;
+    stacks[sample] = SAN_MALLOC(depth * 80 + 1);
+    stacks[sample][0] = 0;
+    for (int i = depth; i > 0; --i) {
+      int function, line;
+      locate(program, *(int*)sanv_nth(&profile->samples, at + i), &function, &line);
+      length += sprintf(stacks[sample] + length, "%s%.63s:%d",
+        i < depth ? ";" : "", function_name(program, function), line);
+    }
+    at += depth + 1;
+  }
+  qsort(stacks, profile->nsamples, sizeof(char*), compare_strings);
+
+  for (int i = 0, count = 1; i < profile->nsamples; ++i, ++count) {
+    if (i + 1 < profile->nsamples && strcmp(stacks[i], stacks[i + 1]) == 0) continue;
+    fprintf(out, "%s %d\n", stacks[i], count);
+    count = 0;
+  }
+  for (int i = 0; i < profile->nsamples; ++i) SAN_FREE(stacks[i]);
+  SAN_FREE(stacks);
+}
+
+typedef struct {
+  int64_t count;
+  int ngram;
+} profile_ngram_t;
+
+static int compare_ngrams(const void *a, const void *b) {
+  const profile_ngram_t *x = a, *y = b;
+  if (x->count != y->count) return x->count < y->count ? 1 : -1;
+  return x->ngram - y->ngram;
+}
+
+void sanr_write_ngrams(const san_profile_t *profile, FILE *out) {
+  int size = SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES;
+  san_vector_t ngrams;
+
+  sanv_create(&ngrams, sizeof(profile_ngram_t));
+  for (int i = 0; i < size; ++i) {
+    profile_ngram_t ngram = { profile->ngrams[i], i };
+    if (ngram.count > 0) sanv_push(&ngrams, &ngram);
+  }
+  qsort(ngrams.elems, ngrams.size, sizeof(profile_ngram_t), compare_ngrams);
+
+  SAN_VECTOR_FOR_EACH(ngrams, i, profile_ngram_t, ngram)
+    int a = ngram->ngram / (SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES);
+    int b = ngram->ngram / SAN_PROFILE_OPCODES % SAN_PROFILE_OPCODES;
+    int c = ngram->ngram % SAN_PROFILE_OPCODES;
+    fprintf(out, "%lld", (long long)ngram->count);
+    if (a != 0) fprintf(out, " %s", sanb_opcode_name(a));
+    fprintf(out, " %s %s\n", sanb_opcode_name(b), sanb_opcode_name(c));
+  SAN_VECTOR_END_FOR_EACH
+  sanv_destroy(&ngrams, sanv_nodestructor);
+}
+
+static int opcode_named(const char *name) {
+  for (int op = 1; op < SAN_PROFILE_OPCODES; ++op) {
+    if (strcmp(sanb_opcode_name(op), name) == 0) return op;
+  }
+  return 0;
+}
+
+int sanr_read_ngrams(san_profile_t *profile, FILE *in) {
+  char line[256];
+
+  while (fgets(line, sizeof line, in) != NULL) {
+    int opcodes[3] = { 0 }, n = 0;
+    char *count = strtok(line, " \n"), *name;
+    if (count == NULL) continue;
+    while ((name = strtok(NULL, " \n")) != NULL) {
+      if (n == 3 || (opcodes[n++] = opcode_named(name)) == 0) return SAN_FAIL;
+    }
+    if (n == 2) {
+      profile->ngrams[SAN_PROFILE_NGRAM(0, opcodes[0], opcodes[1])] += atoll(count);
+    } else if (n == 3) {
+      profile->ngrams[SAN_PROFILE_NGRAM(opcodes[0], opcodes[1], opcodes[2])] += atoll(count);
+    } else {
+      return SAN_FAIL;
+    }
+  }
+  return SAN_OK;
+}
+
+int sanr_pick_supers(san_profile_t *profile, int n, int *picked) {
+  int count = 0;
+
+  for (; count < n; ++count) {
+    int64_t bestSaved = 0, *ab, *bc;
+    int best = 0, a, b, c;
+    for (int i = 0; i < SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES; ++i) {
+      int64_t saved = profile->ngrams[i] * (i >= SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES ? 2 : 1);
+      a = i / (SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES);
+      b = i / SAN_PROFILE_OPCODES % SAN_PROFILE_OPCODES;
+      if (saved > bestSaved && (a == 0 || sanm_fusable(a)) && sanm_fusable(b)) {
+        bestSaved = saved;
+        best = i;
+      }
+    }
+    if (bestSaved == 0) break;
+
+    a = best / (SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES);
+    b = best / SAN_PROFILE_OPCODES % SAN_PROFILE_OPCODES;
+    c = best % SAN_PROFILE_OPCODES;
+    if (a != 0) {
+      ab = &profile->ngrams[SAN_PROFILE_NGRAM(0, a, b)];
+      bc = &profile->ngrams[SAN_PROFILE_NGRAM(0, b, c)];
+      *ab = *ab > profile->ngrams[best] ? *ab - profile->ngrams[best] : 0;
+      *bc = *bc > profile->ngrams[best] ? *bc - profile->ngrams[best] : 0;
+    }
+    profile->ngrams[best] = 0;
+    picked[count] = best;
+  }
+  return count;
+}
@@ -0,0 +1,129 @@
+#ifndef __SAN_PROFILE_H
+#define __SAN_PROFILE_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include "bytecode.h"
+
+/* Opcodes the counters cover, which are all the generator emits */
+#define SAN_PROFILE_OPCODES 32
+
+/* Where a sequence of opcodes run one after the other is counted, a pair having 0 first */
+#define SAN_PROFILE_NGRAM(a, b, c) (((a) * SAN_PROFILE_OPCODES + (b)) * SAN_PROFILE_OPCODES + (c))
+
+/* Samples per second of CPU time, and the innermost frames a sample keeps */
+#define SAN_PROFILE_HZ 997
+#define SAN_PROFILE_DEPTH 64
+
+/*
+ * Profiles
+ *
+ * A runtime given a profile counts every instruction it dispatches and
+ * the cycles until the next dispatch. While sampling, SIGPROF marks a
+ * sample due, which the runtime takes at its next instruction by
+ * recording the pc of each active frame. Reports map the pcs back to
+ * source lines.
+ *
+ * Pairs and triples of instructions run in a straight line are counted
+ * too, to pick the superinstructions from, as are the dispatches made:
+ * the instructions in a superinstruction after its first take none.
+ */
+typedef struct {
+  int64_t counts[SAN_PROFILE_OPCODES];
+  uint64_t cycles[SAN_PROFILE_OPCODES];
+  int64_t *ngrams;
+  int64_t dispatches;
+  uint64_t last;        /* when the instruction running was dispatched */
+  int opcode;           /* the instruction running, 0 before the first */
+  int pc;               /* its pc, -2 when none is running */
+  int before;           /* the opcode run just before it in a straight line, or 0 */
+  int fusedEnd;         /* the end of the superinstruction it started, or is in */
+  volatile sig_atomic_t due;
+  san_vector_t samples; /* int: each sample's depth, then its pcs innermost first */
+  int nsamples;
+} san_profile_t;
+
+static inline uint64_t sanr_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t)hi << 32) | lo;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+#endif
+}
+
+/*
+ * Charges the cycles since the last dispatch to that instruction, and
+ * counts opcode at pc, which starts a superinstruction of length
+ * instructions, or 1 if none.
+ */
+static inline void sanr_count(san_profile_t *profile, int opcode, int pc, int length) {
+  uint64_t now = sanr_cycles();
+  int straight = pc == profile->pc + 1;
+
+  profile->cycles[profile->opcode] += now - profile->last;
+  profile->counts[opcode]++;
+  if (straight) {
+    profile->ngrams[SAN_PROFILE_NGRAM(0, profile->opcode, opcode)]++;
+    if (profile->before != 0) profile->ngrams[SAN_PROFILE_NGRAM(profile->before, profile->opcode, opcode)]++;
+  }
+  if (!straight || pc >= profile->fusedEnd) {
+    profile->dispatches++;
+    profile->fusedEnd = pc + length;
+  }
+  profile->before = straight ? profile->opcode : 0;
+  profile->last = now;
+  profile->opcode = opcode;
+  profile->pc = pc;
+}
+
+/* Charges the cycles since the last dispatch, after which no instruction is running */
+static inline void sanr_charge(san_profile_t *profile) {
+  uint64_t now = sanr_cycles();
+  profile->cycles[profile->opcode] += now - profile->last;
+  profile->last = now;
+  profile->opcode = 0;
+  profile->pc = -2;
+}
+
+void sanr_create(san_profile_t *profile);
+void sanr_destroy(san_profile_t *profile);
+
+/*
+ * Samples while the process spends CPU time, hz times a second. Only one
+ * profile samples at a time.
+ */
+int sanr_start(san_profile_t *profile, int hz);
+void sanr_stop(san_profile_t *profile);
+
+/* Records a sample of depth pcs, innermost first */
+void sanr_sample(san_profile_t *profile, const int *pcs, int depth);
+
+/* Writes the opcode counts and cycles, then where the samples were taken */
+void sanr_report(const san_profile_t *profile, const san_program_t *program, FILE *out);
+
+/* Writes the samples as folded stacks, a line per stack with its count */
+void sanr_fold(const san_profile_t *profile, const san_program_t *program, FILE *out);
+
+/*
+ * Writes the pairs and triples counted, most frequent first, a line each
+ * with the count then the opcode names. Reading such a file adds its
+ * counts, so that runs over a corpus can be added up.
+ */
+void sanr_write_ngrams(const san_profile_t *profile, FILE *out);
+int sanr_read_ngrams(san_profile_t *profile, FILE *in);
+
+/*
+ * Picks up to n superinstructions that save the most dispatches on the
+ * n-grams counted, storing each as its SAN_PROFILE_NGRAM in picked, best
+ * first, and returns how many. Each time a run of n instructions was
+ * counted saves n - 1 dispatches, except that a pair run inside a triple
+ * picked before saves none. Uses up the counts.
+ */
+int sanr_pick_supers(san_profile_t *profile, int n, int *picked);
+
+#endif
@@ -35,15 +35,23 @@
 #include <string.h>
 #include <stdarg.h>
 
+/* Traces every allocation and instruction; build with -DSAN_DEBUG=0 to time anything */
+#ifndef SAN_DEBUG
 #define SAN_DEBUG 1
+#endif
 
 #if SAN_DEBUG == 1
 #define san_dbg(...) do { printf(__VA_ARGS__); fflush(stdout); } while(0)
 
-static void *san_dbg_allocptr;
-#define SAN_MALLOC(size) (san_dbg_allocptr = malloc(size)); do { san_dbg("MALLOC 0x%x, FILE: %s, LINE: %d\n", (int)san_dbg_allocptr, __FILE__, __LINE__); } while(0)
-#define SAN_CALLOC(n, size) (san_dbg_allocptr = calloc(n, size)); do { san_dbg("CALLOC 0x%x, FILE: %s, LINE: %d\n", (int)san_dbg_allocptr, __FILE__, __LINE__); } while(0)
-#define SAN_FREE(ptr) free(ptr); do { san_dbg("FREEING 0x%x, FILE: %s, LINE: %d\n", (int)ptr, __FILE__, __LINE__); } while(0)
+/* Functions rather than a shared temporary, so that threads can allocate at once */
+static inline void *san_dbg_malloc(void *ptr, const char *what, const char *file, int line) {
+  san_dbg("%s %p, FILE: %s, LINE: %d\n", what, ptr, file, line);
+  return ptr;
+}
+
+#define SAN_MALLOC(size) san_dbg_malloc(malloc(size), "MALLOC", __FILE__, __LINE__)
+#define SAN_CALLOC(n, size) san_dbg_malloc(calloc(n, size), "CALLOC", __FILE__, __LINE__)
+#define SAN_FREE(ptr) do { san_dbg("FREEING %p, FILE: %s, LINE: %d\n", (void*)(ptr), __FILE__, __LINE__); free(ptr); } while(0)
 
 #else
 
@@ -51,6 +59,8 @@ static void *san_dbg_allocptr;
 void __san_noop(int k, ...);
 #define san_dbg(...) do { __san_noop(0, __VA_ARGS__); } while(0)
 
+#define SAN_MALLOC(size) malloc(size)
+#define SAN_CALLOC(n, size) calloc(n, size)
 #define SAN_FREE(ptr) free(ptr)
 
 #endif
@@ -0,0 +1,229 @@
+#include "scope.h"
+#include "natives.h"
+
+typedef struct {
+  const char *name;
+  int binding, slot;
+
+  /* The function a local belongs to */
+  int function;
+} scope_entry_t;
+
+typedef struct {
+  san_vector_t entries;
+  san_vector_t *errors;
+
+  /* The function being resolved, NULL at the top level */
+  san_node_t *definition;
+  int function;
+  int numFunctions;
+  int numGlobals;
+} scope_state_t;
+
+#define scopeError(__state, __node, __code, ...) do { \
+  san_error_t err; \
+  memset(&err, 0, sizeof err); \
+  err.code = __code; \
+  err.line = (__node)->token->line; \
+  err.column = (__node)->token->column; \
+  sprintf(err.msg, __code##_MSG, __VA_ARGS__); \
+  sanv_push((__state)->errors, &err); \
+} while (0)
+
+static int resolve(scope_state_t *state, san_node_t *node);
+
+static scope_entry_t const *lookup(scope_state_t const *state, const char *name) {
+  for (int i = state->entries.size - 1; i >= 0; --i) {
+    scope_entry_t const *entry = sanv_nth(&state->entries, i);
+    if (strcmp(entry->name, name) == 0) return entry;
+  }
+  return NULL;
+}
+
+static void bind(scope_state_t *state, san_node_t *node, const char *name, int binding, int slot) {
+  scope_entry_t entry = { name, binding, slot, state->function };
+  sanv_push(&state->entries, &entry);
+  node->binding = binding;
+  node->slot = slot;
+}
+
+/*
+ * Variables get the next free slot of the function they are defined in, or
+ * a global slot at the top level. Slots are never reused, so a function's
+ * frame is its parameters followed by every let in its body.
+ */
+static void declare_variable(scope_state_t *state, san_node_t *node, const char *name) {
+  if (state->definition != NULL) {
+    bind(state, node, name, SAN_BINDING_LOCAL, state->definition->nslots++);
+  } else {
+    bind(state, node, name, SAN_BINDING_GLOBAL, state->numGlobals++);
+  }
+}
+
+static int resolve_name(scope_state_t *state, san_node_t *node, int isCallee) {
+  const char *name = node->token->raw;
+  scope_entry_t const *entry = lookup(state, name);
+  int native;
+
+  if (entry != NULL) {
+    if (entry->binding == SAN_BINDING_LOCAL && entry->function != state->function) {
+      scopeError(state, node, SAN_ERROR_CAPTURED_LOCAL, name);
+      return SAN_FAIL;
+    }
+    node->binding = entry->binding;
+    node->slot = entry->slot;
+    return SAN_OK;
+  }
+
+  native = sann_lookup(name);
+  if (native >= 0) {
+    node->binding = SAN_BINDING_NATIVE;
+    node->slot = native;
+    return SAN_OK;
+  }
+
+  if (isCallee) {
+    scopeError(state, node, SAN_ERROR_UNKNOWN_FUNCTION, name);
+  } else {
+    scopeError(state, node, SAN_ERROR_UNBOUND_NAME, name);
+  }
+  return SAN_FAIL;
+}
+
+static int resolve_children(scope_state_t *state, san_node_t *node, int first) {
+  int result = SAN_OK;
+  for (int i = first; i < node->children.size; ++i) {
+    if (resolve(state, sanv_nth(&node->children, i)) != SAN_OK) result = SAN_FAIL;
+  }
+  return result;
+}
+
+/*
+ * let name params = body
+ *
+ * The name is bound before the body so that the function can call itself.
+ * Parameters take the first slots of the frame.
+ */
+static int resolve_function(scope_state_t *state, san_node_t *node) {
+  san_node_t *lvalue = sanv_nth(&node->children, 0);
+  san_node_t *params = sanv_nth(&lvalue->children, 0);
+  scope_state_t outer = *state;
+  int mark, result;
+
+  bind(state, node, lvalue->token->raw, SAN_BINDING_FUNCTION, ++state->numFunctions);
+  mark = state->entries.size;
+
+  state->definition = node;
+  state->function = node->slot;
+  node->nslots = 0;
+  SAN_VECTOR_FOR_EACH(params->children, i, san_node_t, param)
+    declare_variable(state, param, param->token->raw);
+  SAN_VECTOR_END_FOR_EACH
+
+  result = resolve_children(state, node, 1);
+
+  state->entries.size = mark;
+  state->definition = outer.definition;
+  state->function = outer.function;
+  return result;
+}
+
+/*
+ * let name = value
+ *
+ * The value is resolved before the name is bound, so it refers to any outer
+ * binding of the same name.
+ */
+static int resolve_variable(scope_state_t *state, san_node_t *node) {
+  san_node_t *lvalue = sanv_nth(&node->children, 0);
+  int result = resolve_children(state, node, 1);
+
+  declare_variable(state, lvalue, lvalue->token->raw);
+  node->binding = lvalue->binding;
+  node->slot = lvalue->slot;
+  return result;
+}
+
+static int stage_of(const char *name, int hasArguments) {
+  if (hasArguments) {
+    if (strcmp(name, "map") == 0) return SAN_STAGE_MAP;
+    if (strcmp(name, "filter") == 0) return SAN_STAGE_FILTER;
+    if (strcmp(name, "reduce") == 0) return SAN_STAGE_REDUCE;
+  } else {
+    if (strcmp(name, "sum") == 0) return SAN_STAGE_SUM;
+    if (strcmp(name, "count") == 0) return SAN_STAGE_COUNT;
+    if (strcmp(name, "list") == 0) return SAN_STAGE_LIST;
+  }
+  return 0;
+}
+
+static int resolve_pipe(scope_state_t *state, san_node_t *node) {
+  int result = resolve(state, sanv_nth(&node->children, 0));
+
+  for (int i = 1; i < node->children.size; ++i) {
+    san_node_t *stage = sanv_nth(&node->children, i);
+    san_node_t *name = sanp_bare_name(stage);
+    int isCall = stage->type == SAN_PARSER_FN_EXPRESSION;
+    int id;
+
+    if (isCall) name = sanv_nth(&stage->children, 0);
+    id = name != NULL ? stage_of(name->token->raw, isCall) : 0;
+
+    if (id != 0 && lookup(state, name->token->raw) == NULL) {
+      stage->binding = SAN_BINDING_STAGE;
+      stage->slot = id;
+      if (isCall && resolve_children(state, stage, 1) != SAN_OK) result = SAN_FAIL;
+    } else if (resolve(state, stage) != SAN_OK) {
+      result = SAN_FAIL;
+    }
+  }
+
+  return result;
+}
+
+static int resolve(scope_state_t *state, san_node_t *node) {
+  switch (node->type) {
+    case SAN_PARSER_PIPE_EXPRESSION:
+      return resolve_pipe(state, node);
+    case SAN_PARSER_BLOCK: {
+      int mark = state->entries.size;
+      int result = resolve_children(state, node, 0);
+      state->entries.size = mark;
+      return result;
+    }
+    case SAN_PARSER_VARIABLE_EXPRESSION: {
+      san_node_t const *lvalue = sanv_nth(&node->children, 0);
+      if (lvalue->type == SAN_PARSER_FUNCTION_LVALUE) {
+        return resolve_function(state, node);
+      }
+      return resolve_variable(state, node);
+    }
+    case SAN_PARSER_FN_EXPRESSION: {
+      int result = resolve_name(state, sanv_nth(&node->children, 0), 1);
+      if (resolve_children(state, node, 1) != SAN_OK) result = SAN_FAIL;
+      return result;
+    }
+    case SAN_PARSER_PRIMARY_EXPRESSION:
+      if (node->children.size == 0) {
+        return resolve_name(state, node, 0);
+      }
+      return resolve_children(state, node, 0);
+    default:
+      return resolve_children(state, node, 0);
+  }
+}
+
+int sans_resolve(san_node_t *ast, san_vector_t *errors) {
+  scope_state_t state;
+  int numErrors = errors->size;
+
+  memset(&state, 0, sizeof state);
+  state.errors = errors;
+  sanv_create(&state.entries, sizeof(scope_entry_t));
+
+  resolve(&state, ast);
+  ast->nslots = state.numGlobals;
+
+  sanv_destroy(&state.entries, sanv_nodestructor);
+  return errors->size > numErrors ? SAN_FAIL : SAN_OK;
+}
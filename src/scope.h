@@ -0,0 +1,41 @@
+#ifndef __SAN_SCOPE_H
+#define __SAN_SCOPE_H
+
+#include "parser.h"
+
+/*
+ * Scope analysis
+ *
+ * Runs between sanp_parse and sanb_generate and resolves every name in the
+ * AST. Identifiers and callees are given a binding and a slot:
+ *
+ *   LOCAL     slot in the frame of the enclosing function
+ *   GLOBAL    slot in the program's global table
+ *   FUNCTION  index of the function, in definition order starting at 1
+ *   NATIVE    index in the native registry
+ *   STAGE     one of the SAN_STAGE_* builtins, on a pipe stage
+ *
+ * Function definitions are given the number of frame slots they need, and
+ * the root the number of globals.
+ */
+#define SAN_BINDING_NONE        0
+#define SAN_BINDING_LOCAL       1
+#define SAN_BINDING_GLOBAL      2
+#define SAN_BINDING_FUNCTION    3
+#define SAN_BINDING_NATIVE      4
+#define SAN_BINDING_STAGE       5
+
+/*
+ * Pipe stages the bytecode generator fuses into a single loop. They are only
+ * recognised in a pipe, and only while their name is not otherwise bound.
+ */
+#define SAN_STAGE_MAP           1
+#define SAN_STAGE_FILTER        2
+#define SAN_STAGE_REDUCE        3
+#define SAN_STAGE_SUM           4
+#define SAN_STAGE_COUNT         5
+#define SAN_STAGE_LIST          6
+
+int sans_resolve(san_node_t *ast, san_vector_t *errors);
+
+#endif
@@ -2,10 +2,19 @@
 #define __SAN_STD
 
 #include <math.h>
+#include <stdint.h>
 
-int sanstd_absi(int n);
-int sanstd_squarei(int n);
-int sanstd_sqrti(int n);
-int sanstd_factoriali(int n);
+/*
+ * Integer kernels. Those that can overflow return 0 on overflow instead of
+ * storing their result, and 1 otherwise.
+ */
+int sanstd_absi(int64_t n, int64_t *result);
+int sanstd_squarei(int64_t n, int64_t *result);
+int64_t sanstd_sqrti(int64_t n);
+int sanstd_factoriali(int64_t n, int64_t *result);
+int sanstd_subi(int64_t a, int64_t b, int64_t *result);
+int64_t sanstd_modi(int64_t a, int64_t b);
+int sanstd_eqi(int64_t a, int64_t b);
+int sanstd_lti(int64_t a, int64_t b);
 
 #endif
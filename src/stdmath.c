@@ -1,23 +1,41 @@
 #include "std.h"
 
-inline int sanstd_absi(int n) {
-  if (n < 0) { return -n; }
-  return n;
+inline int sanstd_absi(int64_t n, int64_t *result) {
+  if (n < 0) { return !__builtin_sub_overflow((int64_t)0, n, result); }
+  *result = n;
+  return 1;
 }
 
-inline int sanstd_squarei(int n) {
-  return n * n;
+inline int sanstd_squarei(int64_t n, int64_t *result) {
+  return !__builtin_mul_overflow(n, n, result);
 }
 
-inline int sanstd_sqrti(int n) {
-  return (int)round(sqrt((double)n));
+inline int64_t sanstd_sqrti(int64_t n) {
+  return (int64_t)round(sqrt((double)n));
 }
 
-inline int sanstd_factoriali(int n) {
-  if (n < 3) { return n; }
-  int acc = 1;
+inline int sanstd_factoriali(int64_t n, int64_t *result) {
+  if (n < 3) { *result = n; return 1; }
+  int64_t acc = 1;
   for (; n > 1; --n) {
-      acc *= n;
+      if (__builtin_mul_overflow(acc, n, &acc)) { return 0; }
   }
-  return acc;
+  *result = acc;
+  return 1;
+}
+
+inline int sanstd_subi(int64_t a, int64_t b, int64_t *result) {
+  return !__builtin_sub_overflow(a, b, result);
+}
+
+inline int64_t sanstd_modi(int64_t a, int64_t b) {
+  return a % b;
+}
+
+inline int sanstd_eqi(int64_t a, int64_t b) {
+  return a == b;
+}
+
+inline int sanstd_lti(int64_t a, int64_t b) {
+  return a < b;
 }
@@ -0,0 +1,24 @@
+/* Generated by san --super from bench/ngrams.txt: do not edit */
+#ifndef __SAN_SUPER_H
+#define __SAN_SUPER_H
+
+/* The superinstructions, as X2 of a pair of opcodes or X3 of a triple */
+#define SAN_SUPERINSTRUCTIONS(X2, X3) \
+  X3(LOAD_SLOT, PUSH, CALL_NATIVE_I) \
+  X3(PUSH, CALL_NATIVE_I, JUMP_IF_TRUE) \
+  X3(PUSH, CALL_NATIVE_I, LOAD_SLOT) \
+  X3(PUSH, CALL_NATIVE_I, PUSH) \
+  X3(CALL_NATIVE_I, PUSH, CALL_NATIVE_I) \
+  X3(CALL_NATIVE_I, LOAD_SLOT, TAILCALL) \
+  X3(CALL_NATIVE_I, LOAD_SLOT, LOAD_SLOT) \
+  X3(PUSH, CALL_NATIVE_I, JUMP_IF_FALSE) \
+  X3(LOAD_SLOT, LOAD_SLOT, CALL) \
+  X3(ADD_II, LOAD_SLOT, TAILCALL) \
+  X3(PUSH, CALL_NATIVE_I, CALL) \
+  X2(PUSH, RET) \
+  X3(PUSH, ADD_II, DUP) \
+  X3(LOAD_SLOT, LOAD_SLOT, MUL) \
+  X3(STORE_SLOT, LOAD_SLOT, LOAD_SLOT) \
+  X3(DUP, PUSH, CALL_NATIVE_I)
+
+#endif
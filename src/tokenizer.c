@@ -254,6 +254,17 @@ int sant_tokenize(const char *input, san_vector_t *output, san_vector_t *errors)
   while (*state->inputPtr != '\0') {
     san_token_t *thisToken;
     san_token_t newToken;
+
+    /* Lines starting at column one get an empty indentation token */
+    if (state->column == 1 && state->line > 1 && !is_white_space(*state->inputPtr)) {
+      memset(&newToken, 0, sizeof(san_token_t));
+      newToken.type = SAN_TOKEN_INDENTATION;
+      newToken.raw = "";
+      newToken.line = state->line;
+      newToken.column = state->column;
+      sanv_push(state->output, &newToken);
+    }
+
     memset(&newToken, 0, sizeof(san_token_t));
     newToken.line = state->line;
     newToken.column = state->column;
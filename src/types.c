@@ -0,0 +1,315 @@
+#include "types.h"
+#include "natives.h"
+
+/*
+ * The types of a function's frame slots followed by those of its operand
+ * stack, at some point in its code.
+ */
+typedef struct {
+  int size;
+  int *types;
+} ty_state_t;
+
+typedef struct {
+  san_program_t *program;
+
+  /* Per function: the types of its parameters and of its return value */
+  int **params;
+  int *returns;
+  int *globals;
+  int changed;
+} ty_context_t;
+
+typedef struct {
+  ty_context_t *context;
+  int function;
+  const san_function_t *fn;
+
+  /* In-states of the basic blocks, by offset into the function */
+  ty_state_t *blocks;
+  int *isLeader, *isQueued, *worklist;
+  int pending;
+  int consistent;
+} ty_function_t;
+
+static inline int join(int a, int b) {
+  if (a == b || b == SAN_TYPE_NONE) return a;
+  if (a == SAN_TYPE_NONE) return b;
+  return SAN_TYPE_ANY;
+}
+
+static void join_into(ty_context_t *context, int *type, int with) {
+  int joined = join(*type, with);
+  if (joined != *type) {
+    *type = joined;
+    context->changed = 1;
+  }
+}
+
+static inline san_bytecode_t *code_at(ty_function_t *fun, int offset) {
+  return (san_bytecode_t*)sanv_nth(&fun->context->program->bytecode, fun->fn->entry + offset);
+}
+
+static inline int offset_of(ty_function_t *fun, int target) {
+  return target - fun->fn->entry;
+}
+
+static inline int is_branch(int opcode) {
+  return opcode == SAN_BYTECODE_JUMP || opcode == SAN_BYTECODE_JUMP_IF_FALSE ||
+    opcode == SAN_BYTECODE_JUMP_IF_TRUE || opcode == SAN_BYTECODE_ITER_NEXT;
+}
+
+static inline int ends_block(int opcode) {
+  return opcode == SAN_BYTECODE_JUMP || opcode == SAN_BYTECODE_RET ||
+    opcode == SAN_BYTECODE_TAILCALL;
+}
+
+/*
+ * Joins a state into the in-state of the block at offset, queueing the block
+ * if that changed anything. Codegen never leaves different stack depths at
+ * a join; if it did, the function is not specialised.
+ */
+static void merge(ty_function_t *fun, int offset, const ty_state_t *state) {
+  ty_state_t *block = &fun->blocks[offset];
+  int changed = 0;
+
+  if (block->types == NULL) {
+    block->size = state->size;
+    block->types = SAN_MALLOC((state->size + 1) * sizeof(int));
+    memcpy(block->types, state->types, state->size * sizeof(int));
+    changed = 1;
+  } else if (block->size != state->size) {
+    fun->consistent = 0;
+    return;
+  } else {
+    for (int i = 0; i < state->size; ++i) {
+      int joined = join(block->types[i], state->types[i]);
+      if (joined != block->types[i]) {
+        block->types[i] = joined;
+        changed = 1;
+      }
+    }
+  }
+
+  if (changed && !fun->isQueued[offset]) {
+    fun->isQueued[offset] = 1;
+    fun->worklist[fun->pending++] = offset;
+  }
+}
+
+static inline int top(const ty_state_t *state, int depth) {
+  return state->types[state->size - 1 - depth];
+}
+
+static inline void push(ty_state_t *state, int type) {
+  state->types[state->size++] = type;
+}
+
+/*
+ * Applies one instruction to the state and, once the program's types have
+ * settled, specialises it.
+ */
+static void transfer(ty_function_t *fun, san_bytecode_t *code, ty_state_t *state, int specialise) {
+  ty_context_t *context = fun->context;
+
+  switch (code->opcode) {
+    case SAN_BYTECODE_PUSH:
+      push(state, code->arg1.type == SAN_BYTECODE_TYPE_NUMBER_LITERAL ||
+        code->arg1.type == SAN_BYTECODE_TYPE_BIGNUM_LITERAL ? SAN_TYPE_INT
+        : code->arg1.type == SAN_BYTECODE_TYPE_STRING_LITERAL ? SAN_TYPE_STRING : SAN_TYPE_NIL);
+      break;
+    case SAN_BYTECODE_POP:
+    case SAN_BYTECODE_LIST_APPEND:
+    case SAN_BYTECODE_JUMP_IF_FALSE:
+    case SAN_BYTECODE_JUMP_IF_TRUE:
+      state->size--;
+      break;
+    case SAN_BYTECODE_DUP:
+      push(state, top(state, 0));
+      break;
+    case SAN_BYTECODE_PICK:
+      push(state, top(state, code->arg1.ref));
+      break;
+    case SAN_BYTECODE_ROLL: {
+      int depth = code->arg1.ref, type = top(state, depth);
+      int *at = &state->types[state->size - 1 - depth];
+      memmove(at, at + 1, depth * sizeof(int));
+      state->types[state->size - 1] = type;
+      break;
+    }
+    case SAN_BYTECODE_ADD:
+    case SAN_BYTECODE_MUL:
+    case SAN_BYTECODE_ADD_II:
+    case SAN_BYTECODE_MUL_II:
+      /* The generic ops fail on anything but integers */
+      if (specialise && top(state, 0) == SAN_TYPE_INT && top(state, 1) == SAN_TYPE_INT) {
+        if (code->opcode == SAN_BYTECODE_ADD) code->opcode = SAN_BYTECODE_ADD_II;
+        if (code->opcode == SAN_BYTECODE_MUL) code->opcode = SAN_BYTECODE_MUL_II;
+      }
+      state->size -= 2;
+      push(state, SAN_TYPE_INT);
+      break;
+    case SAN_BYTECODE_CALL_NATIVE:
+    case SAN_BYTECODE_CALL_NATIVE_I: {
+      int isInt = (sann_nth(code->arg1.ref)->flags & SAN_NATIVE_INT) != 0;
+      int argc = code->arg2.ref, allInts = 1;
+      for (int i = 0; i < argc; ++i) allInts = allInts && top(state, i) == SAN_TYPE_INT;
+      if (specialise && isInt && allInts) code->opcode = SAN_BYTECODE_CALL_NATIVE_I;
+      state->size -= argc;
+      push(state, isInt ? SAN_TYPE_INT : SAN_TYPE_ANY);
+      break;
+    }
+    case SAN_BYTECODE_CALL:
+    case SAN_BYTECODE_TAILCALL: {
+      int callee = code->arg1.ref, argc = code->arg2.ref;
+      for (int i = 0; i < argc; ++i) {
+        join_into(context, &context->params[callee][i], top(state, argc - 1 - i));
+      }
+      state->size -= argc;
+      if (code->opcode == SAN_BYTECODE_TAILCALL) {
+        join_into(context, &context->returns[fun->function], context->returns[callee]);
+      } else {
+        push(state, context->returns[callee]);
+      }
+      break;
+    }
+    case SAN_BYTECODE_RET:
+      join_into(context, &context->returns[fun->function], top(state, 0));
+      break;
+    case SAN_BYTECODE_LOAD_SLOT:
+      push(state, code->arg1.type == SAN_BYTECODE_TYPE_GLOBAL
+        ? context->globals[code->arg1.ref] : state->types[code->arg1.ref]);
+      break;
+    case SAN_BYTECODE_STORE_SLOT: {
+      int type = top(state, 0);
+      state->size--;
+      if (code->arg1.type == SAN_BYTECODE_TYPE_GLOBAL) {
+        join_into(context, &context->globals[code->arg1.ref], type);
+      } else {
+        state->types[code->arg1.ref] = type;
+      }
+      break;
+    }
+    case SAN_BYTECODE_MAKE_LIST:
+      state->size -= code->arg1.ref;
+      push(state, SAN_TYPE_LIST);
+      break;
+    case SAN_BYTECODE_ITER:
+      push(state, SAN_TYPE_INT);
+      break;
+    case SAN_BYTECODE_ITER_NEXT: {
+      /* [list index acc] becomes [acc] at the exit */
+      int list = top(state, 2), acc = top(state, 0);
+      state->size -= 2;
+      state->types[state->size - 1] = acc;
+      merge(fun, offset_of(fun, code->arg1.ref), state);
+      state->types[state->size - 1] = list;
+      state->size += 2;
+      push(state, SAN_TYPE_ANY);
+      return;
+    }
+  }
+
+  if (is_branch(code->opcode)) merge(fun, offset_of(fun, code->arg1.ref), state);
+}
+
+/*
+ * Runs the block starting at offset from its in-state.
+ */
+static void run_block(ty_function_t *fun, int offset, ty_state_t *scratch, int specialise) {
+  const ty_state_t *in = &fun->blocks[offset];
+
+  scratch->size = in->size;
+  memcpy(scratch->types, in->types, in->size * sizeof(int));
+
+  for (int pc = offset; pc < fun->fn->length; ++pc) {
+    san_bytecode_t *code = code_at(fun, pc);
+    transfer(fun, code, scratch, specialise);
+    if (ends_block(code->opcode)) break;
+    if (pc + 1 < fun->fn->length && fun->isLeader[pc + 1]) {
+      merge(fun, pc + 1, scratch);
+      break;
+    }
+  }
+}
+
+static void infer_function(ty_context_t *context, int function, int specialise) {
+  const san_function_t *fn = sanv_nth(&context->program->functions, function);
+  ty_function_t fun = { context, function, fn, NULL, NULL, NULL, NULL, 0, 1 };
+  ty_state_t entry, scratch;
+
+  if (fn->length == 0) return;
+
+  fun.blocks = SAN_CALLOC(fn->length, sizeof(ty_state_t));
+  fun.isLeader = SAN_CALLOC(fn->length + 1, sizeof(int));
+  fun.isQueued = SAN_CALLOC(fn->length, sizeof(int));
+  fun.worklist = SAN_MALLOC(fn->length * sizeof(int));
+
+  fun.isLeader[0] = 1;
+  for (int pc = 0; pc < fn->length; ++pc) {
+    san_bytecode_t *code = code_at(&fun, pc);
+    if (is_branch(code->opcode)) fun.isLeader[offset_of(&fun, code->arg1.ref)] = 1;
+    if (is_branch(code->opcode) || ends_block(code->opcode)) fun.isLeader[pc + 1] = 1;
+  }
+
+  /* Parameters come first; every other slot starts out nil */
+  entry.size = fn->nslots;
+  entry.types = SAN_MALLOC((fn->nslots + 1) * sizeof(int));
+  for (int i = 0; i < fn->nslots; ++i) {
+    entry.types[i] = i < fn->arity ? context->params[function][i] : SAN_TYPE_NIL;
+  }
+  scratch.types = SAN_MALLOC((fn->nslots + fn->length + 1) * sizeof(int));
+
+  merge(&fun, 0, &entry);
+  while (fun.pending > 0 && fun.consistent) {
+    int offset = fun.worklist[--fun.pending];
+    fun.isQueued[offset] = 0;
+    run_block(&fun, offset, &scratch, 0);
+  }
+
+  if (specialise && fun.consistent) {
+    for (int pc = 0; pc < fn->length; ++pc) {
+      if (fun.isLeader[pc] && fun.blocks[pc].types != NULL) run_block(&fun, pc, &scratch, 1);
+    }
+  }
+
+  for (int pc = 0; pc < fn->length; ++pc) {
+    if (fun.blocks[pc].types != NULL) {
+      SAN_FREE(fun.blocks[pc].types);
+    }
+  }
+  SAN_FREE(fun.blocks);
+  SAN_FREE(fun.isLeader);
+  SAN_FREE(fun.isQueued);
+  SAN_FREE(fun.worklist);
+  SAN_FREE(entry.types);
+  SAN_FREE(scratch.types);
+}
+
+int sany_infer(san_program_t *program) {
+  int nfunctions = program->functions.size;
+  ty_context_t context = { program, NULL, NULL, NULL, 0 };
+
+  context.params = SAN_CALLOC(nfunctions, sizeof(int*));
+  context.returns = SAN_CALLOC(nfunctions, sizeof(int));
+  context.globals = SAN_CALLOC(program->nglobals + 1, sizeof(int));
+  SAN_VECTOR_FOR_EACH(program->functions, i, san_function_t, fn)
+    context.params[i] = SAN_CALLOC(fn->arity + 1, sizeof(int));
+  SAN_VECTOR_END_FOR_EACH
+
+  /* Types only ever widen, so this settles */
+  do {
+    context.changed = 0;
+    for (int i = 0; i < nfunctions; ++i) infer_function(&context, i, 0);
+  } while (context.changed);
+
+  for (int i = 0; i < nfunctions; ++i) infer_function(&context, i, 1);
+
+  for (int i = 0; i < nfunctions; ++i) {
+    SAN_FREE(context.params[i]);
+  }
+  SAN_FREE(context.params);
+  SAN_FREE(context.returns);
+  SAN_FREE(context.globals);
+  return SAN_OK;
+}
@@ -0,0 +1,26 @@
+#ifndef __SAN_TYPES_H
+#define __SAN_TYPES_H
+
+#include "bytecode.h"
+
+/*
+ * Type inference
+ *
+ * Runs over the linked program and proves which values are integers, so
+ * that arithmetic and integer natives on them can be specialised into the
+ * _II and _I opcodes, which skip the VM's tag checks. Every call is direct,
+ * so parameter types are the union of the argument types at all call sites.
+ *
+ * NONE means no value has been seen yet, ANY that values of several types
+ * may be.
+ */
+#define SAN_TYPE_NONE           0
+#define SAN_TYPE_NIL            1
+#define SAN_TYPE_INT            2
+#define SAN_TYPE_STRING         3
+#define SAN_TYPE_LIST           4
+#define SAN_TYPE_ANY            5
+
+int sany_infer(san_program_t *program);
+
+#endif
@@ -30,17 +30,28 @@ inline int sanv_back_int(san_vector_t const *vector) {
   return *(int*)sanv_back(vector);
 }
 
+/*
+ * Makes room for at least capacity elements, growing geometrically.
+ */
+int sanv_reserve(san_vector_t *vector, unsigned int capacity) {
+  void *newElems, *old = vector->elems;
+  unsigned int newCapacity = vector->capacity * 2;
+
+  if (capacity <= vector->capacity) return SAN_OK;
+  if (newCapacity < capacity) newCapacity = capacity;
+
+  newElems = SAN_CALLOC(newCapacity, vector->elementSize);
+  memcpy(newElems, vector->elems, vector->size * vector->elementSize);
+  vector->elems = newElems;
+  vector->capacity = newCapacity;
+  SAN_FREE(old);
+  return SAN_OK;
+}
+
 int sanv_push(san_vector_t *vector, const void *value) {
   void *back;
 
-  if (vector->size + 1 > vector->capacity) {
-    void *newElems = SAN_CALLOC(vector->capacity * 2, vector->elementSize);
-    void *old = vector->elems;
-    vector->capacity *= 2;
-    memcpy(newElems, vector->elems, vector->size * vector->elementSize);
-    vector->elems = newElems;
-    SAN_FREE(old);
-  }
+  sanv_reserve(vector, vector->size + 1);
 
   back = sanv_nth(vector, vector->size);
   memcpy(back, value, vector->elementSize);
@@ -14,6 +14,7 @@ int sanv_destroy(san_vector_t *vector, int (*destructor)(void *));
 void *sanv_nth(san_vector_t const *vector, int n);
 void *sanv_back(san_vector_t const *vector);
 int sanv_back_int(san_vector_t const *vector);
+int sanv_reserve(san_vector_t *vector, unsigned int capacity);
 int sanv_push(san_vector_t *vector, const void *value);
 int sanv_push_int(san_vector_t *vector, int value);
 int sanv_pop(san_vector_t *vector, void *value);
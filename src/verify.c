@@ -0,0 +1,307 @@
+#include "verify.h"
+#include "natives.h"
+
+#define runtimeError(__errors, __code, ...) do { \
+  san_error_t err; \
+  memset(&err, 0, sizeof err); \
+  err.code = __code; \
+  sprintf(err.msg, __code##_MSG, __VA_ARGS__); \
+  sanv_push((__errors), &err); \
+} while (0)
+
+#define verifyError(__errors, __fn, __pc, __reason) \
+  runtimeError(__errors, SAN_ERROR_INVALID_BYTECODE, (__pc), (__fn)->name, (__reason))
+
+#define UNVISITED -1
+
+typedef struct {
+  const san_program_t *program;
+  const san_function_t *fn;
+  const san_bytecode_t *code;
+
+  /* Stack depth on entry to each instruction, not counting the slots */
+  int *depths;
+  int *worklist, pending;
+  int maxDepth;
+} vf_function_t;
+
+static inline int is_branch(int opcode) {
+  return opcode == SAN_BYTECODE_JUMP || opcode == SAN_BYTECODE_JUMP_IF_FALSE ||
+    opcode == SAN_BYTECODE_JUMP_IF_TRUE || opcode == SAN_BYTECODE_ITER_NEXT;
+}
+
+static inline int ends_block(int opcode) {
+  return opcode == SAN_BYTECODE_JUMP || opcode == SAN_BYTECODE_RET ||
+    opcode == SAN_BYTECODE_TAILCALL;
+}
+
+static inline int is_count(const san_arg_t *arg) {
+  return arg->type == SAN_BYTECODE_TYPE_COUNT && arg->ref >= 0;
+}
+
+/*
+ * Checks that an instruction's operands are what its opcode expects, and
+ * returns why not.
+ */
+static const char *check_operands(const vf_function_t *fun, const san_bytecode_t *code) {
+  const san_program_t *program = fun->program;
+  const san_arg_t *arg1 = &code->arg1, *arg2 = &code->arg2;
+
+  switch (code->opcode) {
+    case SAN_BYTECODE_PUSH:
+      if (arg1->type == SAN_BYTECODE_TYPE_NUMBER_LITERAL) {
+        return arg1->ref >= 0 && arg1->ref < program->numbers.size ? NULL : "no such number literal";
+      }
+      if (arg1->type == SAN_BYTECODE_TYPE_BIGNUM_LITERAL) {
+        return arg1->ref >= 0 && arg1->ref < program->bignums.size ? NULL : "no such number literal";
+      }
+      if (arg1->type == SAN_BYTECODE_TYPE_STRING_LITERAL) {
+        return arg1->ref >= 0 && arg1->ref < program->strings.size ? NULL : "no such string literal";
+      }
+      return arg1->type == SAN_BYTECODE_TYPE_NIL ? NULL : "pushes something other than a literal";
+
+    case SAN_BYTECODE_LOAD_SLOT:
+    case SAN_BYTECODE_STORE_SLOT:
+      if (arg1->type == SAN_BYTECODE_TYPE_LOCAL) {
+        return arg1->ref >= 0 && arg1->ref < fun->fn->nslots ? NULL : "no such slot";
+      }
+      if (arg1->type == SAN_BYTECODE_TYPE_GLOBAL) {
+        return arg1->ref >= 0 && arg1->ref < program->nglobals ? NULL : "no such global";
+      }
+      return "expects a slot";
+
+    case SAN_BYTECODE_CALL_NATIVE:
+    case SAN_BYTECODE_CALL_NATIVE_I: {
+      san_native_t const *native = arg1->type == SAN_BYTECODE_TYPE_NATIVE ? sann_nth(arg1->ref) : NULL;
+      if (native == NULL) return "no such native";
+      if (!is_count(arg2)) return "expects an argument count";
+      if (native->arity != SAN_NATIVE_VARIADIC && native->arity != arg2->ref) return "wrong argument count";
+      if (code->opcode == SAN_BYTECODE_CALL_NATIVE_I && !(native->flags & SAN_NATIVE_INT)) {
+        return "native does not take integers";
+      }
+      return NULL;
+    }
+
+    case SAN_BYTECODE_CALL:
+    case SAN_BYTECODE_TAILCALL: {
+      const san_function_t *callee;
+      if (arg1->type != SAN_BYTECODE_TYPE_FUNCTION || arg1->ref < 0 || arg1->ref >= program->functions.size) {
+        return "no such function";
+      }
+      callee = sanv_nth(&program->functions, arg1->ref);
+      if (!is_count(arg2)) return "expects an argument count";
+      return callee->arity == arg2->ref ? NULL : "wrong argument count";
+    }
+
+    case SAN_BYTECODE_JUMP:
+    case SAN_BYTECODE_JUMP_IF_FALSE:
+    case SAN_BYTECODE_JUMP_IF_TRUE:
+    case SAN_BYTECODE_ITER_NEXT:
+      if (arg1->type != SAN_BYTECODE_TYPE_TARGET) return "expects a target";
+      return arg1->ref >= fun->fn->entry && arg1->ref < fun->fn->entry + fun->fn->length
+        ? NULL : "jumps out of its function";
+
+    case SAN_BYTECODE_PICK:
+    case SAN_BYTECODE_ROLL:
+    case SAN_BYTECODE_MAKE_LIST:
+    case SAN_BYTECODE_MAKE_LOCAL_LIST:
+      return is_count(arg1) ? NULL : "expects a count";
+
+    case SAN_BYTECODE_POP:
+    case SAN_BYTECODE_DUP:
+    case SAN_BYTECODE_ADD:
+    case SAN_BYTECODE_MUL:
+    case SAN_BYTECODE_ADD_II:
+    case SAN_BYTECODE_MUL_II:
+    case SAN_BYTECODE_RET:
+    case SAN_BYTECODE_LIST_APPEND:
+      return NULL;
+
+    case SAN_BYTECODE_ITER:
+      return arg1->type != SAN_BYTECODE_TYPE_COUNT || is_count(arg1) ? NULL : "expects a count";
+  }
+
+  return "unknown opcode";
+}
+
+/*
+ * How many values an instruction needs on the stack, and how many it leaves
+ * in their place when it falls through.
+ */
+static void stack_effect(const san_bytecode_t *code, int *needs, int *leaves) {
+  *needs = 0;
+  *leaves = 0;
+
+  switch (code->opcode) {
+    case SAN_BYTECODE_PUSH:
+    case SAN_BYTECODE_LOAD_SLOT:
+      *leaves = 1;
+      break;
+    case SAN_BYTECODE_POP:
+    case SAN_BYTECODE_STORE_SLOT:
+    case SAN_BYTECODE_JUMP_IF_FALSE:
+    case SAN_BYTECODE_JUMP_IF_TRUE:
+    case SAN_BYTECODE_RET:
+      *needs = 1;
+      break;
+    case SAN_BYTECODE_DUP:
+      *needs = 1;
+      *leaves = 2;
+      break;
+    case SAN_BYTECODE_PICK:
+      *needs = code->arg1.ref + 1;
+      *leaves = code->arg1.ref + 2;
+      break;
+    case SAN_BYTECODE_ROLL:
+      *needs = *leaves = code->arg1.ref + 1;
+      break;
+    case SAN_BYTECODE_ADD:
+    case SAN_BYTECODE_MUL:
+    case SAN_BYTECODE_ADD_II:
+    case SAN_BYTECODE_MUL_II:
+    case SAN_BYTECODE_LIST_APPEND:
+      *needs = 2;
+      *leaves = 1;
+      break;
+    case SAN_BYTECODE_CALL_NATIVE:
+    case SAN_BYTECODE_CALL_NATIVE_I:
+    case SAN_BYTECODE_CALL:
+      *needs = code->arg2.ref;
+      *leaves = 1;
+      break;
+    case SAN_BYTECODE_TAILCALL:
+      *needs = code->arg2.ref;
+      break;
+    case SAN_BYTECODE_MAKE_LIST:
+    case SAN_BYTECODE_MAKE_LOCAL_LIST:
+      *needs = code->arg1.ref;
+      *leaves = 1;
+      break;
+    case SAN_BYTECODE_ITER:
+      *needs = 1;
+      *leaves = 2;
+      break;
+    case SAN_BYTECODE_ITER_NEXT:
+      /* [list index acc] -> [list index acc item] */
+      *needs = 3;
+      *leaves = 4;
+      break;
+  }
+}
+
+static const char *reach(vf_function_t *fun, int offset, int depth) {
+  if (offset >= fun->fn->length) return "runs off the end of its function";
+  if (fun->depths[offset] == UNVISITED) {
+    fun->depths[offset] = depth;
+    fun->worklist[fun->pending++] = offset;
+    return NULL;
+  }
+  return fun->depths[offset] == depth ? NULL : "reached with different stack depths";
+}
+
+/*
+ * Follows every path through the function from its entry and records the
+ * stack depth at each instruction. Returns why that failed, and where.
+ */
+static const char *trace_depths(vf_function_t *fun, int *pc) {
+  const san_function_t *fn = fun->fn;
+  const char *reason;
+
+  for (int i = 0; i < fn->length; ++i) fun->depths[i] = UNVISITED;
+
+  *pc = 0;
+  reason = reach(fun, 0, 0);
+  while (fun->pending > 0 && reason == NULL) {
+    const san_bytecode_t *code;
+    int depth, needs, leaves;
+
+    *pc = fun->worklist[--fun->pending];
+    code = &fun->code[*pc];
+    depth = fun->depths[*pc];
+    stack_effect(code, &needs, &leaves);
+
+    if (depth < needs) return "pops more than was pushed";
+    if (depth - needs + leaves > fun->maxDepth) fun->maxDepth = depth - needs + leaves;
+
+    if (code->opcode == SAN_BYTECODE_ITER_NEXT) {
+      /* The exit leaves only the accumulator where the list was */
+      reason = reach(fun, code->arg1.ref - fn->entry, depth - 2);
+    } else if (is_branch(code->opcode)) {
+      reason = reach(fun, code->arg1.ref - fn->entry, depth - needs + leaves);
+    }
+    if (reason == NULL && !ends_block(code->opcode)) {
+      reason = reach(fun, *pc + 1, depth - needs + leaves);
+    }
+  }
+
+  return reason;
+}
+
+static int verify_function(const san_program_t *program, san_function_t *fn, san_vector_t *errors) {
+  vf_function_t fun = { program, fn, NULL, NULL, NULL, 0, 0 };
+  const char *reason = NULL;
+  int pc = 0;
+
+  if (fn->length <= 0 || fn->entry < 0 || fn->entry + fn->length > program->bytecode.size) {
+    verifyError(errors, fn, fn->entry, "has no code");
+    return SAN_FAIL;
+  }
+  if (fn->arity < 0 || fn->nslots < fn->arity) {
+    verifyError(errors, fn, fn->entry, "has fewer slots than parameters");
+    return SAN_FAIL;
+  }
+
+  fun.code = sanv_nth(&program->bytecode, fn->entry);
+  for (pc = 0; pc < fn->length && reason == NULL; ++pc) {
+    reason = check_operands(&fun, &fun.code[pc]);
+  }
+  if (reason != NULL) {
+    verifyError(errors, fn, fn->entry + pc - 1, reason);
+    return SAN_FAIL;
+  }
+
+  fun.depths = SAN_MALLOC(fn->length * sizeof(int));
+  fun.worklist = SAN_MALLOC(fn->length * sizeof(int));
+  reason = trace_depths(&fun, &pc);
+
+  if (reason != NULL) {
+    verifyError(errors, fn, fn->entry + pc, reason);
+  } else {
+    fn->maxStack = fn->nslots + fun.maxDepth;
+  }
+
+  SAN_FREE(fun.depths);
+  SAN_FREE(fun.worklist);
+  return reason == NULL ? SAN_OK : SAN_FAIL;
+}
+
+int sanc_depths(const san_program_t *program, int function, int *depths) {
+  const san_function_t *fn = sanv_nth(&program->functions, function);
+  vf_function_t fun = { program, fn, NULL, depths, NULL, 0, 0 };
+  const char *reason;
+  int pc;
+
+  if (!program->verified) return SAN_FAIL;
+  fun.code = sanv_nth(&program->bytecode, fn->entry);
+  fun.worklist = SAN_MALLOC(fn->length * sizeof(int));
+  reason = trace_depths(&fun, &pc);
+  SAN_FREE(fun.worklist);
+  return reason == NULL ? SAN_OK : SAN_FAIL;
+}
+
+int sanc_verify(san_program_t *program, san_vector_t *errors) {
+  int result = SAN_OK;
+
+  program->verified = 0;
+  if (program->functions.size == 0) {
+    runtimeError(errors, SAN_ERROR_INVALID_BYTECODE, 0, "<main>", "is missing");
+    return SAN_FAIL;
+  }
+
+  SAN_VECTOR_FOR_EACH(program->functions, i, san_function_t, fn)
+    if (verify_function(program, fn, errors) != SAN_OK) result = SAN_FAIL;
+  SAN_VECTOR_END_FOR_EACH
+
+  program->verified = result == SAN_OK;
+  return result;
+}
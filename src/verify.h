@@ -0,0 +1,28 @@
+#ifndef __SAN_VERIFY_H
+#define __SAN_VERIFY_H
+
+#include "bytecode.h"
+
+/*
+ * Bytecode verifier
+ *
+ * Checks a program before it runs. Every operand must have the kind its
+ * opcode expects and refer to something that exists. Jumps must stay inside
+ * their function. Every path must reach an instruction with the same stack
+ * depth, never pop more than it pushed, and end in RET or TAILCALL.
+ *
+ * On success each function's maxStack holds the exact number of stack
+ * entries its frame can need, slots included, and the program is marked
+ * verified. The VM only runs verified programs and relies on maxStack to
+ * push without bounds checks.
+ */
+int sanc_verify(san_program_t *program, san_vector_t *errors);
+
+/*
+ * Fills depths with the stack depth, not counting the slots, on entry to
+ * each instruction of a function of a verified program, or -1 where the
+ * instruction is unreachable.
+ */
+int sanc_depths(const san_program_t *program, int function, int *depths);
+
+#endif
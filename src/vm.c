@@ -1,126 +1,1218 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include "vm.h"
-#include "std.h"
+#include "natives.h"
+#include "jit.h"
+#include "gc.h"
+#include "integer.h"
+#include "super.h"
 
-#define SAN_VM_INT         1
-#define SAN_VM_STRING      2
-#define SAN_VM_SYMBOL      3
-
-typedef struct {
-  int type;
-  union {
-    int integer;
-    const char *string;
-  } value;
-} vm_object;
+#define runtimeError(__errors, __code, ...) do { \
+  san_error_t err; \
+  memset(&err, 0, sizeof err); \
+  err.code = __code; \
+  sprintf(err.msg, __code##_MSG, __VA_ARGS__); \
+  sanv_push((__errors), &err); \
+} while (0)
 
 static inline vm_object vm_int(const san_program_t *program, int ref) {
-    int val = *(int*)sanv_nth(&program->numbers, ref);
-    vm_object obj = { SAN_VM_INT, { .integer = val } };
-    return obj;
+    return vm_from_int(*(int64_t*)sanv_nth(&program->numbers, ref));
 }
 
 static inline vm_object vm_string(const san_program_t *program, int ref) {
-    const char *val = *(const char**)sanv_nth(&program->strings, ref);
-    vm_object obj = { SAN_VM_STRING, { .string = val } };
-    return obj;
+    return vm_from_string(SAN_VM_STRING, *(const char**)sanv_nth(&program->strings, ref));
 }
 
-static inline vm_object vm_symbol(const san_program_t *program, int ref) {
-    const char *val = *(const char**)sanv_nth(&program->symbols, ref);
-    vm_object obj = { SAN_VM_SYMBOL, { .string = val } };
-    return obj;
+/*
+ * A call frame. Arguments and locals live on the value stack starting at
+ * base; returnPc is the instruction to resume the caller at. The frame's
+ * local lists are those in the arena from index arena on.
+ */
+typedef struct {
+  int function;
+  int returnPc;
+  int base;
+  int arena;
+} vm_frame;
+
+static inline const san_function_t *vm_function(const san_program_t *program, int ref) {
+  return (const san_function_t*)sanv_nth(&program->functions, ref);
 }
 
-int sanm_run(const san_program_t *program) {
-  san_dbg("\nRunning program:\n");
+/*
+ * The operand stack is a raw array of runtime->stackSize values allocated
+ * once. Its top value is cached in the local tos and sp points at the
+ * cell the top belongs in: every cell below sp is up to date, the one at
+ * sp may not be. Cell 0 is never used by a frame, so that sp has a cell
+ * to point at while the stack is empty. Code that needs the whole stack
+ * in memory, such as calls, flushes the top first.
+ */
+#define VM_PUSH(obj) do { *sp++ = tos; tos = (obj); } while (0)
+#define VM_DROP(count) do { sp -= (count); tos = *sp; } while (0)
+#define VM_FLUSH() (*sp = tos)
+
+/*
+ * The verifier proved how deep each frame's stack can get, so a frame only
+ * needs checking against the end of the stack when it is entered, and
+ * pushes and pops within it are unchecked.
+ */
+static inline int enter_frame(int base, const san_function_t *fn, int stackSize, san_vector_t *errors) {
+  if (base + fn->maxStack > stackSize) {
+    runtimeError(errors, SAN_ERROR_STACK_OVERFLOW, fn->name);
+    return 0;
+  }
+  return 1;
+}
+
+static inline int vm_is_truthy(vm_object obj) {
+  return obj != SAN_VM_NIL_OBJECT && obj != vm_from_int(0);
+}
+
+static const char *vm_type_name(int type) {
+  switch (type) {
+    case SAN_VM_INT:
+    case SAN_VM_BIGNUM: return "an integer";
+    case SAN_VM_STRING: return "a string";
+    case SAN_VM_SYMBOL: return "a symbol";
+    case SAN_VM_LIST: return "a list";
+  }
+  return "nil";
+}
 
-  san_vector_t stack;
-  sanv_create(&stack, sizeof(vm_object));
-  
+/*
+ * Checks that the top count values are integers, as the generic arithmetic
+ * ops and integer natives need.
+ */
+static int vm_check_ints(const vm_object *tos, const vm_object *sp, int count, san_vector_t *errors) {
+  for (int i = 0; i < count; ++i) {
+    vm_object obj = i == 0 ? *tos : sp[-i];
+    if (!vm_is_integer(obj)) {
+      runtimeError(errors, SAN_ERROR_TYPE_MISMATCH, "an integer", vm_type_name(vm_type(obj)));
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Points the error just raised at the source of the failing instruction,
+ * then adds where each call still active was made, innermost first. Only
+ * the innermost SAN_VM_TRACE_DEPTH calls are listed, which matters once
+ * the stack has overflowed.
+ */
+#define SAN_VM_TRACE_DEPTH 32
+
+static void locate_error(const san_program_t *program, san_vector_t *errors,
+  const san_vector_t *frames, int pc) {
+  san_error_t *err = sanv_back(errors);
+  sanb_position(program, pc, &err->line, &err->column);
+
+  for (int i = frames->size - 1; i > 0 && i >= (int)frames->size - SAN_VM_TRACE_DEPTH; --i) {
+    const vm_frame *frame = sanv_nth(frames, i);
+    runtimeError(errors, SAN_ERROR_CALLED_FROM, vm_function(program, frame->function)->name);
+    err = sanv_back(errors);
+    sanb_position(program, frame->returnPc - 1, &err->line, &err->column);
+  }
+}
+
+/*
+ * Lists local to a frame are recorded in the arena, outside the collector.
+ */
+static vm_object new_list(san_vector_t *owner) {
+  vm_list *list = SAN_CALLOC(1, sizeof(vm_list));
+  sanv_create(&list->items, sizeof(vm_object));
+  sanv_push(owner, &list);
+  return vm_from_list(list);
+}
+
+static int destroy_list(void *ptr) {
+  vm_list *list = *(vm_list**)ptr;
+  sanv_destroy(&list->items, sanv_nodestructor);
+  SAN_FREE(list);
+  return SAN_OK;
+}
+
+/*
+ * Frees the lists a frame made locally, all at once.
+ */
+static void release_locals(san_vector_t *arena, int mark) {
+  for (int i = mark; i < arena->size; ++i) destroy_list(sanv_nth(arena, i));
+  arena->size = mark;
+}
+
+/*
+ * Calls of a function, and its machine code once it has been called often
+ * enough and could be compiled.
+ */
+typedef struct vm_jit {
+  int calls;
+  int failed;
+  san_jit_code_t code;
+} vm_jit_t;
+
+/*
+ * Runs a call through compiled code if the function is hot and all its
+ * arguments are integers in a C int's range, setting ret. Returns 0 when
+ * the interpreter must run the call instead, as when the compiled code
+ * overflowed.
+ */
+static int vm_call_jit(const san_program_t *program, vm_jit_t *jit, int function,
+  const vm_object *argv, vm_object *ret) {
+  const san_function_t *fn = vm_function(program, function);
+  int args[SAN_JIT_REGISTERS], result;
+
+  if (jit->failed) return 0;
+  if (jit->code.entry == NULL) {
+    if (++jit->calls < SAN_JIT_THRESHOLD) return 0;
+    if (sanj_compile(program, function, &jit->code) != SAN_OK) {
+      jit->failed = 1;
+      return 0;
+    }
+  }
+
+  for (int i = 0; i < fn->arity; ++i) {
+    const vm_object *arg = &argv[i];
+    if (vm_type(*arg) != SAN_VM_INT || vm_to_int(*arg) < INT_MIN || vm_to_int(*arg) > INT_MAX) return 0;
+    args[i] = (int)vm_to_int(*arg);
+  }
+
+  san_dbg("JIT %s/%d\n", fn->name, fn->arity);
+  if (!jit->code.entry(args, &result)) return 0;
+  *ret = vm_from_int(result);
+  return 1;
+}
+
+/*
+ * Parallel loops
+ *
+ * A fused loop whose accumulator is a list or a sum can run its elements
+ * in chunks, each in a runtime of its own, when its body has no effects:
+ * it stores no globals and calls only pure natives and pure functions. A
+ * chunk's runtime starts from a copy of the frame the loop is in, reads
+ * the globals and list of the runtime it was split from, which waits for
+ * it, and runs the loop code as is, only with its ITER_NEXT swapped for
+ * CHUNK_NEXT. The chunks' heaps are then adopted and their accumulators
+ * combined in order. If any chunk fails, the whole loop runs again on the
+ * calling thread, which raises the error where it should be.
+ *
+ * A chunk's heap never has a major collection, which would mark lists of
+ * the runtime it reads; it only lives as long as the chunk anyway.
+ *
+ * The chunks of a loop share one copy of the decoded code, and start from
+ * the machine code the calling runtime has compiled. Each one's stack only
+ * holds the loop's frame and SAN_VM_CHUNK_STACK_SIZE values for the calls
+ * its body makes; a chunk that needs more fails like any other.
+ */
+#define SAN_BYTECODE_CHUNK_NEXT 64
+#define SAN_VM_CHUNK_STACK_SIZE (1 << 14)
+
+typedef struct {
+  san_runtime_t *parent;
+  const san_program_t *program;
+  int function, iter;
+  const vm_object *frame;   /* the loop's frame, up to the list iterated */
+  int frameSize;
+  struct vm_instruction *decoded;
+  const vm_jit_t *jit;      /* the calling runtime's */
+  int begin, end;
+  san_runtime_t runtime;
+  san_vector_t errors;
+  san_vector_t arena;       /* local lists the chunk made, left for the parent */
+  vm_object acc;
+  int result;
+} vm_chunk_t;
+
+static int vm_interpret(san_runtime_t *runtime, vm_chunk_t *chunk, san_vector_t *errors);
+static struct vm_instruction *chunk_code(const san_program_t *program, const struct vm_instruction *decoded,
+  int iter, const void **handlers, const void *chunkNext, int profiled);
+
+static int is_pure_code(const san_program_t *program, const char *pure, int from, int to) {
+  for (int pc = from; pc < to; ++pc) {
+    const san_bytecode_t *code = sanv_nth(&program->bytecode, pc);
+    switch (code->opcode) {
+      case SAN_BYTECODE_STORE_SLOT:
+        if (code->arg1.type == SAN_BYTECODE_TYPE_GLOBAL) return 0;
+        break;
+      case SAN_BYTECODE_CALL_NATIVE:
+      case SAN_BYTECODE_CALL_NATIVE_I:
+        if (!(sann_nth(code->arg1.ref)->flags & SAN_NATIVE_PURE)) return 0;
+        break;
+      case SAN_BYTECODE_CALL:
+      case SAN_BYTECODE_TAILCALL:
+        if (!pure[code->arg1.ref]) return 0;
+        break;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Which functions are pure, assuming they all are until one is shown not
+ * to be, so that recursion alone doesn't make a function impure.
+ */
+static char *pure_functions(const san_program_t *program) {
+  char *pure = SAN_MALLOC(program->functions.size);
+  int changed = 1;
+
+  memset(pure, 1, program->functions.size);
+  while (changed) {
+    changed = 0;
+    SAN_VECTOR_FOR_EACH(program->functions, i, san_function_t, fn)
+      if (pure[i] && !is_pure_code(program, pure, fn->entry, fn->entry + fn->length)) {
+        pure[i] = 0;
+        changed = 1;
+      }
+    SAN_VECTOR_END_FOR_EACH
+  }
+  return pure;
+}
+
+static void run_chunk(void *ptr) {
+  vm_chunk_t *chunk = ptr;
+  san_gc_limits_t limits = { chunk->parent->gc.limits.nurserySize, INT_MAX, 0 };
+
+  sanm_create(&chunk->runtime, &limits, chunk->parent->out);
+  sanv_create(&chunk->errors, sizeof(san_error_t));
+  chunk->runtime.stackSize = 1 + vm_function(chunk->program, chunk->function)->maxStack + SAN_VM_CHUNK_STACK_SIZE;
+  chunk->runtime.globals = chunk->parent->globals;
+  chunk->runtime.context.program = chunk->program;
+  chunk->result = vm_interpret(&chunk->runtime, chunk, &chunk->errors);
+  chunk->runtime.globals = NULL;
+}
+
+/*
+ * Runs the loop starting at iter over the list at the top of frame in
+ * chunks, folding them into acc, which holds the initial accumulator. The
+ * lists the chunks made locally join arena. handlers and chunkNext are
+ * those of threaded dispatch, or NULL. Returns SAN_FAIL if the loop must
+ * run sequentially instead.
+ */
+static int run_parallel(san_runtime_t *runtime, const san_program_t *program, int function,
+  int iter, const vm_object *frame, int frameSize, vm_object *acc, san_vector_t *arena,
+  const void **handlers, const void *chunkNext) {
+  san_context_t *context = &runtime->context;
+  const san_bytecode_t *code = sanv_nth(&program->bytecode, iter);
+  const san_bytecode_t *next = sanv_nth(&program->bytecode, iter + 2);
+  int size = vm_to_list(frame[frameSize - 1])->items.size;
+  int nchunks = runtime->pool->nworkers * SAN_VM_PARALLEL_CHUNKS;
+  int result = SAN_OK;
+  san_batch_t batch = { 0 };
+  vm_chunk_t *chunks;
+  struct vm_instruction *decoded;
+
+  if (next->opcode != SAN_BYTECODE_ITER_NEXT) return SAN_FAIL;
+  if (context->pure == NULL) context->pure = pure_functions(program);
+  if (!is_pure_code(program, context->pure, iter + 3, next->arg1.ref)) return SAN_FAIL;
+
+  san_dbg("PARALLEL %d elements, %d chunks\n", size, nchunks);
+  decoded = chunk_code(program, context->decoded, iter, handlers, chunkNext, runtime->profile != NULL);
+  chunks = SAN_CALLOC(nchunks, sizeof(vm_chunk_t));
+  for (int i = 0; i < nchunks; ++i) {
+    vm_chunk_t *chunk = &chunks[i];
+    chunk->parent = runtime;
+    chunk->program = program;
+    chunk->function = function;
+    chunk->iter = iter;
+    chunk->frame = frame;
+    chunk->frameSize = frameSize;
+    chunk->decoded = decoded;
+    chunk->jit = context->jit;
+    chunk->begin = (int)((int64_t)size * i / nchunks);
+    chunk->end = (int)((int64_t)size * (i + 1) / nchunks);
+    sanw_submit(runtime->pool, &batch, run_chunk, chunk);
+  }
+  sanw_wait(runtime->pool, &batch);
+
+  for (int i = 0; i < nchunks; ++i) {
+    if (chunks[i].result != SAN_OK) result = SAN_FAIL;
+  }
+
+  for (int i = 0; i < nchunks; ++i) {
+    vm_chunk_t *chunk = &chunks[i];
+    if (result == SAN_OK) {
+      san_gc_roots_t roots = { &chunk->acc, 1, NULL, 0, &chunk->arena };
+      sang_adopt(&runtime->gc, &chunk->runtime.gc, &roots);
+      SAN_VECTOR_FOR_EACH(chunk->arena, j, vm_list*, local)
+        sanv_push(arena, local);
+      SAN_VECTOR_END_FOR_EACH
+      sanv_destroy(&chunk->arena, sanv_nodestructor);
+
+      if (code->arg1.ref == SAN_BYTECODE_ITER_LIST) {
+        vm_list *list = vm_to_list(*acc), *part = vm_to_list(chunk->acc);
+        SAN_VECTOR_FOR_EACH(part->items, j, vm_object, item)
+          sanv_push(&list->items, item);
+          sang_barrier(&runtime->gc, list, *item);
+        SAN_VECTOR_END_FOR_EACH
+      } else {
+        *acc = sani_add(&runtime->gc, *acc, chunk->acc);
+      }
+    } else {
+      sanv_destroy(&chunk->arena, destroy_list);
+    }
+    sanm_destroy(&chunk->runtime);
+    sanv_destroy(&chunk->errors, sane_destructor);
+  }
+  SAN_FREE(chunks);
+  SAN_FREE(decoded);
+  return result;
+}
+
+/*
+ * Dispatch. With GCC or Clang each instruction is decoded once into the
+ * address of its handler, and every handler ends in its own indirect jump
+ * to the next; otherwise the loop switches on the opcode. Defining
+ * SAN_VM_SWITCH forces the switch.
+ */
+#if defined(__GNUC__) && !defined(SAN_VM_SWITCH)
+#define VM_THREADED
+#endif
+
+#ifdef VM_THREADED
+/* Label addresses and goto * are GNU extensions */
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define VM_OP(op) op_##op
+#define VM_DISPATCH() do { code = &decoded[pc].code; goto *decoded[pc++].handler; } while (0)
+#else
+#define VM_OP(op) case SAN_BYTECODE_##op
+#define VM_DISPATCH() break
+#endif
+
+typedef struct vm_instruction {
+  const void *handler;
+  san_bytecode_t code;
+} vm_instruction;
+
+#define VM_ROOTS() do { \
+  roots.stack = stack + 1; \
+  roots.stackSize = sp - stack; \
+  roots.globals = globals; \
+  roots.nglobals = program->nglobals + 1; \
+  roots.locals = &arena; \
+} while (0)
+
+/*
+ * Bignums are allocated without collecting, so instructions that may make
+ * one collect afterwards if enough have been, once the stack holds them
+ * all. Lists on the stack may move, so the top is reloaded.
+ */
+#define VM_SAFEPOINT() do { \
+  if (sang_due(gc)) { \
+    VM_FLUSH(); \
+    VM_ROOTS(); \
+    if (sang_collect(gc, &roots) != SAN_OK) { \
+      runtimeError(errors, SAN_ERROR_OUT_OF_MEMORY, gc->limits.heapLimit); \
+      result = SAN_FAIL; \
+      goto out; \
+    } \
+    tos = *sp; \
+  } \
+} while (0)
+
+/*
+ * Profiling counts each instruction before it runs, and takes the sample
+ * due if there is one. With threaded dispatch, every instruction is then
+ * decoded to the PROFILE stub, which goes on to the real handler, so that
+ * a runtime without a profile dispatches exactly as it would otherwise.
+ */
+#define VM_PROFILE() do { \
+  int super = super_at(program, pc - 1); \
+  sanr_count(profile, code->opcode, pc - 1, super != 0 ? sanb_super(super)->length : 1); \
+  if (profile->due) take_sample(profile, &frames, pc - 1); \
+} while (0)
+
+static void take_sample(san_profile_t *profile, const san_vector_t *frames, int pc) {
+  int pcs[SAN_PROFILE_DEPTH], depth = 0;
+
+  profile->due = 0;
+  pcs[depth++] = pc;
+  for (int i = frames->size - 1; i > 0 && depth < SAN_PROFILE_DEPTH; --i) {
+    pcs[depth++] = ((const vm_frame*)sanv_nth(frames, i))->returnPc - 1;
+  }
+  sanr_sample(profile, pcs, depth);
+}
+
+/*
+ * Budgets. Each backward branch and call counts a step off ticks, the
+ * steps given out so far; once they are spent, vm_refill gives out the
+ * next slice, or 0 when the program is to be preempted.
+ */
+typedef struct {
+  int64_t left;         /* steps not given out yet */
+  double deadline;      /* 0 if there is none */
+} vm_budget_t;
+
+static int64_t vm_refill(vm_budget_t *budget) {
+  int64_t slice = budget->left < SAN_VM_BUDGET_SLICE ? budget->left : SAN_VM_BUDGET_SLICE;
+  if (slice == 0 || (budget->deadline > 0 && sanm_time() >= budget->deadline)) return 0;
+  budget->left -= slice;
+  return slice;
+}
+
+#define VM_STEP() do { \
+  if (--ticks <= 0 && (ticks = vm_refill(&budget)) == 0) { \
+    result = SAN_VM_PREEMPTED; \
+    goto suspend; \
+  } \
+} while (0)
+
+/*
+ * The instructions that can run first in a superinstruction, which are
+ * written once here for their own handlers and the fused ones.
+ */
+#define VM_DO_PUSH() do { \
+  switch (code->arg1.type) { \
+    case SAN_BYTECODE_TYPE_NUMBER_LITERAL: { \
+      vm_object obj = vm_int(program, code->arg1.ref); \
+      san_dbg("PUSH %d\n", (int)vm_to_int(obj)); \
+      VM_PUSH(obj); \
+      break; \
+    } \
+    case SAN_BYTECODE_TYPE_BIGNUM_LITERAL: { \
+      const char *digits = *(const char**)sanv_nth(&program->bignums, code->arg1.ref); \
+      san_dbg("PUSH %s\n", digits); \
+      VM_PUSH(sani_parse(gc, digits)); \
+      VM_SAFEPOINT(); \
+      break; \
+    } \
+    case SAN_BYTECODE_TYPE_STRING_LITERAL: { \
+      vm_object obj = vm_string(program, code->arg1.ref); \
+      san_dbg("PUSH %s\n", vm_to_string(obj)); \
+      VM_PUSH(obj); \
+      break; \
+    } \
+    case SAN_BYTECODE_TYPE_NIL: { \
+      san_dbg("PUSH nil\n"); \
+      VM_PUSH(nil); \
+      break; \
+    } \
+  } \
+} while (0)
+
+#define VM_DO_POP() do { \
+  san_dbg("POP\n"); \
+  VM_DROP(1); \
+} while (0)
+
+#define VM_DO_PICK() do { \
+  vm_object obj = code->arg1.ref == 0 ? tos : sp[-code->arg1.ref]; \
+  san_dbg("PICK %d\n", code->arg1.ref); \
+  VM_PUSH(obj); \
+} while (0)
+
+#define VM_DO_DUP() do { \
+  san_dbg("DUP\n"); \
+  VM_PUSH(tos); \
+} while (0)
+
+#define VM_DO_LOAD_SLOT() do { \
+  vm_object obj; \
+  san_dbg("LOAD_SLOT %d\n", code->arg1.ref); \
+  VM_FLUSH(); \
+  obj = code->arg1.type == SAN_BYTECODE_TYPE_GLOBAL \
+    ? globals[code->arg1.ref] \
+    : stack[frame->base + code->arg1.ref]; \
+  VM_PUSH(obj); \
+} while (0)
+
+/* The slot may be the new top, so tos is reloaded after the store */
+#define VM_DO_STORE_SLOT() do { \
+  vm_object obj = tos; \
+  san_dbg("STORE_SLOT %d\n", code->arg1.ref); \
+  sp--; \
+  if (code->arg1.type == SAN_BYTECODE_TYPE_GLOBAL) { \
+    globals[code->arg1.ref] = obj; \
+  } else { \
+    stack[frame->base + code->arg1.ref] = obj; \
+  } \
+  tos = *sp; \
+} while (0)
+
+/* The second operand is in tos, which takes the result */
+#define VM_DO_ADD_II() do { \
+  vm_object arg1 = *--sp; \
+  san_dbg("ADD\n"); \
+  tos = sani_add(gc, arg1, tos); \
+  VM_SAFEPOINT(); \
+} while (0)
+
+#define VM_DO_MUL_II() do { \
+  vm_object arg1 = *--sp; \
+  san_dbg("MUL\n"); \
+  tos = sani_mul(gc, arg1, tos); \
+  VM_SAFEPOINT(); \
+} while (0)
+
+/* The result takes the first argument's cell */
+#define VM_DO_CALL_NATIVE_I() do { \
+  san_native_t const *native = sann_nth(code->arg1.ref); \
+  int argc = code->arg2.ref; \
+  vm_object *args = sp - argc + 1; \
+  vm_object ret = SAN_VM_NIL_OBJECT; \
+  san_dbg("CALL_NATIVE %s/%d\n", native->name, argc); \
+  VM_FLUSH(); \
+  if (native->fn(runtime, args, argc, &ret) != SAN_OK) { \
+    runtimeError(errors, SAN_ERROR_NATIVE_FAILED, native->name); \
+    result = SAN_FAIL; \
+    goto out; \
+  } \
+  sp = args; \
+  tos = ret; \
+  VM_SAFEPOINT(); \
+  if (runtime->suspending) { \
+    runtime->suspending = 0; \
+    result = SAN_VM_SUSPENDED; \
+    goto suspend; \
+  } \
+} while (0)
+
+int sanm_fusable(int opcode) {
+  switch (opcode) {
+    case SAN_BYTECODE_PUSH:
+    case SAN_BYTECODE_POP:
+    case SAN_BYTECODE_PICK:
+    case SAN_BYTECODE_DUP:
+    case SAN_BYTECODE_LOAD_SLOT:
+    case SAN_BYTECODE_STORE_SLOT:
+    case SAN_BYTECODE_ADD_II:
+    case SAN_BYTECODE_MUL_II:
+    case SAN_BYTECODE_CALL_NATIVE_I:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * A superinstruction runs each instruction but the last in turn, keeping
+ * pc and code as their own handlers would, then jumps straight to the
+ * last one's handler, which dispatches once for them all.
+ */
+#define VM_NEXT() (code = &decoded[pc++].code)
+#define VM_SUPER2(a, b) op_##a##__##b: \
+  VM_DO_##a(); VM_NEXT(); goto op_##b;
+#define VM_SUPER3(a, b, c) op_##a##__##b##__##c: \
+  VM_DO_##a(); VM_NEXT(); VM_DO_##b(); VM_NEXT(); goto op_##c;
+#define VM_SUPER2_HANDLER(a, b) &&op_##a##__##b,
+#define VM_SUPER3_HANDLER(a, b, c) &&op_##a##__##b##__##c,
+
+/* The superinstruction generated to start at pc, if the code there is still what it fuses */
+static int super_at(const san_program_t *program, int pc) {
+  const san_super_t *super;
+  int id = pc < program->supers.size ? *(int*)sanv_nth(&program->supers, pc) : 0;
+
+  if ((super = sanb_super(id)) == NULL || pc + super->length > program->bytecode.size) return 0;
+  for (int i = 0; i < super->length; ++i) {
+    if (((const san_bytecode_t*)sanv_nth(&program->bytecode, pc + i))->opcode != super->opcodes[i]) return 0;
+  }
+  return id;
+}
+
+/*
+ * Each instruction is decoded to its handler, or to stub if there is one,
+ * and those starting a superinstruction with a handler in supers to that.
+ */
+static vm_instruction *decode(const san_program_t *program, const void **handlers,
+  const void **supers, const void *stub) {
+  vm_instruction *decoded = SAN_MALLOC(program->bytecode.size * sizeof(vm_instruction));
   SAN_VECTOR_FOR_EACH(program->bytecode, i, san_bytecode_t, code)
+    int super = stub == NULL && supers != NULL ? super_at(program, i) : 0;
+    decoded[i].handler = stub != NULL ? stub : super != 0 ? supers[super]
+      : handlers != NULL ? handlers[code->opcode] : NULL;
+    decoded[i].code = *code;
+  SAN_VECTOR_END_FOR_EACH
+  return decoded;
+}
+
+/*
+ * The code the chunks of the loop at iter run: decoded, with the loop's
+ * ITER_NEXT swapped for CHUNK_NEXT, which no superinstruction may run
+ * either. Chunks aren't profiled, so profiled code goes to the handlers.
+ */
+static vm_instruction *chunk_code(const san_program_t *program, const vm_instruction *decoded,
+  int iter, const void **handlers, const void *chunkNext, int profiled) {
+  int length = program->bytecode.size;
+  int from = profiled ? 0 : iter + 3 - SAN_BYTECODE_SUPER_LENGTH, to = profiled ? length : iter + 2;
+  vm_instruction *shared = SAN_MALLOC(length * sizeof(vm_instruction));
+
+  memcpy(shared, decoded, length * sizeof(vm_instruction));
+  shared[iter + 2].code.opcode = SAN_BYTECODE_CHUNK_NEXT;
+  if (handlers == NULL) return shared;
+
+  for (int i = from < 0 ? 0 : from; i < to; ++i) shared[i].handler = handlers[shared[i].code.opcode];
+  shared[iter + 2].handler = chunkNext;
+  return shared;
+}
+
+/*
+ * Frees what the VM made to run the program in runtime, handing the lists
+ * local to its frames to chunk if it ran one.
+ */
+static void close_context(san_runtime_t *runtime, vm_chunk_t *chunk) {
+  san_context_t *context = &runtime->context;
+
+  /* A chunk only owns the machine code it compiled itself */
+  for (int i = 0; i < context->program->functions.size; ++i) {
+    if (chunk == NULL || chunk->jit[i].code.entry == NULL) sanj_free(&context->jit[i].code);
+  }
+  SAN_FREE(context->jit);
+  if (chunk == NULL) SAN_FREE(context->decoded);
+  SAN_FREE(context->pure);
+  if (chunk != NULL) {
+    chunk->arena = context->arena;
+  } else {
+    sanv_destroy(&context->arena, destroy_list);
+  }
+  sanv_destroy(&context->frames, sanv_nodestructor);
+  memset(context, 0, sizeof *context);
+}
+
+static void vm_sleep(double seconds) {
+  struct timespec delay;
+  if (seconds <= 0) return;
+  delay.tv_sec = (time_t)seconds;
+  delay.tv_nsec = (long)((seconds - delay.tv_sec) * 1e9);
+  /* Profiling signals cut sleeps short */
+  while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {}
+}
+
+double sanm_time(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void sanm_create(san_runtime_t *runtime, const san_gc_limits_t *limits, FILE *out) {
+  memset(runtime, 0, sizeof *runtime);
+  sang_create(&runtime->gc, limits);
+  runtime->stackSize = SAN_VM_STACK_SIZE;
+  runtime->out = out;
+  runtime->parallelThreshold = SAN_VM_PARALLEL_THRESHOLD;
+}
+
+void sanm_destroy(san_runtime_t *runtime) {
+  san_gc_stats_t *stats = &runtime->gc.stats;
+  san_dbg("GC: %d minor, %d major, %d promoted, %d freed, %.3f ms total, %.3f ms longest\n",
+    stats->minor, stats->major, stats->promoted, stats->freed, stats->totalPause, stats->maxPause);
+  sanm_abort(runtime);
+  sang_destroy(&runtime->gc);
+  SAN_FREE(runtime->stack);
+}
+
+static int run_program(const san_program_t *program, san_profile_t *profile, san_vector_t *errors) {
+  san_gc_limits_t limits = SAN_GC_DEFAULT_LIMITS;
+  san_runtime_t runtime;
+  san_pool_t pool;
+  int result;
+
+  sanm_create(&runtime, &limits, stdout);
+  if (sanw_create(&pool, 0) == SAN_OK) runtime.pool = &pool;
+  runtime.profile = profile;
+  if (profile != NULL) sanr_start(profile, SAN_PROFILE_HZ);
+  result = sanm_execute(&runtime, program, errors);
+  if (profile != NULL) sanr_stop(profile);
+  sanw_destroy(&pool);
+  sanm_destroy(&runtime);
+  return result;
+}
+
+int sanm_run(const san_program_t *program, san_vector_t *errors) {
+  return run_program(program, NULL, errors);
+}
+
+int sanm_profile(const san_program_t *program, san_profile_t *profile, san_vector_t *errors) {
+  return run_program(program, profile, errors);
+}
+
+int sanm_execute(san_runtime_t *runtime, const san_program_t *program, san_vector_t *errors) {
+  int result = sanm_start(runtime, program, errors);
+  while (result == SAN_OK && (result = sanm_resume(runtime, errors)) == SAN_VM_SUSPENDED) {
+    vm_sleep(runtime->wakeAt - sanm_time());
+    result = SAN_OK;
+  }
+  return result;
+}
+
+int sanm_start(san_runtime_t *runtime, const san_program_t *program, san_vector_t *errors) {
+  san_dbg("\nRunning program:\n");
+
+  if (!program->verified) {
+    runtimeError(errors, SAN_ERROR_INVALID_BYTECODE, 0, "<main>", "has not been verified");
+    return SAN_FAIL;
+  }
+
+  runtime->globals = SAN_CALLOC(program->nglobals + 1, sizeof(vm_object));
+  runtime->context.program = program;
+  return SAN_OK;
+}
+
+int sanm_resume(san_runtime_t *runtime, san_vector_t *errors) {
+  int result = vm_interpret(runtime, NULL, errors);
+  if (result != SAN_VM_SUSPENDED && result != SAN_VM_PREEMPTED) {
+    SAN_FREE(runtime->globals);
+    runtime->globals = NULL;
+  }
+  return result;
+}
+
+void sanm_abort(san_runtime_t *runtime) {
+  if (runtime->context.decoded != NULL) close_context(runtime, NULL);
+  memset(&runtime->context, 0, sizeof runtime->context);
+  SAN_FREE(runtime->globals);
+  runtime->globals = NULL;
+}
+
+void sanm_sleep(san_runtime_t *runtime, double seconds) {
+  if (runtime->context.decoded == NULL) {
+    vm_sleep(seconds);
+    return;
+  }
+  runtime->wakeAt = sanm_time() + seconds;
+  runtime->suspending = 1;
+}
+
+/*
+ * Runs the program started in runtime from where it stands, or a chunk of
+ * a parallel loop if chunk isn't NULL. Everything the program needs to go
+ * on is kept in runtime->context, so it can be suspended between any two
+ * instructions.
+ */
+static int vm_interpret(san_runtime_t *runtime, vm_chunk_t *chunk, san_vector_t *errors) {
+  san_context_t *context = &runtime->context;
+  const san_program_t *program = context->program;
+  int result = SAN_OK, starting = context->decoded == NULL;
+  san_vector_t frames, arena;
+  san_gc_t *gc = &runtime->gc;
+  san_gc_roots_t roots;
+  vm_frame *frame;
+  vm_object nil = SAN_VM_NIL_OBJECT;
+  vm_object *stack, *sp, tos;
+  vm_object *globals = runtime->globals;
+  vm_object ret;
+  san_profile_t *profile = runtime->profile;
+  vm_budget_t budget;
+  int64_t ticks;
+  int budgeted = runtime->budget.steps > 0 || runtime->budget.seconds > 0;
+  vm_jit_t *jit;
+  vm_instruction *decoded;
+  const san_bytecode_t *code;
+  int pc;
+
+#ifdef VM_THREADED
+  static const void *handlers[] = {
+    [SAN_BYTECODE_PUSH] = &&op_PUSH,
+    [SAN_BYTECODE_POP] = &&op_POP,
+    [SAN_BYTECODE_MUL] = &&op_MUL,
+    [SAN_BYTECODE_ADD] = &&op_ADD,
+    [SAN_BYTECODE_CALL_NATIVE] = &&op_CALL_NATIVE,
+    [SAN_BYTECODE_CALL] = &&op_CALL,
+    [SAN_BYTECODE_TAILCALL] = &&op_TAILCALL,
+    [SAN_BYTECODE_RET] = &&op_RET,
+    [SAN_BYTECODE_LOAD_SLOT] = &&op_LOAD_SLOT,
+    [SAN_BYTECODE_STORE_SLOT] = &&op_STORE_SLOT,
+    [SAN_BYTECODE_JUMP] = &&op_JUMP,
+    [SAN_BYTECODE_JUMP_IF_FALSE] = &&op_JUMP_IF_FALSE,
+    [SAN_BYTECODE_PICK] = &&op_PICK,
+    [SAN_BYTECODE_ROLL] = &&op_ROLL,
+    [SAN_BYTECODE_MAKE_LIST] = &&op_MAKE_LIST,
+    [SAN_BYTECODE_LIST_APPEND] = &&op_LIST_APPEND,
+    [SAN_BYTECODE_ITER] = &&op_ITER,
+    [SAN_BYTECODE_ITER_NEXT] = &&op_ITER_NEXT,
+    [SAN_BYTECODE_JUMP_IF_TRUE] = &&op_JUMP_IF_TRUE,
+    [SAN_BYTECODE_DUP] = &&op_DUP,
+    [SAN_BYTECODE_ADD_II] = &&op_ADD_II,
+    [SAN_BYTECODE_MUL_II] = &&op_MUL_II,
+    [SAN_BYTECODE_CALL_NATIVE_I] = &&op_CALL_NATIVE_I,
+    [SAN_BYTECODE_MAKE_LOCAL_LIST] = &&op_MAKE_LOCAL_LIST,
+    [SAN_BYTECODE_CHUNK_NEXT] = &&op_CHUNK_NEXT
+  };
+  static const void *supers[] = { NULL, SAN_SUPERINSTRUCTIONS(VM_SUPER2_HANDLER, VM_SUPER3_HANDLER) };
+  const void **chunkHandlers = handlers, *chunkNext = &&op_CHUNK_NEXT;
+#else
+  const void **chunkHandlers = NULL, *chunkNext = NULL;
+#endif
+
+  if (starting) {
+    vm_frame main = { chunk != NULL ? chunk->function : 0, -1, 1, 0 };
+    if (chunk != NULL) {
+      context->decoded = chunk->decoded;
+    } else {
+#ifdef VM_THREADED
+      context->decoded = decode(program, handlers, supers, profile != NULL ? &&op_PROFILE : NULL);
+#else
+      context->decoded = decode(program, NULL, NULL, NULL);
+#endif
+    }
+    context->jit = SAN_CALLOC(program->functions.size, sizeof(vm_jit_t));
+    if (chunk != NULL) memcpy(context->jit, chunk->jit, program->functions.size * sizeof(vm_jit_t));
+    for (int i = 0; profile != NULL && i < program->functions.size; ++i) context->jit[i].failed = 1;
+    sanv_create(&context->frames, sizeof(vm_frame));
+    sanv_create(&context->arena, sizeof(vm_list*));
+    sanv_push(&context->frames, &main);
+    if (runtime->stack == NULL) runtime->stack = SAN_MALLOC(runtime->stackSize * sizeof(vm_object));
+  }
+
+  decoded = context->decoded;
+  jit = context->jit;
+  frames = context->frames;
+  arena = context->arena;
+  frame = (vm_frame*)sanv_back(&frames);
+  stack = runtime->stack;
+  sp = stack + context->sp;
+  tos = starting ? nil : *sp;
+  pc = context->pc;
+
+  budget.left = runtime->budget.steps > 0 ? runtime->budget.steps : INT64_MAX;
+  budget.deadline = runtime->budget.seconds > 0 ? sanm_time() + runtime->budget.seconds : 0;
+  ticks = vm_refill(&budget);
+
+  /* Unless starting, everything is where the program was suspended */
+  if (starting && !enter_frame(frame->base, vm_function(program, frame->function), runtime->stackSize, errors)) {
+    result = SAN_FAIL;
+    goto out;
+  }
+  if (starting && chunk == NULL) {
+    pc = vm_function(program, 0)->entry;
+    tos = nil;
+    for (int i = 0; i < vm_function(program, 0)->nslots; ++i) VM_PUSH(nil);
+  } else if (starting) {
+    /* [frame... list] becomes [frame... list begin acc], and the loop goes on from ITER_NEXT */
+    vm_list *allocated;
+    memcpy(stack + 1, chunk->frame, chunk->frameSize * sizeof(vm_object));
+    sp = stack + chunk->frameSize;
+    tos = *sp;
+    VM_PUSH(vm_from_int(chunk->begin));
+    VM_PUSH(vm_from_int(0));
+    if (decoded[chunk->iter].code.arg1.ref == SAN_BYTECODE_ITER_LIST) {
+      VM_FLUSH();
+      VM_ROOTS();
+      if ((allocated = sang_alloc(gc, &roots)) == NULL) {
+        runtimeError(errors, SAN_ERROR_OUT_OF_MEMORY, gc->limits.heapLimit);
+        result = SAN_FAIL;
+        goto out;
+      }
+      tos = vm_from_list(allocated);
+    }
+    pc = chunk->iter + 2;
+  }
+
+#ifdef VM_THREADED
+  VM_DISPATCH();
+#else
+  while (pc < program->bytecode.size) {
+    code = &decoded[pc++].code;
+    if (profile != NULL) VM_PROFILE();
     switch (code->opcode) {
+#endif
+
+      VM_OP(PUSH): {
+        VM_DO_PUSH();
+        VM_DISPATCH();
+      }
+
+      VM_OP(POP): {
+        VM_DO_POP();
+        VM_DISPATCH();
+      }
+
+      VM_OP(PICK): {
+        VM_DO_PICK();
+        VM_DISPATCH();
+      }
+
+      VM_OP(DUP): {
+        VM_DO_DUP();
+        VM_DISPATCH();
+      }
+
+      VM_OP(ROLL): {
+        /* Moves the value at the given depth to the top */
+        int depth = code->arg1.ref;
+        vm_object obj;
+        san_dbg("ROLL %d\n", depth);
+        VM_FLUSH();
+        obj = sp[-depth];
+        memmove(sp - depth, sp - depth + 1, depth * sizeof(vm_object));
+        tos = obj;
+        VM_DISPATCH();
+      }
 
-      case SAN_BYTECODE_PUSH: {
-        switch (code->arg1.type) {
-          case SAN_BYTECODE_TYPE_NUMBER_LITERAL: {
-            vm_object obj = vm_int(program, code->arg1.ref);
-            san_dbg("PUSH %d\n", obj.value.integer);
-            sanv_push(&stack, (void*)&obj);
-            break;
+      VM_OP(JUMP): {
+        int backward = code->arg1.ref < pc;
+        san_dbg("JUMP %d\n", code->arg1.ref);
+        pc = code->arg1.ref;
+        if (backward) VM_STEP();
+        VM_DISPATCH();
+      }
+
+      VM_OP(JUMP_IF_FALSE): {
+        vm_object cond = tos;
+        VM_DROP(1);
+        san_dbg("JUMP_IF_FALSE %d\n", code->arg1.ref);
+        if (!vm_is_truthy(cond)) {
+          int backward = code->arg1.ref < pc;
+          pc = code->arg1.ref;
+          if (backward) VM_STEP();
+        }
+        VM_DISPATCH();
+      }
+
+      VM_OP(JUMP_IF_TRUE): {
+        vm_object cond = tos;
+        VM_DROP(1);
+        san_dbg("JUMP_IF_TRUE %d\n", code->arg1.ref);
+        if (vm_is_truthy(cond)) {
+          int backward = code->arg1.ref < pc;
+          pc = code->arg1.ref;
+          if (backward) VM_STEP();
+        }
+        VM_DISPATCH();
+      }
+
+      VM_OP(MAKE_LIST):
+      VM_OP(MAKE_LOCAL_LIST): {
+        int count = code->arg1.ref;
+        vm_object list;
+        san_dbg("MAKE_LIST %d\n", count);
+        VM_FLUSH();
+        if (code->opcode == SAN_BYTECODE_MAKE_LOCAL_LIST) {
+          list = new_list(&arena);
+        } else {
+          /* A collection moves lists on the stack, so the top is reloaded */
+          vm_list *allocated;
+          VM_ROOTS();
+          if ((allocated = sang_alloc(gc, &roots)) == NULL) {
+            runtimeError(errors, SAN_ERROR_OUT_OF_MEMORY, gc->limits.heapLimit);
+            result = SAN_FAIL;
+            goto out;
           }
-          case SAN_BYTECODE_TYPE_IDENTIFIER: {
-            vm_object obj = vm_symbol(program, code->arg1.ref);
-            san_dbg("PUSH %s\n", obj.value.string);
-            sanv_push(&stack, (void*)&obj);
-            break;
+          list = vm_from_list(allocated);
+          tos = *sp;
+        }
+        for (int i = count - 1; i >= 0; --i) {
+          sanv_push(&vm_to_list(list)->items, sp - i);
+        }
+        VM_DROP(count);
+        VM_PUSH(list);
+        VM_DISPATCH();
+      }
+
+      VM_OP(LIST_APPEND): {
+        vm_object item = tos;
+        VM_DROP(1);
+        san_dbg("LIST_APPEND\n");
+        sanv_push(&vm_to_list(tos)->items, &item);
+        sang_barrier(gc, vm_to_list(tos), item);
+        VM_DISPATCH();
+      }
+
+      VM_OP(ITER): {
+        vm_object index = vm_from_int(0);
+        int type = vm_type(tos);
+        san_dbg("ITER\n");
+        if (type != SAN_VM_LIST) {
+          runtimeError(errors, SAN_ERROR_TYPE_MISMATCH, "a list", vm_type_name(type));
+          result = SAN_FAIL;
+          goto out;
+        }
+        if (runtime->pool != NULL && !budgeted && code->arg1.type == SAN_BYTECODE_TYPE_COUNT &&
+            vm_to_list(tos)->items.size >= runtime->parallelThreshold) {
+          /* Makes the accumulator first, as a collection now would move the list */
+          vm_object acc = vm_from_int(0);
+          VM_FLUSH();
+          if (code->arg1.ref == SAN_BYTECODE_ITER_LIST) {
+            if (decoded[pc].code.opcode == SAN_BYTECODE_MAKE_LOCAL_LIST) {
+              acc = new_list(&arena);
+            } else {
+              vm_list *allocated;
+              VM_ROOTS();
+              if ((allocated = sang_alloc(gc, &roots)) == NULL) {
+                runtimeError(errors, SAN_ERROR_OUT_OF_MEMORY, gc->limits.heapLimit);
+                result = SAN_FAIL;
+                goto out;
+              }
+              acc = vm_from_list(allocated);
+              tos = *sp;
+            }
           }
-          case SAN_BYTECODE_TYPE_STRING_LITERAL: {
-            vm_object obj = vm_string(program, code->arg1.ref);
-            san_dbg("PUSH %s\n", obj.value.string);;
-            sanv_push(&stack, (void*)&obj);
-            break;
+          if (run_parallel(runtime, program, frame->function, pc - 1, stack + frame->base,
+                sp - stack - frame->base + 1, &acc, &arena, chunkHandlers, chunkNext) == SAN_OK) {
+            tos = acc;
+            pc = decoded[pc + 1].code.arg1.ref;
+            VM_SAFEPOINT();
+            VM_DISPATCH();
           }
         }
-        break;
+        VM_PUSH(index);
+        VM_DISPATCH();
       }
 
-      case SAN_BYTECODE_MUL: {
-        vm_object arg1, arg2;
-        sanv_pop(&stack, &arg1);
-        sanv_pop(&stack, &arg2);
-        san_dbg("MUL %d, %d\n", arg1.value.integer, arg2.value.integer);
-        vm_object result = { SAN_VM_INT, { .integer = arg1.value.integer * arg2.value.integer } };
-        sanv_push(&stack, &result);
-        break;
+      VM_OP(CHUNK_NEXT): {
+        /* ITER_NEXT, up to the end of the chunk, after which the chunk is done */
+        vm_list *list = vm_to_list(sp[-2]);
+        int index = (int)vm_to_int(sp[-1]);
+        san_dbg("CHUNK_NEXT %d\n", chunk->end);
+        if (index < chunk->end) {
+          sp[-1] = vm_from_int(index + 1);
+          VM_PUSH(*(vm_object*)sanv_nth(&list->items, index));
+          VM_DISPATCH();
+        }
+        chunk->acc = tos;
+        goto out;
       }
 
-      case SAN_BYTECODE_ADD: {
-        vm_object arg1, arg2;
-        sanv_pop(&stack, &arg1);
-        sanv_pop(&stack, &arg2);
-        san_dbg("ADD %d, %d\n", arg1.value.integer, arg2.value.integer);
-        vm_object result = { SAN_VM_INT, { .integer = arg1.value.integer + arg2.value.integer } };
-        sanv_push(&stack, &result);
-        break;
+      VM_OP(ITER_NEXT): {
+        /* [list index acc] -> [list index+1 acc item], or [acc] and exit */
+        vm_list *list = vm_to_list(sp[-2]);
+        int index = (int)vm_to_int(sp[-1]);
+        san_dbg("ITER_NEXT %d\n", code->arg1.ref);
+        if (index < list->items.size) {
+          sp[-1] = vm_from_int(index + 1);
+          VM_PUSH(*(vm_object*)sanv_nth(&list->items, index));
+        } else {
+          /* The accumulator, still in tos, takes the list's cell */
+          sp -= 2;
+          pc = code->arg1.ref;
+        }
+        VM_DISPATCH();
       }
 
-      case SAN_BYTECODE_CALL: {
-        vm_object fn, args;
-        sanv_pop(&stack, &args);
-        sanv_pop(&stack, &fn);
+      VM_OP(LOAD_SLOT): {
+        VM_DO_LOAD_SLOT();
+        VM_DISPATCH();
+      }
+
+      VM_OP(STORE_SLOT): {
+        VM_DO_STORE_SLOT();
+        VM_DISPATCH();
+      }
 
-        const char *fname = fn.value.string;
-        san_dbg("CALL %s\n", fname);
+      VM_OP(CALL): {
+        const san_function_t *fn = vm_function(program, code->arg1.ref);
+        int argc = code->arg2.ref;
+        vm_frame callee = { code->arg1.ref, pc, sp - stack - argc + 1, arena.size };
 
-        if (strcmp(fname, "print") == 0) {
-          if (args.type == SAN_VM_INT) {
-            printf("%d\n", args.value.integer);
-          } else if (args.type == SAN_VM_STRING) {
-            printf("%s\n", args.value.string);
-          }
-        } else if(strcmp(fname, "square") == 0) {
-          vm_object result = { SAN_VM_INT, { .integer = sanstd_squarei(args.value.integer) } };
-          sanv_push(&stack, &result);
-        } else if(strcmp(fname, "sqrt") == 0) {
-          vm_object result = { SAN_VM_INT, { .integer = sanstd_sqrti(args.value.integer) } };
-          sanv_push(&stack, &result);
-        } else if(strcmp(fname, "factorial") == 0) {
-          vm_object result = { SAN_VM_INT, { .integer = sanstd_factoriali(args.value.integer) } };
-          sanv_push(&stack, &result);
+        VM_FLUSH();
+        if (!budgeted && vm_call_jit(program, &jit[code->arg1.ref], code->arg1.ref, sp - argc + 1, &ret)) {
+          VM_DROP(argc);
+          VM_PUSH(ret);
+          VM_STEP();
+          VM_DISPATCH();
         }
+        san_dbg("CALL %s/%d\n", fn->name, argc);
+        if (!enter_frame(callee.base, fn, runtime->stackSize, errors)) {
+          result = SAN_FAIL;
+          goto out;
+        }
+        sanv_push(&frames, &callee);
+        frame = (vm_frame*)sanv_back(&frames);
+        for (int i = fn->arity; i < fn->nslots; ++i) VM_PUSH(nil);
+        pc = fn->entry;
+        VM_STEP();
+        VM_DISPATCH();
+      }
 
-        break;
+      VM_OP(TAILCALL): {
+        /* Reuse the current frame: slide the arguments down over it */
+        const san_function_t *fn = vm_function(program, code->arg1.ref);
+        int argc = code->arg2.ref;
+        vm_object *args = sp - argc + 1;
+
+        VM_FLUSH();
+        if (!budgeted && vm_call_jit(program, &jit[code->arg1.ref], code->arg1.ref, args, &ret)) goto return_ret;
+        san_dbg("TAILCALL %s/%d\n", fn->name, argc);
+        if (!enter_frame(frame->base, fn, runtime->stackSize, errors)) {
+          result = SAN_FAIL;
+          goto out;
+        }
+        memmove(stack + frame->base, args, argc * sizeof(vm_object));
+        sp = stack + frame->base + argc - 1;
+        tos = *sp;
+        release_locals(&arena, frame->arena);
+        frame->function = code->arg1.ref;
+        for (int i = fn->arity; i < fn->nslots; ++i) VM_PUSH(nil);
+        pc = fn->entry;
+        VM_STEP();
+        VM_DISPATCH();
       }
 
+      VM_OP(RET):
+        ret = tos;
+        /* Fall through */
+      return_ret: {
+        san_dbg("RET\n");
+
+        pc = frame->returnPc;
+        sp = stack + frame->base - 1;
+        tos = *sp;
+        release_locals(&arena, frame->arena);
+        frames.size--;
+        if (frames.size == 0) goto out;
+
+        frame = (vm_frame*)sanv_back(&frames);
+        VM_PUSH(ret);
+        VM_DISPATCH();
+      }
+
+      VM_OP(ADD):
+        if (!vm_check_ints(&tos, sp, 2, errors)) {
+          result = SAN_FAIL;
+          goto out;
+        }
+        /* Fall through */
+      VM_OP(ADD_II): {
+        VM_DO_ADD_II();
+        VM_DISPATCH();
+      }
+
+      VM_OP(MUL):
+        if (!vm_check_ints(&tos, sp, 2, errors)) {
+          result = SAN_FAIL;
+          goto out;
+        }
+        /* Fall through */
+      VM_OP(MUL_II): {
+        VM_DO_MUL_II();
+        VM_DISPATCH();
+      }
+
+      VM_OP(CALL_NATIVE):
+        if ((sann_nth(code->arg1.ref)->flags & SAN_NATIVE_INT) &&
+            !vm_check_ints(&tos, sp, code->arg2.ref, errors)) {
+          result = SAN_FAIL;
+          goto out;
+        }
+        /* Fall through */
+      VM_OP(CALL_NATIVE_I): {
+        VM_DO_CALL_NATIVE_I();
+        VM_DISPATCH();
+      }
+
+#ifndef VM_THREADED
     }
-  SAN_VECTOR_END_FOR_EACH
-/*
-  int result;
-  sanv_pop(&stack, &result);
-  ("RESULT: %d\n", result);
-  */
+  }
+#else
+op_PROFILE:
+  VM_PROFILE();
+  goto *handlers[code->opcode];
 
-  sanv_destroy(&stack, sanv_nodestructor);
+  SAN_SUPERINSTRUCTIONS(VM_SUPER2, VM_SUPER3)
+#endif
 
-  return SAN_OK;
+out:
+  if (profile != NULL) sanr_charge(profile);
+  if (result != SAN_OK && chunk == NULL) locate_error(program, errors, &frames, pc - 1);
+  context->frames = frames;
+  context->arena = arena;
+  close_context(runtime, chunk);
+  return result;
+
+suspend:
+  if (profile != NULL) sanr_charge(profile);
+  VM_FLUSH();
+  context->pc = pc;
+  context->sp = sp - stack;
+  context->frames = frames;
+  context->arena = arena;
+  return result;
 }
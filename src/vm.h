@@ -3,12 +3,136 @@
 
 #include "san.h"
 #include "bytecode.h"
+#include "object.h"
+#include "gc.h"
+#include "pool.h"
+#include "profile.h"
+
+/* Values the operand stack holds by default, across all frames */
+#define SAN_VM_STACK_SIZE (1 << 20)
+
+/* What sanm_resume returns when a native has suspended the program */
+#define SAN_VM_SUSPENDED 1
+
+/* What sanm_resume returns when the program has spent its budget */
+#define SAN_VM_PREEMPTED 2
+
+/*
+ * Steps are backward branches and calls, which bound the instructions run
+ * between them. The budget is counted down a slice of steps at a time,
+ * and the clock is only read between slices.
+ */
+#define SAN_VM_BUDGET_SLICE 1024
+
+/*
+ * Fused loops that build a list or add up, over lists at least
+ * parallelThreshold long and with pure bodies, run in chunks on the
+ * runtime's pool, several per worker so that stealing evens them out.
+ */
+#define SAN_VM_PARALLEL_THRESHOLD 8192
+#define SAN_VM_PARALLEL_CHUNKS 4
+
+struct vm_instruction;
+struct vm_jit;
+
+/*
+ * Where a program stands between being started in a runtime and ending:
+ * the next instruction, the top of the operand stack, the call frames and
+ * the lists local to them, and what the VM made of the program to run it.
+ */
+typedef struct {
+  const san_program_t *program;
+  int pc, sp;
+  san_vector_t frames;
+  san_vector_t arena;
+  struct vm_instruction *decoded;
+  struct vm_jit *jit;
+  char *pure;
+} san_context_t;
+
+/*
+ * What each sanm_resume may spend before the program is preempted: steps,
+ * and seconds of wall time. Either is unlimited if 0. Compiled calls and
+ * parallel loops cannot be preempted, so a program with a budget makes
+ * every call in the VM and runs every loop on its own thread.
+ */
+typedef struct {
+  int64_t steps;
+  double seconds;
+} san_budget_t;
 
 /*
+ * An isolate: everything a running program mutates. The program itself is
+ * only read, so one compiled program can be run by many runtimes at once,
+ * each on its own thread. A runtime runs one program at a time, and keeps
+ * its heap between runs. Natives must all be registered before any
+ * runtime starts.
+ */
 typedef struct {
+  san_gc_t gc;
+  vm_object *stack;     /* allocated on the first run */
+  int stackSize;
+  vm_object *globals;   /* the running program's */
+  san_context_t context;
+  double wakeAt;        /* when a suspended program may be resumed, on sanm_time's clock */
+  int suspending;
+  san_budget_t budget;
+  FILE *out;            /* where print writes */
+  san_pool_t *pool;     /* NULL to run every loop on the calling thread */
+  int parallelThreshold;
+  san_profile_t *profile; /* NULL unless profiling */
 } san_runtime_t;
-*/
 
-int sanm_run(const san_program_t *program);
+void sanm_create(san_runtime_t *runtime, const san_gc_limits_t *limits, FILE *out);
+
+/* Also ends a program that was started and never finished */
+void sanm_destroy(san_runtime_t *runtime);
+
+/*
+ * Runs program to the end, sleeping the thread whenever it is suspended.
+ * Once preempted, it returns SAN_VM_PREEMPTED like sanm_resume.
+ */
+int sanm_execute(san_runtime_t *runtime, const san_program_t *program, san_vector_t *errors);
+
+/*
+ * Runs a program in steps, for a scheduler. sanm_start readies program in
+ * runtime, and sanm_resume runs it until it ends, returning SAN_OK or
+ * SAN_FAIL, until a native suspends it, returning SAN_VM_SUSPENDED, or
+ * until it has spent runtime->budget, returning SAN_VM_PREEMPTED. It may
+ * then be resumed from any thread, once suspended from runtime->wakeAt
+ * on, or ended with sanm_abort.
+ */
+int sanm_start(san_runtime_t *runtime, const san_program_t *program, san_vector_t *errors);
+int sanm_resume(san_runtime_t *runtime, san_vector_t *errors);
+void sanm_abort(san_runtime_t *runtime);
+
+/*
+ * For natives that would block: suspends the program running in runtime
+ * for the given seconds, from when the native returns. Where no program
+ * is running in the VM, as in compiled C, the thread sleeps instead.
+ */
+void sanm_sleep(san_runtime_t *runtime, double seconds);
+
+/* Seconds since some fixed time, on the clock wakeAt is on */
+double sanm_time(void);
+
+/*
+ * Runs program in a runtime of its own, printing to stdout, with a pool of
+ * a worker per core that starts with the first loop run in parallel.
+ */
+int sanm_run(const san_program_t *program, san_vector_t *errors);
+
+/*
+ * Runs program like sanm_run, recording into profile and sampling it. While
+ * profiling, calls are never compiled to machine code, so that samples see
+ * every frame, and loops run in parallel count as their ITER.
+ */
+int sanm_profile(const san_program_t *program, san_profile_t *profile, san_vector_t *errors);
+
+/*
+ * Whether the VM can run opcode inside a superinstruction, before others.
+ * Any opcode can end one.
+ */
+int sanm_fusable(int opcode);
 
 #endif
@@ -0,0 +1,70 @@
+#include <check.h>
+#include "../src/aot.h"
+#include "../src/natives.h"
+#include "../src/scope.h"
+#include "../src/verify.h"
+
+#define BEGIN_EMIT(x) { \
+  san_vector_t tokens, errors; \
+  san_node_t ast; \
+  san_program_t program; \
+  char output[8192]; \
+  FILE *out = tmpfile(); \
+  sanv_create(&tokens, sizeof(san_token_t)); \
+  sanv_create(&errors, sizeof(san_error_t)); \
+  sant_tokenize((x), &tokens, &errors); \
+  sanp_parse(&tokens, &ast, &errors); \
+  memset(&program, 0, sizeof program); \
+  memset(output, 0, sizeof output); \
+  int result = sans_resolve(&ast, &errors); \
+  if (result == SAN_OK) result = sanb_generate(&ast, &program, &errors); \
+  if (result == SAN_OK) result = sanc_verify(&program, &errors); \
+  if (result == SAN_OK) result = sana_emit_c(&program, "test.san", out); \
+  rewind(out); \
+  fread(output, 1, sizeof output - 1, out); \
+  fclose(out);
+
+#define END_EMIT \
+  sanb_destroy(&program); \
+  sanp_destroy(&ast); \
+  sanv_destroy(&tokens, &sant_destructor); \
+  sanv_destroy(&errors, &sane_destructor); \
+}
+
+#define emitted(s) (strstr(output, (s)) != NULL)
+
+START_TEST (test_emit_c) {
+
+  BEGIN_EMIT("let loop n acc = if lt n 1 then acc else loop (sub n 1) (acc + n)\nprint loop 100 0")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert(emitted("static vm_object san_f1(vm_object l0, vm_object l1) {"));
+
+    /* Stack entries are locals, and the self tail call is a loop without a temporary */
+    ck_assert(emitted("  vm_object s0, s1, s2;"));
+    ck_assert(emitted("  goto entry;"));
+
+    /* Integer natives are called directly, others through the registry */
+    ck_assert(emitted("s0 = sani_sub(&san_runtime.gc, s0, s1);"));
+    ck_assert(emitted("san_native(\"print\")"));
+    ck_assert(!emitted("san_native(\"sub\")"));
+  END_EMIT
+
+  /* Checks that type inference could not remove stay, with their position */
+  BEGIN_EMIT("let l = 1 2\nprint l + 1")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert(emitted("return san_type_error(\"an integer\", vm_type(s1), \"test.san:2:7\");"));
+    ck_assert(emitted("  vm_object t, s0, s1;"));
+    ck_assert(emitted("t = san_new_list(&san_heap);"));
+  END_EMIT
+
+} END_TEST
+
+Suite* aot_suite(void) {
+  Suite *s = suite_create("AOT");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_emit_c);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
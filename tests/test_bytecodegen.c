@@ -1,19 +1,359 @@
 #include <check.h>
-#include "../src/bytecodegen.h"
+#include "../src/bytecode.h"
+#include "../src/natives.h"
+#include "../src/scope.h"
 
-#define BYTECODE_OF(x, is) \
-  san_vector_t tokens, bytecode, errors; \
+#define BEGIN_GENERATE(x) { \
+  san_vector_t tokens, errors; \
+  san_node_t ast; \
+  san_program_t program; \
   sanv_create(&tokens, sizeof(san_token_t)); \
   sanv_create(&errors, sizeof(san_error_t)); \
-  sanv_create(&bytecode, sizeof(san_bytecode_t)); \
   sant_tokenize((x), &tokens, &errors); \
-  san_node_t ast; \
   sanp_parse(&tokens, &ast, &errors); \
-  sanb_generate(&ast, &bytecode, &errors); \
-  SAN_VECTOR_FOR_EACH(bytecode, i, san_bytecode_t, )
+  memset(&program, 0, sizeof program); \
+  int result = sans_resolve(&ast, &errors); \
+  if (result == SAN_OK) result = sanb_generate(&ast, &program, &errors);
+
+#define END_GENERATE \
+  sanb_destroy(&program); \
+  sanp_destroy(&ast); \
+  sanv_destroy(&tokens, &sant_destructor); \
+  sanv_destroy(&errors, &sane_destructor); \
+}
+
+#define nth_code(n) ((san_bytecode_t*)sanv_nth(&program.bytecode, n))
+#define last_error() ((san_error_t*)sanv_back(&errors))
+
+START_TEST (test_native_call) {
+
+  BEGIN_GENERATE("print factorial sqrt 25")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(program.bytecode.size, 5);
+    ck_assert_int_eq(nth_code(0)->opcode, SAN_BYTECODE_PUSH);
+    ck_assert_int_eq(nth_code(1)->opcode, SAN_BYTECODE_CALL_NATIVE_I);
+    ck_assert_int_eq(nth_code(1)->arg1.ref, sann_lookup("sqrt"));
+    ck_assert_int_eq(nth_code(1)->arg2.ref, 1);
+    ck_assert_int_eq(nth_code(2)->arg1.ref, sann_lookup("factorial"));
+    ck_assert_int_eq(nth_code(3)->arg1.ref, sann_lookup("print"));
+    ck_assert_int_eq(nth_code(4)->opcode, SAN_BYTECODE_RET);
+  END_GENERATE
+
+} END_TEST
+
+START_TEST (test_unknown_function) {
+
+  BEGIN_GENERATE("frobnicate 3")
+    ck_assert_int_eq(result, SAN_FAIL);
+    ck_assert_int_eq(last_error()->code, SAN_ERROR_UNKNOWN_FUNCTION);
+  END_GENERATE
+
+  BEGIN_GENERATE("square 3 4")
+    ck_assert_int_eq(result, SAN_FAIL);
+    ck_assert_int_eq(last_error()->code, SAN_ERROR_ARITY_MISMATCH);
+  END_GENERATE
+
+} END_TEST
+
+#define nth_function(n) ((san_function_t*)sanv_nth(&program.functions, n))
+
+START_TEST (test_number_literals) {
+
+  /* Literals are kept whole up to the largest integer, and as their digits past it */
+  BEGIN_GENERATE("print 3000000000 140737488355327 140737488355328")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert(*(int64_t*)sanv_nth(&program.numbers, nth_code(0)->arg1.ref) == INT64_C(3000000000));
+    ck_assert(*(int64_t*)sanv_nth(&program.numbers, nth_code(1)->arg1.ref) == INT64_C(140737488355327));
+    ck_assert_int_eq(nth_code(2)->arg1.type, SAN_BYTECODE_TYPE_BIGNUM_LITERAL);
+    ck_assert_str_eq(*(const char**)sanv_nth(&program.bignums, nth_code(2)->arg1.ref), "140737488355328");
+  END_GENERATE
+
+} END_TEST
+
+START_TEST (test_user_function) {
+
+  BEGIN_GENERATE("let add a b = a + b\nprint add 1 square 2")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(program.functions.size, 2);
+    ck_assert_str_eq(nth_function(1)->name, "add");
+    ck_assert_int_eq(nth_function(1)->arity, 2);
+
+    /* <main> is laid out first */
+    san_function_t *add = nth_function(1);
+    ck_assert_int_eq(add->entry, nth_function(0)->length);
+    ck_assert_int_eq(nth_code(add->entry)->opcode, SAN_BYTECODE_LOAD_SLOT);
+    ck_assert_int_eq(nth_code(add->entry + 1)->arg1.ref, 1);
+    ck_assert_int_eq(nth_code(add->entry + add->length - 1)->opcode, SAN_BYTECODE_RET);
+
+    /* Arguments are grouped by the callee's arity, and add is inlined */
+    ck_assert_int_eq(nth_code(2)->opcode, SAN_BYTECODE_CALL_NATIVE_I);
+    ck_assert_int_eq(nth_code(2)->arg2.ref, 1);
+    ck_assert_int_eq(nth_code(3)->opcode, SAN_BYTECODE_ADD_II);
+    ck_assert_int_eq(nth_code(4)->opcode, SAN_BYTECODE_CALL_NATIVE);
+    ck_assert_int_eq(nth_code(4)->arg2.ref, 1);
+  END_GENERATE
+
+  BEGIN_GENERATE("let f a b = b\nf 1")
+    ck_assert_int_eq(result, SAN_FAIL);
+    ck_assert_int_eq(last_error()->code, SAN_ERROR_ARITY_MISMATCH);
+  END_GENERATE
+
+  BEGIN_GENERATE("let f a = b")
+    ck_assert_int_eq(result, SAN_FAIL);
+    ck_assert_int_eq(last_error()->code, SAN_ERROR_UNBOUND_NAME);
+  END_GENERATE
+
+} END_TEST
+
+START_TEST (test_tail_call) {
+
+  BEGIN_GENERATE("let f n = f n + 1")
+    ck_assert_int_eq(result, SAN_OK);
+    san_function_t *f = nth_function(1);
+    /* The return after it is unreachable and dropped */
+    ck_assert_int_eq(nth_code(f->entry + f->length - 1)->opcode, SAN_BYTECODE_TAILCALL);
+  END_GENERATE
+
+  BEGIN_GENERATE("let f n = print f n")
+    ck_assert_int_eq(result, SAN_OK);
+    san_function_t *f = nth_function(1);
+    ck_assert_int_eq(nth_code(f->entry + f->length - 3)->opcode, SAN_BYTECODE_CALL);
+  END_GENERATE
+
+} END_TEST
+
+START_TEST (test_variable_slots) {
+
+  BEGIN_GENERATE("let x = 2\nlet f n =\n  let y = n * x\n  y\nprint f x")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(program.nglobals, 1);
+    ck_assert_int_eq(nth_code(1)->opcode, SAN_BYTECODE_STORE_SLOT);
+    ck_assert_int_eq(nth_code(1)->arg1.type, SAN_BYTECODE_TYPE_GLOBAL);
+
+    san_function_t *f = nth_function(1);
+    ck_assert_int_eq(f->nslots, 2);
+    ck_assert_int_eq(nth_code(f->entry + 1)->arg1.type, SAN_BYTECODE_TYPE_GLOBAL);
+    ck_assert_int_eq(nth_code(f->entry + 3)->opcode, SAN_BYTECODE_STORE_SLOT);
+    ck_assert_int_eq(nth_code(f->entry + 3)->arg1.type, SAN_BYTECODE_TYPE_LOCAL);
+    ck_assert_int_eq(nth_code(f->entry + 3)->arg1.ref, 1);
+  END_GENERATE
+
+} END_TEST
+
+static int count_opcode(san_program_t const *program, int opcode) {
+  int n = 0;
+  SAN_VECTOR_FOR_EACH(program->bytecode, i, san_bytecode_t, code)
+    if (code->opcode == opcode) n++;
+  SAN_VECTOR_END_FOR_EACH
+  return n;
+}
+
+/* Native calls, whether or not type inference specialised them */
+#define count_native_calls(program) \
+  (count_opcode(program, SAN_BYTECODE_CALL_NATIVE) + count_opcode(program, SAN_BYTECODE_CALL_NATIVE_I))
+
+START_TEST (test_fused_pipe) {
+
+  BEGIN_GENERATE("let inc n = n + 1\n1 2 3 | map inc | filter square | map inc | sum")
+    ck_assert_int_eq(result, SAN_OK);
+
+    /* One loop, and no list other than the source */
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_ITER), 1);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_ITER_NEXT), 1);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_MAKE_LOCAL_LIST), 1);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_LIST_APPEND), 0);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_JUMP_IF_FALSE), 1);
+
+    /* Both calls to inc are inlined into the loop */
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_CALL), 0);
+    ck_assert_int_eq(program.calls.size, 2);
+  END_GENERATE
+
+  /* A stage that needs the whole list ends the loop */
+  BEGIN_GENERATE("let add a b = a + b\n1 2 3 | map square | list | print | reduce add 0")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_ITER), 2);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_LIST_APPEND), 1);
+  END_GENERATE
+
+} END_TEST
+
+START_TEST (test_if_layout) {
+
+  BEGIN_GENERATE("let loop n acc = if eq n 0 then acc else loop sub n 1 n")
+    ck_assert_int_eq(result, SAN_OK);
+    san_function_t *loop = nth_function(1);
+
+    /* The recursive branch falls through; the base case is out of line */
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_JUMP_IF_FALSE), 0);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_JUMP_IF_TRUE), 1);
+    ck_assert_int_eq(nth_code(loop->entry + loop->length - 1)->opcode, SAN_BYTECODE_RET);
+    ck_assert_int_eq(nth_code(loop->entry + loop->length - 3)->opcode, SAN_BYTECODE_TAILCALL);
+
+    /* The jump past the else branch was unreachable after the tail call */
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_JUMP), 0);
+  END_GENERATE
+
+  BEGIN_GENERATE("let f n = if n then 1 else 2\nprint f 0")
+    ck_assert_int_eq(result, SAN_OK);
+
+    /* No jump lands on the instruction after it */
+    SAN_VECTOR_FOR_EACH(program.bytecode, i, san_bytecode_t, code)
+      if (code->opcode == SAN_BYTECODE_JUMP || code->opcode == SAN_BYTECODE_JUMP_IF_FALSE) {
+        ck_assert_int_ne(code->arg1.ref, i + 1);
+      }
+    SAN_VECTOR_END_FOR_EACH
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_RET), 3);
+  END_GENERATE
+
+} END_TEST
+
+START_TEST (test_common_subexpressions) {
+
+  /* A value still on top of the stack is duplicated */
+  BEGIN_GENERATE("print (sqrt 25) + (sqrt 25)")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(count_native_calls(&program), 2);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_DUP), 1);
+  END_GENERATE
+
+  /* Otherwise it is kept in a temporary slot */
+  BEGIN_GENERATE("let f x = ((square x + 1) * 2) + (square x + 1)")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(count_native_calls(&program), 1);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_STORE_SLOT), 1);
+    ck_assert_int_eq(nth_function(1)->nslots, 2);
+  END_GENERATE
+
+  /* Calls that are not pure are never shared */
+  BEGIN_GENERATE("let f x = (print x) + (print x)")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(count_native_calls(&program), 2);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_DUP), 0);
+  END_GENERATE
+
+  /* Nor are values computed on another branch */
+  BEGIN_GENERATE("let f x = if x then (square x) else (square x)")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(count_native_calls(&program), 2);
+  END_GENERATE
+
+} END_TEST
+
+#define nth_call(n) ((san_call_site_t*)sanv_nth(&program.calls, n))
+
+START_TEST (test_inlining) {
+
+  /* Parameters loaded in order are used in place */
+  BEGIN_GENERATE("let inc n = n + 1\nprint inc 2")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(program.calls.size, 1);
+    ck_assert_ptr_eq(nth_call(0)->reason, NULL);
+    ck_assert_int_eq(nth_code(0)->opcode, SAN_BYTECODE_PUSH);
+    ck_assert_int_eq(nth_code(1)->opcode, SAN_BYTECODE_PUSH);
+    ck_assert_int_eq(nth_code(2)->opcode, SAN_BYTECODE_ADD_II);
+    ck_assert_int_eq(nth_function(0)->nslots, 0);
+  END_GENERATE
+
+  /* Otherwise they are stored into slots of the caller */
+  BEGIN_GENERATE("let sq n = n * n\nlet f x = sq x + 1")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_ptr_eq(nth_call(0)->reason, NULL);
+    ck_assert_int_eq(nth_function(2)->nslots, 2);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_STORE_SLOT), 1);
+  END_GENERATE
+
+  BEGIN_GENERATE("let f n = if n then 1 else 2\nlet g n = g n\nprint f 1\nprint g 1")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(program.calls.size, 3);
+    ck_assert_str_eq(nth_call(0)->reason, "recursive");
+    ck_assert_str_eq(nth_call(1)->reason, "has branches");
+    ck_assert_str_eq(nth_call(2)->reason, "recursive");
+  END_GENERATE
+
+} END_TEST
+
+START_TEST (test_type_specialisation) {
+
+  BEGIN_GENERATE("print (square 3) + 1")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_CALL_NATIVE_I), 1);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_ADD_II), 1);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_ADD), 0);
+  END_GENERATE
+
+  /* Parameter types come from the call sites; g has none */
+  BEGIN_GENERATE("let f x = x * 2 + x * 3 + x * 4 + x\nprint f 3\nlet g x = x * 2")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_str_eq(nth_call(0)->reason, "too large");
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_MUL_II), 3);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_MUL), 1);
+  END_GENERATE
+
+  /* Anything that may not be an integer keeps the checked opcode */
+  BEGIN_GENERATE("let l = 1 2\nprint l + 1")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_ADD), 1);
+  END_GENERATE
+
+} END_TEST
+
+START_TEST (test_escape_analysis) {
+
+  /* Lists only handed to natives or pipes are local to the frame */
+  BEGIN_GENERATE("(1 2 3) | map square | print")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_MAKE_LOCAL_LIST), 2);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_MAKE_LIST), 0);
+  END_GENERATE
+
+  /* So are those bound in a function, unless they are returned */
+  BEGIN_GENERATE("let f x =\n  let l = 1 x\n  print l\nlet g x = 1 x")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_MAKE_LOCAL_LIST), 1);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_MAKE_LIST), 1);
+  END_GENERATE
+
+  /* Global bindings and enclosing lists do not */
+  BEGIN_GENERATE("let xs = 1 2\n(3 4) 5 | print")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_MAKE_LOCAL_LIST), 1);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_MAKE_LIST), 2);
+  END_GENERATE
+
+} END_TEST
+
+static int find_opcode(san_program_t const *program, int opcode) {
+  SAN_VECTOR_FOR_EACH(program->bytecode, i, san_bytecode_t, code)
+    if (code->opcode == opcode) return i;
+  SAN_VECTOR_END_FOR_EACH
+  return -1;
+}
+
+START_TEST (test_source_positions) {
+
+  BEGIN_GENERATE("print 1\n\nprint 2 * 3")
+    int line, column;
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(sanb_position(&program, 0, &line, &column), SAN_OK);
+    ck_assert_int_eq(line, 1);
+    sanb_position(&program, find_opcode(&program, SAN_BYTECODE_MUL_II), &line, &column);
+    ck_assert_int_eq(line, 3);
 
-START_TEST (test_empty_input) {
+    /* Rows are only written where the position changes */
+    ck_assert_int_lt(program.lines.size, program.bytecode.size * 3);
+  END_GENERATE
 
+  /* Inlined code keeps the callee's positions; calls sit at the callee */
+  BEGIN_GENERATE("let inc n =\n  n + 1\nlet f n = f n\nprint inc 2\nprint   f 1")
+    int line, column;
+    ck_assert_int_eq(result, SAN_OK);
+    sanb_position(&program, find_opcode(&program, SAN_BYTECODE_ADD_II), &line, &column);
+    ck_assert_int_eq(line, 2);
+    sanb_position(&program, find_opcode(&program, SAN_BYTECODE_CALL), &line, &column);
+    ck_assert_int_eq(line, 5);
+    ck_assert_int_eq(column, 9);
+  END_GENERATE
 
 } END_TEST
 
@@ -21,7 +361,19 @@ Suite* bytecodegen_suite(void) {
   Suite *s = suite_create("Bytecode Generator");
 
   TCase *tc_core = tcase_create("Core");
-  tcase_add_test(tc_core, test_empty_input);
+  tcase_add_test(tc_core, test_native_call);
+  tcase_add_test(tc_core, test_unknown_function);
+  tcase_add_test(tc_core, test_number_literals);
+  tcase_add_test(tc_core, test_user_function);
+  tcase_add_test(tc_core, test_tail_call);
+  tcase_add_test(tc_core, test_variable_slots);
+  tcase_add_test(tc_core, test_fused_pipe);
+  tcase_add_test(tc_core, test_if_layout);
+  tcase_add_test(tc_core, test_common_subexpressions);
+  tcase_add_test(tc_core, test_inlining);
+  tcase_add_test(tc_core, test_type_specialisation);
+  tcase_add_test(tc_core, test_escape_analysis);
+  tcase_add_test(tc_core, test_source_positions);
   suite_add_tcase(s, tc_core);
 
   return s;
@@ -0,0 +1,172 @@
+#include <check.h>
+#include "../src/fiber.h"
+#include "../src/scope.h"
+#include "../src/verify.h"
+
+#define BEGIN_FIBER(x) { \
+  san_vector_t tokens, errors; \
+  san_node_t ast; \
+  san_program_t program; \
+  sanv_create(&tokens, sizeof(san_token_t)); \
+  sanv_create(&errors, sizeof(san_error_t)); \
+  sant_tokenize((x), &tokens, &errors); \
+  sanp_parse(&tokens, &ast, &errors); \
+  memset(&program, 0, sizeof program); \
+  int result = sans_resolve(&ast, &errors); \
+  if (result == SAN_OK) result = sanb_generate(&ast, &program, &errors); \
+  if (result == SAN_OK) result = sanc_verify(&program, &errors); \
+  ck_assert_int_eq(result, SAN_OK);
+
+#define END_FIBER \
+  sanb_destroy(&program); \
+  sanp_destroy(&ast); \
+  sanv_destroy(&tokens, &sant_destructor); \
+  sanv_destroy(&errors, &sane_destructor); \
+}
+
+#define FIBERS 200
+
+static void read_output(FILE *out, char *output, int size) {
+  rewind(out);
+  memset(output, 0, size);
+  fread(output, 1, size - 1, out);
+  fclose(out);
+}
+
+START_TEST (test_fibers) {
+
+  /* Each fiber sleeps 60ms in all, and two threads run them all at once */
+  BEGIN_FIBER("let f n = if lt n 1 then 0 else (f (sub n 1)) + 1\nlet a = sleep 30\nprint f 100\nlet b = sleep 30\nlet l = 1 2 3\nprint l")
+    static san_fiber_t fibers[FIBERS];
+    static FILE *outs[FIBERS];
+    san_gc_limits_t limits = SAN_FIBER_DEFAULT_LIMITS;
+    san_scheduler_t sched;
+    char output[64];
+    double start = sanm_time();
+
+    ck_assert_int_eq(sanf_create(&sched, 2), SAN_OK);
+    for (int i = 0; i < FIBERS; ++i) {
+      outs[i] = tmpfile();
+      ck_assert_int_eq(sanf_spawn(&sched, &fibers[i], &program, &limits, outs[i]), SAN_OK);
+    }
+    sanf_wait(&sched);
+    ck_assert(sanm_time() - start < FIBERS * 0.06 / 4);
+
+    for (int i = 0; i < FIBERS; ++i) {
+      ck_assert(fibers[i].finished);
+      ck_assert_int_eq(fibers[i].result, SAN_OK);
+      read_output(outs[i], output, sizeof output);
+      ck_assert_str_eq(output, "100\n(1 2 3)\n");
+      sanf_release(&fibers[i]);
+    }
+    sanf_destroy(&sched);
+  END_FIBER
+
+} END_TEST
+
+START_TEST (test_fiber_errors) {
+
+  /* A fiber that fails after suspending reports where, like any program */
+  BEGIN_FIBER("let a = sleep 1\nlet b = sleep (sub 0 1)\nprint 1")
+    san_gc_limits_t limits = SAN_FIBER_DEFAULT_LIMITS;
+    san_scheduler_t sched;
+    san_fiber_t fiber;
+    FILE *out = tmpfile();
+    char output[64];
+
+    ck_assert_int_eq(sanf_create(&sched, 1), SAN_OK);
+    ck_assert_int_eq(sanf_spawn(&sched, &fiber, &program, &limits, out), SAN_OK);
+    sanf_wait(&sched);
+    sanf_destroy(&sched);
+
+    ck_assert_int_eq(fiber.result, SAN_FAIL);
+    ck_assert_int_eq(fiber.errors.size, 1);
+    ck_assert_int_eq(((san_error_t*)sanv_nth(&fiber.errors, 0))->code, SAN_ERROR_NATIVE_FAILED);
+    read_output(out, output, sizeof output);
+    ck_assert_str_eq(output, "");
+    sanf_release(&fiber);
+  END_FIBER
+
+} END_TEST
+
+START_TEST (test_preemption) {
+
+  /* On one thread, a fiber that loops long is preempted for one spawned after it */
+  BEGIN_FIBER("let count n l = if lt n 1 then l else count (sub n 1) l\nlet l = 1 2 3\nlet a = count 20000 l\nprint 1")
+    san_gc_limits_t limits = SAN_FIBER_DEFAULT_LIMITS;
+    san_scheduler_t sched;
+    san_fiber_t hog, quick;
+    san_vector_t tokens2;
+    san_node_t ast2;
+    san_program_t program2;
+    FILE *out = tmpfile();
+    char output[64];
+
+    sanv_create(&tokens2, sizeof(san_token_t));
+    sant_tokenize("print 2", &tokens2, &errors);
+    sanp_parse(&tokens2, &ast2, &errors);
+    memset(&program2, 0, sizeof program2);
+    ck_assert_int_eq(sans_resolve(&ast2, &errors), SAN_OK);
+    ck_assert_int_eq(sanb_generate(&ast2, &program2, &errors), SAN_OK);
+    ck_assert_int_eq(sanc_verify(&program2, &errors), SAN_OK);
+
+    ck_assert_int_eq(sanf_create(&sched, 1), SAN_OK);
+    sched.budget.steps = 100;
+    ck_assert_int_eq(sanf_spawn(&sched, &hog, &program, &limits, out), SAN_OK);
+    ck_assert_int_eq(sanf_spawn(&sched, &quick, &program2, &limits, out), SAN_OK);
+    sanf_wait(&sched);
+    sanf_destroy(&sched);
+
+    ck_assert_int_eq(hog.result, SAN_OK);
+    ck_assert_int_eq(quick.result, SAN_OK);
+    read_output(out, output, sizeof output);
+    ck_assert_str_eq(output, "2\n1\n");
+    sanf_release(&hog);
+    sanf_release(&quick);
+    sanb_destroy(&program2);
+    sanp_destroy(&ast2);
+    sanv_destroy(&tokens2, &sant_destructor);
+  END_FIBER
+
+} END_TEST
+
+START_TEST (test_ready_queue) {
+
+  /* Two fibers taking turns on one thread never drain the queue, which stays short anyway */
+  BEGIN_FIBER("let count n l = if lt n 1 then l else count (sub n 1) l\nlet l = 1 2 3\nlet a = count 20000 l\nprint 1")
+    san_gc_limits_t limits = SAN_FIBER_DEFAULT_LIMITS;
+    san_scheduler_t sched;
+    san_fiber_t first, second;
+    FILE *out = tmpfile();
+    char output[64];
+
+    ck_assert_int_eq(sanf_create(&sched, 1), SAN_OK);
+    sched.budget.steps = 100;
+    ck_assert_int_eq(sanf_spawn(&sched, &first, &program, &limits, out), SAN_OK);
+    ck_assert_int_eq(sanf_spawn(&sched, &second, &program, &limits, out), SAN_OK);
+    sanf_wait(&sched);
+    ck_assert_int_lt(sched.ready.capacity, 16);
+    sanf_destroy(&sched);
+
+    ck_assert_int_eq(first.result, SAN_OK);
+    ck_assert_int_eq(second.result, SAN_OK);
+    read_output(out, output, sizeof output);
+    ck_assert_str_eq(output, "1\n1\n");
+    sanf_release(&first);
+    sanf_release(&second);
+  END_FIBER
+
+} END_TEST
+
+Suite* fiber_suite(void) {
+  Suite *s = suite_create("Fiber");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_fibers);
+  tcase_add_test(tc_core, test_fiber_errors);
+  tcase_add_test(tc_core, test_preemption);
+  tcase_add_test(tc_core, test_ready_queue);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
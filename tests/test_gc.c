@@ -0,0 +1,97 @@
+#include <check.h>
+#include "../src/gc.h"
+
+#define BEGIN_GC(...) { \
+  san_gc_limits_t limits = { __VA_ARGS__ }; \
+  san_gc_t gc; \
+  san_vector_t locals; \
+  vm_object stack[8]; \
+  san_gc_roots_t roots = { stack, 8, NULL, 0, &locals }; \
+  memset(stack, 0, sizeof stack); \
+  sanv_create(&locals, sizeof(vm_list*)); \
+  sang_create(&gc, &limits);
+
+#define END_GC \
+  sang_destroy(&gc); \
+  sanv_destroy(&locals, sanv_nodestructor); \
+}
+
+static vm_object make_list(san_gc_t *gc, san_gc_roots_t *roots, int item) {
+  vm_list *list = sang_alloc(gc, roots);
+  vm_object obj = vm_from_int(item);
+  if (list == NULL) return SAN_VM_NIL_OBJECT;
+  sanv_push(&list->items, &obj);
+  return vm_from_list(list);
+}
+
+#define first_item(obj) vm_to_int(*(vm_object*)sanv_nth(&vm_to_list(obj)->items, 0))
+
+START_TEST (test_minor) {
+
+  /* Reachable lists move out of the nursery, the rest are freed */
+  BEGIN_GC(4, 100, 0)
+    vm_list *young;
+    stack[0] = make_list(&gc, &roots, 1);
+    young = vm_to_list(stack[0]);
+    for (int i = 0; i < 3; ++i) make_list(&gc, &roots, 2);
+    stack[1] = make_list(&gc, &roots, 3);
+
+    ck_assert_int_eq(gc.stats.minor, 1);
+    ck_assert_int_eq(gc.stats.promoted, 1);
+    ck_assert_int_eq(gc.stats.freed, 3);
+    ck_assert(vm_to_list(stack[0]) != young);
+    ck_assert_int_eq(first_item(stack[0]), 1);
+  END_GC
+
+  /* An old list keeps a young one it was appended alive */
+  BEGIN_GC(2, 100, 0)
+    vm_object young;
+    stack[0] = make_list(&gc, &roots, 1);
+    make_list(&gc, &roots, 2);
+    young = make_list(&gc, &roots, 3);
+    sanv_push(&vm_to_list(stack[0])->items, &young);
+    sang_barrier(&gc, vm_to_list(stack[0]), young);
+    make_list(&gc, &roots, 4);
+    make_list(&gc, &roots, 5);
+
+    ck_assert_int_eq(gc.stats.minor, 2);
+    ck_assert_int_eq(gc.stats.promoted, 2);
+    young = *(vm_object*)sanv_nth(&vm_to_list(stack[0])->items, 1);
+    ck_assert_int_eq(first_item(young), 3);
+  END_GC
+
+} END_TEST
+
+START_TEST (test_major) {
+
+  /* Garbage promoted along the way is swept */
+  BEGIN_GC(2, 4, 0)
+    for (int i = 0; i < 64; ++i) stack[i % 2] = make_list(&gc, &roots, i);
+    ck_assert(gc.stats.major > 0);
+    ck_assert(gc.old.size <= 4);
+    ck_assert_int_eq(first_item(stack[1]), 63);
+  END_GC
+
+  /* Allocation fails once more lists than the limit stay reachable */
+  BEGIN_GC(2, 2, 3)
+    int i;
+    for (i = 0; i < 8; ++i) {
+      stack[i] = make_list(&gc, &roots, i);
+      if (stack[i] == SAN_VM_NIL_OBJECT) break;
+    }
+    ck_assert_int_lt(i, 8);
+    ck_assert_int_eq(first_item(stack[0]), 0);
+  END_GC
+
+} END_TEST
+
+Suite* gc_suite(void) {
+  Suite *s = suite_create("GC");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_minor);
+  tcase_add_test(tc_core, test_major);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
@@ -0,0 +1,113 @@
+#include <check.h>
+#include "../src/integer.h"
+
+#define BEGIN_INTEGER { \
+  san_gc_limits_t limits = SAN_GC_DEFAULT_LIMITS; \
+  san_gc_t gc; \
+  vm_object result; \
+  sang_create(&gc, &limits);
+
+#define END_INTEGER \
+  sang_destroy(&gc); \
+}
+
+static char printed[256];
+
+static const char *print(char *buffer, int size, vm_object n) {
+  FILE *out = tmpfile();
+  memset(buffer, 0, size);
+  sani_print(out, n);
+  rewind(out);
+  fread(buffer, 1, size - 1, out);
+  fclose(out);
+  return buffer;
+}
+
+#define printed(n) print(printed, sizeof printed, (n))
+
+START_TEST (test_promote) {
+
+  /* Overflowing the payload promotes to a bignum, and fitting demotes */
+  BEGIN_INTEGER
+    vm_object max = vm_from_int(SAN_VM_INT_MAX);
+    vm_object big = sani_mul(&gc, max, vm_from_int(2));
+    ck_assert_int_eq(vm_type(big), SAN_VM_BIGNUM);
+    ck_assert_str_eq(printed(big), "281474976710654");
+    ck_assert_int_eq(sani_compare(big, max), 1);
+
+    result = sani_sub(&gc, big, max);
+    ck_assert_int_eq(vm_type(result), SAN_VM_INT);
+    ck_assert_int_eq(vm_to_int(result), SAN_VM_INT_MAX);
+
+    result = sani_add(&gc, sani_sub(&gc, vm_from_int(0), big), vm_from_int(1));
+    ck_assert_str_eq(printed(result), "-281474976710653");
+    ck_assert_int_eq(sani_compare(result, vm_from_int(SAN_VM_INT_MIN)), -1);
+
+    /* Truncated like C, taking the dividend's sign */
+    ck_assert_int_eq(sani_mod(&gc, sani_sub(&gc, vm_from_int(0), big), vm_from_int(1000003), &result), SAN_OK);
+    ck_assert_int_eq(vm_to_int(result), -288258);
+    ck_assert_int_eq(sani_mod(&gc, big, vm_from_int(0), &result), SAN_FAIL);
+  END_INTEGER
+
+} END_TEST
+
+START_TEST (test_parse) {
+
+  BEGIN_INTEGER
+    result = sani_parse(&gc, "123456789012345678901234567890");
+    ck_assert_int_eq(vm_type(result), SAN_VM_BIGNUM);
+    ck_assert_str_eq(printed(result), "123456789012345678901234567890");
+
+    /* Leading zeros, and numbers that fit, are small */
+    result = sani_parse(&gc, "000140737488355327");
+    ck_assert_int_eq(vm_type(result), SAN_VM_INT);
+    ck_assert_int_eq(vm_to_int(result), SAN_VM_INT_MAX);
+  END_INTEGER
+
+} END_TEST
+
+START_TEST (test_natives) {
+
+  BEGIN_INTEGER
+    ck_assert_int_eq(sani_factorial(&gc, vm_from_int(20), &result), SAN_OK);
+    ck_assert_str_eq(printed(result), "2432902008176640000");
+    ck_assert_int_eq(sani_factorial(&gc, vm_from_int(25), &result), SAN_OK);
+    ck_assert_str_eq(printed(result), "15511210043330985984000000");
+
+    ck_assert_int_eq(sani_factorial(&gc, vm_from_int(30), &result), SAN_OK);
+    ck_assert_int_eq(sani_sqrt(&gc, result, &result), SAN_OK);
+    ck_assert_str_eq(printed(result), "16286585271694956");
+    ck_assert_int_eq(sani_sqrt(&gc, vm_from_int(-4), &result), SAN_FAIL);
+  END_INTEGER
+
+} END_TEST
+
+START_TEST (test_karatsuba) {
+
+  /* 2^4096 by squaring, which is Karatsuba at 64 limbs, and by doubling */
+  BEGIN_INTEGER
+    vm_object squared = vm_from_int(2), doubled = vm_from_int(1);
+    for (int i = 0; i < 12; ++i) squared = sani_square(&gc, squared);
+    for (int i = 0; i < 4096; ++i) doubled = sani_add(&gc, doubled, doubled);
+    ck_assert_int_eq(vm_to_bignum(squared)->size, 129);
+    ck_assert_int_eq(sani_compare(squared, doubled), 0);
+
+    /* x^2 = 1 mod x - 1 */
+    ck_assert_int_eq(sani_mod(&gc, sani_square(&gc, squared), sani_sub(&gc, squared, vm_from_int(1)), &result), SAN_OK);
+    ck_assert_int_eq(vm_to_int(result), 1);
+  END_INTEGER
+
+} END_TEST
+
+Suite* integer_suite(void) {
+  Suite *s = suite_create("Integer");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_promote);
+  tcase_add_test(tc_core, test_parse);
+  tcase_add_test(tc_core, test_natives);
+  tcase_add_test(tc_core, test_karatsuba);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
@@ -0,0 +1,78 @@
+#include <check.h>
+#include "../src/jit.h"
+#include "../src/natives.h"
+#include "../src/scope.h"
+#include "../src/verify.h"
+
+#define BEGIN_JIT(x) { \
+  san_vector_t tokens, errors; \
+  san_node_t ast; \
+  san_program_t program; \
+  san_jit_code_t code; \
+  sanv_create(&tokens, sizeof(san_token_t)); \
+  sanv_create(&errors, sizeof(san_error_t)); \
+  sant_tokenize((x), &tokens, &errors); \
+  sanp_parse(&tokens, &ast, &errors); \
+  memset(&program, 0, sizeof program); \
+  int result = sans_resolve(&ast, &errors); \
+  if (result == SAN_OK) result = sanb_generate(&ast, &program, &errors); \
+  if (result == SAN_OK) result = sanc_verify(&program, &errors); \
+  ck_assert_int_eq(result, SAN_OK);
+
+#define END_JIT \
+  sanj_free(&code); \
+  sanb_destroy(&program); \
+  sanp_destroy(&ast); \
+  sanv_destroy(&tokens, &sant_destructor); \
+  sanv_destroy(&errors, &sane_destructor); \
+}
+
+START_TEST (test_compile) {
+#if defined(__x86_64__)
+  int args[2], ret;
+
+  /* The self tail call becomes a loop */
+  BEGIN_JIT("let loop n acc = if lt n 1 then acc else loop (sub n 1) (acc + n)\nprint loop 100 0")
+    ck_assert_int_eq(sanj_compile(&program, 1, &code), SAN_OK);
+    args[0] = 100; args[1] = 0;
+    ck_assert_int_eq(code.entry(args, &ret), 1);
+    ck_assert_int_eq(ret, 5050);
+
+    /* Overflowing leaves the call to the interpreter */
+    args[0] = 100000; args[1] = 7;
+    ck_assert_int_eq(code.entry(args, &ret), 0);
+  END_JIT
+
+  BEGIN_JIT("let f a b =\n  let c = abs (sub a b)\n  if eq c 0 then square a else c * 3\nprint f 2 5")
+    ck_assert_int_eq(sanj_compile(&program, 1, &code), SAN_OK);
+    args[0] = 2; args[1] = 5;
+    ck_assert_int_eq(code.entry(args, &ret), 1);
+    ck_assert_int_eq(ret, 9);
+    args[0] = 4; args[1] = 4;
+    ck_assert_int_eq(code.entry(args, &ret), 1);
+    ck_assert_int_eq(ret, 16);
+    args[0] = 70000; args[1] = 70000;
+    ck_assert_int_eq(code.entry(args, &ret), 0);
+  END_JIT
+#endif
+
+  /* Lists and natives without a template stay interpreted */
+  BEGIN_JIT("let f a = 1 a\nprint f 2")
+    ck_assert_int_eq(sanj_compile(&program, 1, &code), SAN_FAIL);
+  END_JIT
+
+  BEGIN_JIT("let f a = mod a 3\nprint f 2")
+    ck_assert_int_eq(sanj_compile(&program, 1, &code), SAN_FAIL);
+  END_JIT
+
+} END_TEST
+
+Suite* jit_suite(void) {
+  Suite *s = suite_create("JIT");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_compile);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
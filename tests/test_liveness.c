@@ -0,0 +1,137 @@
+#include <check.h>
+#include "../src/bytecode.h"
+#include "../src/liveness.h"
+#include "../src/natives.h"
+#include "../src/scope.h"
+
+#define BEGIN_ELIMINATE(x) { \
+  san_vector_t tokens, errors, removed; \
+  san_node_t ast; \
+  san_program_t program; \
+  sanv_create(&tokens, sizeof(san_token_t)); \
+  sanv_create(&errors, sizeof(san_error_t)); \
+  sanv_create(&removed, sizeof(san_removal_t)); \
+  sant_tokenize((x), &tokens, &errors); \
+  sanp_parse(&tokens, &ast, &errors); \
+  memset(&program, 0, sizeof program); \
+  int result = sans_resolve(&ast, &errors); \
+  if (result == SAN_OK) result = sanl_eliminate(&ast, &removed); \
+  if (result == SAN_OK) result = sanb_generate(&ast, &program, &errors);
+
+#define END_ELIMINATE \
+  sanb_destroy(&program); \
+  sanp_destroy(&ast); \
+  sanv_destroy(&tokens, &sant_destructor); \
+  sanv_destroy(&errors, &sane_destructor); \
+  sanv_destroy(&removed, sanv_nodestructor); \
+}
+
+#define nth_code(n) ((san_bytecode_t*)sanv_nth(&program.bytecode, n))
+#define nth_function(n) ((san_function_t*)sanv_nth(&program.functions, n))
+#define nth_removal(n) ((san_removal_t*)sanv_nth(&removed, n))
+
+static int count_opcode(san_program_t const *program, int opcode) {
+  int count = 0;
+  SAN_VECTOR_FOR_EACH(program->bytecode, i, san_bytecode_t, code)
+    if (code->opcode == opcode) ++count;
+  SAN_VECTOR_END_FOR_EACH
+  return count;
+}
+
+#define count_native_calls(program) \
+  (count_opcode(program, SAN_BYTECODE_CALL_NATIVE) + count_opcode(program, SAN_BYTECODE_CALL_NATIVE_I))
+
+START_TEST (test_unused_bindings) {
+
+  /* Removing y leaves x unused */
+  BEGIN_ELIMINATE("let x = 1\nlet y = x + 1\nprint 2")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(removed.size, 2);
+    ck_assert_str_eq(nth_removal(0)->what, "binding");
+    ck_assert_str_eq(nth_removal(0)->name, "y");
+    ck_assert_int_eq(nth_removal(0)->line, 2);
+    ck_assert_str_eq(nth_removal(1)->name, "x");
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_STORE_SLOT), 0);
+  END_ELIMINATE
+
+  /* Recursion alone does not keep a function */
+  BEGIN_ELIMINATE("let f n = n + 1\nlet g n = f g n\nprint 3")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(removed.size, 2);
+    ck_assert_str_eq(nth_removal(0)->what, "function");
+    ck_assert_str_eq(nth_removal(0)->name, "g");
+    ck_assert_str_eq(nth_removal(1)->name, "f");
+    ck_assert_int_eq(program.functions.size, 1);
+  END_ELIMINATE
+
+  /* The remaining functions are numbered again */
+  BEGIN_ELIMINATE("let f n = n + 1\nlet g n = if n then 1 else 2\nprint g 1")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(removed.size, 1);
+    ck_assert_int_eq(program.functions.size, 2);
+    ck_assert_str_eq(nth_function(1)->name, "g");
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_CALL), 1);
+  END_ELIMINATE
+
+  /* Used bindings and the last value of a block stay */
+  BEGIN_ELIMINATE("let x = 2\nlet f n =\n  let y = n * x\n  y\nprint f x")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(removed.size, 0);
+  END_ELIMINATE
+
+} END_TEST
+
+START_TEST (test_effects_kept) {
+
+  BEGIN_ELIMINATE("let x = print 1\nprint 2")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(removed.size, 1);
+    ck_assert_str_eq(nth_removal(0)->name, "x");
+    ck_assert_int_eq(count_native_calls(&program), 2);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_STORE_SLOT), 0);
+  END_ELIMINATE
+
+  /* Calling a function that prints is an effect too, inlined or not */
+  BEGIN_ELIMINATE("let f n = print n\nf 1\nsquare 2\n1 + 2")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(removed.size, 2);
+    ck_assert_str_eq(nth_removal(0)->what, "expression");
+    ck_assert_str_eq(nth_removal(0)->name, "square");
+    ck_assert_int_eq(nth_removal(0)->line, 3);
+    ck_assert_int_eq(nth_removal(1)->line, 4);
+    ck_assert_int_eq(count_native_calls(&program), 2);
+  END_ELIMINATE
+
+  BEGIN_ELIMINATE("let f n =\n  let y = square n\n  let z = print n\n  n\nprint f 1")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(removed.size, 2);
+    ck_assert_str_eq(nth_removal(0)->name, "y");
+    ck_assert_str_eq(nth_removal(1)->name, "z");
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_CALL_NATIVE_I), 0);
+  END_ELIMINATE
+
+} END_TEST
+
+START_TEST (test_dropped_definitions) {
+
+  /* A let before the last statement pushes no nil to pop */
+  BEGIN_ELIMINATE("let x = square 2\nprint x")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(nth_code(2)->opcode, SAN_BYTECODE_STORE_SLOT);
+    ck_assert_int_eq(nth_code(3)->opcode, SAN_BYTECODE_LOAD_SLOT);
+    ck_assert_int_eq(count_opcode(&program, SAN_BYTECODE_POP), 0);
+  END_ELIMINATE
+
+} END_TEST
+
+Suite* liveness_suite(void) {
+  Suite *s = suite_create("Liveness");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_unused_bindings);
+  tcase_add_test(tc_core, test_effects_kept);
+  tcase_add_test(tc_core, test_dropped_definitions);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
@@ -2,6 +2,20 @@
 #include <check.h>
 
 Suite *(pvector_suite)(void);
+Suite *(bytecodegen_suite)(void);
+Suite *(parser_suite)(void);
+Suite *(scope_suite)(void);
+Suite *(liveness_suite)(void);
+Suite *(tokenizer_suite)(void);
+Suite *(vector_suite)(void);
+Suite *(verifier_suite)(void);
+Suite *(aot_suite)(void);
+Suite *(jit_suite)(void);
+Suite *(gc_suite)(void);
+Suite *(integer_suite)(void);
+Suite *(runtime_suite)(void);
+Suite *(fiber_suite)(void);
+Suite *(profile_suite)(void);
 
 void runSuite(Suite* (*suiteFn)(void), int *numFailed) {
   Suite *s = suiteFn();
@@ -15,6 +29,20 @@ int main(void) {
   int numFailed, numTotalFailed = 0, i;
   Suite* (*suites[])(void) = {
     &pvector_suite,
+    &bytecodegen_suite,
+    &parser_suite,
+    &scope_suite,
+    &liveness_suite,
+    &tokenizer_suite,
+    &vector_suite,
+    &verifier_suite,
+    &aot_suite,
+    &jit_suite,
+    &gc_suite,
+    &integer_suite,
+    &runtime_suite,
+    &fiber_suite,
+    &profile_suite,
     0
   };
 
@@ -143,6 +143,66 @@ START_TEST (test_if_expression) {
     expect_no_errors
   END_WALK_TREE
 
+  BEGIN_WALK_TREE("if x then y else z")
+    expect_exists(
+      SAN_PARSER_EXPRESSION
+      , with_parent SAN_PARSER_IF_EXPRESSION)
+    expect_no_errors
+  END_WALK_TREE
+
+  BEGIN_WALK_TREE("let f x =\n"
+                  "  if x\n"
+                  "    y\n"
+                  "  else\n"
+                  "    z")
+    expect_exists(
+      SAN_PARSER_BLOCK
+      , with_parent SAN_PARSER_IF_EXPRESSION)
+    expect_no_errors
+  END_WALK_TREE
+
+  /* As the last argument of a call */
+  BEGIN_WALK_TREE("print a if x then y else z")
+    expect_exists(
+      SAN_PARSER_IF_EXPRESSION
+      , with_parent SAN_PARSER_FN_EXPRESSION)
+    expect_no_errors
+  END_WALK_TREE
+
+  BEGIN_WALK_TREE("if x then y else")
+    ck_assert_int_eq(((san_error_t*)sanv_back(&errorList))->code, SAN_ERROR_EXPECTED_EXPRESSION);
+  END_WALK_TREE
+
+} END_TEST
+
+START_TEST (test_top_level_statements) {
+
+  BEGIN_WALK_TREE("let inc n = n + 1\nprint inc 5\nprint 6")
+    expect_exists(
+      SAN_PARSER_VARIABLE_EXPRESSION
+      , with_parent SAN_PARSER_EXPRESSION)
+    expect_exists(
+      SAN_PARSER_FN_EXPRESSION
+      , with_parent SAN_PARSER_FN_EXPRESSION)
+    expect_no_errors
+    ck_assert_int_eq(ast.children.size, 3);
+  END_WALK_TREE
+
+} END_TEST
+
+START_TEST (test_parenthesised_expression) {
+
+  BEGIN_WALK_TREE("(sqrt 25) * 2 + 1\nprint 1")
+    expect_exists(
+      SAN_PARSER_LIST
+      , with_parent SAN_PARSER_PRIMARY_EXPRESSION)
+    expect_exists(
+      SAN_PARSER_MULTIPLICATIVE_EXPRESSION
+      , with_parent SAN_PARSER_ADDITIVE_EXPRESSION)
+    expect_no_errors
+    ck_assert_int_eq(ast.children.size, 2);
+  END_WALK_TREE
+
 } END_TEST
 
 Suite* parser_suite(void) {
@@ -153,6 +213,8 @@ Suite* parser_suite(void) {
   tcase_add_test(tc_core, test_function_definition);
   tcase_add_test(tc_core, test_function_indentation);
   tcase_add_test(tc_core, test_if_expression);
+  tcase_add_test(tc_core, test_top_level_statements);
+  tcase_add_test(tc_core, test_parenthesised_expression);
   suite_add_tcase(s, tc_core);
 
   return s;
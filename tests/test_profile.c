@@ -0,0 +1,187 @@
+#include <check.h>
+#include "../src/profile.h"
+#include "../src/scope.h"
+#include "../src/verify.h"
+#include "../src/vm.h"
+
+#define BEGIN_PROFILE(x) { \
+  san_vector_t tokens, errors; \
+  san_node_t ast; \
+  san_program_t program; \
+  san_profile_t profile; \
+  sanv_create(&tokens, sizeof(san_token_t)); \
+  sanv_create(&errors, sizeof(san_error_t)); \
+  sant_tokenize((x), &tokens, &errors); \
+  sanp_parse(&tokens, &ast, &errors); \
+  memset(&program, 0, sizeof program); \
+  int result = sans_resolve(&ast, &errors); \
+  if (result == SAN_OK) result = sanb_generate(&ast, &program, &errors); \
+  if (result == SAN_OK) result = sanc_verify(&program, &errors); \
+  ck_assert_int_eq(result, SAN_OK); \
+  sanr_create(&profile);
+
+#define END_PROFILE \
+  sanr_destroy(&profile); \
+  sanb_destroy(&program); \
+  sanp_destroy(&ast); \
+  sanv_destroy(&tokens, &sant_destructor); \
+  sanv_destroy(&errors, &sane_destructor); \
+}
+
+static int run_profiled(const san_program_t *program, san_profile_t *profile) {
+  san_gc_limits_t limits = SAN_GC_DEFAULT_LIMITS;
+  san_runtime_t runtime;
+  san_vector_t errors;
+  FILE *out = tmpfile();
+  int result;
+
+  sanv_create(&errors, sizeof(san_error_t));
+  sanm_create(&runtime, &limits, out);
+  runtime.profile = profile;
+  result = sanm_execute(&runtime, program, &errors);
+  sanm_destroy(&runtime);
+  sanv_destroy(&errors, &sane_destructor);
+  fclose(out);
+  return result;
+}
+
+static const char *folded(const san_profile_t *profile, const san_program_t *program, char *buffer, int size) {
+  FILE *out = tmpfile();
+  memset(buffer, 0, size);
+  sanr_fold(profile, program, out);
+  rewind(out);
+  fread(buffer, 1, size - 1, out);
+  fclose(out);
+  return buffer;
+}
+
+START_TEST (test_counts) {
+
+  /* fib 15 adds 986 times in 1973 calls, none of which are compiled while profiling */
+  BEGIN_PROFILE("let fib n = if lt n 2 then n else (fib (sub n 1)) + (fib (sub n 2))\nprint fib 15")
+    ck_assert_int_eq(run_profiled(&program, &profile), SAN_OK);
+    ck_assert_int_eq(profile.counts[SAN_BYTECODE_ADD] + profile.counts[SAN_BYTECODE_ADD_II], 986);
+    ck_assert_int_eq(profile.counts[SAN_BYTECODE_CALL] + profile.counts[SAN_BYTECODE_TAILCALL], 1973);
+    ck_assert_int_eq(profile.counts[SAN_BYTECODE_RET], 1974);
+    ck_assert(profile.cycles[SAN_BYTECODE_CALL] > 0);
+    ck_assert_int_eq(profile.opcode, 0);
+  END_PROFILE
+
+} END_TEST
+
+START_TEST (test_samples) {
+
+  /* A sample due is taken at the next instruction, and stacks fold by line */
+  BEGIN_PROFILE("let f n = n * 2\n\nlet g n =\n  f n + 1\nprint g 3")
+    const san_function_t *f = sanv_nth(&program.functions, 1);
+    int main = ((const san_function_t*)sanv_nth(&program.functions, 0))->entry;
+    char buffer[256];
+
+    profile.due = 1;
+    ck_assert_int_eq(run_profiled(&program, &profile), SAN_OK);
+    ck_assert_int_eq(profile.nsamples, 1);
+    ck_assert_int_eq(profile.due, 0);
+
+    sanr_sample(&profile, (int[]){ f->entry, main }, 2);
+    sanr_sample(&profile, (int[]){ f->entry, main }, 2);
+    ck_assert_str_eq(folded(&profile, &program, buffer, sizeof buffer), "<main>:5 1\n<main>:5;f:1 2\n");
+  END_PROFILE
+
+} END_TEST
+
+START_TEST (test_ngrams) {
+
+  /* lt n 1 and sub n 1 each run load_slot push call_native_i, the last 100 times */
+  BEGIN_PROFILE("let count n l = if lt n 1 then l else count (sub n 1) l\nlet l = 1 2 3\nprint count 100 l")
+    int size = SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES * SAN_PROFILE_OPCODES;
+    san_profile_t copy;
+    FILE *fp = tmpfile();
+
+    ck_assert_int_eq(run_profiled(&program, &profile), SAN_OK);
+    ck_assert_int_eq(profile.ngrams[SAN_PROFILE_NGRAM(SAN_BYTECODE_LOAD_SLOT, SAN_BYTECODE_PUSH, SAN_BYTECODE_CALL_NATIVE_I)], 201);
+    ck_assert_int_eq(profile.ngrams[SAN_PROFILE_NGRAM(0, SAN_BYTECODE_PUSH, SAN_BYTECODE_CALL_NATIVE_I)], 201);
+
+    /* Reading what was written adds it up again */
+    sanr_write_ngrams(&profile, fp);
+    sanr_create(&copy);
+    for (int i = 0; i < 2; ++i) {
+      rewind(fp);
+      ck_assert_int_eq(sanr_read_ngrams(&copy, fp), SAN_OK);
+    }
+    for (int i = 0; i < size; ++i) ck_assert(copy.ngrams[i] == 2 * profile.ngrams[i]);
+    sanr_destroy(&copy);
+    fclose(fp);
+
+    fp = tmpfile();
+    fputs("12 push bogus\n", fp);
+    rewind(fp);
+    ck_assert_int_eq(sanr_read_ngrams(&profile, fp), SAN_FAIL);
+    fclose(fp);
+  END_PROFILE
+
+} END_TEST
+
+START_TEST (test_supers) {
+
+  /* Every pc marked starts the instructions its superinstruction fuses */
+  BEGIN_PROFILE("let count n l = if lt n 1 then l else count (sub n 1) l\nlet l = 1 2 3\nprint count 100 l")
+    int64_t total = 0;
+    int marked = 0;
+    ck_assert_int_eq(program.supers.size, program.bytecode.size);
+    SAN_VECTOR_FOR_EACH(program.supers, pc, int, id)
+      const san_super_t *super = sanb_super(*id);
+      if (*id == 0) continue;
+      ck_assert(super != NULL);
+      for (int i = 0; i < super->length; ++i) {
+        ck_assert_int_eq(((san_bytecode_t*)sanv_nth(&program.bytecode, pc + i))->opcode, super->opcodes[i]);
+      }
+      marked++;
+    SAN_VECTOR_END_FOR_EACH
+
+    /* Profiling dispatches as it would without, so a run saves a dispatch for each fused */
+    ck_assert_int_eq(run_profiled(&program, &profile), SAN_OK);
+    for (int op = 0; op < SAN_PROFILE_OPCODES; ++op) total += profile.counts[op];
+    ck_assert(marked == 0 ? profile.dispatches == total : profile.dispatches < total);
+  END_PROFILE
+
+} END_TEST
+
+START_TEST (test_pick_supers) {
+  san_profile_t profile;
+  int picked[8];
+
+  /* The triple saves two dispatches a run, after which only the pairs run outside it save any */
+  sanr_create(&profile);
+  profile.ngrams[SAN_PROFILE_NGRAM(0, SAN_BYTECODE_LOAD_SLOT, SAN_BYTECODE_PUSH)] = 100;
+  profile.ngrams[SAN_PROFILE_NGRAM(0, SAN_BYTECODE_PUSH, SAN_BYTECODE_CALL_NATIVE_I)] = 120;
+  profile.ngrams[SAN_PROFILE_NGRAM(SAN_BYTECODE_LOAD_SLOT, SAN_BYTECODE_PUSH, SAN_BYTECODE_CALL_NATIVE_I)] = 90;
+  profile.ngrams[SAN_PROFILE_NGRAM(0, SAN_BYTECODE_CALL, SAN_BYTECODE_PUSH)] = 1000;
+  ck_assert_int_eq(sanr_pick_supers(&profile, 8, picked), 3);
+  ck_assert_int_eq(picked[0], SAN_PROFILE_NGRAM(SAN_BYTECODE_LOAD_SLOT, SAN_BYTECODE_PUSH, SAN_BYTECODE_CALL_NATIVE_I));
+  ck_assert_int_eq(picked[1], SAN_PROFILE_NGRAM(0, SAN_BYTECODE_PUSH, SAN_BYTECODE_CALL_NATIVE_I));
+  ck_assert_int_eq(picked[2], SAN_PROFILE_NGRAM(0, SAN_BYTECODE_LOAD_SLOT, SAN_BYTECODE_PUSH));
+  sanr_destroy(&profile);
+
+  /* No more than asked for */
+  sanr_create(&profile);
+  profile.ngrams[SAN_PROFILE_NGRAM(0, SAN_BYTECODE_LOAD_SLOT, SAN_BYTECODE_PUSH)] = 100;
+  profile.ngrams[SAN_PROFILE_NGRAM(0, SAN_BYTECODE_PUSH, SAN_BYTECODE_CALL_NATIVE_I)] = 120;
+  ck_assert_int_eq(sanr_pick_supers(&profile, 1, picked), 1);
+  ck_assert_int_eq(picked[0], SAN_PROFILE_NGRAM(0, SAN_BYTECODE_PUSH, SAN_BYTECODE_CALL_NATIVE_I));
+  sanr_destroy(&profile);
+
+} END_TEST
+
+Suite* profile_suite(void) {
+  Suite *s = suite_create("Profile");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_counts);
+  tcase_add_test(tc_core, test_samples);
+  tcase_add_test(tc_core, test_ngrams);
+  tcase_add_test(tc_core, test_supers);
+  tcase_add_test(tc_core, test_pick_supers);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
@@ -0,0 +1,298 @@
+#include <check.h>
+#include <pthread.h>
+#include "../src/natives.h"
+#include "../src/scope.h"
+#include "../src/verify.h"
+#include "../src/vm.h"
+
+#define BEGIN_RUNTIME(x) { \
+  san_vector_t tokens, errors; \
+  san_node_t ast; \
+  san_program_t program; \
+  sanv_create(&tokens, sizeof(san_token_t)); \
+  sanv_create(&errors, sizeof(san_error_t)); \
+  sant_tokenize((x), &tokens, &errors); \
+  sanp_parse(&tokens, &ast, &errors); \
+  memset(&program, 0, sizeof program); \
+  int result = sans_resolve(&ast, &errors); \
+  if (result == SAN_OK) result = sanb_generate(&ast, &program, &errors); \
+  if (result == SAN_OK) result = sanc_verify(&program, &errors); \
+  ck_assert_int_eq(result, SAN_OK);
+
+#define END_RUNTIME \
+  sanb_destroy(&program); \
+  sanp_destroy(&ast); \
+  sanv_destroy(&tokens, &sant_destructor); \
+  sanv_destroy(&errors, &sane_destructor); \
+}
+
+#define THREADS 4
+
+typedef struct {
+  const san_program_t *program;
+  int result;
+  char output[256];
+} isolate_t;
+
+/* Runs the program twice in a runtime of its own, capturing what it prints */
+static void *run_isolate(void *ptr) {
+  isolate_t *isolate = ptr;
+  san_gc_limits_t limits = { 2, 100, 0 };
+  san_runtime_t runtime;
+  san_vector_t errors;
+  FILE *out = tmpfile();
+
+  sanv_create(&errors, sizeof(san_error_t));
+  sanm_create(&runtime, &limits, out);
+  isolate->result = sanm_execute(&runtime, isolate->program, &errors);
+  if (isolate->result == SAN_OK) isolate->result = sanm_execute(&runtime, isolate->program, &errors);
+  sanm_destroy(&runtime);
+  sanv_destroy(&errors, &sane_destructor);
+
+  rewind(out);
+  memset(isolate->output, 0, sizeof isolate->output);
+  fread(isolate->output, 1, sizeof isolate->output - 1, out);
+  fclose(out);
+  return NULL;
+}
+
+START_TEST (test_isolates) {
+
+  /* One program, shared by runtimes on several threads */
+  BEGIN_RUNTIME("let f n acc = if lt n 1 then acc else f (sub n 1) (acc * 3)\nlet l = 1 2 3\nprint f 100 1\nprint l")
+    pthread_t threads[THREADS];
+    isolate_t isolates[THREADS];
+    const char *expected =
+      "515377520732011331036461129765621272702107522001\n(1 2 3)\n"
+      "515377520732011331036461129765621272702107522001\n(1 2 3)\n";
+
+    for (int i = 0; i < THREADS; ++i) {
+      isolates[i].program = &program;
+      ck_assert_int_eq(pthread_create(&threads[i], NULL, run_isolate, &isolates[i]), 0);
+    }
+    for (int i = 0; i < THREADS; ++i) {
+      pthread_join(threads[i], NULL);
+      ck_assert_int_eq(isolates[i].result, SAN_OK);
+      ck_assert_str_eq(isolates[i].output, expected);
+    }
+  END_RUNTIME
+
+} END_TEST
+
+/* Runs program in a runtime with or without a pool, returning what it prints */
+/* Runs program with a pool of nworkers, if any, counting the threads it started in nthreads */
+static int run_pooled(const san_program_t *program, int nworkers, char *output, int size, int *nthreads) {
+  san_gc_limits_t limits = { 16, 100, 0 };
+  san_runtime_t runtime;
+  san_pool_t pool;
+  san_vector_t errors;
+  FILE *out = tmpfile();
+  int result;
+
+  sanv_create(&errors, sizeof(san_error_t));
+  sanm_create(&runtime, &limits, out);
+  if (nworkers > 0) {
+    sanw_create(&pool, nworkers);
+    runtime.pool = &pool;
+    runtime.parallelThreshold = 16;
+  }
+  result = sanm_execute(&runtime, program, &errors);
+  if (nthreads != NULL) *nthreads = nworkers > 0 ? pool.nthreads : 0;
+  if (nworkers > 0) sanw_destroy(&pool);
+  sanm_destroy(&runtime);
+  sanv_destroy(&errors, &sane_destructor);
+
+  rewind(out);
+  memset(output, 0, size);
+  fread(output, 1, size - 1, out);
+  fclose(out);
+  return result;
+}
+
+START_TEST (test_parallel) {
+
+  /* Loops over the 160 numbers run in chunks, except where they print */
+  char source[1024] = "let sq n = n * n + 1\nlet odd n = eq (mod n 2) 1\nlet show n = print n\nlet l =";
+  for (int i = 1; i <= 160; ++i) sprintf(source + strlen(source), " %d", i);
+  strcat(source, "\nlet a = l | map sq | filter odd | list\nlet b = a | map square | map square | sum\n"
+    "let c = a | count\nprint b c\nlet d = l | filter odd | map show | count\n");
+
+  BEGIN_RUNTIME(source)
+    static char sequential[4096], parallel[4096];
+    int nthreads;
+    ck_assert_int_eq(run_pooled(&program, 0, sequential, sizeof sequential, NULL), SAN_OK);
+    ck_assert_int_eq(run_pooled(&program, 4, parallel, sizeof parallel, &nthreads), SAN_OK);
+    ck_assert_int_eq(nthreads, 4);
+    const char *expected = "4036876817515717328 80\n1\n3\n5\n";
+    ck_assert(strncmp(sequential, expected, strlen(expected)) == 0);
+    ck_assert_str_eq(parallel, sequential);
+  END_RUNTIME
+
+  /* The workers only start once a loop is long enough to need them */
+  BEGIN_RUNTIME("let l = 1 2 3\nlet s = l | map square | sum\nprint s")
+    char output[64];
+    int nthreads;
+    ck_assert_int_eq(run_pooled(&program, 4, output, sizeof output, &nthreads), SAN_OK);
+    ck_assert_str_eq(output, "14\n");
+    ck_assert_int_eq(nthreads, 0);
+  END_RUNTIME
+
+  /* Chunks have small stacks: a body recursing deeper runs on the calling thread */
+  strcpy(source, "let deep n = if eq n 0 then 0 else 1 + (deep (sub n 1))\nlet far n = deep (n + 20000)\nlet l =");
+  for (int i = 1; i <= 160; ++i) sprintf(source + strlen(source), " %d", i);
+  strcat(source, "\nlet s = l | map far | sum\nprint s\n");
+  BEGIN_RUNTIME(source)
+    char output[64];
+    ck_assert_int_eq(run_pooled(&program, 4, output, sizeof output, NULL), SAN_OK);
+    ck_assert_str_eq(output, "3212880\n");
+  END_RUNTIME
+
+} END_TEST
+
+START_TEST (test_bignum_literals) {
+
+  /* Literals too large for an integer print back as written */
+  BEGIN_RUNTIME("let f n = n * 1000000000000000000000\nprint 123456789012345678901234567890\n"
+    "print 99999999999999999999 + 1\nprint f 3")
+    char output[256];
+    ck_assert_int_eq(run_pooled(&program, 0, output, sizeof output, NULL), SAN_OK);
+    ck_assert_str_eq(output, "123456789012345678901234567890\n100000000000000000000\n3000000000000000000000\n");
+  END_RUNTIME
+
+} END_TEST
+
+START_TEST (test_pipe_in_call) {
+
+  /* drafts/experimental.san: print takes what comes out of the pipe */
+  BEGIN_RUNTIME("let inc n = n + 1\n\nprint 1 2 3 4 5 | map inc")
+    char output[64];
+    ck_assert_int_eq(run_pooled(&program, 0, output, sizeof output, NULL), SAN_OK);
+    ck_assert_str_eq(output, "(2 3 4 5 6)\n");
+  END_RUNTIME
+
+  BEGIN_RUNTIME("let sq n = n * n\nlet l = 1 2 3\nprint l | map sq | sum\nprint square 3 | sub 100")
+    char output[64];
+    ck_assert_int_eq(run_pooled(&program, 0, output, sizeof output, NULL), SAN_OK);
+    ck_assert_str_eq(output, "14\n91\n");
+  END_RUNTIME
+
+} END_TEST
+
+START_TEST (test_if_argument) {
+
+  BEGIN_RUNTIME("print if 0 then 1 else 2\nlet f n = sub 10 if lt n 5 then n else 0\nprint f 3 (f 7)")
+    char output[64];
+    ck_assert_int_eq(run_pooled(&program, 0, output, sizeof output, NULL), SAN_OK);
+    ck_assert_str_eq(output, "2\n7 10\n");
+  END_RUNTIME
+
+} END_TEST
+
+START_TEST (test_budget) {
+
+  /* 20000 tail calls, which a list argument keeps from being compiled */
+  BEGIN_RUNTIME("let count n l = if lt n 1 then l else count (sub n 1) l\nlet l = 1 2 3\nprint count 20000 l")
+    san_gc_limits_t limits = { 16, 100, 0 };
+    san_runtime_t runtime;
+    char output[64];
+    FILE *out = tmpfile();
+    int preempted = 0;
+
+    sanm_create(&runtime, &limits, out);
+    runtime.budget.steps = 1000;
+    ck_assert_int_eq(sanm_start(&runtime, &program, &errors), SAN_OK);
+    while ((result = sanm_resume(&runtime, &errors)) == SAN_VM_PREEMPTED) preempted++;
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(preempted, 20);
+
+    /* Out of time within the first slice, then ended and run again */
+    runtime.budget.steps = 0;
+    runtime.budget.seconds = 1e-6;
+    ck_assert_int_eq(sanm_execute(&runtime, &program, &errors), SAN_VM_PREEMPTED);
+    sanm_abort(&runtime);
+    runtime.budget.seconds = 0;
+    ck_assert_int_eq(sanm_execute(&runtime, &program, &errors), SAN_OK);
+    ck_assert_int_eq(errors.size, 0);
+    sanm_destroy(&runtime);
+
+    rewind(out);
+    memset(output, 0, sizeof output);
+    fread(output, 1, sizeof output - 1, out);
+    fclose(out);
+    ck_assert_str_eq(output, "(1 2 3)\n(1 2 3)\n");
+  END_RUNTIME
+
+} END_TEST
+
+/* Runs program to the end under a budget of steps, counting how often it was preempted */
+static int run_budgeted(const san_program_t *program, int64_t steps, san_pool_t *pool,
+  char *output, int size, int *preempted) {
+  san_gc_limits_t limits = { 16, 100, 0 };
+  san_runtime_t runtime;
+  san_vector_t errors;
+  FILE *out = tmpfile();
+  int result;
+
+  sanv_create(&errors, sizeof(san_error_t));
+  sanm_create(&runtime, &limits, out);
+  runtime.budget.steps = steps;
+  runtime.pool = pool;
+  runtime.parallelThreshold = 16;
+  *preempted = 0;
+  if ((result = sanm_start(&runtime, program, &errors)) == SAN_OK) {
+    while ((result = sanm_resume(&runtime, &errors)) == SAN_VM_PREEMPTED) ++*preempted;
+  }
+  sanm_destroy(&runtime);
+  sanv_destroy(&errors, &sane_destructor);
+
+  rewind(out);
+  memset(output, 0, size);
+  fread(output, 1, size - 1, out);
+  fclose(out);
+  return result;
+}
+
+START_TEST (test_budget_compiled) {
+
+  /* Neither a loop the JIT would compile nor one that would run in chunks escapes the budget */
+  BEGIN_RUNTIME("let loop n acc = if lt n 1 then acc else loop (sub n 1) (acc + 1)\nprint loop 20000 0")
+    char output[64];
+    int preempted;
+    ck_assert_int_eq(run_budgeted(&program, 1000, NULL, output, sizeof output, &preempted), SAN_OK);
+    ck_assert_int_eq(preempted, 20);
+    ck_assert_str_eq(output, "20000\n");
+  END_RUNTIME
+
+  char source[1024] = "let sq n = n * n + 1\nlet l =";
+  for (int i = 1; i <= 160; ++i) sprintf(source + strlen(source), " %d", i);
+  strcat(source, "\nlet a = l | map sq | sum\nprint a\n");
+
+  BEGIN_RUNTIME(source)
+    san_pool_t pool;
+    char output[64];
+    int preempted;
+    sanw_create(&pool, 4);
+    ck_assert_int_eq(run_budgeted(&program, 50, &pool, output, sizeof output, &preempted), SAN_OK);
+    ck_assert_int_eq(pool.nthreads, 0);
+    ck_assert(preempted >= 3);
+    ck_assert_str_eq(output, "1378320\n");
+    sanw_destroy(&pool);
+  END_RUNTIME
+
+} END_TEST
+
+Suite* runtime_suite(void) {
+  Suite *s = suite_create("Runtime");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_isolates);
+  tcase_add_test(tc_core, test_parallel);
+  tcase_add_test(tc_core, test_bignum_literals);
+  tcase_add_test(tc_core, test_pipe_in_call);
+  tcase_add_test(tc_core, test_if_argument);
+  tcase_add_test(tc_core, test_budget);
+  tcase_add_test(tc_core, test_budget_compiled);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
@@ -0,0 +1,90 @@
+#include <check.h>
+#include "../src/scope.h"
+#include "../src/natives.h"
+
+#define BEGIN_RESOLVE(x) { \
+  san_vector_t tokens, errors; \
+  san_node_t ast; \
+  sanv_create(&tokens, sizeof(san_token_t)); \
+  sanv_create(&errors, sizeof(san_error_t)); \
+  sant_tokenize((x), &tokens, &errors); \
+  sanp_parse(&tokens, &ast, &errors); \
+  int result = sans_resolve(&ast, &errors);
+
+#define END_RESOLVE \
+  sanp_destroy(&ast); \
+  sanv_destroy(&tokens, &sant_destructor); \
+  sanv_destroy(&errors, &sane_destructor); \
+}
+
+#define last_error() ((san_error_t*)sanv_back(&errors))
+
+/* Follows a path of child indices down from the root */
+static san_node_t *node_at(san_node_t *root, int depth, const int *path) {
+  for (int i = 0; i < depth; ++i) {
+    root = sanv_nth(&root->children, path[i]);
+  }
+  return root;
+}
+
+START_TEST (test_global_slots) {
+
+  BEGIN_RESOLVE("let x = 1\nlet y = 2\nlet x = x + y")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(ast.nslots, 3);
+
+    /* Root > Expression > Variable definition */
+    const int third[] = { 2, 0 };
+    san_node_t *def = node_at(&ast, 2, third);
+    ck_assert_int_eq(def->binding, SAN_BINDING_GLOBAL);
+    ck_assert_int_eq(def->slot, 2);
+  END_RESOLVE
+
+} END_TEST
+
+START_TEST (test_function_slots) {
+
+  BEGIN_RESOLVE("let f a b =\n  let c = a + b\n  c\nprint f 1 2")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(ast.nslots, 0);
+
+    const int first[] = { 0, 0 };
+    san_node_t *def = node_at(&ast, 2, first);
+    ck_assert_int_eq(def->binding, SAN_BINDING_FUNCTION);
+    ck_assert_int_eq(def->slot, 1);
+    ck_assert_int_eq(def->nslots, 3);
+  END_RESOLVE
+
+} END_TEST
+
+START_TEST (test_unbound_names) {
+
+  BEGIN_RESOLVE("let x = y")
+    ck_assert_int_eq(result, SAN_FAIL);
+    ck_assert_int_eq(last_error()->code, SAN_ERROR_UNBOUND_NAME);
+  END_RESOLVE
+
+  /* A block's bindings end with the block */
+  BEGIN_RESOLVE("let f a =\n  let b = a\n  b\nprint b")
+    ck_assert_int_eq(result, SAN_FAIL);
+    ck_assert_int_eq(last_error()->code, SAN_ERROR_UNBOUND_NAME);
+  END_RESOLVE
+
+  BEGIN_RESOLVE("let f a =\n  let g b = a + b\n  g a")
+    ck_assert_int_eq(result, SAN_FAIL);
+    ck_assert_int_eq(last_error()->code, SAN_ERROR_CAPTURED_LOCAL);
+  END_RESOLVE
+
+} END_TEST
+
+Suite* scope_suite(void) {
+  Suite *s = suite_create("Scope");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_global_slots);
+  tcase_add_test(tc_core, test_function_slots);
+  tcase_add_test(tc_core, test_unbound_names);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
@@ -0,0 +1,154 @@
+#include <check.h>
+#include "../src/bytecode.h"
+#include "../src/natives.h"
+#include "../src/scope.h"
+#include "../src/verify.h"
+
+#define BEGIN_VERIFY(x) { \
+  san_vector_t tokens, errors; \
+  san_node_t ast; \
+  san_program_t program; \
+  sanv_create(&tokens, sizeof(san_token_t)); \
+  sanv_create(&errors, sizeof(san_error_t)); \
+  sant_tokenize((x), &tokens, &errors); \
+  sanp_parse(&tokens, &ast, &errors); \
+  memset(&program, 0, sizeof program); \
+  int result = sans_resolve(&ast, &errors); \
+  if (result == SAN_OK) result = sanb_generate(&ast, &program, &errors); \
+  if (result == SAN_OK) result = sanc_verify(&program, &errors);
+
+#define END_VERIFY \
+  sanb_destroy(&program); \
+  sanp_destroy(&ast); \
+  sanv_destroy(&tokens, &sant_destructor); \
+  sanv_destroy(&errors, &sane_destructor); \
+}
+
+/*
+ * Hand-written programs: just a <main> with one slot.
+ */
+#define BEGIN_BYTECODE(...) { \
+  san_bytecode_t code[] = { __VA_ARGS__ }; \
+  san_function_t main = { "<main>", 0, 1, 0, sizeof code / sizeof code[0] }; \
+  san_vector_t errors; \
+  san_program_t program; \
+  memset(&program, 0, sizeof program); \
+  sanv_create(&errors, sizeof(san_error_t)); \
+  sanv_create(&program.bytecode, sizeof(san_bytecode_t)); \
+  sanv_create(&program.numbers, sizeof(int64_t)); \
+  sanv_create(&program.strings, sizeof(char*)); \
+  sanv_create(&program.functions, sizeof(san_function_t)); \
+  sanv_create(&program.calls, sizeof(san_call_site_t)); \
+  sanv_create(&program.lines, sizeof(unsigned char)); \
+  sanv_push(&program.numbers, &(int64_t){ 1 }); \
+  sanv_push(&program.functions, &main); \
+  for (int i = 0; i < main.length; ++i) sanv_push(&program.bytecode, &code[i]); \
+  int result = sanc_verify(&program, &errors);
+
+#define END_BYTECODE \
+  sanb_destroy(&program); \
+  sanv_destroy(&errors, &sane_destructor); \
+}
+
+#define NONE { -1, -1 }
+#define ONE { SAN_BYTECODE_TYPE_NUMBER_LITERAL, 0 }
+#define COUNT(n) { SAN_BYTECODE_TYPE_COUNT, n }
+#define TARGET(n) { SAN_BYTECODE_TYPE_TARGET, n }
+#define LOCAL(n) { SAN_BYTECODE_TYPE_LOCAL, n }
+
+#define nth_function(n) ((san_function_t*)sanv_nth(&program.functions, n))
+#define last_error() ((san_error_t*)sanv_back(&errors))
+
+START_TEST (test_generated_programs) {
+
+  BEGIN_VERIFY("print (square 3) + 1")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(program.verified, 1);
+    ck_assert_int_eq(nth_function(0)->maxStack, 2);
+  END_VERIFY
+
+  /* Slots count towards a frame's stack */
+  BEGIN_VERIFY("let f a b = b * (a + 1)\nprint f 1 2")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(nth_function(1)->maxStack, 5);
+  END_VERIFY
+
+  /* A fused loop keeps its list, index and accumulator on the stack */
+  BEGIN_VERIFY("1 2 3 | map square | sum | print")
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(nth_function(0)->maxStack, 4);
+  END_VERIFY
+
+} END_TEST
+
+START_TEST (test_malformed_bytecode) {
+
+  BEGIN_BYTECODE(
+    { SAN_BYTECODE_PUSH, ONE, NONE },
+    { SAN_BYTECODE_JUMP_IF_FALSE, TARGET(4), NONE },
+    { SAN_BYTECODE_PUSH, ONE, NONE },
+    { SAN_BYTECODE_RET, NONE, NONE },
+    { SAN_BYTECODE_PUSH, ONE, NONE },
+    { SAN_BYTECODE_PUSH, ONE, NONE },
+    { SAN_BYTECODE_ADD, NONE, NONE },
+    { SAN_BYTECODE_RET, NONE, NONE })
+    ck_assert_int_eq(result, SAN_OK);
+    ck_assert_int_eq(nth_function(0)->maxStack, 3);
+  END_BYTECODE
+
+  /* Underflow */
+  BEGIN_BYTECODE(
+    { SAN_BYTECODE_PUSH, ONE, NONE },
+    { SAN_BYTECODE_ADD, NONE, NONE },
+    { SAN_BYTECODE_RET, NONE, NONE })
+    ck_assert_int_eq(result, SAN_FAIL);
+    ck_assert_int_eq(program.verified, 0);
+    ck_assert_int_eq(last_error()->code, SAN_ERROR_INVALID_BYTECODE);
+  END_BYTECODE
+
+  /* Paths that disagree on the stack depth */
+  BEGIN_BYTECODE(
+    { SAN_BYTECODE_PUSH, ONE, NONE },
+    { SAN_BYTECODE_JUMP_IF_FALSE, TARGET(3), NONE },
+    { SAN_BYTECODE_PUSH, ONE, NONE },
+    { SAN_BYTECODE_PUSH, ONE, NONE },
+    { SAN_BYTECODE_RET, NONE, NONE })
+    ck_assert_int_eq(result, SAN_FAIL);
+  END_BYTECODE
+
+  /* Running off the end, out of range operands */
+  BEGIN_BYTECODE({ SAN_BYTECODE_PUSH, ONE, NONE })
+    ck_assert_int_eq(result, SAN_FAIL);
+  END_BYTECODE
+
+  BEGIN_BYTECODE(
+    { SAN_BYTECODE_LOAD_SLOT, LOCAL(1), NONE },
+    { SAN_BYTECODE_RET, NONE, NONE })
+    ck_assert_int_eq(result, SAN_FAIL);
+  END_BYTECODE
+
+  BEGIN_BYTECODE(
+    { SAN_BYTECODE_PUSH, ONE, NONE },
+    { SAN_BYTECODE_JUMP, TARGET(7), NONE })
+    ck_assert_int_eq(result, SAN_FAIL);
+  END_BYTECODE
+
+  BEGIN_BYTECODE(
+    { SAN_BYTECODE_PUSH, ONE, NONE },
+    { SAN_BYTECODE_CALL_NATIVE, { SAN_BYTECODE_TYPE_NATIVE, sann_lookup("sub") }, COUNT(1) },
+    { SAN_BYTECODE_RET, NONE, NONE })
+    ck_assert_int_eq(result, SAN_FAIL);
+  END_BYTECODE
+
+} END_TEST
+
+Suite* verifier_suite(void) {
+  Suite *s = suite_create("Verifier");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_generated_programs);
+  tcase_add_test(tc_core, test_malformed_bytecode);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}